@@ -44,3 +44,11 @@ CREATE TABLE DataUpdate (
 	checked boolean,
 	run boolean
 );
+
+CREATE TABLE SourceValidator (
+	source text PRIMARY KEY,
+	etag text,
+	last_modified text,
+	sha256 char(64),
+	checked timestamp DEFAULT CURRENT_TIMESTAMP
+);
@@ -27,6 +27,7 @@
 #include <time.h>
 
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include "bstrlib.h"
 #include "civetweb.h"
@@ -60,6 +61,32 @@
     #define EMISS_UPDATE_INTERVAL 604800
 #endif
 
+/*! Remote data retrieval: concurrent downloads, retries of a failed download on transient errors
+    with a backoff doubling from EMISS_FETCH_RETRY_BACKOFF_MS, and connect timeout in seconds. */
+#ifndef EMISS_FETCH_MAX_PARALLEL
+    #define EMISS_FETCH_MAX_PARALLEL 4
+#endif
+#ifndef EMISS_FETCH_MAX_RETRIES
+    #define EMISS_FETCH_MAX_RETRIES 3
+#endif
+#ifndef EMISS_FETCH_RETRY_BACKOFF_MS
+    #define EMISS_FETCH_RETRY_BACKOFF_MS 500
+#endif
+#ifndef EMISS_FETCH_CONNECT_TIMEOUT
+    #define EMISS_FETCH_CONNECT_TIMEOUT 30
+#endif
+
+/*! Local dataset cache: directory (empty to disable) and the age in seconds under which the
+    cached datasets are used without asking the sources. Setting the environment variable
+    EMISS_OFFLINE to 1 parses only the cache, to a directory parses that directory instead. */
+#ifndef EMISS_CACHE_ROOT
+    #define EMISS_CACHE_ROOT EMISS_RESOURCE_ROOT"/cache"
+#endif
+#ifndef EMISS_CACHE_MAX_AGE
+    #define EMISS_CACHE_MAX_AGE EMISS_UPDATE_INTERVAL
+#endif
+#define EMISS_OFFLINE_ENV "EMISS_OFFLINE"
+
 /*!  Data sources. Definable at compile-time, defaults to the below values. */
 #ifndef EMISS_WORLDBANK_HOST
     #define EMISS_WORLDBANK_HOST "api.worldbank.org"
@@ -135,6 +162,35 @@
 */
 #define NCOUNTRY_DATA_SLOTS 300
 
+/*! The most countries a line chart may be requested for. */
+#ifndef EMISS_CHART_MAX_COUNTRIES
+    #define EMISS_CHART_MAX_COUNTRIES 32
+#endif
+
+/*! Admission control of the requests querying the database: the most answered at once, the most
+    waiting for their turn beyond those and the longest in milliseconds one waits, before being
+    refused with a 503 to retry after EMISS_ADMISSION_RETRY_AFTER seconds. Requests answered from
+    memory are never held back. */
+#ifndef EMISS_ADMISSION_MAX_RUNNING
+    #define EMISS_ADMISSION_MAX_RUNNING 8
+#endif
+#ifndef EMISS_ADMISSION_MAX_WAITING
+    #define EMISS_ADMISSION_MAX_WAITING 16
+#endif
+#ifndef EMISS_ADMISSION_WAIT_MS
+    #define EMISS_ADMISSION_WAIT_MS 1000
+#endif
+#ifndef EMISS_ADMISSION_RETRY_AFTER
+    #define EMISS_ADMISSION_RETRY_AFTER 1
+#endif
+
+/*! Metrics: the most threads counted apart, those beyond sharing a single set of counters, and
+    the most request handlers timed apart. */
+#ifndef EMISS_METRICS_MAX_THREADS
+    #define EMISS_METRICS_MAX_THREADS 0x100
+#endif
+#define EMISS_METRICS_MAX_HANDLERS 0x10
+
 /*! A PCRE regex to pick out fields that are not to be included as rows in the database. */
 #ifndef EMISS_IGNORE_REGEX
     #define EMISS_IGNORE_REGEX\
@@ -143,19 +199,21 @@
         "|(\\w+\\.\\w+\\.\\w+)"
 #endif
 
-/*! File path prefixes. *////@{
-#define EMISS_RESOURCE_ROOT "../resources"
+/*! File path prefixes of the data, read and cached at runtime: the html, css, js and fonts are
+    embedded at build time, see emiss_assets. The root is relative to bin/, unless defined at
+    compile-time or replaced at runtime by the environment variable EMISS_RESOURCE_ROOT_ENV, see
+    emiss_resource_path(). *////@{
+#ifndef EMISS_RESOURCE_ROOT
+    #define EMISS_RESOURCE_ROOT "../resources"
+#endif
+#define EMISS_RESOURCE_ROOT_ENV "EMISS_RESOURCE_ROOT"
 #define EMISS_DATA_ROOT EMISS_RESOURCE_ROOT"/data"
-#define EMISS_JS_ROOT EMISS_RESOURCE_ROOT"/js"
-#define EMISS_HTML_ROOT EMISS_RESOURCE_ROOT
-#define EMISS_CSS_ROOT EMISS_RESOURCE_ROOT"/css"
-#define EMISS_FONT_ROOT EMISS_RESOURCE_ROOT"/fonts"
 ///@}
 
 /*! Number of static assets. */
 #define EMISS_NSTATICS 5
-/*! Number of template assets. */
-#define EMISS_NTEMPLATES 2
+/*! Number of template assets, the last of which is the series data endpoint. */
+#define EMISS_NTEMPLATES 3
 
 /*! All relative URIs available on the server. *////@{
 #define EMISS_URI_INDEX "/"
@@ -163,13 +221,13 @@
 #define EMISS_URI_NEW "/new"
 #define EMISS_URI_SHOW "/show"
 #define EMISS_URI_ABOUT "/about"
-#define EMISS_URI_STYLE_CSS "/css/all.min.css"
+#define EMISS_URI_CSS "/css"
 #define EMISS_URI_FONTS "/fonts"
-#define EMISS_FONT_SANS "fira-sans-v8"
-#define EMISS_VALID_FONT_NAMES EMISS_FONT_SANS"-latin-regular"
 #define EMISS_URI_CHART_JS "/js/chart.js"
 #define EMISS_URI_PARAM_JS "/js/param.js"
 #define EMISS_URI_VERGE_JS "/js/verge.min.js"
+#define EMISS_URI_API_SERIES "/api/series"
+#define EMISS_URI_METRICS "/metrics"
 ///@}
 
 /*
@@ -191,6 +249,12 @@ typedef struct emiss_template_s emiss_template_st;
 */
 typedef struct emiss_resource_ctx emiss_resource_ctx_st;
 
+/*! An opaque handle for a snapshot of the resources served from memory: the country data, static
+    resources and templates. Replaced as a whole when the data is updated.
+    Implemented in emiss_resource.c.
+*/
+typedef struct emiss_resource_snapshot emiss_resource_snapshot_st;
+
 /*  Function typesdefs. Used in the context of the template structure declared above and
     defined below.
 */
@@ -201,6 +265,22 @@ typedef int (emiss_printfio_ft)(void *at,
     const char *restrict conn_action,
     const char *restrict frmt,...);
 
+/*  Output of a body sent as is, gathered from iovcnt parts, with the given Content-Encoding
+    unless NULL. */
+typedef int (emiss_sendio_ft)(void *at,
+    const unsigned http_response_code,
+    const char *restrict mime_type,
+    const char *restrict content_encoding,
+    const struct iovec *iov,
+    const int iovcnt);
+
+/*  Whether the client at the other end accepts a content coding. */
+typedef int (emiss_acceptsio_ft)(void *at, const char *restrict content_encoding);
+
+/*  Output of a 503 response to a request refused under load, to retry after retry_after
+    seconds. */
+typedef int (emiss_unavailio_ft)(void *at, const unsigned retry_after);
+
 typedef int (emiss_template_ft)(emiss_template_st *template_data,
     size_t i, const char *qstr, void *cbdata);
 
@@ -221,13 +301,63 @@ struct emiss_template_s {
     emiss_template_ft              *template_function[EMISS_NTEMPLATES];
     int                             template_count;
     emiss_printfio_ft              *output_function;
+    emiss_sendio_ft                *send_function;
+    emiss_acceptsio_ft             *accepts_function;
+    emiss_unavailio_ft             *unavailable_function;
 };
 
-typedef struct emiss_file_data {
-    char      *paths[EMISS_NINDICATORS + 1];
-    uintmax_t  file_sizes[EMISS_NINDICATORS + 1];
-    int        dataset_ids[EMISS_NINDICATORS + 1];
-} emiss_file_data_st;
+/*! A file embedded at build time from under resources/, by its path there: its content, NUL
+    terminated past size, its MIME type, a strong ETag of its SHA-256 and a gzip'd variant, or
+    NULL if it does not compress. */
+typedef struct emiss_asset {
+    const char                     *path;
+    const char                     *mime_type;
+    const char                     *etag;
+    const unsigned char            *data;
+    size_t                          size;
+    const unsigned char            *gzip;
+    size_t                          gzip_size;
+} emiss_asset_st;
+
+/*! Validators of a remote source from its last fetch, to make the next one conditional on. Empty
+    strings for those not known. */
+typedef struct emiss_source_validator {
+    char    etag[0x100];
+    char    last_modified[0x40];
+    char    sha256[65];
+} emiss_source_validator_st;
+
+/*! Counters of the metrics endpoint, added to by emiss_metrics_add(). */
+typedef enum emiss_metric {
+    EMISS_METRIC_MAP_PAYLOAD_HITS,
+    EMISS_METRIC_MAP_PAYLOAD_MISSES,
+    EMISS_METRIC_SERIES_SNAPSHOT_HITS,
+    EMISS_METRIC_SERIES_QUERIES,
+    EMISS_METRIC_ARENA_REUSES,
+    EMISS_METRIC_ARENA_ALLOCS,
+    EMISS_METRIC_INGEST_BYTES,
+    EMISS_METRIC_INGEST_ROWS,
+    EMISS_METRIC_INGEST_DATASETS,
+    EMISS_METRIC_SNAPSHOT_BUILDS,
+    EMISS_METRIC_ADMISSION_IMMEDIATE,
+    EMISS_METRIC_ADMISSION_WAITED,
+    EMISS_METRIC_ADMISSION_REJECTED,
+    EMISS_METRIC_ADMISSION_TIMED_OUT,
+    EMISS_METRIC_FLIGHT_JOINS,
+    EMISS_METRIC_FLIGHT_LEADS,
+    EMISS_NMETRICS
+} emiss_metric_et;
+
+/*! Gauges of the metrics endpoint, set by emiss_metrics_gauge_set(). */
+typedef enum emiss_gauge {
+    EMISS_GAUGE_INGEST_RUNNING,
+    EMISS_GAUGE_INGEST_DATASET,
+    EMISS_GAUGE_INGEST_LAST_SUCCESS,
+    EMISS_GAUGE_SNAPSHOT_TIME,
+    EMISS_GAUGE_ADMISSION_RUNNING,
+    EMISS_GAUGE_ADMISSION_WAITING,
+    EMISS_NGAUGES
+} emiss_gauge_et;
 
 /*! An opaque handle for the server context structure.
     Implemented in emiss_server.c.
@@ -239,17 +369,51 @@ typedef struct emiss_server_ctx emiss_server_ctx_st;
 ** FUNCTIONS
 */
 
-/*! Fetch data from a remote source [TODO elaboration] and decompress all files if they zipped.
+/*! Fetch data from a remote source [TODO elaboration] and parse it as it arrives.
+
+    Archives are inflated in memory and their entries passed on to the parser, nothing is written
+    to disk. Datasets are parsed in the order emiss_update_dataset_begin() expects them: one whose
+    download arrives before its turn is buffered in memory until then.
+
+    Requests are conditional on the validators of the last fetch. A source that answers 304, or
+    with a matching ETag, Last-Modified or SHA-256 of its content, is not parsed. The country codes
+    are fetched again in full if unmodified while another source was modified.
+
+    The parsed datasets are stored in EMISS_CACHE_ROOT by their SHA-256, listed in a manifest with
+    the validators and fetch times of their sources. A cache fetched less than EMISS_CACHE_MAX_AGE
+    seconds ago is parsed without asking the sources, and a source whose datasets are missing from
+    the cache is fetched unconditionally. With EMISS_OFFLINE set in the environment, the datasets
+    are parsed with emiss_retrieve_from_cache() instead.
+
+    @param upd_ctx      A data update context structure, with emiss_update_begin() called on it.
+    @param validators   The validators of the EMISS_NINDICATORS sources (country codes and the
+                        two indicators) or NULL to fetch them unconditionally. Updated for the
+                        sources fetched.
 
     @return 1 on success, 0 on error.
 
-    @see emiss_should_check_for_update()
+    @see emiss_should_check_for_update(), emiss_update_begin()
+*/
+int
+emiss_retrieve_data(emiss_update_ctx_st *upd_ctx, emiss_source_validator_st *validators);
+
+/*! Parse the datasets from a local directory, without network access. A directory with a
+    manifest is read as a cache written by emiss_retrieve_data(), each file checked against its
+    hash; any other directory is expected to hold the datasets as <name>.csv, like resources/data.
+
+    @param upd_ctx      A data update context structure, with emiss_update_begin() called on it.
+    @param dir          Path of the directory.
+
+    @return 1 on success, 0 on error, for instance a dataset missing from the directory.
 */
 int
-emiss_retrieve_data(emiss_file_data_st *retrieved_files_data);
+emiss_retrieve_from_cache(emiss_update_ctx_st *upd_ctx, const char *dir);
+
+/*  --> emiss_assets.c, generated by src/tools/emiss_embed.c <-- */
 
-void *
-emiss_retrieve_async_start();
+/*! The files embedded at build time, sorted by path, and their count. */
+extern const emiss_asset_st emiss_assets[];
+extern const size_t emiss_nassets;
 
 /*  --> emiss_update.c <-- */
 
@@ -278,29 +442,144 @@ emiss_update_ctx_init(wlpq_conn_ctx_st *conn_ctx, const char *tui_chart_data);
 void
 emiss_update_ctx_free(emiss_update_ctx_st *upd_ctx);
 
-/*! Preview csv files and check "Last updated" information from the Worldbank data files, if newer
-    than `last_update`, update records in the database concerning the data in that file.
-
-    For data of type "Meta", run an update in case any other update is run. Worldbank
-    sadly does not annotate their metadata csv files with dates.
+/*! Begin an update, to be fed dataset by dataset with emiss_update_dataset_begin(),
+    emiss_update_dataset_push() and emiss_update_dataset_end().
 
     @param upd_ctx      An initialized data update context structure.
+    @param last_update  UNIX timestamp of the last time updates were checked for, or 0.
+
+    @return 1 on success, 0 on error.
+
+    @see emiss_update_end()
+*/
+int
+emiss_update_begin(emiss_update_ctx_st *upd_ctx, time_t last_update);
+
+/*! Begin parsing a dataset. The country codes (DATASET_COUNTRY_CODES) must come first, followed
+    by the Worldbank datasets.
+
+    Worldbank data files are checked for their "Last updated" information: if no newer than
+    `last_update`, the rest of the dataset is skipped. For data of type "Meta", an update is run in
+    any case, Worldbank sadly does not annotate their metadata csv files with dates.
+
+    @param upd_ctx      A data update context structure with an update begun.
+    @param dataset_id   One of the DATASET_* codes.
+
+    @return 1 on success, 0 on error.
+*/
+int
+emiss_update_dataset_begin(emiss_update_ctx_st *upd_ctx, int dataset_id);
+
+/*! Parse the next chunk of the current dataset. Chunks may split the data at any byte.
+
+    @return 1 on success, -1 on error.
+*/
+int
+emiss_update_dataset_push(emiss_update_ctx_st *upd_ctx, const void *data, size_t len);
+
+/*! Finish parsing the current dataset and wait for its queries to be sent.
+
+    Each row of indicator values is compared to a fingerprint of those currently in table Datapoint,
+    loaded at the start, and only rows that changed are sent: their values upserted in one statement
+    and those deleted nulled in another. A summary of these is printed for each dataset.
+
+    @return 1 on success, 0 on error.
+*/
+int
+emiss_update_dataset_end(emiss_update_ctx_st *upd_ctx);
+
+/*! End an update begun with emiss_update_begin().
+
+    @return Size in bytes of all parsed Worldbank data.
+*/
+long long
+emiss_update_end(emiss_update_ctx_st *upd_ctx);
+
+/*! Parse csv files from disk and send updates of the data in them, with the functions above.
+
+    @param upd_ctx      An initialized data update context structure, freed before returning.
     @param paths        A string array containing paths to the csv data files.
-    @param file_sizes   The total byte size of each respective csv file.
     @param npaths       The number of csv files in paths.
-    @param dataset_ids  An array of integer codes that can be used to control how the file data is
-                        to be interpreted [TODO elaboration]
+    @param dataset_ids  An array of the DATASET_* codes of the files, in the order expected by
+                        emiss_update_dataset_begin().
     @param last_update  UNIX timestamp of the last time updates were checked for.
 
-    @return Size in bytes of all parsed data or -1 on error.
+    @return Size in bytes of all parsed Worldbank data or -1 on error.
 
-    @see emiss_update_ctx_free(), emiss_update_ctx_init()
+    @see emiss_update_begin(), emiss_update_ctx_init()
 */
-
-size_t
+long long
 emiss_update_parse_send(emiss_update_ctx_st *upd_ctx,
-    char **paths, uintmax_t *file_sizes, size_t npaths,
-    int *dataset_ids, time_t last_update);
+    char **paths, size_t npaths, int *dataset_ids, time_t last_update);
+
+/*  --> emiss_metrics.c <-- */
+
+/*! Add to a counter of the metrics endpoint.
+
+    Each thread adds to a set of counters of its own, without locks or contention; the sets are
+    summed when the metrics are formatted.
+
+    @param metric   The counter.
+    @param n        The amount to add.
+
+    @see emiss_metrics_format()
+*/
+void
+emiss_metrics_add(emiss_metric_et metric, uint64_t n);
+
+/*! Set a gauge of the metrics endpoint. A gauge is set by a single thread at a time, the one
+    doing what it measures or holding the lock of what it measures.
+
+    @param gauge    The gauge.
+    @param value    The value to set it to.
+*/
+void
+emiss_metrics_gauge_set(emiss_gauge_et gauge, int64_t value);
+
+/*! Mark the calling thread busy with a request, until emiss_metrics_request_end().
+
+    @see emiss_metrics_request_end()
+*/
+void
+emiss_metrics_request_begin(void);
+
+/*! Count a request of a handler and the time it took, and mark the calling thread idle.
+
+    @param handler  The index of the handler, below EMISS_METRICS_MAX_HANDLERS.
+    @param status   The HTTP status code the handler returned.
+    @param usec     The time the request took in microseconds.
+
+    @see emiss_metrics_request_begin()
+*/
+void
+emiss_metrics_request_end(size_t handler, int status, uint64_t usec);
+
+/*! Append the metrics of the process in the Prometheus text format: requests and their latencies
+    by handler, busy threads, admission control, cache hits, ingest progress and resident memory.
+
+    @param out              The string to append to.
+    @param handler_names    The names of the handlers, by index, as labels of their requests.
+    @param nhandlers        The number of handlers.
+
+    @return 1 on success, 0 on error.
+
+    @see emiss_metrics_format_db()
+*/
+int
+emiss_metrics_format(bstring out, const char *const *handler_names, size_t nhandlers);
+
+/*! Append the state of a database connection context in the Prometheus text format: the query
+    queue, queries in flight, sent and failed, and the state of each thread and connection.
+
+    @param out      The string to append to.
+    @param stats    A view of the context from wlpq_stats_get().
+
+    @return 1 on success, 0 on error.
+
+    @see emiss_metrics_format()
+*/
+int
+emiss_metrics_format_db(bstring out, const wlpq_stats_st *stats);
 
 /*  --> emiss_resource.c <-- */
 
@@ -322,9 +601,70 @@ emiss_resource_ctx_free(emiss_resource_ctx_st *rsrc_ctx);
 emiss_resource_ctx_st *
 emiss_resource_ctx_init();
 
+/*! Start a background thread that wakes every EMISS_UPDATE_INTERVAL seconds to check for, fetch
+    and ingest new data, then rebuilds the resources from it and publishes them as a new snapshot.
+    Requests in flight finish on the snapshot they began with. The thread is stopped by
+    emiss_resource_ctx_free().
+
+    @param rsrc_ctx An initialized resource context structure.
+
+    @return 1 on success, 0 on error.
+
+    @see emiss_resource_ctx_init(), emiss_resource_snapshot_acquire()
+*/
+int
+emiss_resource_refresh_start(emiss_resource_ctx_st *rsrc_ctx);
+
+/*! Begin reading the current resource snapshot. Does not block: the snapshot stays valid, even if
+    replaced meanwhile, until released with emiss_resource_snapshot_release().
+
+    @param rsrc_ctx An initialized resource context structure.
+    @param epoch    Set to the epoch to pass to emiss_resource_snapshot_release().
+
+    @return The current snapshot.
+
+    @see emiss_resource_snapshot_release()
+*/
+emiss_resource_snapshot_st *
+emiss_resource_snapshot_acquire(emiss_resource_ctx_st *rsrc_ctx, unsigned *epoch);
+
+/*! Finish reading a snapshot acquired with emiss_resource_snapshot_acquire().
+
+    @param rsrc_ctx An initialized resource context structure.
+    @param epoch    The epoch set by emiss_resource_snapshot_acquire().
+
+    @see emiss_resource_snapshot_acquire()
+*/
+void
+emiss_resource_snapshot_release(emiss_resource_ctx_st *rsrc_ctx, unsigned epoch);
+
+/*! Resolve a path of the resources read and written at runtime, such as EMISS_CACHE_ROOT: a path
+    beginning with EMISS_RESOURCE_ROOT has it replaced by the directory in the environment variable
+    EMISS_RESOURCE_ROOT_ENV, if set, so that the server finds its data from any working directory.
+    Other paths are copied as they are.
+
+    @param buf  Buffer for the resolved path.
+    @param size Size of buf.
+    @param path The path to resolve.
+
+    @return 1 on success, 0 if buf is too small.
+*/
+int
+emiss_resource_path(char *buf, size_t size, const char *path);
+
+/*! Fill in a view of the database connection context of the resources, for monitoring.
+
+    @param rsrc_ctx An initialized resource context structure.
+    @param stats    The structure to fill in.
+
+    @see wlpq_stats_get()
+*/
+void
+emiss_resource_db_stats(emiss_resource_ctx_st *rsrc_ctx, wlpq_stats_st *stats);
+
 /*! Return a pointer to a static asset stored in memory.
 
-    @param rsrc_ctx: An initialized resource context structure.
+    @param snapshot: A resource snapshot, acquired for as long as the asset is used.
     @param The index of the resource.
 
     @return A pointer to the resource or NULL on any error.
@@ -332,11 +672,11 @@ emiss_resource_ctx_init();
     @see emiss_init_resource_ctx(), emiss_free_resource_ctx(), emiss_get_static_resource_size()
 */
 char *
-emiss_resource_static_get(emiss_resource_ctx_st *rsrc_ctx, size_t i);
+emiss_resource_static_get(emiss_resource_snapshot_st *snapshot, size_t i);
 
 /*! Return the size in bytes of a static asset stored in memory.
 
-    @param rsrc_ctx: An initialized resource context structure.
+    @param snapshot: A resource snapshot, acquired for as long as the asset is used.
     @param The index of the resource.
 
     @return The byte size as a positive integer or 0 on any error.
@@ -344,7 +684,16 @@ emiss_resource_static_get(emiss_resource_ctx_st *rsrc_ctx, size_t i);
     @see emiss_init_resource_ctx(), emiss_free_resource_ctx(), emiss_get_static_resource()
 */
 size_t
-emiss_resource_static_size(emiss_resource_ctx_st *rsrc_ctx, size_t i);
+emiss_resource_static_size(emiss_resource_snapshot_st *snapshot, size_t i);
+
+/*! Find a file embedded at build time, by a binary search of emiss_assets.
+
+    @param path     The path of the file under resources/, without a leading slash.
+
+    @return The file or NULL if there is none by that path.
+*/
+const emiss_asset_st *
+emiss_resource_asset_get(const char *path);
 
 /*! Deallocator/cleaner or document template data structure.
 
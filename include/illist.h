@@ -0,0 +1,82 @@
+/*  @file       illist.h
+    @brief      An intrusive, circular doubly linked list, after the one of the Linux kernel.
+    @details    A structure is made a list item by embedding a struct list_head in it; the
+                structure is then accessed from a pointer to that member with container_of().
+    @author     Joa Käis (github.com/jiikai).
+    @copyright  Public domain.
+*/
+
+#ifndef _illist_h_
+#define _illist_h_
+
+#include <stddef.h>
+
+/*  Access a structure of type *type* from a *pointer* to its *member*, sans type checking. */
+#ifndef container_of
+    #define container_of(pointer, type, member)\
+        ((type *)((char *)(pointer) - offsetof(type, member)))
+#endif
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+
+#define LIST_HEAD(name)\
+    struct list_head name = LIST_HEAD_INIT(name)
+
+#define list_entry(pointer, type, member)\
+    container_of(pointer, type, member)
+
+#define list_for_each(pos, head)\
+    for (pos = (head)->next; pos != (head); pos = pos->next)
+
+#define list_for_each_safe(pos, n, head)\
+    for (pos = (head)->next, n = pos->next; pos != (head); pos = n, n = pos->next)
+
+static inline void
+INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void
+list_insert(struct list_head *item, struct list_head *prev, struct list_head *next)
+{
+    next->prev = item;
+    item->next = next;
+    item->prev = prev;
+    prev->next = item;
+}
+
+/*  Add item after head, as in a stack. */
+static inline void
+list_add(struct list_head *item, struct list_head *head)
+{
+    list_insert(item, head, head->next);
+}
+
+/*  Add item before head, as in a queue. */
+static inline void
+list_add_tail(struct list_head *item, struct list_head *head)
+{
+    list_insert(item, head->prev, head);
+}
+
+static inline void
+list_del(struct list_head *item)
+{
+    item->next->prev = item->prev;
+    item->prev->next = item->next;
+    INIT_LIST_HEAD(item);
+}
+
+static inline int
+list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+#endif  /* _illist_h_ */
@@ -0,0 +1,147 @@
+/*  @file       util_bench.h
+    @brief      A small timing harness: warmup, repeated samples, median and MAD, and cycles.
+    @author     Joa Käis (github.com/jiikai).
+    @copyright  Public domain.
+*/
+
+#ifndef _util_bench_h
+#define _util_bench_h
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <x86intrin.h>
+    /*  Cycles of the time-stamp counter, which ticks at a constant rate, not the core clock. */
+    #define UTIL_BENCH_CYCLES() ((uint64_t) __rdtsc())
+    #define UTIL_BENCH_HAS_CYCLES 1
+#else
+    #define UTIL_BENCH_CYCLES() ((uint64_t) 0)
+    #define UTIL_BENCH_HAS_CYCLES 0
+#endif
+
+#define UTIL_BENCH_MAX_SAMPLES 0x100
+
+/*! A function benchmarked, returning the number of bytes it processed. */
+typedef size_t (util_bench_ft)(void *arg);
+
+/*! How a function is measured: warmed up for warmup seconds, then timed for nsamples samples,
+    each of as many calls as take at least sample seconds. */
+typedef struct util_bench_config {
+    double          warmup;
+    double          sample;
+    size_t          nsamples;
+} util_bench_config_st;
+
+/*! What was measured, per call. The cycles are NAN where there is no cycle counter. */
+typedef struct util_bench_result {
+    size_t          bytes;
+    size_t          iterations;
+    double          median_ns;
+    double          mad_ns;
+    double          median_cycles;
+} util_bench_result_st;
+
+/*  Results of the calls benchmarked are summed here, so that none is optimized away. */
+static volatile size_t util_bench_sink;
+
+static inline double
+util_bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static inline int
+util_bench_compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*! The median of n values, which are sorted in place. */
+static inline double
+util_bench_median(double *values, size_t n)
+{
+    qsort(values, n, sizeof(double), util_bench_compare_doubles);
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/*! The median absolute deviation of n values from their median, overwriting them. */
+static inline double
+util_bench_mad(double *values, size_t n, double median)
+{
+    for (size_t i = 0; i < n; ++i)
+        values[i] = fabs(values[i] - median);
+    return util_bench_median(values, n);
+}
+
+/*  Time iterations calls of f, in seconds, and their cycles. */
+static inline double
+util_bench_time(util_bench_ft *f, void *arg, size_t iterations, uint64_t *cycles)
+{
+    size_t sink = 0;
+    double start = util_bench_now();
+    uint64_t start_cycles = UTIL_BENCH_CYCLES();
+    for (size_t i = 0; i < iterations; ++i)
+        sink += f(arg);
+    *cycles = UTIL_BENCH_CYCLES() - start_cycles;
+    double elapsed = util_bench_now() - start;
+    util_bench_sink += sink;
+    return elapsed;
+}
+
+/*! Measure f. Returns 1 on success, 0 if f processed nothing or config is out of range. */
+static inline int
+util_bench_run(util_bench_ft *f, void *arg, const util_bench_config_st *config,
+    util_bench_result_st *result)
+{
+    double ns[UTIL_BENCH_MAX_SAMPLES], cycles[UTIL_BENCH_MAX_SAMPLES];
+    size_t n = config->nsamples;
+    if (!n || n > UTIL_BENCH_MAX_SAMPLES)
+        return 0;
+    result->bytes = f(arg);
+    if (!result->bytes)
+        return 0;
+
+    /*  Warm up, doubling the calls of a sample until it takes long enough to time. */
+    size_t iterations = 1;
+    uint64_t elapsed_cycles;
+    for (double start = util_bench_now();;) {
+        double elapsed = util_bench_time(f, arg, iterations, &elapsed_cycles);
+        if (elapsed < config->sample)
+            iterations *= 2;
+        else if (util_bench_now() - start >= config->warmup)
+            break;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        ns[i]     = util_bench_time(f, arg, iterations, &elapsed_cycles) * 1e9
+                  / (double) iterations;
+        cycles[i] = (double) elapsed_cycles / (double) iterations;
+    }
+    result->iterations    = iterations;
+    result->median_ns     = util_bench_median(ns, n);
+    result->mad_ns        = util_bench_mad(ns, n, result->median_ns);
+    result->median_cycles = UTIL_BENCH_HAS_CYCLES ? util_bench_median(cycles, n) : NAN;
+    return 1;
+}
+
+/*! The number following "key": in json, searched for from from on and before before, if not
+    NULL, or NAN. Enough to read back results written by the harness's users, not JSON at large. */
+static inline double
+util_bench_json_number(const char *from, const char *before, const char *key)
+{
+    char quoted[0x40];
+    if (snprintf(quoted, sizeof(quoted), "\"%s\":", key) >= (int) sizeof(quoted))
+        return NAN;
+    const char *at = strstr(from, quoted);
+    return at && (!before || at < before) ? strtod(at + strlen(quoted), 0) : NAN;
+}
+
+#endif  /* _util_bench_h_ */
@@ -0,0 +1,70 @@
+/*  @file       util_ccode.h
+    @brief      A direct-mapped index of ISO-3166-1 country codes.
+    @author     Joa Käis (github.com/jiikai).
+    @copyright  Public domain.
+*/
+
+#ifndef _util_ccode_h
+#define _util_ccode_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*  Slots for every Alpha-3 and Alpha-2 code: a code of letters is a number in base 26. */
+#define UTIL_CCODE_NSLOTS_A3 (26 * 26 * 26)
+#define UTIL_CCODE_NSLOTS_A2 (26 * 26)
+
+/*  The value of an empty slot. */
+#define UTIL_CCODE_NONE 0xFFFF
+
+/*! Dense ids, such as indices of arrays of country data, by Alpha-3 and Alpha-2 code. Built once
+    and read only after, a lookup is a single memory access with no comparing of strings. */
+typedef struct util_ccode_index {
+    uint16_t    a3[UTIL_CCODE_NSLOTS_A3];
+    uint16_t    a2[UTIL_CCODE_NSLOTS_A2];
+} util_ccode_index_st;
+
+/*! The slot of a code of len letters, either case, or -1 if it is not one. */
+static inline int
+util_ccode_slot(const char *code, size_t len)
+{
+    int slot = 0;
+    for (size_t i = 0; i < len; ++i) {
+        unsigned c = ((unsigned char) code[i] | 0x20) - 'a';
+        if (c > 25)
+            return -1;
+        slot = slot * 26 + (int) c;
+    }
+    return slot;
+}
+
+static inline void
+util_ccode_index_init(util_ccode_index_st *index)
+{
+    memset(index, 0xFF, sizeof(util_ccode_index_st));
+}
+
+/*! Map a code of 3 or 2 letters to id. Returns 1 on success, 0 if code is not one. */
+static inline int
+util_ccode_index_set(util_ccode_index_st *index, const char *code, size_t len, uint16_t id)
+{
+    int slot = len == 3 || len == 2 ? util_ccode_slot(code, len) : -1;
+    if (slot < 0)
+        return 0;
+    (len == 3 ? index->a3 : index->a2)[slot] = id;
+    return 1;
+}
+
+/*! The id of a code of 3 or 2 letters, or -1 if there is none. */
+static inline int
+util_ccode_index_get(const util_ccode_index_st *index, const char *code, size_t len)
+{
+    int slot = len == 3 || len == 2 ? util_ccode_slot(code, len) : -1;
+    if (slot < 0)
+        return -1;
+    uint16_t id = (len == 3 ? index->a3 : index->a2)[slot];
+    return id == UTIL_CCODE_NONE ? -1 : (int) id;
+}
+
+#endif  /* _util_ccode_h_ */
@@ -1,5 +1,5 @@
 /*  @file       util_json.h
-    @brief      A set of convenience macros for formatting JSON.
+    @brief      A set of convenience macros and an append-only builder for formatting JSON.
     @author     Joa Käis (github.com/jiikai).
     @copyright  Public domain.
 */
@@ -7,6 +7,12 @@
 #ifndef _util_json_h
 #define _util_json_h
 
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #define JSON_FRMT_KEY_VALUE_PAIR(out, out_n, k_name, v_name, prep_delim, ...)\
     snprintf(out, out_n, (prep_delim ? ",{\"" k_name "\":\"%s\",\"" v_name "\":%s}"\
             : "{\"" k_name "\":\"%s\",\"" v_name "\":%s}"), __VA_ARGS__)
@@ -19,4 +25,225 @@
     snprintf(buf, buf_n, (append ? ",{\"%s\":%s}" : "{\"%s\":%s}"), key_name, val_name) < 0 ? -1 :\
     snprintf(out, out_n, buf, __VA_ARGS__)
 
+/*  Append a string literal without escaping: lit must be an array, not a pointer. */
+#define UTIL_JSON_LITERAL(json, lit) util_json_raw(json, lit, sizeof(lit) - 1)
+
+/*
+**  BUILDER
+*/
+
+/*! How strings are escaped: as JSON, as JSON text that is itself placed inside a single quoted
+    JavaScript string literal (as in JSON.parse('...')), or as the content of such a literal. */
+typedef enum util_json_escape {
+    UTIL_JSON_ESC_JSON,
+    UTIL_JSON_ESC_JS_QUOTED,
+    UTIL_JSON_ESC_JS
+} util_json_escape_et;
+
+/*! An append-only output buffer. Either fixed, over memory of the caller, or allocated and grown
+    as needed, in which case the caller takes ownership of data. A failed append (out of space or
+    memory) sets failed and makes every later append a no-op, so it needs checking only once, at
+    the end. The data is always NUL-terminated. */
+typedef struct util_json_buf {
+    char                   *data;
+    size_t                  len;
+    size_t                  size;
+    int                     fixed;
+    int                     failed;
+    util_json_escape_et     escape;
+} util_json_buf_st;
+
+/*! Initialize a builder over buf of size bytes, or, if buf is NULL, over an allocation of size
+    bytes that grows as needed. Returns 1 on success, 0 if the allocation failed. */
+static inline int
+util_json_init(util_json_buf_st *json, char *buf, size_t size, util_json_escape_et escape)
+{
+    json->fixed  = buf != NULL;
+    json->data   = buf ? buf : malloc(size ? size : 1);
+    json->size   = json->data ? (size ? size : 1) : 0;
+    json->len    = 0;
+    json->failed = !json->size;
+    json->escape = escape;
+    if (json->size)
+        json->data[0] = '\0';
+    return !json->failed;
+}
+
+/*! Ensure room for n more bytes and the terminating NUL. */
+static inline int
+util_json_reserve(util_json_buf_st *json, size_t n)
+{
+    if (json->failed)
+        return 0;
+    if (json->len + n < json->size)
+        return 1;
+    size_t size = json->size * 2;
+    if (size <= json->len + n)
+        size = json->len + n + 1;
+    char *data = json->fixed ? NULL : realloc(json->data, size);
+    if (!data) {
+        json->failed = 1;
+        return 0;
+    }
+    json->data = data;
+    json->size = size;
+    return 1;
+}
+
+static inline void
+util_json_raw(util_json_buf_st *json, const char *src, size_t n)
+{
+    if (!util_json_reserve(json, n))
+        return;
+    memcpy(&json->data[json->len], src, n);
+    json->len += n;
+    json->data[json->len] = '\0';
+}
+
+static inline void
+util_json_char(util_json_buf_st *json, char c)
+{
+    if (!util_json_reserve(json, 1))
+        return;
+    json->data[json->len++] = c;
+    json->data[json->len]   = '\0';
+}
+
+/*! Append the characters of a string, escaped as the builder was initialized to, without the
+    surrounding quotes. Bytes other than ASCII are copied as is, the input is assumed UTF-8. */
+static inline void
+util_json_str_chars(util_json_buf_st *json, const char *src, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    const int js_quoted = json->escape == UTIL_JSON_ESC_JS_QUOTED,
+              js        = json->escape == UTIL_JSON_ESC_JS;
+    size_t i = 0;
+    while (i < n) {
+        /*  Copy the run of characters needing no escape at once. */
+        size_t run = i;
+        while (run < n) {
+            unsigned char c = (unsigned char) src[run];
+            if (c < 0x20 || c == '\\' || (c == '"' && !js) || (c == '\'' && json->escape))
+                break;
+            ++run;
+        }
+        util_json_raw(json, &src[i], run - i);
+        if (run == n)
+            break;
+        unsigned char c = (unsigned char) src[run];
+        i = run + 1;
+        char esc[8];
+        size_t len = 0;
+        if (c == '\'') {
+            esc[len++] = '\\';
+            esc[len++] = '\'';
+            util_json_raw(json, esc, len);
+            continue;
+        }
+        /*  The backslash of an escape sequence is itself escaped inside a JavaScript literal. */
+        esc[len++] = '\\';
+        if (js_quoted)
+            esc[len++] = '\\';
+        switch (c) {
+        case '"':  esc[len++] = '"';  break;
+        case '\\': esc[len++] = '\\';
+                   if (js_quoted)
+                       esc[len++] = '\\';
+                   break;
+        case '\b': esc[len++] = 'b';  break;
+        case '\f': esc[len++] = 'f';  break;
+        case '\n': esc[len++] = 'n';  break;
+        case '\r': esc[len++] = 'r';  break;
+        case '\t': esc[len++] = 't';  break;
+        default:
+            esc[len++] = 'u';
+            esc[len++] = '0';
+            esc[len++] = '0';
+            esc[len++] = hex[c >> 4];
+            esc[len++] = hex[c & 0xF];
+        }
+        util_json_raw(json, esc, len);
+    }
+}
+
+/*! Append a quoted, escaped string. */
+static inline void
+util_json_str(util_json_buf_st *json, const char *src)
+{
+    util_json_char(json, '"');
+    util_json_str_chars(json, src, strlen(src));
+    util_json_char(json, '"');
+}
+
+static inline void
+util_json_uint(util_json_buf_st *json, uintmax_t value)
+{
+    char buf[24];
+    size_t i = sizeof(buf);
+    do
+        buf[--i] = (char) ('0' + value % 10);
+    while (value /= 10);
+    util_json_raw(json, &buf[i], sizeof(buf) - i);
+}
+
+static inline void
+util_json_int(util_json_buf_st *json, intmax_t value)
+{
+    if (value < 0) {
+        util_json_char(json, '-');
+        util_json_uint(json, (uintmax_t) -(value + 1) + 1);
+    } else
+        util_json_uint(json, (uintmax_t) value);
+}
+
+/*! Append a double in digits that read back as the same value, or null if it is not finite.
+    Values with up to 6 decimals and under 2^53 scaled, which is most of data like ours, take the
+    fewest digits, formatted as integers; the rest take 15 to 17 significant digits by printf. */
+static inline void
+util_json_double(util_json_buf_st *json, double value)
+{
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6};
+    if (!isfinite(value)) {
+        UTIL_JSON_LITERAL(json, "null");
+        return;
+    }
+    double magnitude = fabs(value);
+    if (magnitude < 1e15) {
+        /*  The decimal m / 10^k reads back as the correctly rounded quotient, which is value
+            exactly when the division gives it. The smallest such k gives the fewest digits. */
+        for (size_t k = 0; k < sizeof(pow10) / sizeof(pow10[0]); ++k) {
+            double scaled = magnitude * pow10[k];
+            if (scaled >= 9007199254740992.0)
+                break;
+            double m = floor(scaled + 0.5);
+            if (m / pow10[k] != magnitude)
+                continue;
+            char buf[32];
+            size_t i = sizeof(buf);
+            uintmax_t digits = (uintmax_t) m;
+            for (size_t d = 0; d <= k || digits; ++d) {
+                if (d == k && k)
+                    buf[--i] = '.';
+                buf[--i] = (char) ('0' + digits % 10);
+                digits /= 10;
+            }
+            if (value < 0)
+                buf[--i] = '-';
+            util_json_raw(json, &buf[i], sizeof(buf) - i);
+            return;
+        }
+    }
+    char buf[32];
+    int len = 0;
+    for (int precision = 15; precision <= 17; ++precision) {
+        len = snprintf(buf, sizeof(buf), "%.*g", precision, value);
+        if (strtod(buf, 0) == value)
+            break;
+    }
+    if (len > 0)
+        util_json_raw(json, buf, (size_t) len);
+    else
+        json->failed = 1;
+}
+
 #endif  /* _util_json_h_ */
@@ -0,0 +1,112 @@
+/*  @file       util_sha256.h
+    @brief      SHA-256 (FIPS 180-4), incremental, to a hex digest.
+    @author     Joa Käis (github.com/jiikai).
+    @copyright  Public domain.
+*/
+
+#ifndef _util_sha256_h
+#define _util_sha256_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Length of a hex digest, without the NUL. */
+#define UTIL_SHA256_HEX_LEN 64
+
+#define UTIL_SHA256_ROTR32(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+typedef struct util_sha256 {
+    uint32_t        state[8];
+    uint64_t        len;
+    unsigned char   block[64];
+    size_t          fill;
+} util_sha256_st;
+
+static inline void
+util_sha256_compress(uint32_t *state, const unsigned char *block)
+{
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+        0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+        0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+        0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+        0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+        0xc67178f2
+    };
+    uint32_t w[64], v[8];
+    for (size_t i = 0; i < 16; ++i)
+        w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16
+             | (uint32_t) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    for (size_t i = 16; i < 64; ++i)
+        w[i] = w[i - 16] + w[i - 7]
+             + (UTIL_SHA256_ROTR32(w[i - 15], 7) ^ UTIL_SHA256_ROTR32(w[i - 15], 18)
+                ^ w[i - 15] >> 3)
+             + (UTIL_SHA256_ROTR32(w[i - 2], 17) ^ UTIL_SHA256_ROTR32(w[i - 2], 19)
+                ^ w[i - 2] >> 10);
+    memcpy(v, state, sizeof(v));
+    for (size_t i = 0; i < 64; ++i) {
+        uint32_t t1 = v[7] + (UTIL_SHA256_ROTR32(v[4], 6) ^ UTIL_SHA256_ROTR32(v[4], 11)
+                        ^ UTIL_SHA256_ROTR32(v[4], 25))
+                    + ((v[4] & v[5]) ^ (~v[4] & v[6])) + k[i] + w[i],
+                 t2 = (UTIL_SHA256_ROTR32(v[0], 2) ^ UTIL_SHA256_ROTR32(v[0], 13)
+                        ^ UTIL_SHA256_ROTR32(v[0], 22))
+                    + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(&v[1], v, sizeof(uint32_t) * 7);
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (size_t i = 0; i < 8; ++i)
+        state[i] += v[i];
+}
+
+static inline void
+util_sha256_init(util_sha256_st *hash)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(hash->state, initial, sizeof(initial));
+    hash->len  = 0;
+    hash->fill = 0;
+}
+
+static inline void
+util_sha256_update(util_sha256_st *hash, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    hash->len += len;
+    while (len) {
+        size_t n = sizeof(hash->block) - hash->fill;
+        n = n < len ? n : len;
+        memcpy(&hash->block[hash->fill], bytes, n);
+        hash->fill += n;
+        bytes += n;
+        len -= n;
+        if (hash->fill == sizeof(hash->block)) {
+            util_sha256_compress(hash->state, hash->block);
+            hash->fill = 0;
+        }
+    }
+}
+
+/*! Finish a hash and write its digest to hex, UTIL_SHA256_HEX_LEN digits and a NUL. */
+static inline void
+util_sha256_final_hex(util_sha256_st *hash, char *hex)
+{
+    uint64_t bits = hash->len * 8;
+    unsigned char pad[72] = {0x80};
+    size_t npad = (hash->fill < 56 ? 56 : 120) - hash->fill;
+    for (size_t i = 0; i < 8; ++i)
+        pad[npad + i] = (unsigned char) (bits >> (56 - i * 8));
+    util_sha256_update(hash, pad, npad + 8);
+    for (size_t i = 0; i < 8; ++i)
+        sprintf(&hex[i * 8], "%08x", (unsigned) hash->state[i]);
+}
+
+#endif  /* _util_sha256_h_ */
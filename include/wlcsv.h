@@ -12,6 +12,7 @@
 **  INCLUDES
 */
 
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,12 +39,23 @@
 /*!  Option flag for ignoring empty fields completely when parsing. */
 #define WLCSV_IGNORE_EMPTY_FIELDS 1
 
+/*! Option flag for tokenizing with the block-wise SIMD engine instead of libcsv.
+
+    Delimiters, quotes and line terminators are classified 64 bytes at a time (AVX2 or SSE2,
+    selected at runtime, with a portable scalar fallback). Fields are delivered with semantics
+    identical to libcsv; a field it cannot handle (e.g. a stray quote) is handed back to libcsv
+    together with the remainder of the data. Has no effect on wlcsv_file_preview().
+*/
+#define WLCSV_TOKENIZER_SIMD 2
+
 /*! Maximun number of enlisted callbacks, including the default
-    but excluding the end-of-row callback. */
+    but excluding the end-of-row callback. The callback table grows on demand up to this limit,
+    which is bound by the range of callback ids (`UINT8_MAX` being reserved for errors). */
 #ifndef WLCSV_NCALLBACKS_MAX
-    #define WLCSV_NCALLBACKS_MAX 0x10
-#elif ((WLCSV_NCALLBACKS_MAX - 1) % WLCSV_NCALLBACK_MATCH_TYPES)
-    #define  WLCSV_NCALLBACKS_MAX 0x10
+    #define WLCSV_NCALLBACKS_MAX UINT8_MAX
+#elif (WLCSV_NCALLBACKS_MAX > UINT8_MAX)
+    #undef  WLCSV_NCALLBACKS_MAX
+    #define WLCSV_NCALLBACKS_MAX UINT8_MAX
 #endif
 
 /*  FUNCTION-LIKE MACROS */
@@ -107,13 +119,17 @@ typedef unsigned wlcsv_callback_match_ft(const char *, size_t, wlcsv_state_st *)
     1.  If the pointer to the current field is NULL (or the field is empty in case
         ignore_empty_fields is set), return with no callback.
     2.  If ignore_regex is not NULL, check field text for match. Return with no callback if so.
-    3.  If h_kcallbacks has entries, check if a string key matching the field text is found. If so,
-        select the associated callback function and return.
-    4.  If h_rcallbacks has entries, check if a row key (int) matching the current row number
-        exists. If so, select the associated callback function and return.
-    5.  If h_ccallbacks has entries, check if a column key (int) matching the current column number
-        exists. If so, select the associated callback function and return.
-    6.  If a default callback has been set, call it and return.
+    3.  If KEYWORD callbacks are active, look up a key equal to the field text from a hash. If
+        found, select the associated callback function and return.
+    4.  If REGEX callbacks are active, try each against the field text. On a match, select the
+        associated callback function and return.
+    5.  If ROW callbacks are active, look up the current row number from a hash. If found, select
+        the associated callback function and return.
+    6.  If COLUMN callbacks are active, index a table by the current column number. If an entry
+        exists, select the associated callback function and return.
+    7.  If a default callback has been set, call it and return.
+
+    Where several active callbacks share a key, row or column, the one set last is selected.
 */
 typedef void wlcsv_callback_ft(void *, size_t, void *);
 
@@ -142,6 +158,50 @@ typedef union {
     char                       *key_or_rgx;
 } wlcsv_callback_match_to_ut;
 
+/*! Value types for typed callbacks.
+
+    @see wlcsv_value_st, wlcsv_callbacks_typed_set()
+*/
+typedef enum wlcsv_value_type {
+    WLCSV_TEXT, WLCSV_INT64, WLCSV_DOUBLE
+} wlcsv_value_type_et;
+
+/*! Parse outcomes for typed callbacks.
+
+    @see wlcsv_value_st, wlcsv_callbacks_typed_set()
+*/
+typedef enum wlcsv_value_status {
+    WLCSV_VALUE_OK, WLCSV_VALUE_EMPTY, WLCSV_VALUE_MALFORMED
+} wlcsv_value_status_et;
+
+/*! A field value as passed to typed callbacks.
+
+    @member type    WLCSV_INT64 or WLCSV_DOUBLE, as declared for the callback.
+    @member status  WLCSV_VALUE_OK if the whole field parsed as @a type. On WLCSV_VALUE_EMPTY or
+                    WLCSV_VALUE_MALFORMED the value is NaN for WLCSV_DOUBLE and 0 for WLCSV_INT64.
+    @member i64,
+            f64     The parsed value, by @a type.
+
+    @see wlcsv_typed_callback_ft, wlcsv_callbacks_typed_set()
+*/
+typedef struct wlcsv_value {
+    wlcsv_value_type_et         type;
+    wlcsv_value_status_et       status;
+    union {
+        int64_t                 i64;
+        double                  f64;
+    };
+} wlcsv_value_st;
+
+/*! A function type for typed callbacks, set with wlcsv_callbacks_typed_set().
+
+    Selected by the same rules as wlcsv_callback_ft, but the field is parsed as declared before
+    the call, and the parsed value is passed in place of the field text.
+
+    @see wlcsv_value_st
+*/
+typedef void wlcsv_typed_callback_ft(const wlcsv_value_st *, void *);
+
 /*
 **  FUNCTIONS
 */
@@ -164,10 +224,12 @@ wlcsv_free(wlcsv_ctx_st *ctx);
     @param  nkeycallbacks,
             nrgxcallbacks,
             nrowcallbacks,
-            ncolcallbacks,          Total count of callbacks by keyword, regex, row or column match.
+            ncolcallbacks,          Expected count of callbacks by keyword, regex, row or column
+                                    match, used to presize the callback table.
     @param lineskip                 Offset in lines from the beginning of the file to be skipped
                                     over. Default 0, can be set later.
-    @param options                  [TODO]
+    @param options                  A bit mask of WLCSV_IGNORE_EMPTY_FIELDS and
+                                    WLCSV_TOKENIZER_SIMD.
 
     @remark Parameters ignore_rgx, default_callback, default_callback_data, lineskip and options can
     be set or changed later.
@@ -218,15 +280,57 @@ wlcsv_file_preview(wlcsv_ctx_st *ctx, unsigned nrows, size_t buf_size,
 /*! Processes a csv file, the path to which was set via wlcsv_set_target_path().
 
     @param ctx          An initialized context structure handle.
-    @param buf_size     Byte size of the data.
+    @param buf_size     Size of the chunks in which the file is read and parsed. If 0, a default
+                        of 64 KiB is used.
+
+    @remark The file is streamed through wlcsv_push(), so it is never held in memory as a whole.
 
     @return Count of parsed bytes, or 0 if no path had previously been set, or -1 on NULL @a ctx or
             a memory/file stream error.
-    @see wlcsv_free(), wlcsv_init(), wlcsv_preview()
+    @see wlcsv_free(), wlcsv_init(), wlcsv_preview(), wlcsv_push()
 */
 int
 wlcsv_file_read(wlcsv_ctx_st *ctx, size_t buf_size);
 
+/*! Begin parsing a csv stream, to be passed in chunks to wlcsv_push().
+
+    Resets the row and column counts. The first @a lineskip lines of the stream are skipped.
+
+    @param ctx          An initialized context structure handle.
+
+    @return `1` on success, `0` on `ctx == NULL` and `-1` if a previous stream was not ended.
+    @see wlcsv_push(), wlcsv_push_end()
+*/
+int
+wlcsv_push_begin(wlcsv_ctx_st *ctx);
+
+/*! Parse the next chunk of a csv stream begun with wlcsv_push_begin().
+
+    Chunks may be split anywhere, even within a quoted field or a line terminator. Callbacks are
+    called for all fields completed by the chunk; the incomplete field at its end, if any, is kept
+    until the next chunk or the end of the stream.
+
+    @param ctx          An initialized context structure handle.
+    @param data,
+           len          The chunk of data and its byte size.
+
+    @return `1` on success, `0` on `ctx == NULL` and `-1` on a parse or memory error.
+    @see wlcsv_push_begin(), wlcsv_push_end()
+*/
+int
+wlcsv_push(wlcsv_ctx_st *ctx, const void *data, size_t len);
+
+/*! End a csv stream, parsing its last field and row.
+
+    @param ctx          An initialized context structure handle.
+
+    @return Count of parsed bytes (sans skipped lines), or 0 on `ctx == NULL` or -1 on a parse
+            error or if the stream ended before @a lineskip lines.
+    @see wlcsv_push_begin(), wlcsv_push()
+*/
+int
+wlcsv_push_end(wlcsv_ctx_st *ctx);
+
 /*!*/
 int
 wlcsv_callbacks_active(wlcsv_ctx_st *ctx, uint8_t id);
@@ -289,6 +393,38 @@ wlcsv_callbacks_set(wlcsv_ctx_st *ctx,
     void *callback_data,
     unsigned once);
 
+/*! Associate a typed callback function with a regex, keyword, row or a column number.
+
+    As wlcsv_callbacks_set(), but the field is parsed as @a type before @a callback is called.
+    Numbers are parsed without regard to the current locale: an optional sign, digits and, for
+    WLCSV_DOUBLE, an optional '.' fraction and an 'e' or 'E' exponent. Surrounding whitespace,
+    hexadecimal, "inf" and "nan" are malformed.
+
+    @param ctx           An initialized context structure handle.
+    @param match_by      An enum type denoting the property against which to match.
+    @param match_to      A union holding either an unsigned value or an object/function pointer.
+    @param type          WLCSV_INT64 or WLCSV_DOUBLE.
+    @param callback      Called with the parsed value of a field with matching data.
+    @param callback_data If not NULL, this pointer will be passed to the callback when invoked.
+                            Otherwise the context-wise data pointer is used (if set).
+    @param once          If nonzero, the callback is disabled after its first call.
+
+    @remark Empty fields reach a typed callback as WLCSV_VALUE_EMPTY unless the option
+    WLCSV_IGNORE_EMPTY_FIELDS is set, in which case they are skipped as with any callback.
+
+    @return  An id for this callback association on success or `UINT8_MAX` on any error.
+
+    @see wlcsv_callbacks_set(), wlcsv_value_st
+*/
+uint8_t
+wlcsv_callbacks_typed_set(wlcsv_ctx_st *ctx,
+    wlcsv_callback_match_by_et match_by,
+    wlcsv_callback_match_to_ut *match_to,
+    wlcsv_value_type_et type,
+    wlcsv_typed_callback_ft *callback,
+    void *callback_data,
+    unsigned once);
+
 /*! Activate a disabled or deactive an enabled callback.
 
     @param ctx      An initialized context structure handle.
@@ -300,11 +436,27 @@ wlcsv_callbacks_set(wlcsv_ctx_st *ctx,
 int
 wlcsv_callbacks_toggle(wlcsv_ctx_st *ctx, uint8_t id);
 
+/*! Activate every callback, those disabled by wlcsv_callbacks_toggle() and those disabled as they
+    were called: a `once` callback and a ROW callback by the end of its row. Callbacks set up once
+    for a file will so be called again for its next read.
+
+    Does nothing if `ctx == NULL`.
+
+    @param ctx      An initialized context structure handle.
+    @see wlcsv_callbacks_set(), wlcsv_callbacks_toggle(), wlcsv_file_read()
+*/
+void
+wlcsv_reset_callbacks(wlcsv_ctx_st *ctx);
+
 /*! Set or unset a PCRE regex that will cause any field that matches to be ignored.
 
     @param ctx      An initialized context structure handle.
     @param regex    A regular expression string. If NULL, no fields are ignored by a regex match.
 
+    @remark The regex is JIT-compiled where supported. Fields that cannot match, such as numbers
+    for a regex requiring a letter, are rejected without PCRE, and decisions on short fields are
+    memoized per column.
+
     @return `1` on success, `0` on `ctx == NULL` and `-1` on a regex compile error.
     @see wlcsv_read(), wlcsv_preview()
 */
@@ -86,6 +86,22 @@ typedef enum wlpq_thread_state {
     NONE, IDLE, BUSY, SUCC, FAIL
 } wlpq_thread_state_et;
 
+/*! A view of the query queue and of the send/poll threads and their connections, for monitoring.
+
+    Read without locking from the running threads: each value is current, but they are not
+    necessarily all of the same instant.
+*/
+typedef struct wlpq_stats {
+    unsigned                        queue_length;
+    unsigned                        in_flight;
+    unsigned                        nthreads;
+    unsigned                        nconn;
+    uint64_t                        nsent;
+    uint64_t                        nfailed;
+    wlpq_thread_state_et            thread_state[WLPQ_MAX_NCONNTHREADS];
+    uint8_t                         conn_iostate[WLPQ_MAX_NCONNTHREADS][WLPQ_MAX_NCONN_PER_THREAD];
+} wlpq_stats_st;
+
 /*! An opaque handle to the main context structure. */
 typedef struct wlpq_conn_ctx wlpq_conn_ctx_st;
 
@@ -228,6 +244,30 @@ wlpq_query_run_blocking(wlpq_conn_ctx_st *ctx, char *stmt_or_cmd,
     char **param_values, int *param_lengths, uint8_t nparams,
     wlpq_res_handler_ft *callback, void *cb_arg);
 
+/*! Fill in a view of the state of the query queue and the send/poll threads.
+
+    The number of queries in flight is that of the connections sending a query or waiting on its
+    result; nsent and nfailed count the queries sent and the errors met since the context was
+    initialized.
+
+    @param ctx      A pointer to the connection context structure.
+    @param stats    The structure to fill in.
+
+    @see wlpq_stats_iostate_name()
+*/
+void
+wlpq_stats_get(wlpq_conn_ctx_st *ctx, wlpq_stats_st *stats);
+
+/*! The name of a connection I/O state of wlpq_stats_st: "idle", "send", "wait", "flush", "exit"
+    or "error".
+
+    @param iostate  A value of wlpq_stats_st.conn_iostate.
+
+    @return A string literal, "unknown" for a value of no state.
+*/
+const char *
+wlpq_stats_iostate_name(uint8_t iostate);
+
 /*!
 */
 uint8_t
@@ -7,13 +7,19 @@
 
 /*! end verge.js */
 
-const chart_type = '%s';
+const chart_type = '{{chart_type}}';
 
 function setChartData(arg) {
   if (chart_type !== 'map') {
-    arg.categories = JSON.parse('[%s]');
+    arg.categories = JSON.parse('[{{categories}}]');
+  }
+  arg.series = JSON.parse('[{{series}}]');
+  if (chart_type === 'combo') {
+    arg.series = {
+      line: arg.series,
+      area: JSON.parse('[{{series_secondary}}]')
+    };
   }
-  arg.series = JSON.parse('[%s]');
 }
 
 (() => {
@@ -55,22 +61,31 @@ let options = {
   chart: {
     format: '1,000',
     height: height < 300 ? 300 : height,
-    title: '%s',
+    title: '{{title}}',
     width: width < 300 ? 300 : width
   },
   tooltip: {
-    suffix: '%s'
+    suffix: '{{suffix}}'
   },
   legend: {
-    align: (width > 1000 && chart_type === 'line'
+    align: (width > 1000 && chart_type !== 'map'
             ? 'right' : chart_type === 'map'
             ? 'left' : 'bottom')
   }
 };
-if (chart_type === 'line') {
+if (chart_type === 'line' || chart_type === 'combo') {
   options.yAxis = {
-    title: '%s'
+    title: '{{y_axis_title}}'
   };
+  if (chart_type === 'combo') {
+    options.yAxis = [{
+      title: '{{y_axis_title}}',
+      chartType: 'line'
+    }, {
+      title: '{{y_axis_title_secondary}}',
+      chartType: 'area'
+    }];
+  }
   options.xAxis = {
     title: 'Year',
     type: 'dateTime',
@@ -98,8 +113,10 @@ if (chart_type === 'map') {
     "categories": categories,
     "series": series
   };
-  chart = tui.chart.lineChart(document.getElementById('chart-area'), data, options);
-  let not_found_msg = '%s';
+  chart = chart_type === 'combo'
+        ? tui.chart.comboChart(document.getElementById('chart-area'), data, options)
+        : tui.chart.lineChart(document.getElementById('chart-area'), data, options);
+  let not_found_msg = '{{not_found_msg}}';
   if (not_found_msg.length) {
     let not_found_elem = document.getElementById('not-found-msg');
     not_found_elem.textContent = not_found_msg;
@@ -9,6 +9,10 @@ main(int argc, const char *argv[]) {
     emiss_template_st *template_data = emiss_resource_template_init(rsrc_ctx);
     check(template_data, ERR_FAIL, EMISS_ERR, "setting up templates");
 
+    /* Refresh data in the background while the server runs. */
+    if (!emiss_resource_refresh_start(rsrc_ctx))
+        log_warn(ERR_FAIL, EMISS_ERR, "starting background data refresh");
+
     /* Init server & run event loop. */
     emiss_server_ctx_st *server_ctx = emiss_server_ctx_init(template_data);
     check(server_ctx, ERR_FAIL, EMISS_ERR, "setting up server context");
@@ -0,0 +1,383 @@
+/*! @file       emiss_metrics.c
+    @brief      Part of the implementation of [Emission](../include/emiss.h).
+    @details    See [documentation](../doc/emiss_api.md).
+    @copyright: (c) Joa Käis [github.com/jiikai] 2018-2019, [MIT](../LICENSE).
+*/
+
+/*
+**  INCLUDES
+*/
+
+#include "emiss.h"
+
+/*
+**  MACROS
+*/
+
+/*  Upper bounds of the request latency histogram buckets in microseconds, the last bucket being
+    that of the requests slower than any. */
+#define METRICS_NBUCKETS 12
+#define METRICS_BUCKET_BOUNDS_USEC\
+    {1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000}
+
+/*  Requests are counted by the class of their status code, 1xx to 5xx, class 0 being that of a
+    status out of range, such as that of a connection closed before a response. */
+#define METRICS_NCODE_CLASSES 6
+
+/*  The caches, by their counters of hits and misses. */
+#define METRICS_NCACHES 4
+
+/*  A counter and a gauge in the text format, with the help and type lines. */
+#define METRICS_COUNTER(out, name, help, value)\
+    bformata(out, "# HELP " name " " help "\n# TYPE " name " counter\n" name " %llu\n",\
+        (unsigned long long) (value))
+#define METRICS_GAUGE(out, name, help, frmt, value)\
+    bformata(out, "# HELP " name " " help "\n# TYPE " name " gauge\n" name " " frmt "\n", value)
+
+/*
+**  TYPES
+*/
+
+/*  The counters of a thread. Only the thread itself adds to them, unless there are more threads
+    than EMISS_METRICS_MAX_THREADS and the set is the one shared by those beyond: relaxed atomic
+    adds suffice in both cases. A set is never freed, for the counts of a thread that exits to
+    stay in the sums. */
+struct metrics_thread {
+    atomic_uint_fast64_t    counter[EMISS_NMETRICS];
+    atomic_uint_fast64_t    request_bucket[EMISS_METRICS_MAX_HANDLERS][METRICS_NBUCKETS + 1];
+    atomic_uint_fast64_t    request_code[EMISS_METRICS_MAX_HANDLERS][METRICS_NCODE_CLASSES];
+    atomic_uint_fast64_t    request_usec[EMISS_METRICS_MAX_HANDLERS];
+    atomic_uint_fast64_t    busy_usec;
+    atomic_uint             busy;
+};
+
+/*  The sums of the counters of every thread, taken when formatting. */
+struct metrics_sum {
+    uint64_t                counter[EMISS_NMETRICS];
+    uint64_t                request_bucket[EMISS_METRICS_MAX_HANDLERS][METRICS_NBUCKETS + 1];
+    uint64_t                request_code[EMISS_METRICS_MAX_HANDLERS][METRICS_NCODE_CLASSES];
+    uint64_t                request_usec[EMISS_METRICS_MAX_HANDLERS];
+    uint64_t                busy_usec;
+    unsigned                busy;
+};
+
+/*
+**  STATIC VARIABLES
+*/
+
+static struct metrics_thread *_Atomic   metrics_threads[EMISS_METRICS_MAX_THREADS];
+static atomic_size_t                    metrics_nthreads;
+static struct metrics_thread            metrics_shared;
+static atomic_int_fast64_t              metrics_gauge[EMISS_NGAUGES];
+static const uint64_t                   metrics_bucket_usec[METRICS_NBUCKETS]
+                                            = METRICS_BUCKET_BOUNDS_USEC;
+
+static const char *code_class_names[METRICS_NCODE_CLASSES] = {
+    "none", "1xx", "2xx", "3xx", "4xx", "5xx"
+};
+
+static const struct metrics_cache {
+    const char         *name;
+    emiss_metric_et     hits;
+    emiss_metric_et     misses;
+} metrics_caches[METRICS_NCACHES] = {
+    {"map_payload", EMISS_METRIC_MAP_PAYLOAD_HITS, EMISS_METRIC_MAP_PAYLOAD_MISSES},
+    {"series", EMISS_METRIC_SERIES_SNAPSHOT_HITS, EMISS_METRIC_SERIES_QUERIES},
+    {"arena", EMISS_METRIC_ARENA_REUSES, EMISS_METRIC_ARENA_ALLOCS},
+    {"flight", EMISS_METRIC_FLIGHT_JOINS, EMISS_METRIC_FLIGHT_LEADS}
+};
+
+static const char *thread_state_names[] = {
+    "none", "idle", "busy", "done", "failed"
+};
+
+/*
+**  FUNCTIONS
+*/
+
+/*  STATIC  */
+
+/*  The counters of the calling thread, claimed on its first call. */
+static struct metrics_thread *
+metrics_thread_self(void)
+{
+    static _Thread_local struct metrics_thread *self;
+    if (self)
+        return self;
+    size_t i = atomic_fetch_add_explicit(&metrics_nthreads, 1, memory_order_relaxed);
+    if (i < EMISS_METRICS_MAX_THREADS) {
+        struct metrics_thread *counters = calloc(1, sizeof(struct metrics_thread));
+        if (counters) {
+            atomic_store_explicit(&metrics_threads[i], counters, memory_order_release);
+            return self = counters;
+        }
+        log_warn(ERR_MEM, EMISS_ERR);
+    }
+    return self = &metrics_shared;
+}
+
+static void
+metrics_sum_add(struct metrics_sum *sum, struct metrics_thread *counters)
+{
+    for (size_t m = 0; m < EMISS_NMETRICS; ++m)
+        sum->counter[m] += atomic_load_explicit(&counters->counter[m], memory_order_relaxed);
+    for (size_t h = 0; h < EMISS_METRICS_MAX_HANDLERS; ++h) {
+        for (size_t b = 0; b <= METRICS_NBUCKETS; ++b)
+            sum->request_bucket[h][b] += atomic_load_explicit(&counters->request_bucket[h][b],
+                                            memory_order_relaxed);
+        for (size_t c = 0; c < METRICS_NCODE_CLASSES; ++c)
+            sum->request_code[h][c] += atomic_load_explicit(&counters->request_code[h][c],
+                                            memory_order_relaxed);
+        sum->request_usec[h] += atomic_load_explicit(&counters->request_usec[h],
+                                    memory_order_relaxed);
+    }
+    sum->busy_usec += atomic_load_explicit(&counters->busy_usec, memory_order_relaxed);
+    sum->busy      += atomic_load_explicit(&counters->busy, memory_order_relaxed);
+}
+
+/*  The resident set size of the process in bytes, or 0 if it is not known. */
+static uint64_t
+metrics_rss_bytes(void)
+{
+    unsigned long long size = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp)
+        return 0;
+    int ret = fscanf(fp, "%llu %llu", &size, &resident);
+    fclose(fp);
+    long page_size = sysconf(_SC_PAGESIZE);
+    return ret == 2 && page_size > 0 ? resident * (uint64_t) page_size : 0;
+}
+
+/*  IMPLEMENTATION OF FUNCTION PROTOTYPES IN: 'emiss.h' */
+
+void
+emiss_metrics_add(emiss_metric_et metric, uint64_t n)
+{
+    atomic_fetch_add_explicit(&metrics_thread_self()->counter[metric], n, memory_order_relaxed);
+}
+
+void
+emiss_metrics_gauge_set(emiss_gauge_et gauge, int64_t value)
+{
+    atomic_store_explicit(&metrics_gauge[gauge], value, memory_order_relaxed);
+}
+
+void
+emiss_metrics_request_begin(void)
+{
+    atomic_fetch_add_explicit(&metrics_thread_self()->busy, 1, memory_order_relaxed);
+}
+
+void
+emiss_metrics_request_end(size_t handler, int status, uint64_t usec)
+{
+    struct metrics_thread *counters = metrics_thread_self();
+    if (handler < EMISS_METRICS_MAX_HANDLERS) {
+        size_t b = 0;
+        while (b < METRICS_NBUCKETS && usec > metrics_bucket_usec[b])
+            ++b;
+        size_t c = status >= 100 && status < 600 ? (size_t) status / 100 : 0;
+        atomic_fetch_add_explicit(&counters->request_bucket[handler][b], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&counters->request_code[handler][c], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&counters->request_usec[handler], usec, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&counters->busy_usec, usec, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&counters->busy, 1, memory_order_relaxed);
+}
+
+int
+emiss_metrics_format(bstring out, const char *const *handler_names, size_t nhandlers)
+{
+    struct metrics_sum *sum = calloc(1, sizeof(struct metrics_sum));
+    check(sum, ERR_MEM, EMISS_ERR);
+    size_t nthreads = atomic_load_explicit(&metrics_nthreads, memory_order_relaxed);
+    if (nthreads > EMISS_METRICS_MAX_THREADS)
+        nthreads = EMISS_METRICS_MAX_THREADS;
+    for (size_t i = 0; i < nthreads; ++i) {
+        struct metrics_thread *counters = atomic_load_explicit(&metrics_threads[i],
+                                            memory_order_acquire);
+        if (counters)
+            metrics_sum_add(sum, counters);
+    }
+    metrics_sum_add(sum, &metrics_shared);
+    if (nhandlers > EMISS_METRICS_MAX_HANDLERS)
+        nhandlers = EMISS_METRICS_MAX_HANDLERS;
+
+    /*  Requests by handler and status class, and their latencies. */
+    int ret = bcatcstr(out,
+                "# HELP emiss_http_requests_total Requests by URI handler and status class.\n"
+                "# TYPE emiss_http_requests_total counter\n");
+    for (size_t h = 0; h < nhandlers && ret == BSTR_OK; ++h)
+        for (size_t c = 0; c < METRICS_NCODE_CLASSES && ret == BSTR_OK; ++c)
+            if (sum->request_code[h][c])
+                ret = bformata(out, "emiss_http_requests_total{handler=\"%s\",code=\"%s\"} %llu\n",
+                        handler_names[h], code_class_names[c],
+                        (unsigned long long) sum->request_code[h][c]);
+    check(ret == BSTR_OK, ERR_FAIL, EMISS_ERR, "formatting metrics");
+    const char *name = "emiss_http_request_duration_seconds";
+    ret = bformata(out, "# HELP %s Time to handle a request, by URI handler.\n"
+                        "# TYPE %s histogram\n", name, name);
+    for (size_t h = 0; h < nhandlers && ret == BSTR_OK; ++h) {
+        unsigned long long count = 0;
+        for (size_t b = 0; b < METRICS_NBUCKETS && ret == BSTR_OK; ++b) {
+            count += sum->request_bucket[h][b];
+            ret = bformata(out, "%s_bucket{handler=\"%s\",le=\"%g\"} %llu\n", name,
+                    handler_names[h], (double) metrics_bucket_usec[b] / 1e6, count);
+        }
+        count += sum->request_bucket[h][METRICS_NBUCKETS];
+        if (ret == BSTR_OK)
+            ret = bformata(out,
+                    "%s_bucket{handler=\"%s\",le=\"+Inf\"} %llu\n"
+                    "%s_sum{handler=\"%s\"} %.6f\n"
+                    "%s_count{handler=\"%s\"} %llu\n",
+                    name, handler_names[h], count,
+                    name, handler_names[h], (double) sum->request_usec[h] / 1e6,
+                    name, handler_names[h], count);
+    }
+    check(ret == BSTR_OK, ERR_FAIL, EMISS_ERR, "formatting metrics");
+
+    /*  Threads busy with a request now, and the time spent busy, the rate of which over the
+        number of worker threads is their utilization. */
+    ret = METRICS_GAUGE(out, "emiss_http_workers_busy",
+            "Threads handling a request.", "%u", sum->busy);
+    if (ret == BSTR_OK)
+        ret = bformata(out,
+                "# HELP emiss_http_workers_busy_seconds_total Time spent handling requests.\n"
+                "# TYPE emiss_http_workers_busy_seconds_total counter\n"
+                "emiss_http_workers_busy_seconds_total %.6f\n", (double) sum->busy_usec / 1e6);
+    check(ret == BSTR_OK, ERR_FAIL, EMISS_ERR, "formatting metrics");
+
+    /*  Admission of the requests querying the database. */
+    static const struct {
+        const char         *result;
+        emiss_metric_et     metric;
+    } admission[] = {
+        {"immediate", EMISS_METRIC_ADMISSION_IMMEDIATE},
+        {"waited", EMISS_METRIC_ADMISSION_WAITED},
+        {"rejected", EMISS_METRIC_ADMISSION_REJECTED},
+        {"timed_out", EMISS_METRIC_ADMISSION_TIMED_OUT}
+    };
+    ret = bcatcstr(out,
+            "# HELP emiss_admission_requests_total Requests querying the database by admission.\n"
+            "# TYPE emiss_admission_requests_total counter\n");
+    for (size_t i = 0; i < sizeof(admission) / sizeof(admission[0]) && ret == BSTR_OK; ++i)
+        ret = bformata(out, "emiss_admission_requests_total{result=\"%s\"} %llu\n",
+                admission[i].result, (unsigned long long) sum->counter[admission[i].metric]);
+    if (ret == BSTR_OK)
+        ret = METRICS_GAUGE(out, "emiss_admission_running",
+                "Requests querying the database.", "%lld", (long long)
+                atomic_load_explicit(&metrics_gauge[EMISS_GAUGE_ADMISSION_RUNNING],
+                    memory_order_relaxed));
+    if (ret == BSTR_OK)
+        ret = METRICS_GAUGE(out, "emiss_admission_waiting",
+                "Requests waiting for their turn to query the database.", "%lld", (long long)
+                atomic_load_explicit(&metrics_gauge[EMISS_GAUGE_ADMISSION_WAITING],
+                    memory_order_relaxed));
+    check(ret == BSTR_OK, ERR_FAIL, EMISS_ERR, "formatting metrics");
+
+    /*  Caches: precomputed map charts, line chart series served from the snapshot instead of the
+        database, and request arenas reused from the free list. */
+    ret = bcatcstr(out,
+            "# HELP emiss_cache_requests_total Lookups of a cache by result.\n"
+            "# TYPE emiss_cache_requests_total counter\n");
+    for (size_t i = 0; i < METRICS_NCACHES && ret == BSTR_OK; ++i)
+        ret = bformata(out,
+                "emiss_cache_requests_total{cache=\"%s\",result=\"hit\"} %llu\n"
+                "emiss_cache_requests_total{cache=\"%s\",result=\"miss\"} %llu\n",
+                metrics_caches[i].name, (unsigned long long) sum->counter[metrics_caches[i].hits],
+                metrics_caches[i].name,
+                (unsigned long long) sum->counter[metrics_caches[i].misses]);
+    if (ret == BSTR_OK)
+        ret = bcatcstr(out,
+                "# HELP emiss_cache_hit_ratio Hits of a cache over its lookups since the start.\n"
+                "# TYPE emiss_cache_hit_ratio gauge\n");
+    for (size_t i = 0; i < METRICS_NCACHES && ret == BSTR_OK; ++i) {
+        uint64_t hits    = sum->counter[metrics_caches[i].hits],
+                 lookups = hits + sum->counter[metrics_caches[i].misses];
+        if (lookups)
+            ret = bformata(out, "emiss_cache_hit_ratio{cache=\"%s\"} %.6f\n",
+                    metrics_caches[i].name, (double) hits / (double) lookups);
+    }
+    check(ret == BSTR_OK, ERR_FAIL, EMISS_ERR, "formatting metrics");
+
+    /*  Ingest progress and the snapshot built from it. */
+    int64_t gauge[EMISS_NGAUGES];
+    for (size_t g = 0; g < EMISS_NGAUGES; ++g)
+        gauge[g] = atomic_load_explicit(&metrics_gauge[g], memory_order_relaxed);
+    ret = METRICS_GAUGE(out, "emiss_ingest_running",
+            "Whether a data update is being parsed and sent.", "%lld",
+            (long long) gauge[EMISS_GAUGE_INGEST_RUNNING]);
+    if (ret == BSTR_OK)
+        ret = METRICS_GAUGE(out, "emiss_ingest_dataset",
+                "The id of the dataset being or last parsed.", "%lld",
+                (long long) gauge[EMISS_GAUGE_INGEST_DATASET]);
+    if (ret == BSTR_OK)
+        ret = METRICS_COUNTER(out, "emiss_ingest_bytes_total",
+                "Bytes of dataset parsed.", sum->counter[EMISS_METRIC_INGEST_BYTES]);
+    if (ret == BSTR_OK)
+        ret = METRICS_COUNTER(out, "emiss_ingest_rows_total",
+                "Rows of dataset parsed.", sum->counter[EMISS_METRIC_INGEST_ROWS]);
+    if (ret == BSTR_OK)
+        ret = METRICS_COUNTER(out, "emiss_ingest_datasets_total",
+                "Datasets parsed to the end.", sum->counter[EMISS_METRIC_INGEST_DATASETS]);
+    if (ret == BSTR_OK)
+        ret = METRICS_GAUGE(out, "emiss_ingest_last_success_timestamp_seconds",
+                "Time of the last data update to succeed.", "%lld",
+                (long long) gauge[EMISS_GAUGE_INGEST_LAST_SUCCESS]);
+    if (ret == BSTR_OK)
+        ret = METRICS_COUNTER(out, "emiss_snapshot_builds_total",
+                "Resource snapshots built.", sum->counter[EMISS_METRIC_SNAPSHOT_BUILDS]);
+    if (ret == BSTR_OK)
+        ret = METRICS_GAUGE(out, "emiss_snapshot_timestamp_seconds",
+                "Time the current resource snapshot was published.", "%lld",
+                (long long) gauge[EMISS_GAUGE_SNAPSHOT_TIME]);
+    if (ret == BSTR_OK)
+        ret = METRICS_GAUGE(out, "process_resident_memory_bytes",
+                "Resident memory size in bytes.", "%llu",
+                (unsigned long long) metrics_rss_bytes());
+    check(ret == BSTR_OK, ERR_FAIL, EMISS_ERR, "formatting metrics");
+    free(sum);
+    return 1;
+error:
+    free(sum);
+    return 0;
+}
+
+int
+emiss_metrics_format_db(bstring out, const wlpq_stats_st *stats)
+{
+    int ret = METRICS_GAUGE(out, "emiss_db_queue_length",
+                "Queries waiting for a connection.", "%u", stats->queue_length);
+    if (ret == BSTR_OK)
+        ret = METRICS_GAUGE(out, "emiss_db_queries_in_flight",
+                "Queries sent and waited on.", "%u", stats->in_flight);
+    if (ret == BSTR_OK)
+        ret = METRICS_COUNTER(out, "emiss_db_queries_total", "Queries sent.", stats->nsent);
+    if (ret == BSTR_OK)
+        ret = METRICS_COUNTER(out, "emiss_db_errors_total",
+                "Errors sending, polling or in the results of queries.", stats->nfailed);
+    if (ret == BSTR_OK)
+        ret = bcatcstr(out,
+                "# HELP emiss_db_thread_state The state of a send/poll thread.\n"
+                "# TYPE emiss_db_thread_state gauge\n");
+    for (size_t i = 0; i < stats->nthreads && ret == BSTR_OK; ++i) {
+        size_t state = (size_t) stats->thread_state[i];
+        ret = bformata(out, "emiss_db_thread_state{thread=\"%zu\",state=\"%s\"} 1\n", i,
+                state < sizeof(thread_state_names) / sizeof(thread_state_names[0])
+                ? thread_state_names[state] : "unknown");
+    }
+    if (ret == BSTR_OK)
+        ret = bcatcstr(out,
+                "# HELP emiss_db_connection_state The I/O state of a database connection.\n"
+                "# TYPE emiss_db_connection_state gauge\n");
+    for (size_t i = 0; i < stats->nthreads && ret == BSTR_OK; ++i)
+        for (size_t j = 0; j < stats->nconn && ret == BSTR_OK; ++j)
+            ret = bformata(out,
+                    "emiss_db_connection_state{thread=\"%zu\",conn=\"%zu\",state=\"%s\"} 1\n",
+                    i, j, wlpq_stats_iostate_name(stats->conn_iostate[i][j]));
+    check(ret == BSTR_OK, ERR_FAIL, EMISS_ERR, "formatting metrics");
+    return 1;
+error:
+    return 0;
+}
@@ -10,7 +10,13 @@
 
 #include "emiss.h"
 
+#include <errno.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#define MINIZ_HEADER_FILE_ONLY
+#include "miniz.h"
+#include "util_ccode.h"
 #include "util_json.h"
 #include "util_sql.h"
 
@@ -18,15 +24,70 @@
 **  MACRO CONSTANTS
 */
 
+#define TUI_CHART_DATA_PATH EMISS_DATA_ROOT"/in_tui_chart_map.txt"
+
 #define INTERNAL_ERROR_MSG "An internal error occured processing the request."
 
 #define DATA_NOT_FOUND_MSG "No data for the selected time range could be found for: "
 
+#define INVALID_PARAMETER_FRMT "Invalid or missing parameter %s."
+
 #define COUNTRY_COL_NAMES "code_iso_a3, code_iso_a2, name, region_id, "\
     "income_id, is_independent, is_an_aggregate, in_tui_chart"
 
 #define FRMT_HTML_OPTION_YEAR "<option id=\"f%u\" value=\"%u\">%u</option>\n"
 
+/*  Map charts are precomputed for each year and kind: CO2 emissions total and per capita, and
+    population, in the order of the value columns of SQL_SELECT_MAP_CHART_VALUES. */
+#define MAP_CHART_NKINDS 3
+#define MAP_CHART_NYEARS (1 + EMISS_YEAR_LAST - EMISS_YEAR_ZERO)
+
+/*  Aggregates of the countries of each region and income group, computed as a snapshot is built
+    and listed after the countries of the country data as pseudo-countries, coded QRA-QRG and
+    QNA-QND from the ISO-3166-1 Alpha-3 codes reserved for user assignment. */
+#define GROUP_NREGIONS 7
+#define GROUP_NINCOMES 4
+#define GROUP_COUNT (GROUP_NREGIONS + GROUP_NINCOMES)
+
+/*  Map charts are also precomputed valuing each country by its region or its income group. */
+#define MAP_CHART_NGROUPINGS 3
+
+/*  The most indicators, kinds of chart as above, a line chart may compare, one on each y-axis. */
+#define CHART_MAX_KINDS 2
+
+#define CHART_KIND_DATASET(kind) ((kind) < 2 ? DATASET_CO2E : DATASET_POPT)
+#define CHART_KIND_PER_CAPITA(kind) ((kind) == 1)
+
+/*  Size of the first block of a request arena, which a chart of the most countries fits in, and
+    the most arenas kept for reuse. */
+#define ARENA_BLOCK_SIZE 0x10000
+#define ARENA_NFREE_MAX 0x10
+
+/*  Number of the templates read from files, show.html and chart.js, of EMISS_NTEMPLATES. */
+#define TEMPLATE_NFILES 2
+
+/*  Layout of a binary series response, all little-endian: a header of SERIES_BINARY_HEADER_SIZE
+    bytes, with the magic, version, dataset, per capita flag, first and last year and the counts of
+    countries and years, the ISO-3166-1 Alpha-3 codes of the countries, NUL padded to 4 bytes and
+    to a multiple of 8 in total, and a matrix of doubles by country and year, NaN where missing. */
+#define SERIES_BINARY_MAGIC "EMSS"
+#define SERIES_BINARY_VERSION 1
+#define SERIES_BINARY_HEADER_SIZE 16
+#define SERIES_BINARY_CODES_SIZE(ncountries) (((ncountries) * 4 + 7) / 8 * 8)
+
+/*  The most slots a template may have. */
+#define TEMPLATE_MAX_SLOTS 0x10
+
+#define SQL_SELECT_MAP_CHART_VALUES\
+    "SELECT yeardata_year, country_code, emission_kt, "\
+    "round(((emission_kt/NULLIF(population_total, 0)) * 1000000)::numeric, 3), population_total "\
+    "FROM Datapoint WHERE yeardata_year>=%u AND yeardata_year<=%u;"
+
+/*  Size of the canonical query string of a chart request: the parameters other than the
+    countries take less than 0x80 bytes. */
+#define CHART_REQUEST_CANONICAL_SIZE\
+    (0x80 + EMISS_CHART_MAX_COUNTRIES * STRLLEN("&ccode=XXX"))
+
 /*  Required size for a buffer holding comma separated years in string format. */
 #define EMISS_SIZEOF_FORMATTED_YEARDATA\
     (1 + EMISS_YEAR_LAST - EMISS_YEAR_ZERO) * STRLLEN(",\"4242\"")
@@ -53,10 +114,9 @@
 
 /*  Ugly but useful conditional operator expressions. */
 #define CHOOSE_COL_LINE_CHART(dataset, per_capita)\
-    (dataset == DATASET_CO2E && per_capita ? "Yeardata.year, "\
+    (dataset == DATASET_CO2E && per_capita ?\
         "round(((Datapoint.emission_kt/Datapoint.population_total) * 1000000)::numeric, 3)"\
-    : dataset == DATASET_CO2E ? "Yeardata.year, Datapoint.emission_kt"\
-    : "Yeardata.year, Datapoint.population_total")
+    : dataset == DATASET_CO2E ? "Datapoint.emission_kt" : "Datapoint.population_total")
 
 #define CHOOSE_COL_MAP_CHART(dataset, per_capita)\
     (dataset == DATASET_CO2E && per_capita ?\
@@ -67,14 +127,21 @@
     (dataset == DATASET_CO2E && per_capita ? "emission_kg_per_capita"\
     : dataset == DATASET_CO2E ? "emission_kt" : "population_total")
 
+#define CHOOSE_MAP_CHART_KIND(dataset, per_capita)\
+    (dataset == DATASET_CO2E ? (per_capita ? 1 : 0) : 2)
+
 #define CHOOSE_MAP_CHART_TITLE_FRMT(dataset, per_capita)\
     ((dataset == DATASET_CO2E && per_capita) ?\
-        "Carbon dioxide emissions, year %u, per capita (kg/person) by country."\
-    : dataset == DATASET_CO2E ? "Carbon dioxide emissions, year %u, total (kt) by country."\
-    : "Population, year %u, total by country.")
+        "Carbon dioxide emissions, year %u, per capita (kg/person) by %s."\
+    : dataset == DATASET_CO2E ? "Carbon dioxide emissions, year %u, total (kt) by %s."\
+    : "Population, year %u, total by %s.")
+
+#define CHOOSE_MAP_CHART_GROUPING(grouping)\
+    (grouping == GROUPING_REGION ? "region" : grouping == GROUPING_INCOME ? "income group"\
+    : "country")
 
-#define CHOOSE_WHERE_CLAUSE(from, to)\
-    (from < to ? "Yeardata.year>=%u AND Yeardata.year<=%u ORDER BY Yeardata.year"\
+#define CHOOSE_WHERE_CLAUSE(map_chart)\
+    (!map_chart ? "Yeardata.year>=%u AND Yeardata.year<=%u ORDER BY Yeardata.year"\
     : "yeardata_year=%u ORDER BY country_code")
 
 #define CHOOSE_ALIAS_LINE_CHART(dataset, per_capita)\
@@ -94,18 +161,21 @@
     : dataset == DATASET_CO2E ? "CO2 emissions in kilotonnes (kt)"\
     : "Population count, total")
 
-#define LINE_CHART_PARAMS(dataset, per_capita)\
-    CHOOSE_LINE_CHART_TITLE(dataset, per_capita),\
-    CHOOSE_SUFFIX(dataset, per_capita),\
-    CHOOSE_Y_AXIS_TITLE(dataset, per_capita)
+/*  Names of the indicators of a chart comparing several, for its title and series. */
+#define CHOOSE_INDICATOR_NAME(dataset, per_capita)\
+    (dataset == DATASET_CO2E && per_capita ? "CO2 emissions per capita (kg/person)"\
+    : dataset == DATASET_CO2E ? "CO2 emissions (kt)" : "Population")
 
-#define LINE_CHART_PARAMS_LEN(dataset, per_capita)\
-    strlen(CHOOSE_LINE_CHART_TITLE(dataset, per_capita))\
-    + strlen(CHOOSE_SUFFIX(dataset, per_capita))\
-    + strlen(CHOOSE_Y_AXIS_TITLE(dataset, per_capita))
+#define CHOOSE_DATA_TYPE(dataset, per_capita)\
+    (dataset == DATASET_CO2E && per_capita ? "co2e_percapita"\
+    : dataset == DATASET_CO2E ? "co2e" : "population")
 
 #define STRLLEN(str_lit) (sizeof(str_lit) - 1U)
 
+/*  Whether a key of len bytes of a query string is the one named. */
+#define QUERY_KEY_IS(key, len, name)\
+    ((len) == STRLLEN(name) && !strncmp(key, name, len))
+
 #define TIMESPEC_INIT_S_MS(s_val, ms_val)\
     (struct timespec) {.tv_sec = s_val, .tv_nsec = ms_val * 1000000L}
 
@@ -113,13 +183,41 @@
 **   STRUCTURES & TYPES
 */
 
+/*  A block of memory of an arena, used up to 'used' bytes. */
+struct arena_block {
+    struct arena_block     *next;
+    size_t                  size;
+    size_t                  used;
+    max_align_t             data[];
+};
+
+/*  A bump allocator owning the transient memory of a request, all of which is released at once
+    by arena_release() after the response is sent. The first block, last in the chain, is kept
+    with the arena on a free list of the resource context for the next request; blocks added for
+    a request outgrowing it are freed. */
+struct arena {
+    struct arena           *next_free;
+    struct arena_block     *block;
+};
+
 /*  Definition & declaration of a key-value type structure for asynchronous operation
     by callbacks on database result sets. The atomic 'in_progress' flag is set to false
-    to establish between threads that the result set has been processed. */
+    to establish between threads that the result set has been processed. The data is held
+    as doubles, NaN for a missing value, to be formatted as the response is built:
+    'nvalues' is their count and 'count' that of the values found. The data, and for a map chart
+    the names, are allocated from the arena of the request for up to 'capacity' rows before the
+    query is sent, so that the callbacks allocate nothing. A map chart result has 'cdata' set to
+    decode the country codes by. A query for several indicators fills a result for each, of the
+    kind of chart 'kind', chained by 'next' in the order of the columns. */
 struct result_storage_s {
     void                   *name;
-    void                   *data;
+    double                 *data;
+    const struct country_data *cdata;
+    struct result_storage_s *next;
+    unsigned                capacity;
     unsigned                count;
+    unsigned                nvalues;
+    uint8_t                 kind;
     volatile atomic_flag    in_progress;
 };
 
@@ -142,33 +240,196 @@ struct result_storage_s {
         02 = independent and not in tui.chart,
         04 = aggregate,
         08 = not independent and not an aggregate and in tui.chart,
-        16 = not independent and not an aggregate and not in tui.chart
+        16 = not independent and not an aggregate and not in tui.chart,
+        32 = aggregate of a region or income group computed of the countries in it
+    - group_first: id of the first of the GROUP_COUNT region and income group aggregates, which
+      follow the countries, regions first, in the order of their ids.
+    - index: the index into the arrays above by Alpha-3 and Alpha-2 code.
+    - failed: set by callback_countrydata_res_handler() on an error, for the caller to reject the
+      data.
 */
 struct country_data {
     char                       *name[NCOUNTRY_DATA_SLOTS];
     char                        iso3[NCOUNTRY_DATA_SLOTS][4];
     char                        iso2[NCOUNTRY_DATA_SLOTS][3];
     size_t                      ccount;
+    size_t                      group_first;
     size_t                      total_byte_length_of_names;
     uint8_t                     region_and_income[NCOUNTRY_DATA_SLOTS];
     uint8_t                     country_type[NCOUNTRY_DATA_SLOTS];
+    util_ccode_index_st         index;
+    uint8_t                     failed;
 };
 
-/*  Definition of an application resource structure declared and typedef'd in header, housing
-    a db connection context pointer, a country data structure pointer of the type specified above,
-     a string with the data range in years formatted
-    for convenience and two bstring arrays of in-memory html and js source.
+/*  Names of the slots of the templates, written as {{name}} in the template files. */
+enum template_slot {
+    SLOT_QUERY,
+    SLOT_CHART_TYPE,
+    SLOT_CATEGORIES,
+    SLOT_SERIES,
+    SLOT_TITLE,
+    SLOT_SUFFIX,
+    SLOT_Y_AXIS_TITLE,
+    SLOT_NOT_FOUND_MSG,
+    SLOT_SERIES_SECONDARY,
+    SLOT_Y_AXIS_TITLE_SECONDARY,
+    TEMPLATE_NSLOT_NAMES
+};
+
+/*  A template compiled at load: the literal segments of its source, each but the last followed
+    by a slot. It is rendered by listing the segments and slot values in an iovec, with no format
+    string to parse, and the size of a response is the sum of their lengths. */
+struct template {
+    bstring                     source;
+    size_t                      nslots;
+    struct iovec                segment[TEMPLATE_MAX_SLOTS + 1];
+    enum template_slot          slot[TEMPLATE_MAX_SLOTS];
+    size_t                      literal_size;
+};
+
+enum chart_type {
+    CHART_NONE,
+    CHART_LINE,
+    CHART_MAP
+};
+
+/*  Map charts by country, or valuing each country by the aggregate of its region or income
+    group. */
+enum grouping {
+    GROUPING_NONE,
+    GROUPING_REGION,
+    GROUPING_INCOME
+};
+
+/*  Formats of a series response. */
+enum series_format {
+    SERIES_NONE,
+    SERIES_CSV,
+    SERIES_BINARY
+};
+
+/*  A chart request, parsed and validated from its query string by chart_request_parse(). The
+    years are clamped to the range of the data, the countries are ids into the country data,
+    without duplicates and in the order of their codes, and canonical is the query string they
+    make up, with the parameters in a fixed order, for use as a cache key. The indicators are
+    kinds of chart in their order, the first also as dataset and per_capita. */
+struct chart_request {
+    enum chart_type             chart_type;
+    enum grouping               grouping;
+    enum series_format          format;
+    uint8_t                     dataset;
+    uint8_t                     per_capita;
+    size_t                      nkinds;
+    uint8_t                     kind[CHART_MAX_KINDS];
+    unsigned                    from_year;
+    unsigned                    to_year;
+    size_t                      ncountries;
+    uint16_t                    country[EMISS_CHART_MAX_COUNTRIES];
+    char                        canonical[CHART_REQUEST_CANONICAL_SIZE];
+};
+
+/*  A ready-to-send map chart response, as is and gzip'd. */
+struct map_payload {
+    bstring                     body;
+    unsigned char              *gzip;
+    size_t                      gzip_size;
+};
+
+/*  Values of the map charts by kind, country and year, NaN where there is none. Every country but
+    the aggregates published by Worldbank has its values, those not drawn on a map included, for
+    the aggregates of the regions and income groups. */
+struct map_chart_values {
+    struct country_data        *cdata;
+    double                    (*value)[NCOUNTRY_DATA_SLOTS][MAP_CHART_NYEARS];
+};
+
+/*  Definition of a resource snapshot structure declared and typedef'd in header, housing a
+    country data structure pointer of the type specified above, a string with the data range in
+    years formatted for convenience, two bstring arrays of in-memory html and js source, the
+    values of the region and income group aggregates by kind of chart, group and year, and the
+    responses to every map chart request.
+    A snapshot is never modified once published: a data update builds a new one to replace it.
 */
-struct emiss_resource_ctx {
-    struct wlpq_conn_ctx       *conn_ctx;
+struct emiss_resource_snapshot {
     struct country_data        *cdata;
     char                        yeardata_formatted[EMISS_SIZEOF_FORMATTED_YEARDATA];
     size_t                      yeardata_size;
     bstring                     static_resource[EMISS_NSTATICS];
     char                        static_resource_name[EMISS_NSTATICS][0x20];
     uintmax_t                   static_resource_size[EMISS_NSTATICS];
-    bstring                     template[EMISS_NTEMPLATES];
-    uintmax_t                   template_frmtless_size[EMISS_NTEMPLATES];
+    struct template             template[TEMPLATE_NFILES];
+    double                      group_value[MAP_CHART_NKINDS][GROUP_COUNT][MAP_CHART_NYEARS];
+    struct map_payload          map_payload[MAP_CHART_NGROUPINGS][MAP_CHART_NKINDS]
+                                           [MAP_CHART_NYEARS];
+};
+
+/*  The function answering a chart request from the database, retrieve_matching_data() or
+    retrieve_series(). */
+typedef int (retrieve_ft)(emiss_template_st *template_data,
+    struct emiss_resource_snapshot *snapshot, struct arena *arena,
+    const struct chart_request *req, void *cbdata);
+
+/*  A request being answered, by the first of the identical ones that arrived while it was, for
+    all of them: requests are identical by their snapshot, the function answering them, that is
+    their endpoint, and canonical query string. Once the response is ready, the flight is taken
+    off the list of the resource context; if any request joined it, the response is copied to
+    body for them, and the last to replay it frees the flight. The mime type and encoding are
+    string literals. */
+struct flight {
+    struct flight              *next;
+    const struct emiss_resource_snapshot *snapshot;
+    retrieve_ft                *retrieve;
+    char                        canonical[CHART_REQUEST_CANONICAL_SIZE];
+    unsigned                    njoined;
+    uint8_t                     done;
+    unsigned                    status;
+    unsigned                    retry_after;
+    const char                 *mime_type;
+    const char                 *content_encoding;
+    char                       *body;
+    size_t                      body_size;
+    pthread_cond_t              cond;
+};
+
+/*  The first request of a flight, answering through the output functions of a copy of the
+    template data, which finish the flight before answering the request itself. */
+struct flight_leader {
+    emiss_template_st          *template_data;
+    void                       *cbdata;
+    struct flight              *flight;
+};
+
+/*  Definition of an application resource structure declared and typedef'd in header, housing
+    a db connection context pointer and the current resource snapshot, with the state of its
+    readers and of the background refresh thread.
+    - epoch, readers: requests count themselves in readers[epoch & 1] for as long as they use
+      the snapshot; a replaced snapshot is freed once the epoch has been flipped twice, each time
+      waiting for the readers of the previous one to leave.
+    - refresh_lock, refresh_cond: guard refresh_continue and wake the refresh thread to stop.
+    - arena_free, arena_nfree: request arenas kept for reuse, guarded by arena_lock.
+    - admission_running, admission_waiting: requests querying the database and those waiting for
+      their turn to, guarded by admission_lock, on admission_cond.
+    - flight: the requests querying the database being answered, each for itself and the
+      identical requests arriving meanwhile, guarded by flight_lock.
+*/
+struct emiss_resource_ctx {
+    struct wlpq_conn_ctx                       *conn_ctx;
+    struct arena                               *arena_free;
+    size_t                                      arena_nfree;
+    pthread_mutex_t                             arena_lock;
+    unsigned                                    admission_running;
+    unsigned                                    admission_waiting;
+    pthread_mutex_t                             admission_lock;
+    pthread_cond_t                              admission_cond;
+    struct flight                              *flight;
+    pthread_mutex_t                             flight_lock;
+    _Atomic(struct emiss_resource_snapshot *)   snapshot;
+    atomic_uint                                 epoch;
+    atomic_uint                                 readers[2];
+    pthread_t                                   refresh_thread;
+    pthread_mutex_t                             refresh_lock;
+    pthread_cond_t                              refresh_cond;
+    uint8_t                                     refresh_continue;
 };
 
 /*
@@ -177,16 +438,108 @@ struct emiss_resource_ctx {
 
 /*  STATIC  */
 
+static const char *template_slot_names[TEMPLATE_NSLOT_NAMES] = {
+    "query", "chart_type", "categories", "series", "title", "suffix", "y_axis_title",
+    "not_found_msg", "series_secondary", "y_axis_title_secondary"
+};
+
+/*  Names of the region and income group aggregates, by the ids of db/emiss-pg-inserts.sql. */
+static const char *group_names[GROUP_COUNT] = {
+    "Region: East Asia & Pacific",
+    "Region: Europe & Central Asia",
+    "Region: Latin America & Caribbean",
+    "Region: Middle East & North Africa",
+    "Region: North America",
+    "Region: South Asia",
+    "Region: Sub-Saharan Africa",
+    "Income group: Low income",
+    "Income group: Lower middle income",
+    "Income group: Higher middle income",
+    "Income group: High income"
+};
+
+/*  Names of the remote sources, in the order of the validators of emiss_retrieve_data(). */
+static const char *source_names[EMISS_NINDICATORS] = {
+    DATASET_0_NAME, DATASET_1_NAME, DATASET_2_NAME
+};
+
+static void
+callback_validators_res_handler(PGresult *res, void *arg)
+{
+    emiss_source_validator_st *validators = (emiss_source_validator_st *)arg;
+    for (int row = 0; row < PQntuples(res); ++row)
+        for (size_t i = 0; i < EMISS_NINDICATORS; ++i)
+            if (!strcmp(PQgetvalue(res, row, 0), source_names[i])) {
+                snprintf(validators[i].etag, sizeof(validators[i].etag),
+                    "%s", PQgetvalue(res, row, 1));
+                snprintf(validators[i].last_modified, sizeof(validators[i].last_modified),
+                    "%s", PQgetvalue(res, row, 2));
+                snprintf(validators[i].sha256, sizeof(validators[i].sha256),
+                    "%s", PQgetvalue(res, row, 3));
+            }
+}
+
+/*  Store the validators of the last fetch, for the next one to be conditional on. */
+static int
+save_source_validators(emiss_resource_ctx_st *rsrc_ctx, emiss_source_validator_st *validators)
+{
+    for (size_t i = 0; i < EMISS_NINDICATORS; ++i) {
+        char *params[4] = {
+            (char *) source_names[i], validators[i].etag,
+            validators[i].last_modified, validators[i].sha256
+        };
+        check(wlpq_query_run_blocking(rsrc_ctx->conn_ctx,
+                "INSERT INTO SourceValidator (source, etag, last_modified, sha256) "
+                "VALUES ($1, NULLIF($2, ''), NULLIF($3, ''), NULLIF($4, '')) "
+                "ON CONFLICT (source) DO UPDATE SET etag = EXCLUDED.etag, "
+                "last_modified = EXCLUDED.last_modified, sha256 = EXCLUDED.sha256, "
+                "checked = CURRENT_TIMESTAMP;",
+                params, 0, 4, 0, 0) != -1,
+            ERR_FAIL_A, EMISS_ERR, "storing validators of source", source_names[i]);
+    }
+    return 1;
+error:
+    return 0;
+}
+
+/*  Fetch the data from remote sources, parsing it as it arrives. Sources are fetched conditionally
+    on the validators stored at the last update. If the sources cannot be reached, the datasets of
+    the local cache are parsed instead. */
 static inline int
-run_data_update(emiss_resource_ctx_st *rsrc_ctx, emiss_file_data_st *retrieved_data,
-    const char *tui_chart_data, time_t last_update)
+run_data_update(emiss_resource_ctx_st *rsrc_ctx, time_t last_update)
 {
+    char tui_chart_data[0x400], cache_root[0x400];
+    check(emiss_resource_path(tui_chart_data, sizeof(tui_chart_data), TUI_CHART_DATA_PATH)
+        && emiss_resource_path(cache_root, sizeof(cache_root), EMISS_CACHE_ROOT),
+        ERR_FAIL, EMISS_ERR, "resolving resource paths");
+    emiss_source_validator_st validators[EMISS_NINDICATORS];
+    memset(validators, 0, sizeof(validators));
+    if (wlpq_query_run_blocking(rsrc_ctx->conn_ctx,
+            "SELECT source, etag, last_modified, sha256 FROM SourceValidator;", 0, 0, 0,
+            (wlpq_res_handler_ft *) callback_validators_res_handler, validators) == -1)
+        log_warn(ERR_FAIL_A, EMISS_ERR, "loading source validators,", "fetching in full");
+
     emiss_update_ctx_st *upd_ctx = emiss_update_ctx_init(rsrc_ctx->conn_ctx, tui_chart_data);
     check(upd_ctx, ERR_FAIL, EMISS_ERR, "initializing update context structure");
-    int ret = emiss_update_parse_send(upd_ctx, retrieved_data->paths,
-                    retrieved_data->file_sizes, 4, retrieved_data->dataset_ids,
-                    last_update);
-    check(ret != -1, ERR_FAIL, EMISS_ERR, "processing data");
+    int ok = emiss_update_begin(upd_ctx, last_update)
+          && emiss_retrieve_data(upd_ctx, validators);
+    long long ret = emiss_update_end(upd_ctx);
+    emiss_update_ctx_free(upd_ctx);
+    if (ok) {
+        if (!save_source_validators(rsrc_ctx, validators))
+            log_warn(ERR_FAIL, EMISS_ERR, "storing source validators");
+    } else {
+        log_warn(ERR_FAIL_A, EMISS_ERR, "retrieving data from a remote source,",
+            "parsing the local cache");
+        check(*cache_root, ERR_FAIL, EMISS_ERR, "retrieving data from a remote source");
+        upd_ctx = emiss_update_ctx_init(rsrc_ctx->conn_ctx, tui_chart_data);
+        check(upd_ctx, ERR_FAIL, EMISS_ERR, "initializing update context structure");
+        ok  = emiss_update_begin(upd_ctx, last_update)
+           && emiss_retrieve_from_cache(upd_ctx, cache_root);
+        ret = emiss_update_end(upd_ctx);
+        emiss_update_ctx_free(upd_ctx);
+        check(ok, ERR_FAIL, EMISS_ERR, "parsing the local cache");
+    }
     /*  Log update status to console, update "Updated" time in db and return. */
     struct tm update_time_utc;
     char time_str_buf[0x100];
@@ -201,7 +554,8 @@ run_data_update(emiss_resource_ctx_st *rsrc_ctx, emiss_file_data_st *retrieved_d
     }
     check(wlpq_query_run_blocking(rsrc_ctx->conn_ctx, cmd, 0, 0, 0, 0, 0) != -1,
             ERR_FAIL, EMISS_ERR, "inserting update time to database");
-    return ret;
+    emiss_metrics_gauge_set(EMISS_GAUGE_INGEST_LAST_SUCCESS, (int64_t) time(0));
+    return ret > 0;
 error:
     return -1;
 }
@@ -209,81 +563,305 @@ error:
 static inline int
 fill_yeardata_buffer(char *buf, size_t len)
 {
-    unsigned  i = EMISS_YEAR_ZERO,
-              j = 0;
-    int ret = snprintf(buf, len - 1, "\"%u\"", i);
-    check(ret != -1, ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
-    j += ret;
-    for (i = EMISS_YEAR_ZERO + 1; i <= EMISS_YEAR_LAST; ++i) {
-        ret = snprintf(&buf[j], len - 1, ",\"%u\"", i);
-        j += ret;
+    util_json_buf_st json;
+    util_json_init(&json, buf, len, UTIL_JSON_ESC_JSON);
+    for (unsigned i = EMISS_YEAR_ZERO; i <= EMISS_YEAR_LAST; ++i) {
+        if (i != EMISS_YEAR_ZERO)
+            util_json_char(&json, ',');
+        util_json_char(&json, '"');
+        util_json_uint(&json, i);
+        util_json_char(&json, '"');
     }
-    return j;
+    check(!json.failed, ERR_FAIL, EMISS_ERR, "formatting year data");
+    return (int) json.len;
 error:
-    return -1;
+    return 0;
+}
+
+static struct arena *
+arena_new(void)
+{
+    struct arena *arena = malloc(sizeof(struct arena));
+    check(arena, ERR_MEM, EMISS_ERR);
+    arena->next_free = 0;
+    arena->block     = malloc(sizeof(struct arena_block) + ARENA_BLOCK_SIZE);
+    check(arena->block, ERR_MEM, EMISS_ERR);
+    arena->block->next = 0;
+    arena->block->size = ARENA_BLOCK_SIZE;
+    arena->block->used = 0;
+    return arena;
+error:
+    free(arena);
+    return 0;
+}
+
+static void
+arena_free(struct arena *arena)
+{
+    if (arena) {
+        while (arena->block) {
+            struct arena_block *next = arena->block->next;
+            free(arena->block);
+            arena->block = next;
+        }
+        free(arena);
+    }
+}
+
+/*  Allocate size bytes, aligned for any type, from an arena. */
+static void *
+arena_alloc(struct arena *arena, size_t size)
+{
+    size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+    struct arena_block *block = arena->block;
+    if (block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct arena_block) + block_size);
+        check(block, ERR_MEM, EMISS_ERR);
+        block->next  = arena->block;
+        block->size  = block_size;
+        block->used  = 0;
+        arena->block = block;
+    }
+    void *ptr = (char *) block->data + block->used;
+    block->used += size;
+    return ptr;
+error:
+    return 0;
+}
+
+/*  Take an arena for a request from the free list, or a new one if it is empty. */
+static struct arena *
+arena_acquire(emiss_resource_ctx_st *rsrc_ctx)
+{
+    pthread_mutex_lock(&rsrc_ctx->arena_lock);
+    struct arena *arena = rsrc_ctx->arena_free;
+    if (arena) {
+        rsrc_ctx->arena_free = arena->next_free;
+        rsrc_ctx->arena_nfree--;
+    }
+    pthread_mutex_unlock(&rsrc_ctx->arena_lock);
+    emiss_metrics_add(arena ? EMISS_METRIC_ARENA_REUSES : EMISS_METRIC_ARENA_ALLOCS, 1);
+    return arena ? arena : arena_new();
+}
+
+/*  Release everything allocated from an arena and return it to the free list. */
+static void
+arena_release(emiss_resource_ctx_st *rsrc_ctx, struct arena *arena)
+{
+    if (!arena)
+        return;
+    while (arena->block->next) {
+        struct arena_block *next = arena->block->next;
+        free(arena->block);
+        arena->block = next;
+    }
+    arena->block->used = 0;
+    pthread_mutex_lock(&rsrc_ctx->arena_lock);
+    if (rsrc_ctx->arena_nfree < ARENA_NFREE_MAX) {
+        arena->next_free     = rsrc_ctx->arena_free;
+        rsrc_ctx->arena_free = arena;
+        rsrc_ctx->arena_nfree++;
+        arena = 0;
+    }
+    pthread_mutex_unlock(&rsrc_ctx->arena_lock);
+    arena_free(arena);
 }
 
-static inline char *
-escape_single_quotes(char *buf, char *src)
+/*  The time EMISS_ADMISSION_WAIT_MS from now, when a request waiting to query the database, or
+    for an identical one to, gives up. */
+static void
+admission_deadline(struct timespec *deadline)
 {
-    char *single_quote = strchr(src, '\'');
-    if (single_quote) {
-        char *ptr = buf;
-        while (single_quote) {
-            single_quote[0] = '\0';
-            memcpy(ptr, src, strlen(src));
-            strcat(ptr, "\\'");
-            ptr += strlen(ptr);
-            src = single_quote + 1;
-            single_quote = strchr(src, '\'');
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec  += EMISS_ADMISSION_WAIT_MS / 1000;
+    deadline->tv_nsec += EMISS_ADMISSION_WAIT_MS % 1000 * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/*  Admit a request to query the database, if fewer than EMISS_ADMISSION_MAX_RUNNING are, or else
+    once one of those finishes if fewer than EMISS_ADMISSION_MAX_WAITING are waiting already and
+    within EMISS_ADMISSION_WAIT_MS. Returns 1 if admitted, to be followed by admission_release(),
+    0 if refused: the load is shed fast, instead of piling up workers waiting on results. */
+static int
+admission_acquire(emiss_resource_ctx_st *rsrc_ctx)
+{
+    emiss_metric_et result = EMISS_METRIC_ADMISSION_IMMEDIATE;
+    pthread_mutex_lock(&rsrc_ctx->admission_lock);
+    if (rsrc_ctx->admission_running >= EMISS_ADMISSION_MAX_RUNNING) {
+        result = EMISS_METRIC_ADMISSION_REJECTED;
+        if (rsrc_ctx->admission_waiting < EMISS_ADMISSION_MAX_WAITING) {
+            struct timespec deadline;
+            admission_deadline(&deadline);
+            rsrc_ctx->admission_waiting++;
+            emiss_metrics_gauge_set(EMISS_GAUGE_ADMISSION_WAITING, rsrc_ctx->admission_waiting);
+            int ret = 0;
+            while (rsrc_ctx->admission_running >= EMISS_ADMISSION_MAX_RUNNING && ret != ETIMEDOUT)
+                ret = pthread_cond_timedwait(&rsrc_ctx->admission_cond,
+                        &rsrc_ctx->admission_lock, &deadline);
+            rsrc_ctx->admission_waiting--;
+            emiss_metrics_gauge_set(EMISS_GAUGE_ADMISSION_WAITING, rsrc_ctx->admission_waiting);
+            /*  A turn that came with the timeout is taken, lest its wakeup be lost. */
+            result = rsrc_ctx->admission_running < EMISS_ADMISSION_MAX_RUNNING
+                   ? EMISS_METRIC_ADMISSION_WAITED : EMISS_METRIC_ADMISSION_TIMED_OUT;
         }
-        strcat(buf, src);
-        return buf;
     }
-    return src;
+    int admitted = result == EMISS_METRIC_ADMISSION_IMMEDIATE
+                || result == EMISS_METRIC_ADMISSION_WAITED;
+    if (admitted) {
+        rsrc_ctx->admission_running++;
+        emiss_metrics_gauge_set(EMISS_GAUGE_ADMISSION_RUNNING, rsrc_ctx->admission_running);
+    }
+    pthread_mutex_unlock(&rsrc_ctx->admission_lock);
+    emiss_metrics_add(result, 1);
+    return admitted;
 }
 
+/*  Finish a request admitted by admission_acquire(), giving its turn to one waiting. */
+static void
+admission_release(emiss_resource_ctx_st *rsrc_ctx)
+{
+    pthread_mutex_lock(&rsrc_ctx->admission_lock);
+    rsrc_ctx->admission_running--;
+    emiss_metrics_gauge_set(EMISS_GAUGE_ADMISSION_RUNNING, rsrc_ctx->admission_running);
+    pthread_cond_signal(&rsrc_ctx->admission_cond);
+    pthread_mutex_unlock(&rsrc_ctx->admission_lock);
+}
+
+/*  A result destination with room for capacity rows, allocated from the arena of a request. */
 static inline struct result_storage_s *
-init_result_storage_s()
+init_result_storage_s(struct arena *arena, unsigned capacity)
 {
-    struct result_storage_s *dest_buf = malloc(sizeof(struct result_storage_s));
+    struct result_storage_s *dest_buf = arena_alloc(arena, sizeof(struct result_storage_s));
     check(dest_buf, ERR_MEM, EMISS_ERR);
     atomic_flag_clear(&dest_buf->in_progress);
     atomic_flag_test_and_set(&dest_buf->in_progress);
-    dest_buf->data = 0;
+    dest_buf->data = arena_alloc(arena, capacity * sizeof(double) + 1);
+    check(dest_buf->data, ERR_MEM, EMISS_ERR);
+    dest_buf->cdata = 0;
+    dest_buf->next = 0;
+    dest_buf->kind = 0;
+    dest_buf->capacity = capacity;
     dest_buf->count = 0;
+    dest_buf->nvalues = 0;
     dest_buf->name = 0;
     return dest_buf;
 error:
     return 0;
 }
 
+/*  Wait for the callback of a result destination to have run. */
+static inline void
+wait_result_storage_s(struct result_storage_s *dest)
+{
+    struct timespec timer = TIMESPEC_INIT_S_MS(0, 5);
+    do
+        nanosleep(&timer, 0);
+    while (atomic_flag_test_and_set(&dest->in_progress));
+}
 
+/*  A copy of a file embedded at build time, to be formatted or compiled. */
 static inline bstring
-read_to_bstring(char *path, void *placeholder_count_dest)
-{
-    FILE *fp = 0;
-	fp = fopen(path, "r");
-    check(fp, ERR_FAIL_A, EMISS_ERR, "opening file", path);
-    bstring read_here = bread((bNread) fread, fp);
-    check(read_here, ERR_FAIL_A, EMISS_ERR, "reading file", path);
-    if (placeholder_count_dest) {
-        size_t nplaceholders = 0;
-        char *ptr = bdata(read_here);
-        ptr = strstr(ptr, "%s");
-        while (ptr) {
-            ++nplaceholders;
-            ptr += 2;
-            ptr = ptr ? strstr(ptr, "%s") : 0;
-        }
-        if (nplaceholders)
-            memcpy(placeholder_count_dest, &nplaceholders, sizeof(size_t));
-    } fclose(fp);
-	return read_here;
+asset_to_bstring(const char *path)
+{
+    const emiss_asset_st *asset = emiss_resource_asset_get(path);
+    check(asset, ERR_FAIL_A, EMISS_ERR, "finding embedded file", path);
+    bstring copy = blk2bstr(asset->data, (int) asset->size);
+    check(copy, ERR_MEM, EMISS_ERR);
+    return copy;
+error:
+    return 0;
+}
+
+static int
+asset_compare(const void *path, const void *asset)
+{
+    return strcmp((const char *)path, ((const emiss_asset_st *)asset)->path);
+}
+
+/*  Compile a template from its source, which it takes ownership of, splitting it at each slot. */
+static int
+template_compile(struct template *template, bstring source)
+{
+    memset(template, 0, sizeof(struct template));
+    template->source = source;
+    check(source, ERR_FAIL, EMISS_ERR, "compiling template: no source");
+    char *ptr = bdata(source),
+         *end = ptr + blength(source),
+         *open;
+    while ((open = strstr(ptr, "{{"))) {
+        char *close = strstr(open + 2, "}}");
+        check(close, ERR_FAIL_A, EMISS_ERR, "compiling template:", "unterminated slot");
+        check(template->nslots < TEMPLATE_MAX_SLOTS, ERR_FAIL_A, EMISS_ERR,
+            "compiling template:", "too many slots");
+        size_t len = close - open - 2, k = 0;
+        while (k < TEMPLATE_NSLOT_NAMES && (strlen(template_slot_names[k]) != len
+                || strncmp(template_slot_names[k], open + 2, len)))
+            ++k;
+        check(k < TEMPLATE_NSLOT_NAMES, ERR_FAIL_A, EMISS_ERR,
+            "compiling template: unknown slot at", open);
+        template->segment[template->nslots] = (struct iovec) {ptr, open - ptr};
+        template->slot[template->nslots++]  = (enum template_slot) k;
+        template->literal_size += open - ptr;
+        ptr = close + 2;
+    }
+    template->segment[template->nslots] = (struct iovec) {ptr, end - ptr};
+    template->literal_size += end - ptr;
+    return 1;
+error:
+    return 0;
+}
+
+/*  Render a template with the values of its slots, indexed by name, to iov, which must have room
+    for 2 * TEMPLATE_MAX_SLOTS + 1 entries. A NULL value renders empty. Returns the count of iov
+    entries and sets size to the total length. */
+static int
+template_render(const struct template *template, const char *values[TEMPLATE_NSLOT_NAMES],
+    struct iovec *iov, uintmax_t *size)
+{
+    size_t n = 0;
+    *size = template->literal_size;
+    for (size_t i = 0; i < template->nslots; ++i) {
+        const char *value = values[template->slot[i]] ? values[template->slot[i]] : "";
+        iov[n++] = template->segment[i];
+        iov[n++] = (struct iovec) {(void *) value, strlen(value)};
+        *size += iov[n - 1].iov_len;
+    }
+    iov[n++] = template->segment[template->nslots];
+    return (int) n;
+}
+
+/*  Render a template to a single string, for a response to be kept. */
+static bstring
+template_render_bstring(const struct template *template, const char *values[TEMPLATE_NSLOT_NAMES])
+{
+    struct iovec iov[2 * TEMPLATE_MAX_SLOTS + 1];
+    uintmax_t size;
+    int n = template_render(template, values, iov, &size);
+    bstring rendered = bfromcstralloc((int) size + 1, "");
+    check(rendered, ERR_MEM, EMISS_ERR);
+    for (int i = 0; i < n; ++i)
+        check(bcatblk(rendered, iov[i].iov_base, (int) iov[i].iov_len) == BSTR_OK,
+            ERR_MEM, EMISS_ERR);
+    return rendered;
 error:
-	if (fp)
-		fclose(fp);
-	return 0;
+    if (rendered)
+        bdestroy(rendered);
+    return 0;
+}
+
+/*  Send a rendered template as the response. */
+static int
+template_send(emiss_template_st *template_data, const struct template *template,
+    const char *values[TEMPLATE_NSLOT_NAMES], const char *mime_type, void *cbdata)
+{
+    struct iovec iov[2 * TEMPLATE_MAX_SLOTS + 1];
+    uintmax_t size;
+    int n = template_render(template, values, iov, &size);
+    return template_data->send_function(cbdata, 200, mime_type, 0, iov, n);
 }
 
 static inline bstring
@@ -295,7 +873,7 @@ frmt_new_chart_html(struct country_data *cdata, char *html)
     check(buf, ERR_MEM, EMISS_ERR);
     size_t i, j = 0;
     for (i = 0; i < ncountries; ++i) {
-        const char *type = cdata->country_type[i] == 4 ? "a"
+        const char *type = cdata->country_type[i] == 4 || cdata->country_type[i] == 32 ? "a"
                          : cdata->country_type[i] >= 8 ? "n"
                          : "i";
         FRMT_HTML_OPTION_ID_VALUE(&buf[j], type, cdata->iso3[i], cdata->name[i], 1);
@@ -317,38 +895,20 @@ frmt_chart_params_js(char *js)
             EMISS_YEAR_LAST);
 }
 
-static inline int
-binary_search_str_arr(int count, size_t el_size, char (*data)[el_size], char *key)
-{
-    int l = 0,
-        r = count - 1;
-    size_t len = el_size - 1;
-    while (l <= r) {
-        int m = (int) floor((l + r) / 2);
-        int diff = strncmp(data[m], key, len);
-        if (diff < 0)
-            l = m + 1;
-        else if (diff > 0)
-            r = m - 1;
-        else
-            return m;
-    }
-    return -1;
-}
-
 static void
 callback_countrydata_res_handler(PGresult *res, void *arg)
 {
-    emiss_resource_ctx_st *rsrc_ctx = (emiss_resource_ctx_st *)arg;
-    struct country_data *cdata = rsrc_ctx->cdata;
+    struct country_data *cdata = (struct country_data *)arg;
     size_t rows = PQntuples(res), total_byte_length_of_names = 0;
     char *field;
+    check(rows <= NCOUNTRY_DATA_SLOTS, ERR_FAIL, EMISS_ERR, "storing country data: too many rows");
+    util_ccode_index_init(&cdata->index);
     for (size_t i = 0; i < rows; ++i) {
         field = PQgetvalue(res, i, 0);
-        if (strlen(field) == 3)
+        if (strlen(field) == 3 && util_ccode_index_set(&cdata->index, field, 3, (uint16_t) i))
             memcpy(&cdata->iso3[i], field, 3);
         field = PQgetvalue(res, i, 1);
-        if (strlen(field) == 2)
+        if (strlen(field) == 2 && util_ccode_index_set(&cdata->index, field, 2, (uint16_t) i))
             memcpy(&cdata->iso2[i], field, 2);
         field = PQgetvalue(res, i, 2);
         size_t len = strlen(field);
@@ -377,7 +937,9 @@ callback_countrydata_res_handler(PGresult *res, void *arg)
     cdata->total_byte_length_of_names = total_byte_length_of_names;
     return;
 error:
-    exit(0);
+    /*  The names stored so far are freed with the rest of the snapshot. */
+    cdata->ccount = rows <= NCOUNTRY_DATA_SLOTS ? rows : 0;
+    cdata->failed = 1;
 }
 
 static void
@@ -385,139 +947,330 @@ callback_datapoint_res_handler(PGresult *res, void *arg)
 {
     struct result_storage_s *dest = (struct result_storage_s *)arg;
     size_t rows = (size_t) PQntuples(res);
-    if (dest->data) {
-        struct country_data *cdata = (struct country_data *)dest->data;
-        size_t ccount = cdata->ccount;
-        char (*iso2codes)[3] = cdata->iso2;
-        char (*iso3codes)[4] = cdata->iso3;
-        uint8_t *country_type = cdata->country_type;
-        char (*dest_data)[0xF] = calloc(rows, sizeof(*dest_data));
-        check(dest_data, ERR_MEM, EMISS_ERR);
-        memset(dest_data, 0, sizeof(*dest_data));
-        dest->data = dest_data;
-        char **dest_name = malloc(rows * sizeof(char *));
-        check(dest_name, ERR_MEM, EMISS_ERR);
-        dest->name = dest_name;
-        size_t j = 0, k = 0, len = 0;
+    if (rows > dest->capacity)
+        rows = dest->capacity;
+    double *dest_data = dest->data;
+    if (dest->cdata) {
+        const struct country_data *cdata = dest->cdata;
+        const char **dest_name = (const char **)dest->name;
+        size_t k = 0;
         for (size_t i = 0; i < rows; ++i) {
-            len = PQgetlength(res, i, 0);
-            if (len) {
-                char *country_code = PQgetvalue(res, i, 1);
-                while (strncmp(country_code, iso3codes[j], 3))
-                    if (++j == ccount) {
-                        /*  shouldn't happen */
-                        dest->count = k;
-                        atomic_flag_clear(&dest->in_progress);
-                        return;
-                    }
-
-                uint8_t in_tui_chart = country_type[j] == 1 || country_type[j] == 8 ? 1 : 0;
-                if (in_tui_chart && iso2codes[j] && iso2codes[j][0]) {
-                    memcpy(dest_data[k], PQgetvalue(res, i, 0), len);
-                    dest_name[k] = iso2codes[j];
+            if (PQgetlength(res, i, 0)) {
+                int j = util_ccode_index_get(&cdata->index, PQgetvalue(res, i, 1),
+                            (size_t) PQgetlength(res, i, 1));
+                if (j < 0)
+                    continue;
+                uint8_t in_tui_chart = cdata->country_type[j] == 1
+                                    || cdata->country_type[j] == 8 ? 1 : 0;
+                if (in_tui_chart && cdata->iso2[j][0]) {
+                    dest_data[k] = strtod(PQgetvalue(res, i, 0), 0);
+                    dest_name[k] = cdata->iso2[j];
                     ++k;
                 }
             }
         }
-        dest->count = k;
+        dest->count = dest->nvalues = k;
     } else {
-        char buffer[0x2000] = {0};
-        size_t j = 0, k = 0, count = 0;
-        const char *frmt = "%s,";
-        for (size_t i = 0; i < rows; ++i) {
-            size_t len = PQgetlength(res, i, 1);
-            if (len) {
-                snprintf(&buffer[j], 0xFFF, frmt, PQgetvalue(res, i, 1));
-                ++count;
-            } else
-                if (rows - i == 1) {
-                    /*  Handle some border cases lest tui.chart crash. */
-                    len = 12;
-                    snprintf(&buffer[j], 0xFFF, frmt, "Number(null)");
-                } else {
-                    len = 4;
-                    snprintf(&buffer[j], 0xFFF, frmt, "null");
-                }
-
-            j += len + 1;
-            ++k;
-        }
-        if (count > 1) {
-            dest->count = count;
-            buffer[j - 1] = '\0';
-            dest->data = malloc(++j * sizeof(char));
-            check(dest->data, ERR_MEM, EMISS_ERR);
-            memcpy(dest->data, buffer, j);
+        /*  The values of each indicator follow the year, a column each. */
+        size_t ncolumns = (size_t) PQnfields(res);
+        for (size_t c = 1; dest; ++c) {
+            struct result_storage_s *next = dest->next;
+            size_t count = 0;
+            dest_data = dest->data;
+            for (size_t i = 0; i < rows; ++i) {
+                if (c < ncolumns && PQgetlength(res, i, c)) {
+                    dest_data[i] = strtod(PQgetvalue(res, i, c), 0);
+                    ++count;
+                } else
+                    dest_data[i] = NAN;
+            }
+            dest->count   = count;
+            dest->nvalues = rows;
+            atomic_flag_clear(&dest->in_progress);
+            dest = next;
         }
+        return;
     }
     atomic_flag_clear(&dest->in_progress);
-    return;
+}
+
+/*  List the region and income group aggregates after the countries, coded and named by id. */
+static int
+country_data_add_groups(struct country_data *cdata)
+{
+    check(cdata->ccount + GROUP_COUNT <= NCOUNTRY_DATA_SLOTS, ERR_FAIL, EMISS_ERR,
+        "storing country data: too many rows");
+    cdata->group_first = cdata->ccount;
+    for (size_t g = 0; g < GROUP_COUNT; ++g) {
+        size_t i = cdata->ccount + g,
+               n = g < GROUP_NREGIONS ? g : g - GROUP_NREGIONS;
+        char code[4] = {'Q', g < GROUP_NREGIONS ? 'R' : 'N', (char) ('A' + n), '\0'};
+        check(util_ccode_index_get(&cdata->index, code, 3) < 0, ERR_FAIL_A, EMISS_ERR,
+            "adding aggregate: code in use", code);
+        util_ccode_index_set(&cdata->index, code, 3, (uint16_t) i);
+        memcpy(&cdata->iso3[i], code, 4);
+        size_t len = strlen(group_names[g]);
+        cdata->name[i] = calloc(len + 1, sizeof(char));
+        check(cdata->name[i], ERR_MEM, EMISS_ERR);
+        memcpy(cdata->name[i], group_names[g], len);
+        cdata->total_byte_length_of_names += len;
+        cdata->region_and_income[i] = g < GROUP_NREGIONS ? (uint8_t) (n + 1)
+                                    : (uint8_t) ((n + 1) << 4);
+        cdata->country_type[i]      = 32;
+    }
+    cdata->ccount += GROUP_COUNT;
+    return 1;
 error:
-    exit(0);
+    return 0;
 }
 
 static int
-retrieve_country_data(emiss_resource_ctx_st *rsrc_ctx)
+retrieve_country_data(wlpq_conn_ctx_st *conn_ctx, struct country_data *cdata)
 {
     char *cmd = SQL_SELECT_COUNTRY_ORDER_BY("Country.code_iso_a3");
-    int ret   = wlpq_query_run_blocking(rsrc_ctx->conn_ctx,
+    int ret   = wlpq_query_run_blocking(conn_ctx,
                         cmd, 0, 0, 0, (wlpq_res_handler_ft *)
                         callback_countrydata_res_handler,
-                        rsrc_ctx);
+                        cdata);
     check(ret, ERR_FAIL_N, EMISS_ERR, "running a blocking db query: returned", ret);
-    check(rsrc_ctx->cdata->name[rsrc_ctx->cdata->ccount - 1], ERR_FAIL, EMISS_ERR,
+    check(!cdata->failed && cdata->ccount && cdata->name[cdata->ccount - 1], ERR_FAIL, EMISS_ERR,
         "saving data to cdata array");
-    return 1;
+    return country_data_add_groups(cdata);
 error:
     return 0;
 }
 
+static void
+callback_map_chart_res_handler(PGresult *res, void *arg)
+{
+    struct map_chart_values *dest = (struct map_chart_values *)arg;
+    struct country_data *cdata = dest->cdata;
+    size_t rows = (size_t) PQntuples(res);
+    for (size_t i = 0; i < rows; ++i) {
+        unsigned long year = strtoul(PQgetvalue(res, i, 0), 0, 10);
+        int j = util_ccode_index_get(&cdata->index, PQgetvalue(res, i, 1),
+                    (size_t) PQgetlength(res, i, 1));
+        if (year < EMISS_YEAR_ZERO || year > EMISS_YEAR_LAST || j < 0
+            || cdata->country_type[j] == 4 || cdata->country_type[j] == 32)
+            continue;
+        for (size_t k = 0; k < MAP_CHART_NKINDS; ++k)
+            if (!PQgetisnull(res, i, 2 + k))
+                dest->value[k][j][year - EMISS_YEAR_ZERO] = strtod(PQgetvalue(res, i, 2 + k), 0);
+    }
+}
+
+/*  Compress to a gzip member (RFC 1952), for clients accepting that content coding. */
+static unsigned char *
+gzip_compress(const char *src, size_t len, size_t *gzip_size)
+{
+    static const unsigned char header[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 2, 3};
+    size_t deflated_size;
+    unsigned char *gzip = 0;
+    void *deflated = tdefl_compress_mem_to_heap(src, len, &deflated_size, TDEFL_MAX_PROBES_MASK);
+    check(deflated, ERR_EXTERN, "miniz", "compressing payload");
+    gzip = malloc(sizeof(header) + deflated_size + 8);
+    check(gzip, ERR_MEM, EMISS_ERR);
+    memcpy(gzip, header, sizeof(header));
+    memcpy(&gzip[sizeof(header)], deflated, deflated_size);
+    unsigned char *trailer = &gzip[sizeof(header) + deflated_size];
+    mz_ulong crc = mz_crc32(MZ_CRC32_INIT, (const unsigned char *)src, len);
+    for (size_t i = 0; i < 4; ++i) {
+        trailer[i]     = (unsigned char) (crc >> 8 * i);
+        trailer[4 + i] = (unsigned char) ((uint32_t) len >> 8 * i);
+    }
+    *gzip_size = sizeof(header) + deflated_size + 8;
+error:
+    mz_free(deflated);
+    return gzip;
+}
+
+/*  Compute the aggregates of the regions and income groups for each year: the sums of emissions
+    and of population of the countries having a value, and per capita, weighting each country by
+    its population, the sum of emissions over that of population of those having both, rounded
+    as queried for. A group with no value for a year gets NaN. Each country adds its row of years
+    to those of its groups, a reduction over the matrix the compiler vectorizes by year, without
+    reordering any sum. */
+static void
+group_values_init(struct emiss_resource_snapshot *snapshot, const struct map_chart_values *values)
+{
+    const struct country_data *cdata = snapshot->cdata;
+    double sum[MAP_CHART_NKINDS][GROUP_COUNT][MAP_CHART_NYEARS]     = {{{0}}},
+           count[MAP_CHART_NKINDS][GROUP_COUNT][MAP_CHART_NYEARS]   = {{{0}}},
+           population_with_emissions[GROUP_COUNT][MAP_CHART_NYEARS] = {{0}};
+    for (size_t j = 0; j < cdata->group_first; ++j) {
+        unsigned region = cdata->region_and_income[j] & 0xF,
+                 income = cdata->region_and_income[j] >> 4;
+        size_t group[2] = {
+            region && region <= GROUP_NREGIONS ? region - 1 : GROUP_COUNT,
+            income && income <= GROUP_NINCOMES ? GROUP_NREGIONS + income - 1 : GROUP_COUNT
+        };
+        const double *emission   = values->value[0][j],
+                     *population = values->value[2][j];
+        for (size_t m = 0; m < 2; ++m) {
+            size_t g = group[m];
+            if (g == GROUP_COUNT || cdata->country_type[j] == 4)
+                continue;
+            for (size_t y = 0; y < MAP_CHART_NYEARS; ++y) {
+                int has_emission   = !isnan(emission[y]),
+                    has_population = !isnan(population[y]),
+                    has_both       = has_emission && has_population;
+                sum[0][g][y]   += has_emission ? emission[y] : 0;
+                count[0][g][y] += has_emission;
+                sum[1][g][y]   += has_both ? emission[y] : 0;
+                count[1][g][y] += has_both;
+                population_with_emissions[g][y] += has_both ? population[y] : 0;
+                sum[2][g][y]   += has_population ? population[y] : 0;
+                count[2][g][y] += has_population;
+            }
+        }
+    }
+    for (size_t g = 0; g < GROUP_COUNT; ++g)
+        for (size_t y = 0; y < MAP_CHART_NYEARS; ++y) {
+            double per_capita = population_with_emissions[g][y] > 0
+                              ? sum[1][g][y] / population_with_emissions[g][y] * 1000000 : NAN;
+            snapshot->group_value[0][g][y] = count[0][g][y] ? sum[0][g][y] : NAN;
+            snapshot->group_value[1][g][y] = count[1][g][y] ? round(per_capita * 1000) / 1000 : NAN;
+            snapshot->group_value[2][g][y] = count[2][g][y] ? sum[2][g][y] : NAN;
+        }
+}
+
+/*  The value of country j on a map chart of a kind and year, its own or that of its group. */
+static inline double
+map_chart_value(const struct emiss_resource_snapshot *snapshot,
+    const struct map_chart_values *values, size_t grouping, size_t k, size_t y, size_t j)
+{
+    unsigned region = snapshot->cdata->region_and_income[j] & 0xF,
+             income = snapshot->cdata->region_and_income[j] >> 4;
+    return grouping == GROUPING_NONE ? values->value[k][j][y]
+         : grouping == GROUPING_REGION ? (region && region <= GROUP_NREGIONS
+            ? snapshot->group_value[k][region - 1][y] : NAN)
+         : income && income <= GROUP_NINCOMES
+            ? snapshot->group_value[k][GROUP_NREGIONS + income - 1][y] : NAN;
+}
+
+/*  Build the response to every map chart request, chart.js formatted with the values of each
+    grouping, kind of chart and year, from a single query, computing the region and income group
+    aggregates on the way. A year without data gets an empty chart, as it would when queried for. */
+static int
+map_payloads_init(wlpq_conn_ctx_st *conn_ctx, struct emiss_resource_snapshot *snapshot)
+{
+    struct country_data *cdata = snapshot->cdata;
+    struct map_chart_values values = {
+        .cdata = cdata,
+        .value = malloc(MAP_CHART_NKINDS * sizeof(*values.value))
+    };
+    util_json_buf_st countrydata = {0};
+    int ret = 0;
+    check(values.value, ERR_MEM, EMISS_ERR);
+    for (size_t k = 0; k < MAP_CHART_NKINDS; ++k)
+        for (size_t j = 0; j < NCOUNTRY_DATA_SLOTS; ++j)
+            for (size_t y = 0; y < MAP_CHART_NYEARS; ++y)
+                values.value[k][j][y] = NAN;
+    char cmd[0x200];
+    check(snprintf(cmd, sizeof(cmd), SQL_SELECT_MAP_CHART_VALUES,
+            EMISS_YEAR_ZERO, EMISS_YEAR_LAST) > 0, ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+    check(wlpq_query_run_blocking(conn_ctx, cmd, 0, 0, 0,
+            (wlpq_res_handler_ft *) callback_map_chart_res_handler, &values) == 1,
+        ERR_FAIL, EMISS_ERR, "querying map chart values");
+    group_values_init(snapshot, &values);
+
+    check(util_json_init(&countrydata, 0, cdata->ccount * 0x20, UTIL_JSON_ESC_JS_QUOTED),
+        ERR_MEM, EMISS_ERR);
+    for (size_t g = 0; g < MAP_CHART_NGROUPINGS; ++g) {
+        for (size_t k = 0; k < MAP_CHART_NKINDS; ++k) {
+            uint8_t dataset    = k < 2 ? DATASET_CO2E : DATASET_POPT,
+                    per_capita = k == 1;
+            for (size_t y = 0; y < MAP_CHART_NYEARS; ++y) {
+                countrydata.len = 0;
+                countrydata.data[0] = '\0';
+                size_t count = 0;
+                for (size_t j = 0; j < cdata->group_first; ++j) {
+                    double value = map_chart_value(snapshot, &values, g, k, y, j);
+                    if (isnan(value) || !cdata->iso2[j][0]
+                        || (cdata->country_type[j] != 1 && cdata->country_type[j] != 8))
+                        continue;
+                    if (count++)
+                        util_json_char(&countrydata, ',');
+                    UTIL_JSON_LITERAL(&countrydata, "{\"code\":");
+                    util_json_str(&countrydata, cdata->iso2[j]);
+                    UTIL_JSON_LITERAL(&countrydata, ",\"data\":");
+                    util_json_double(&countrydata, value);
+                    util_json_char(&countrydata, '}');
+                }
+                check(!countrydata.failed, ERR_FAIL, EMISS_ERR, "formatting chart data");
+                char title[0x80];
+                check(snprintf(title, sizeof(title),
+                        CHOOSE_MAP_CHART_TITLE_FRMT(dataset, per_capita),
+                        (unsigned) (EMISS_YEAR_ZERO + y), CHOOSE_MAP_CHART_GROUPING(g)) > 0,
+                    ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+                struct map_payload *payload = &snapshot->map_payload[g][k][y];
+                const char *slots[TEMPLATE_NSLOT_NAMES] = {
+                    [SLOT_CHART_TYPE] = "map", [SLOT_SERIES] = countrydata.data,
+                    [SLOT_TITLE] = title
+                };
+                payload->body = template_render_bstring(&snapshot->template[1], slots);
+                check(payload->body, ERR_FAIL, EMISS_ERR, "formatting map chart payload");
+                payload->gzip = gzip_compress(bdata(payload->body), blength(payload->body),
+                                    &payload->gzip_size);
+            }
+        }
+    }
+    ret = 1;
+error:
+    free(countrydata.data);
+    free(values.value);
+    return ret;
+}
+
+/*  Answer a map chart request with its precomputed payload, gzip'd if the client accepts it. */
+static int
+send_map_payload(emiss_template_st *template_data, struct map_payload *payload, void *cbdata)
+{
+    if (payload->gzip && template_data->accepts_function(cbdata, "gzip"))
+        return template_data->send_function(cbdata, 200, "application/javascript", "gzip",
+                    &(struct iovec) {payload->gzip, payload->gzip_size}, 1);
+    return template_data->send_function(cbdata, 200, "application/javascript", 0,
+                &(struct iovec) {bdata(payload->body), blength(payload->body)}, 1);
+}
+
 static int
-frmt_map_chart_data(emiss_template_st *template_data,
-    struct result_storage_s *query_res, size_t ncountries,
+frmt_map_chart_data(emiss_template_st *template_data, struct emiss_resource_snapshot *snapshot,
+    struct arena *arena, struct result_storage_s *query_res,
     uint8_t dataset_id, uint8_t per_capita, unsigned year,
     void *cbdata)
 {
     /*  Wait for data retrieval to complete. */
-    volatile atomic_flag *not_ready = &query_res->in_progress;
-    struct timespec timer = TIMESPEC_INIT_S_MS(0, 5);
-    do
-        nanosleep(&timer, 0);
-    while (atomic_flag_test_and_set(not_ready));
-    /*  Allocate space for result string and grab pointers. */
-    size_t count      = query_res->count,
-    countrydata_len   = count * STRLLEN(",{\"code\":\"XX\",\"data\":}") + count * 0xF;
-    char *countrydata = calloc(countrydata_len, sizeof(char));
-    check(countrydata, ERR_MEM, EMISS_ERR);
-    char **iso2 = (char **)query_res->name;
-    char (*data)[0xF] = (char (*)[0xF]) query_res->data;
-
-    /*  Format data from iso2 and data to a single JSON array string. */
-    size_t j = 0;
+    wait_result_storage_s(query_res);
+    /*  Grab pointers and format data from iso2 and data to a single JSON array string. */
+    size_t count = query_res->count;
+    char **iso2  = (char **)query_res->name;
+    double *data = query_res->data;
+    size_t size  = count * (STRLLEN(",{\"code\":\"XX\",\"data\":}") + 0x20) + 1;
+    util_json_buf_st countrydata;
+    char *buf = arena_alloc(arena, size);
+    check(buf, ERR_MEM, EMISS_ERR);
+    util_json_init(&countrydata, buf, size, UTIL_JSON_ESC_JS_QUOTED);
     for (size_t i = 0; i < count; ++i) {
-        int ret = JSON_FRMT_KEY_VALUE_PAIR(&countrydata[j],
-                        countrydata_len - j, "code", "data",
-                        i, iso2[i], data[i]);
-        check(ret >= 0, ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
-        j += ret;
+        if (i)
+            util_json_char(&countrydata, ',');
+        UTIL_JSON_LITERAL(&countrydata, "{\"code\":");
+        util_json_str(&countrydata, iso2[i]);
+        UTIL_JSON_LITERAL(&countrydata, ",\"data\":");
+        util_json_double(&countrydata, data[i]);
+        util_json_char(&countrydata, '}');
     }
-    free(iso2);
-    free(data);
-    free(query_res);
+    check(!countrydata.failed, ERR_FAIL, EMISS_ERR, "formatting chart data");
 
     /*  Call provided output function. */
-    const char *js = bdata(template_data->rsrc_ctx->template[1]);
     char title[0x80];
-    int ret = snprintf(title, 0x7F, CHOOSE_MAP_CHART_TITLE_FRMT(dataset_id, per_capita), year);
+    int ret = snprintf(title, 0x7F, CHOOSE_MAP_CHART_TITLE_FRMT(dataset_id, per_capita), year,
+                CHOOSE_MAP_CHART_GROUPING(GROUPING_NONE));
     check(ret >= 0, ERR_FAIL, EMISS_ERR, "printf'ing to buffer\n");
-    uintmax_t byte_size = template_data->rsrc_ctx->template_frmtless_size[1]
-                                + STRLLEN("map") + j + ret;
-    ret = template_data->output_function(cbdata, 200,
-                                byte_size, "application/javascript",
-                                "close", js, "map", "", countrydata,
-                                title, "", "", "");
-    free(countrydata);
-    return ret;
+    const char *slots[TEMPLATE_NSLOT_NAMES] = {
+        [SLOT_CHART_TYPE] = "map", [SLOT_SERIES] = countrydata.data, [SLOT_TITLE] = title
+    };
+    return template_send(template_data, &snapshot->template[1], slots,
+                "application/javascript", cbdata);
 error:
     return template_data->output_function(cbdata, 500,
                                 STRLLEN(INTERNAL_ERROR_MSG),
@@ -525,75 +1278,126 @@ error:
                                 "%s", INTERNAL_ERROR_MSG);
 }
 
+/*  Format a line chart of the results of a request, a series for each country and indicator,
+    from query_res in that order. A chart comparing indicators is a combo chart, the first on the
+    primary y-axis and the second, as an area, on the secondary. */
 static int
-frmt_line_chart_data(emiss_template_st *template_data, unsigned year_start,
-    unsigned year_end, struct result_storage_s **query_res, size_t nitems,
-    size_t names_bytelen, uint8_t dataset_id, uint8_t per_capita, void *cbdata)
+frmt_line_chart_data(emiss_template_st *template_data,
+    struct emiss_resource_snapshot *snapshot, struct arena *arena,
+    const struct chart_request *req, struct result_storage_s **query_res,
+    size_t names_bytelen, void *cbdata)
 {
+    size_t nkinds = req->nkinds,
+           nitems = req->ncountries * nkinds;
+    /*  Wait for data retrieval to complete: the results live until the arena is released. */
+    for (size_t i = 0; i < nitems; ++i)
+        wait_result_storage_s(query_res[i]);
+
+    unsigned year_start = req->from_year,
+             year_end   = req->to_year;
     if (year_start < EMISS_YEAR_ZERO)
         year_start = EMISS_YEAR_ZERO;
     if (year_end > EMISS_YEAR_LAST)
         year_end = EMISS_YEAR_LAST;
-    if (year_end < year_start + 1)
-        year_end = year_start + 1;
-    emiss_resource_ctx_st *rsrc_ctx = template_data->rsrc_ctx;
 
-    char *yeardata = calloc((1 + year_end - year_start) * STRLLEN(",\"4242\""), sizeof(char));
-    check(yeardata, ERR_MEM, EMISS_ERR);
-    char *years_formatted = rsrc_ctx->yeardata_formatted;
     size_t yeardata_len = (1 + year_end - year_start) * STRLLEN(",\"4242\"") - 1;
-    memcpy(yeardata, &years_formatted[(year_start - EMISS_YEAR_ZERO) * 7], yeardata_len);
-    unsigned ndatapoints = (1 + year_end - year_start) * nitems;
-    size_t countrydata_len = nitems * (STRLLEN("{\"name\":\"\",\"data\":[]},") - 1
-                             + ndatapoints * 0x10) + names_bytelen;
-    char *countrydata = calloc(countrydata_len, sizeof(char));
-    check(countrydata, ERR_MEM, EMISS_ERR);
-    size_t j = 0, k = 0;
-    char not_found_msg[0x1000] = {0};
-    strncpy(not_found_msg, DATA_NOT_FOUND_MSG, 0xFFF);
-    struct timespec timer = TIMESPEC_INIT_S_MS(0, 5);
+    char *yeardata = arena_alloc(arena, yeardata_len + 1);
+    check(yeardata, ERR_MEM, EMISS_ERR);
+    memcpy(yeardata, &snapshot->yeardata_formatted[(year_start - EMISS_YEAR_ZERO) * 7],
+        yeardata_len);
+    yeardata[yeardata_len] = '\0';
+    /*  At most 24 bytes and a comma for a value, and 7 bytes for a byte of a name escaped, with
+        the name of the indicator when comparing several. */
+    size_t ndatapoints = 0;
+    for (size_t i = 0; i < nitems; ++i)
+        ndatapoints += query_res[i]->nvalues;
+    size_t size = nitems * (STRLLEN(",{\"name\":\": \",\"data\":[]}")
+                + (nkinds > 1 ? STRLLEN("CO2 emissions per capita (kg/person)") : 0))
+                + ndatapoints * 25 + names_bytelen * 7 + 1;
+    util_json_buf_st countrydata[CHART_MAX_KINDS], not_found;
+    char not_found_msg[0x1000];
+    for (size_t m = 0; m < nkinds; ++m) {
+        char *buf = arena_alloc(arena, size);
+        check(buf, ERR_MEM, EMISS_ERR);
+        util_json_init(&countrydata[m], buf, size, UTIL_JSON_ESC_JS_QUOTED);
+    }
+    util_json_init(&not_found, not_found_msg, sizeof(not_found_msg), UTIL_JSON_ESC_JS);
+    UTIL_JSON_LITERAL(&not_found, DATA_NOT_FOUND_MSG);
+    size_t found[CHART_MAX_KINDS] = {0}, k = 0;
     for (size_t i = 0; i < nitems; ++i) {
-        volatile atomic_flag *not_ready = &query_res[i]->in_progress;
-        do
-            nanosleep(&timer, 0);
-        while (atomic_flag_test_and_set(not_ready));
-        char *name = (char *)query_res[i]->name;
-        char *data = (char *)query_res[i]->data;
-        if (name && data) {
-            char buf[64] = {0};
-            name = escape_single_quotes(buf, name);
-            if (!query_res[i]->count) {
-                size_t len = strlen(name);
-                memcpy(&not_found_msg[k], name, len);
-                k += len;
-                memcpy(&not_found_msg[k], ", ", 2);
-                k += 2;
-            } else {
-                int ret = JSON_FRMT_KEY_ARRAY_VALUE_PAIR(&countrydata[j], countrydata_len - j,
-                        "name", "data", i, name, data);
-                check(ret >= 0, ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
-                j += ret;
-                free(data);
+        char *name   = (char *)query_res[i]->name;
+        double *data = query_res[i]->data;
+        /*  A single value makes no line: the country is listed as having no data instead. */
+        size_t nvalues = query_res[i]->count > 1 ? query_res[i]->nvalues : 0,
+               m       = i % nkinds;
+        uint8_t kind   = req->kind[m];
+        const char *indicator = CHOOSE_INDICATOR_NAME(CHART_KIND_DATASET(kind),
+                                    CHART_KIND_PER_CAPITA(kind));
+        if (name && !nvalues) {
+            util_json_str_chars(&not_found, name, strlen(name));
+            if (nkinds > 1) {
+                UTIL_JSON_LITERAL(&not_found, ": ");
+                util_json_str_chars(&not_found, indicator, strlen(indicator));
             }
-
+            UTIL_JSON_LITERAL(&not_found, ", ");
+            k = not_found.len;
+        } else if (name) {
+            util_json_buf_st *series = &countrydata[m];
+            if (found[m]++)
+                util_json_char(series, ',');
+            UTIL_JSON_LITERAL(series, "{\"name\":");
+            if (nkinds > 1) {
+                util_json_char(series, '"');
+                util_json_str_chars(series, name, strlen(name));
+                UTIL_JSON_LITERAL(series, ": ");
+                util_json_str_chars(series, indicator, strlen(indicator));
+                util_json_char(series, '"');
+            } else
+                util_json_str(series, name);
+            UTIL_JSON_LITERAL(series, ",\"data\":[");
+            for (size_t v = 0; v < nvalues; ++v) {
+                if (v)
+                    util_json_char(series, ',');
+                /*  A trailing null crashes tui.chart: Number(null), that is 0, was sent instead. */
+                if (isnan(data[v]) && v == nvalues - 1)
+                    util_json_char(series, '0');
+                else
+                    util_json_double(series, data[v]);
+            }
+            UTIL_JSON_LITERAL(series, "]}");
         }
-        free(query_res[i]);
-    }
-    free(query_res);
-
-    const char *js = bdata(rsrc_ctx->template[1]);
-    uintmax_t byte_size = rsrc_ctx->template_frmtless_size[1]
-                            + STRLLEN("line") + j + yeardata_len + k +
-                            + LINE_CHART_PARAMS_LEN(dataset_id, per_capita);
-
-    int ret = template_data->output_function(cbdata, 200,
-                                byte_size, "application/javascript", "close",
-                                js, "line", yeardata, countrydata,
-                                LINE_CHART_PARAMS(dataset_id, per_capita),
-                                k ? not_found_msg : "");
-    free(countrydata);
-    free(yeardata);
-    return ret;
+    }
+    for (size_t m = 0; m < nkinds; ++m)
+        check(!countrydata[m].failed, ERR_FAIL, EMISS_ERR, "formatting chart data");
+    check(!not_found.failed, ERR_FAIL, EMISS_ERR, "formatting chart data");
+
+    uint8_t dataset_id = req->dataset,
+            per_capita = req->per_capita;
+    char title[0x80];
+    const char *slots[TEMPLATE_NSLOT_NAMES] = {
+        [SLOT_CHART_TYPE]    = "line",
+        [SLOT_CATEGORIES]    = yeardata,
+        [SLOT_SERIES]        = countrydata[0].data,
+        [SLOT_TITLE]         = CHOOSE_LINE_CHART_TITLE(dataset_id, per_capita),
+        [SLOT_SUFFIX]        = CHOOSE_SUFFIX(dataset_id, per_capita),
+        [SLOT_Y_AXIS_TITLE]  = CHOOSE_Y_AXIS_TITLE(dataset_id, per_capita),
+        [SLOT_NOT_FOUND_MSG] = k ? not_found_msg : ""
+    };
+    if (nkinds > 1) {
+        uint8_t kind = req->kind[1];
+        check(snprintf(title, sizeof(title), "%s and %s by country and year",
+                CHOOSE_INDICATOR_NAME(dataset_id, per_capita),
+                CHOOSE_INDICATOR_NAME(CHART_KIND_DATASET(kind), CHART_KIND_PER_CAPITA(kind))) > 0,
+            ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+        slots[SLOT_CHART_TYPE]  = "combo";
+        slots[SLOT_TITLE]       = title;
+        slots[SLOT_SUFFIX]      = "";
+        slots[SLOT_SERIES_SECONDARY]      = countrydata[1].data;
+        slots[SLOT_Y_AXIS_TITLE_SECONDARY] = CHOOSE_Y_AXIS_TITLE(CHART_KIND_DATASET(kind),
+                                                CHART_KIND_PER_CAPITA(kind));
+    }
+    return template_send(template_data, &snapshot->template[1], slots,
+                "application/javascript", cbdata);
 error:
     return template_data->output_function(cbdata, 500,
                                 STRLLEN(INTERNAL_ERROR_MSG),
@@ -601,35 +1405,326 @@ error:
                                 "%s", INTERNAL_ERROR_MSG);
 }
 
+/*  The value of a year parameter, clamped to the range of the data, or 0 if it is not a year. */
+static unsigned
+chart_request_year(const char *value, size_t len)
+{
+    unsigned year = 0;
+    if (!len || len > 4)
+        return 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (value[i] < '0' || value[i] > '9')
+            return 0;
+        year = year * 10 + (unsigned) (value[i] - '0');
+    }
+    return year < EMISS_YEAR_ZERO ? EMISS_YEAR_ZERO
+        : year > EMISS_YEAR_LAST ? EMISS_YEAR_LAST
+        : year;
+}
+
+/*  Parse the query string of a chart request in a single pass, before anything is allocated or
+    queried for, taking chart_type for one naming none. Parameters with an empty value count as
+    missing and unknown ones are ignored, as is count, the number of countries being that of the
+    distinct ccode values. Returns NULL on success, otherwise the name of the first parameter found
+    invalid or missing. */
+static const char *
+chart_request_parse(struct chart_request *req, const struct country_data *cdata, const char *qstr,
+    enum chart_type chart_type)
+{
+    bool selected[NCOUNTRY_DATA_SLOTS] = {false};
+    unsigned select_year = 0;
+    size_t nselected     = 0;
+    unsigned kinds       = 0;
+    memset(req, 0, offsetof(struct chart_request, country));
+
+    const char *ptr = qstr ? qstr : "";
+    while (*ptr) {
+        size_t len       = strcspn(ptr, "&"),
+               key_len   = strcspn(ptr, "=&");
+        const char *value = key_len < len ? ptr + key_len + 1 : ptr + len;
+        size_t value_len = (size_t) (ptr + len - value);
+        if (!value_len)
+            ;
+        else if (QUERY_KEY_IS(ptr, key_len, "data_type")) {
+            if (QUERY_KEY_IS(value, value_len, "co2e"))
+                kinds |= 1 << 0;
+            else if (QUERY_KEY_IS(value, value_len, "co2e_percapita"))
+                kinds |= 1 << 1;
+            else if (QUERY_KEY_IS(value, value_len, "population"))
+                kinds |= 1 << 2;
+            else
+                return "data_type";
+        } else if (QUERY_KEY_IS(ptr, key_len, "chart_type")) {
+            if (req->chart_type)
+                return "chart_type";
+            req->chart_type = QUERY_KEY_IS(value, value_len, "line") ? CHART_LINE
+                            : QUERY_KEY_IS(value, value_len, "map") ? CHART_MAP
+                            : CHART_NONE;
+            if (!req->chart_type)
+                return "chart_type";
+        } else if (QUERY_KEY_IS(ptr, key_len, "group")) {
+            if (req->grouping)
+                return "group";
+            req->grouping = QUERY_KEY_IS(value, value_len, "region") ? GROUPING_REGION
+                          : QUERY_KEY_IS(value, value_len, "income") ? GROUPING_INCOME
+                          : GROUPING_NONE;
+            if (!req->grouping)
+                return "group";
+        } else if (QUERY_KEY_IS(ptr, key_len, "format")) {
+            if (req->format)
+                return "format";
+            req->format = QUERY_KEY_IS(value, value_len, "csv") ? SERIES_CSV
+                        : QUERY_KEY_IS(value, value_len, "binary") ? SERIES_BINARY
+                        : SERIES_NONE;
+            if (!req->format)
+                return "format";
+        } else if (QUERY_KEY_IS(ptr, key_len, "from_year")) {
+            if (req->from_year || !(req->from_year = chart_request_year(value, value_len)))
+                return "from_year";
+        } else if (QUERY_KEY_IS(ptr, key_len, "to_year")) {
+            if (req->to_year || !(req->to_year = chart_request_year(value, value_len)))
+                return "to_year";
+        } else if (QUERY_KEY_IS(ptr, key_len, "select_year")) {
+            if (select_year || !(select_year = chart_request_year(value, value_len)))
+                return "select_year";
+        } else if (QUERY_KEY_IS(ptr, key_len, "ccode")) {
+            int id = value_len == 3 ? util_ccode_index_get(&cdata->index, value, 3) : -1;
+            if (id < 0)
+                return "ccode";
+            if (!selected[id]) {
+                selected[id] = true;
+                ++nselected;
+            }
+        }
+        ptr += len + (ptr[len] == '&');
+    }
+
+    /*  A data_type repeated names several indicators, kept in the order of their kinds. */
+    for (uint8_t kind = 0; kind < MAP_CHART_NKINDS; ++kind)
+        if (kinds & 1 << kind) {
+            if (req->nkinds == CHART_MAX_KINDS)
+                return "data_type";
+            req->kind[req->nkinds++] = kind;
+        }
+    if (!req->nkinds)
+        return "data_type";
+    req->dataset    = CHART_KIND_DATASET(req->kind[0]);
+    req->per_capita = CHART_KIND_PER_CAPITA(req->kind[0]);
+    if (!req->chart_type)
+        req->chart_type = chart_type;
+    uint8_t last = req->kind[req->nkinds - 1];
+    char data_type[0x40];
+    int ret = snprintf(data_type, sizeof(data_type), "%s%s%s",
+                CHOOSE_DATA_TYPE(req->dataset, req->per_capita),
+                req->nkinds > 1 ? "&data_type=" : "",
+                req->nkinds > 1 ? CHOOSE_DATA_TYPE(CHART_KIND_DATASET(last),
+                                    CHART_KIND_PER_CAPITA(last)) : "");
+    if (req->chart_type == CHART_MAP) {
+        if (req->nkinds > 1)
+            return "data_type";
+        if (!select_year)
+            return "select_year";
+        req->from_year = req->to_year = select_year;
+        ret = snprintf(req->canonical, sizeof(req->canonical),
+                "data_type=%s&chart_type=map&select_year=%u%s%s", data_type, select_year,
+                req->grouping ? "&group=" : "",
+                req->grouping == GROUPING_REGION ? "region"
+                : req->grouping == GROUPING_INCOME ? "income" : "");
+        return ret > 0 && (size_t) ret < sizeof(req->canonical) ? NULL : "chart_type";
+    } else if (req->chart_type != CHART_LINE)
+        return "chart_type";
+    if (req->grouping)
+        return "group";
+    if (!req->from_year)
+        return "from_year";
+    /*  A line takes two years at least: of a single year, every country would have none. */
+    if (!req->to_year || req->to_year <= req->from_year)
+        return "to_year";
+    if (!nselected || nselected > EMISS_CHART_MAX_COUNTRIES)
+        return "ccode";
+    ret = snprintf(req->canonical, sizeof(req->canonical),
+            "data_type=%s&chart_type=line&from_year=%u&to_year=%u", data_type,
+            req->from_year, req->to_year);
+    for (size_t i = 0; i < cdata->ccount && ret > 0; ++i)
+        if (selected[i]) {
+            req->country[req->ncountries++] = (uint16_t) i;
+            size_t n = strlen(req->canonical);
+            ret = snprintf(&req->canonical[n], sizeof(req->canonical) - n, "&ccode=%s",
+                    cdata->iso3[i]);
+        }
+    if (req->format && ret > 0) {
+        size_t n = strlen(req->canonical);
+        ret = snprintf(&req->canonical[n], sizeof(req->canonical) - n, "&format=%s",
+                req->format == SERIES_CSV ? "csv" : "binary");
+    }
+    return ret > 0 ? NULL : "ccode";
+}
+
+/*  Resolve the format of a series request, CSV unless given, into its canonical query string, so
+    that a request naming the default and one leaving it out are keyed alike. */
+static void
+series_request_format(struct chart_request *req)
+{
+    if (req->format)
+        return;
+    req->format = SERIES_CSV;
+    size_t n = strlen(req->canonical);
+    snprintf(&req->canonical[n], sizeof(req->canonical) - n, "&format=csv");
+}
+
+/*  Whether answering a request queries the database: a map chart not answered from its payload,
+    or a line chart of a country other than the region and income group aggregates. */
+static int
+chart_request_queries(const struct chart_request *req, const struct country_data *cdata)
+{
+    if (req->chart_type == CHART_MAP)
+        return 1;
+    for (size_t i = 0; i < req->ncountries; ++i)
+        if (cdata->country_type[req->country[i]] != 32)
+            return 1;
+    return 0;
+}
+
+static int
+send_invalid_request(emiss_template_st *template_data, const char *invalid, void *cbdata)
+{
+    return template_data->output_function(cbdata,
+                            400, STRLLEN(INVALID_PARAMETER_FRMT) - 2 + strlen(invalid),
+                            "text/plain", "close", INVALID_PARAMETER_FRMT, invalid);
+}
+
+/*  Fill result destinations with the values of a region or income group aggregate, as the
+    callback of a query for them would. */
+static void
+group_result_fill(struct result_storage_s *dest, const struct emiss_resource_snapshot *snapshot,
+    const struct chart_request *req, size_t group)
+{
+    for (; dest; dest = dest->next) {
+        const double *value = &snapshot->group_value[dest->kind][group]
+                                                    [req->from_year - EMISS_YEAR_ZERO];
+        size_t count = 0;
+        for (size_t y = 0; y < dest->capacity; ++y) {
+            dest->data[y] = value[y];
+            count += !isnan(value[y]);
+        }
+        dest->count   = count;
+        dest->nvalues = dest->capacity;
+        atomic_flag_clear(&dest->in_progress);
+    }
+}
+
+/*  Send a query for the values of each country of a line chart request, of all its indicators at
+    once, to result destinations allocated from the arena of the request into res_dest_arr, one
+    for each country and indicator in that order, adding the lengths of the names of the countries
+    to names_bytelength. Those of the region and income group aggregates are filled from the
+    snapshot instead. Returns the number of results filled or queried for, less than that of the
+    countries and indicators on error: their callbacks are to be waited for before the arena is
+    released. */
+static size_t
+line_chart_queries_send(emiss_resource_ctx_st *rsrc_ctx, struct emiss_resource_snapshot *snapshot,
+    struct arena *arena, const struct chart_request *req, struct result_storage_s **res_dest_arr,
+    size_t *names_bytelength)
+{
+    char    buf[0x600] = {0};
+    char    out[0x600] = {0};
+    char    col[0x200] = "Yeardata.year";
+    size_t  nkinds     = req->nkinds;
+    uint8_t last       = req->kind[nkinds - 1];
+    for (size_t m = 0; m < nkinds; ++m) {
+        uint8_t kind = req->kind[m];
+        size_t n = strlen(col);
+        snprintf(&col[n], sizeof(col) - n, m + 1 < nkinds ? ", %s AS %s" : ", %s",
+            CHOOSE_COL_LINE_CHART(CHART_KIND_DATASET(kind), CHART_KIND_PER_CAPITA(kind)),
+            CHOOSE_ALIAS_LINE_CHART(CHART_KIND_DATASET(kind), CHART_KIND_PER_CAPITA(kind)));
+    }
+    const char  *alias        = CHOOSE_ALIAS_LINE_CHART(CHART_KIND_DATASET(last),
+                                    CHART_KIND_PER_CAPITA(last)),
+                *from_tbl     = "Yeardata",
+                *join_tbl     = "Datapoint",
+                *join_on      = "Yeardata.year=Datapoint.yeardata_year "\
+                                "AND Datapoint.country_code='%s'",
+                *where        = CHOOSE_WHERE_CLAUSE(0);
+    char  **names             = snapshot->cdata->name;
+    size_t  nqueued           = 0;
+    for (size_t i = 0; i < req->ncountries; ++i) {
+        const char *code = snapshot->cdata->iso3[req->country[i]];
+        char *name       = names[req->country[i]];
+        if (!name)
+            log_warn(ERR_FAIL_A, EMISS_ERR, "finding country name for code", code);
+        struct result_storage_s **dest = &res_dest_arr[i * nkinds];
+        for (size_t m = 0; m < nkinds; ++m) {
+            dest[m] = init_result_storage_s(arena, 1 + req->to_year - req->from_year);
+            check(dest[m], ERR_FAIL, EMISS_ERR, "initializing result buffer");
+            dest[m]->kind = req->kind[m];
+            dest[m]->name = name;
+            *names_bytelength += name ? strlen(name) : 0;
+            if (m)
+                dest[m - 1]->next = dest[m];
+        }
+        if (snapshot->cdata->country_type[req->country[i]] == 32) {
+            group_result_fill(dest[0], snapshot, req,
+                req->country[i] - snapshot->cdata->group_first);
+            emiss_metrics_add(EMISS_METRIC_SERIES_SNAPSHOT_HITS, 1);
+            nqueued += nkinds;
+            continue;
+        }
+
+        check(SQL_SELECT_JOIN_WHERE(buf, 0x5FF, out, 0x5FF,
+                col, alias, from_tbl, "LEFT", join_tbl,
+                join_on, where, code, req->from_year, req->to_year) >= 0,
+                ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+        wlpq_query_data_st *qr_dt = wlpq_query_init(out, 0, 0, 0,
+                                        callback_datapoint_res_handler,
+                                        dest[0], 0);
+        check(qr_dt, ERR_FAIL, EMISS_ERR, "initializing query data structure");
+        check(wlpq_query_queue_enqueue(rsrc_ctx->conn_ctx, qr_dt),
+                ERR_FAIL, EMISS_ERR, "enqueuing query to db");
+        emiss_metrics_add(EMISS_METRIC_SERIES_QUERIES, 1);
+        nqueued += nkinds;
+        memset(buf, 0, sizeof(buf));
+        memset(out, 0, sizeof(out));
+    }
+error:
+    return nqueued;
+}
+
+/*  Query for the data of a chart and format it, all memory taken from the arena of the request,
+    which is not to be released before the callbacks of the queries sent have run. */
 static int
-retrieve_matching_data(emiss_template_st *template_data, unsigned from_year,
-    unsigned to_year, uint8_t dataset, uint8_t per_capita, char *country_codes,
-    size_t ncountries, void *cbdata)
+retrieve_matching_data(emiss_template_st *template_data,
+    struct emiss_resource_snapshot *snapshot, struct arena *arena,
+    const struct chart_request *req, void *cbdata)
 {
     emiss_resource_ctx_st *rsrc_ctx = template_data->rsrc_ctx;
     char    buf[0x600] = {0};
     char    out[0x600] = {0};
-    uint8_t map_chart  = from_year == to_year ? 1 : 0;
-    const char *where  = CHOOSE_WHERE_CLAUSE(from_year, to_year);
+    uint8_t map_chart  = req->chart_type == CHART_MAP,
+            dataset    = req->dataset,
+            per_capita = req->per_capita;
+    unsigned from_year = req->from_year;
+    size_t ncountries  = req->ncountries,
+           nqueued     = 0;
+    const char *where  = CHOOSE_WHERE_CLAUSE(1);
+    struct result_storage_s **res_dest_arr = 0;
 
     /*  Enqueue non-blocking queries for the data values. Results will be
         parsed by a callback to a buffer struct, the address of which is passed
         forward formatting the data. */
-    int ret;
-    char (*iso3codes)[4] = rsrc_ctx->cdata->iso3;
     if (map_chart) {
         const char  *tbl   = "Datapoint",
                     *col   = CHOOSE_COL_MAP_CHART(dataset, per_capita),
                     *alias = CHOOSE_ALIAS_MAP_CHART(dataset, per_capita);
 
-        ncountries = rsrc_ctx->cdata->ccount;
         check(SQL_SELECT_WHERE(buf, 0x5FF, out, 0x5FF, col, alias,
                 tbl, where, from_year) >= 0, ERR_FAIL, ERR_MEM,
                 "printf'ing to buffer");
 
-        struct result_storage_s *res_dest = init_result_storage_s();
+        unsigned ccount = (unsigned) snapshot->cdata->ccount;
+        struct result_storage_s *res_dest = init_result_storage_s(arena, ccount);
         check(res_dest, ERR_FAIL, EMISS_ERR, "initializing result destination buffer");
-        res_dest->data = rsrc_ctx->cdata;
+        res_dest->cdata = snapshot->cdata;
+        res_dest->name  = arena_alloc(arena, ccount * sizeof(char *) + 1);
+        check(res_dest->name, ERR_MEM, EMISS_ERR);
 
         wlpq_query_data_st *qr_dt = wlpq_query_init(out, 0, 0, 0,
                                             callback_datapoint_res_handler,
@@ -638,54 +1733,119 @@ retrieve_matching_data(emiss_template_st *template_data, unsigned from_year,
         check(wlpq_query_queue_enqueue(rsrc_ctx->conn_ctx, qr_dt),
                 ERR_FAIL, EMISS_ERR, "enqueuing query to db");
 
-        return frmt_map_chart_data(template_data, res_dest, ncountries,
+        return frmt_map_chart_data(template_data, snapshot, arena, res_dest,
                     dataset, per_capita, from_year, cbdata);
     } else {
-        const char  *col          = CHOOSE_COL_LINE_CHART(dataset, per_capita),
-                    *alias        = CHOOSE_ALIAS_LINE_CHART(dataset, per_capita),
-                    *from_tbl     = "Yeardata",
-                    *join_tbl     = "Datapoint",
-                    *join_on      = "Yeardata.year=Datapoint.yeardata_year "\
-                                    "AND Datapoint.country_code='%s'";
-
-        struct result_storage_s **res_dest_arr;
-        res_dest_arr  = malloc(sizeof(struct result_storage_s *) * ncountries);
+        res_dest_arr = arena_alloc(arena,
+                            sizeof(struct result_storage_s *) * ncountries * req->nkinds);
         check(res_dest_arr, ERR_MEM, EMISS_ERR);
+        size_t names_bytelength = 0;
+        nqueued = line_chart_queries_send(rsrc_ctx, snapshot, arena, req, res_dest_arr,
+                    &names_bytelength);
+        check(nqueued == ncountries * req->nkinds, ERR_FAIL, EMISS_ERR,
+            "querying for line chart data");
+        return frmt_line_chart_data(template_data, snapshot, arena, req, res_dest_arr,
+                    names_bytelength, cbdata);
+    }
+error:
+    /*  The results of the queries already sent are written to until their callbacks have run. */
+    for (size_t i = 0; i < nqueued; ++i)
+        wait_result_storage_s(res_dest_arr[i]);
+    return template_data->output_function(cbdata, 500,
+                            STRLLEN(INTERNAL_ERROR_MSG),
+                            "text/plain", "close",
+                            "%s", INTERNAL_ERROR_MSG);
+}
 
-        char  **names             = rsrc_ctx->cdata->name;
-        size_t  ccount            = rsrc_ctx->cdata->ccount,
-                names_bytelength  = 0;
-        char *ptr                 = strchr(country_codes, '=') + 1;
-        for (size_t i = 0; ptr && i < ncountries; ++i) {
-            char code[4] = {0};
-            memcpy(code, ptr, 3);
-            check(SQL_SELECT_JOIN_WHERE(buf, 0x5FF, out, 0x5FF,
-                    col, alias, from_tbl, "LEFT", join_tbl,
-                    join_on, where, code, from_year, to_year) >= 0,
-                    ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+/*  Append a value to a binary series response, as a little-endian double. */
+static inline void
+series_binary_double(unsigned char *dest, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    for (size_t i = 0; i < 8; ++i)
+        dest[i] = (unsigned char) (bits >> 8 * i);
+}
 
-            res_dest_arr[i] = init_result_storage_s();
-            check(res_dest_arr[i], ERR_FAIL, EMISS_ERR, "initializing result buffer");
-            wlpq_query_data_st *qr_dt = wlpq_query_init(out, 0, 0, 0,
-                                            callback_datapoint_res_handler,
-                                            res_dest_arr[i], 0);
-            check(qr_dt, ERR_FAIL, EMISS_ERR, "initializing query data structure");
-            check(wlpq_query_queue_enqueue(rsrc_ctx->conn_ctx, qr_dt),
-                    ERR_FAIL, EMISS_ERR, "enqueuing query to db");
-            ret = binary_search_str_arr(ccount, 4, iso3codes, code);
-            if (ret != -1) {
-                res_dest_arr[i]->name = names[ret];
-                names_bytelength     += strlen(names[ret]);
-            } else
-                log_warn(ERR_FAIL_A, EMISS_ERR, "finding country name for code", code);
-            memset(buf, 0, sizeof(buf));
-            memset(out, 0, sizeof(out));
-            ptr = strchr(ptr, '=') + 1;
+static inline void
+series_binary_u16(unsigned char *dest, unsigned value)
+{
+    dest[0] = (unsigned char) value;
+    dest[1] = (unsigned char) (value >> 8);
+}
+
+/*  Query for the values of a series request and send them as CSV, a row of years and one of values
+    for each country, empty where missing, or in the binary layout described above. */
+static int
+retrieve_series(emiss_template_st *template_data, struct emiss_resource_snapshot *snapshot,
+    struct arena *arena, const struct chart_request *req, void *cbdata)
+{
+    size_t ncountries = req->ncountries,
+           nyears     = 1 + req->to_year - req->from_year,
+           nqueued    = 0,
+           names_bytelength = 0;
+    struct result_storage_s **res_dest_arr = arena_alloc(arena,
+                                                sizeof(struct result_storage_s *) * ncountries);
+    check(res_dest_arr, ERR_MEM, EMISS_ERR);
+    nqueued = line_chart_queries_send(template_data->rsrc_ctx, snapshot, arena, req, res_dest_arr,
+                &names_bytelength);
+    for (size_t i = 0; i < nqueued; ++i)
+        wait_result_storage_s(res_dest_arr[i]);
+    check(nqueued == ncountries, ERR_FAIL, EMISS_ERR, "querying for series data");
+
+    struct iovec iov;
+    const char *mime_type;
+    if (req->format == SERIES_BINARY) {
+        size_t size = SERIES_BINARY_HEADER_SIZE + SERIES_BINARY_CODES_SIZE(ncountries)
+                    + ncountries * nyears * sizeof(double);
+        unsigned char *body = arena_alloc(arena, size);
+        check(body, ERR_MEM, EMISS_ERR);
+        memset(body, 0, SERIES_BINARY_HEADER_SIZE + SERIES_BINARY_CODES_SIZE(ncountries));
+        memcpy(body, SERIES_BINARY_MAGIC, 4);
+        series_binary_u16(&body[4], SERIES_BINARY_VERSION);
+        body[6] = req->dataset;
+        body[7] = req->per_capita;
+        series_binary_u16(&body[8], req->from_year);
+        series_binary_u16(&body[10], req->to_year);
+        series_binary_u16(&body[12], (unsigned) ncountries);
+        series_binary_u16(&body[14], (unsigned) nyears);
+        unsigned char *ptr = &body[SERIES_BINARY_HEADER_SIZE];
+        for (size_t i = 0; i < ncountries; ++i)
+            memcpy(&ptr[i * 4], snapshot->cdata->iso3[req->country[i]], 3);
+        ptr += SERIES_BINARY_CODES_SIZE(ncountries);
+        for (size_t i = 0; i < ncountries; ++i)
+            for (size_t y = 0; y < nyears; ++y, ptr += 8)
+                series_binary_double(ptr, y < res_dest_arr[i]->nvalues
+                    ? res_dest_arr[i]->data[y] : NAN);
+        iov       = (struct iovec) {body, size};
+        mime_type = "application/octet-stream";
+    } else {
+        /*  At most 24 bytes and a comma for a value, and the code and a newline for a row. */
+        size_t size = (ncountries + 1) * (nyears * 25 + STRLLEN("code\n")) + 1;
+        util_json_buf_st csv;
+        char *buf = arena_alloc(arena, size);
+        check(buf, ERR_MEM, EMISS_ERR);
+        util_json_init(&csv, buf, size, UTIL_JSON_ESC_JSON);
+        UTIL_JSON_LITERAL(&csv, "code");
+        for (size_t y = 0; y < nyears; ++y) {
+            util_json_char(&csv, ',');
+            util_json_uint(&csv, req->from_year + y);
         }
-        return frmt_line_chart_data(template_data, from_year, to_year,
-                    res_dest_arr, ncountries, names_bytelength,
-                    dataset, per_capita, cbdata);
+        for (size_t i = 0; i < ncountries; ++i) {
+            util_json_char(&csv, '\n');
+            util_json_raw(&csv, snapshot->cdata->iso3[req->country[i]], 3);
+            for (size_t y = 0; y < nyears; ++y) {
+                util_json_char(&csv, ',');
+                if (y < res_dest_arr[i]->nvalues && !isnan(res_dest_arr[i]->data[y]))
+                    util_json_double(&csv, res_dest_arr[i]->data[y]);
+            }
+        }
+        util_json_char(&csv, '\n');
+        check(!csv.failed, ERR_FAIL, EMISS_ERR, "formatting series data");
+        iov       = (struct iovec) {csv.data, csv.len};
+        mime_type = "text/csv";
     }
+    return template_data->send_function(cbdata, 200, mime_type, 0, &iov, 1);
 error:
     return template_data->output_function(cbdata, 500,
                             STRLLEN(INTERNAL_ERROR_MSG),
@@ -693,75 +1853,295 @@ error:
                             "%s", INTERNAL_ERROR_MSG);
 }
 
+static void
+flight_free(struct flight *flight)
+{
+    pthread_cond_destroy(&flight->cond);
+    free(flight->body);
+    free(flight);
+}
+
+/*  Take the flight of a leader off the list, with its response for the requests that joined it,
+    and wake them. The flight is freed if none did, and otherwise by the last of them. */
+static void
+flight_finish(emiss_resource_ctx_st *rsrc_ctx, struct flight_leader *leader, unsigned status,
+    const char *mime_type, const char *content_encoding, const struct iovec *iov, int iovcnt,
+    unsigned retry_after)
+{
+    struct flight *flight = leader->flight;
+    if (!flight)
+        return;
+    leader->flight = 0;
+    pthread_mutex_lock(&rsrc_ctx->flight_lock);
+    struct flight **prev = &rsrc_ctx->flight;
+    while (*prev != flight)
+        prev = &(*prev)->next;
+    *prev = flight->next;
+    if (!flight->njoined) {
+        pthread_mutex_unlock(&rsrc_ctx->flight_lock);
+        flight_free(flight);
+        return;
+    }
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        size += iov[i].iov_len;
+    flight->body = malloc(size + 1);
+    if (flight->body) {
+        for (int i = 0; i < iovcnt; ++i) {
+            memcpy(&flight->body[flight->body_size], iov[i].iov_base, iov[i].iov_len);
+            flight->body_size += iov[i].iov_len;
+        }
+        flight->body[size] = '\0';
+        flight->status           = status;
+        flight->retry_after      = retry_after;
+        flight->mime_type        = mime_type;
+        flight->content_encoding = content_encoding;
+    } else {
+        log_err(ERR_MEM, EMISS_ERR);
+        flight->status = 500;
+    }
+    flight->done = 1;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&rsrc_ctx->flight_lock);
+}
+
 static int
-forward_to_format(emiss_template_st *template_data, size_t i, const char *qstr, void *cbdata)
+flight_output(void *at, const unsigned http_response_code, const uintmax_t byte_size,
+    const char *restrict mime_type, const char *restrict conn_action,
+    const char *restrict frmt, ...)
 {
-    const uint8_t dataset = strstr(qstr, "co2e") ? DATASET_CO2E : DATASET_POPT;
-    const uint8_t per_capita = dataset == DATASET_CO2E && strstr(qstr, "co2e_percapita") ? 1 : 0;
-    const char *invalid = "";
-    if (strstr(qstr, "line")) {
-        const char *from_year_str = strstr(qstr, "from_year");
-        unsigned long from_year   = from_year_str
-                                  ? strtoul(strchr(from_year_str, '=') + 1, 0, 10)
-                                  : 0;
-        if (!from_year || from_year == ULONG_MAX)
-            invalid = "from_year";
-        else {
-            const char *to_year_str = strstr(from_year_str, "to_year");
-            unsigned long to_year   = to_year_str
-                                    ? strtoul(strchr(to_year_str, '=') + 1, 0, 10)
-                                    : 0;
-            if (!to_year || to_year == ULONG_MAX)
-                invalid = "to_year";
-            else {
-                unsigned long count   = 0;
-                const char *count_str = strstr(qstr, "count");
-                if (!count_str) {
-                    char *ccode = strstr(qstr, "ccode");
-                    while (ccode) {
-                        ++count;
-                        ccode = strstr(ccode, "ccode");
-                    }
-                } else {
-                    count = strtoul(strchr(count_str, '=') + 1, 0, 10);
-                    if (!count || count == ULONG_MAX)
-                        invalid = "count";
-                    else
-                        return retrieve_matching_data(template_data,
-                                from_year, to_year, dataset,
-                                per_capita, strstr(count_str, "ccode"),
-                                count, cbdata);
-                }
-            }
+    struct flight_leader *leader = at;
+    /*  Only the short error messages are printf'd. */
+    char body[0x200];
+    va_list ap;
+    va_start(ap, frmt);
+    int len = vsnprintf(body, sizeof(body), frmt, ap);
+    va_end(ap);
+    if (len < 0)
+        body[len = 0] = '\0';
+    else if ((size_t) len >= sizeof(body))
+        len = sizeof(body) - 1;
+    flight_finish(leader->template_data->rsrc_ctx, leader, http_response_code, mime_type, 0,
+        &(struct iovec) {body, (size_t) len}, 1, 0);
+    return leader->template_data->output_function(leader->cbdata, http_response_code, byte_size,
+                mime_type, conn_action, "%s", body);
+}
+
+static int
+flight_send(void *at, const unsigned http_response_code, const char *restrict mime_type,
+    const char *restrict content_encoding, const struct iovec *iov, const int iovcnt)
+{
+    struct flight_leader *leader = at;
+    flight_finish(leader->template_data->rsrc_ctx, leader, http_response_code, mime_type,
+        content_encoding, iov, iovcnt, 0);
+    return leader->template_data->send_function(leader->cbdata, http_response_code, mime_type,
+                content_encoding, iov, iovcnt);
+}
+
+/*  The response is replayed to clients other than the one of the leader: it takes no encoding
+    that not every client accepts. */
+static int
+flight_accepts(void *at, const char *restrict content_encoding)
+{
+    (void) at, (void) content_encoding;
+    return 0;
+}
+
+static int
+flight_unavailable(void *at, const unsigned retry_after)
+{
+    struct flight_leader *leader = at;
+    flight_finish(leader->template_data->rsrc_ctx, leader, 503, 0, 0, 0, 0, retry_after);
+    return leader->template_data->unavailable_function(leader->cbdata, retry_after);
+}
+
+/*  Answer a request that joined a flight with the response of its leader. */
+static int
+flight_replay(emiss_template_st *template_data, const struct flight *flight, void *cbdata)
+{
+    if (flight->status == 503)
+        return template_data->unavailable_function(cbdata, flight->retry_after);
+    if (!flight->body)
+        return template_data->output_function(cbdata, 500, STRLLEN(INTERNAL_ERROR_MSG),
+                    "text/plain", "close", "%s", INTERNAL_ERROR_MSG);
+    if (flight->status != 200)
+        return template_data->output_function(cbdata, flight->status, flight->body_size,
+                    flight->mime_type, "close", "%s", flight->body);
+    return template_data->send_function(cbdata, 200, flight->mime_type,
+                flight->content_encoding, &(struct iovec) {flight->body, flight->body_size}, 1);
+}
+
+/*  Answer a request querying the database once for it and every identical request arriving
+    while it is, so that the queries sent under a burst are bounded by the distinct requests. The
+    first, the leader, is admitted and queries as any other; the rest wait for and replay its
+    response, taking no turn of admission, but are refused as a request waiting for one would be
+    if it takes longer than EMISS_ADMISSION_WAIT_MS. */
+static int
+retrieve_coalesced(emiss_template_st *template_data, struct emiss_resource_snapshot *snapshot,
+    struct arena *arena, const struct chart_request *req, retrieve_ft *retrieve, void *cbdata)
+{
+    emiss_resource_ctx_st *rsrc_ctx = template_data->rsrc_ctx;
+    pthread_mutex_lock(&rsrc_ctx->flight_lock);
+    struct flight *flight = rsrc_ctx->flight;
+    while (flight && (flight->snapshot != snapshot || flight->retrieve != retrieve
+            || strcmp(flight->canonical, req->canonical)))
+        flight = flight->next;
+    if (flight) {
+        struct timespec deadline;
+        admission_deadline(&deadline);
+        flight->njoined++;
+        int wait = 0;
+        while (!flight->done && wait != ETIMEDOUT)
+            wait = pthread_cond_timedwait(&flight->cond, &rsrc_ctx->flight_lock, &deadline);
+        /*  A request leaving a flight unfinished leaves it to its leader to free. */
+        if (!flight->done) {
+            flight->njoined--;
+            pthread_mutex_unlock(&rsrc_ctx->flight_lock);
+            emiss_metrics_add(EMISS_METRIC_ADMISSION_TIMED_OUT, 1);
+            return template_data->unavailable_function(cbdata, EMISS_ADMISSION_RETRY_AFTER);
         }
-    } else if (strstr(qstr, "map")) {
-        const char *sel_year_str = strstr(qstr, "select_year");
-        unsigned long sel_year   = sel_year_str
-                                 ? strtoul(strchr(sel_year_str, '=') + 1, 0, 10)
-                                 : 0;
-        if (!sel_year || sel_year == ULONG_MAX)
-            invalid = "select_year";
-        else
-            return retrieve_matching_data(template_data,
-                sel_year, sel_year, dataset,
-                per_capita, NULL, 0, cbdata);
+        pthread_mutex_unlock(&rsrc_ctx->flight_lock);
+        emiss_metrics_add(EMISS_METRIC_FLIGHT_JOINS, 1);
+        int ret = flight_replay(template_data, flight, cbdata);
+        pthread_mutex_lock(&rsrc_ctx->flight_lock);
+        int last = !--flight->njoined;
+        pthread_mutex_unlock(&rsrc_ctx->flight_lock);
+        if (last)
+            flight_free(flight);
+        return ret;
+    }
+    /*  Without a flight to lead, the request is answered for itself alone. */
+    flight = calloc(1, sizeof(struct flight));
+    if (flight) {
+        flight->snapshot = snapshot;
+        flight->retrieve = retrieve;
+        memcpy(flight->canonical, req->canonical, sizeof(flight->canonical));
+        flight->cond = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+        flight->next = rsrc_ctx->flight;
+        rsrc_ctx->flight = flight;
     } else
-        invalid = "chart_type";
-    /*  Invalid request. */
-    const char *frmt = "Invalid or missing parameter %s.";
-    return template_data->output_function(cbdata,
-                            400, strlen(frmt) - 2 + strlen(invalid),
-                            "text/plain", "close", frmt, invalid);
+        log_err(ERR_MEM, EMISS_ERR);
+    pthread_mutex_unlock(&rsrc_ctx->flight_lock);
+    emiss_metrics_add(EMISS_METRIC_FLIGHT_LEADS, 1);
+
+    struct flight_leader leader = {template_data, cbdata, flight};
+    emiss_template_st capture   = *template_data;
+    capture.output_function      = flight_output;
+    capture.send_function        = flight_send;
+    capture.accepts_function     = flight_accepts;
+    capture.unavailable_function = flight_unavailable;
+    int ret;
+    if (admission_acquire(rsrc_ctx)) {
+        ret = retrieve(&capture, snapshot, arena, req, &leader);
+        admission_release(rsrc_ctx);
+    } else
+        ret = flight_unavailable(&leader, EMISS_ADMISSION_RETRY_AFTER);
+    /*  Those who joined are not left waiting on a leader that did not answer. */
+    if (leader.flight)
+        flight_finish(rsrc_ctx, &leader, 500, "text/plain", 0,
+            &(struct iovec) {INTERNAL_ERROR_MSG, STRLLEN(INTERNAL_ERROR_MSG)}, 1, 0);
+    return ret;
+}
+
+static int
+format_chart_js(emiss_template_st *template_data, struct emiss_resource_snapshot *snapshot,
+    struct arena *arena, const char *qstr, void *cbdata)
+{
+    struct chart_request req;
+    const char *invalid = chart_request_parse(&req, snapshot->cdata, qstr, CHART_NONE);
+    if (invalid)
+        return send_invalid_request(template_data, invalid, cbdata);
+    if (req.chart_type == CHART_MAP) {
+        struct map_payload *payload = &snapshot->map_payload[req.grouping]
+                                        [CHOOSE_MAP_CHART_KIND(req.dataset, req.per_capita)]
+                                        [req.from_year - EMISS_YEAR_ZERO];
+        if (payload->body && template_data->send_function) {
+            emiss_metrics_add(EMISS_METRIC_MAP_PAYLOAD_HITS, 1);
+            return send_map_payload(template_data, payload, cbdata);
+        }
+        emiss_metrics_add(EMISS_METRIC_MAP_PAYLOAD_MISSES, 1);
+        /*  The groupings have no query to fall back on. */
+        if (req.grouping)
+            return template_data->output_function(cbdata, 500, STRLLEN(INTERNAL_ERROR_MSG),
+                        "text/plain", "close", "%s", INTERNAL_ERROR_MSG);
+    }
+    /*  Only requests querying the database are coalesced, wait their turn or are refused under
+        load. */
+    if (!chart_request_queries(&req, snapshot->cdata))
+        return retrieve_matching_data(template_data, snapshot, arena, &req, cbdata);
+    return retrieve_coalesced(template_data, snapshot, arena, &req, retrieve_matching_data,
+                cbdata);
+}
+
+/*  Template functions run on the snapshot current when the request began. */
+
+static int
+forward_to_format(emiss_template_st *template_data, size_t i, const char *qstr, void *cbdata)
+{
+    (void) i;
+    unsigned epoch;
+    emiss_resource_snapshot_st *snapshot = emiss_resource_snapshot_acquire(
+                                                template_data->rsrc_ctx, &epoch);
+    /*  Everything allocated for the request is released in one go once it has been answered. */
+    struct arena *arena = arena_acquire(template_data->rsrc_ctx);
+    int ret = arena
+            ? format_chart_js(template_data, snapshot, arena, qstr, cbdata)
+            : template_data->output_function(cbdata, 500, STRLLEN(INTERNAL_ERROR_MSG),
+                    "text/plain", "close", "%s", INTERNAL_ERROR_MSG);
+    arena_release(template_data->rsrc_ctx, arena);
+    emiss_resource_snapshot_release(template_data->rsrc_ctx, epoch);
+    return ret;
 }
 
 static int
 format_chart_html(emiss_template_st *template_data,
     size_t i, const char *qstr, void *cbdata)
 {
-    return template_data->output_function(cbdata, 200,
-                            template_data->rsrc_ctx->template_frmtless_size[i] + strlen(qstr),
-                            "text/html", "close", bdata(template_data->rsrc_ctx->template[i]),
-                            qstr);
+    unsigned epoch;
+    emiss_resource_snapshot_st *snapshot = emiss_resource_snapshot_acquire(
+                                                template_data->rsrc_ctx, &epoch);
+    /*  The page links to the chart by the canonical form of the query. */
+    struct chart_request req;
+    const char *invalid = chart_request_parse(&req, snapshot->cdata, qstr, CHART_NONE);
+    int ret;
+    if (invalid)
+        ret = send_invalid_request(template_data, invalid, cbdata);
+    else {
+        const char *slots[TEMPLATE_NSLOT_NAMES] = {[SLOT_QUERY] = req.canonical};
+        ret = template_send(template_data, &snapshot->template[i], slots, "text/html", cbdata);
+    }
+    emiss_resource_snapshot_release(template_data->rsrc_ctx, epoch);
+    return ret;
+}
+
+/*  The values of a series, as a line chart request names them, from the same queries. */
+static int
+format_series(emiss_template_st *template_data, size_t i, const char *qstr, void *cbdata)
+{
+    (void) i;
+    unsigned epoch;
+    emiss_resource_snapshot_st *snapshot = emiss_resource_snapshot_acquire(
+                                                template_data->rsrc_ctx, &epoch);
+    struct chart_request req;
+    const char *invalid = chart_request_parse(&req, snapshot->cdata, qstr, CHART_LINE);
+    if (!invalid && req.chart_type != CHART_LINE)
+        invalid = "chart_type";
+    if (!invalid && req.nkinds > 1)
+        invalid = "data_type";
+    if (!invalid)
+        series_request_format(&req);
+    struct arena *arena = invalid ? 0 : arena_acquire(template_data->rsrc_ctx);
+    int ret = invalid
+            ? send_invalid_request(template_data, invalid, cbdata)
+            : !arena
+            ? template_data->output_function(cbdata, 500, STRLLEN(INTERNAL_ERROR_MSG),
+                    "text/plain", "close", "%s", INTERNAL_ERROR_MSG)
+            : chart_request_queries(&req, snapshot->cdata)
+            ? retrieve_coalesced(template_data, snapshot, arena, &req, retrieve_series, cbdata)
+            : retrieve_series(template_data, snapshot, arena, &req, cbdata);
+    arena_release(template_data->rsrc_ctx, arena);
+    emiss_resource_snapshot_release(template_data->rsrc_ctx, epoch);
+    return ret;
 }
 
 static void
@@ -771,6 +2151,156 @@ callback_save_last_updated(PGresult *res, void *arg)
         *((time_t *)arg) = (time_t) strtol(PQgetvalue(res, 0, 0), 0, 10);
 }
 
+static void
+snapshot_free(struct emiss_resource_snapshot *snapshot)
+{
+    if (snapshot) {
+        if (snapshot->cdata) {
+            char **cdata_name = snapshot->cdata->name;
+            size_t count = snapshot->cdata->ccount;
+            for (size_t i = 0; i < count; ++i)
+                if (cdata_name[i])
+                    free(cdata_name[i]);
+            free(snapshot->cdata);
+        }
+
+        bstring *rsrc = snapshot->static_resource;
+        for (size_t i = 0; i < EMISS_NSTATICS; ++i)
+            if (rsrc[i])
+                bdestroy(rsrc[i]);
+
+        struct template *template = snapshot->template;
+        for (size_t i = 0; i < TEMPLATE_NFILES; ++i)
+            if (template[i].source)
+                bdestroy(template[i].source);
+
+        for (size_t g = 0; g < MAP_CHART_NGROUPINGS; ++g)
+            for (size_t k = 0; k < MAP_CHART_NKINDS; ++k)
+                for (size_t y = 0; y < MAP_CHART_NYEARS; ++y) {
+                    struct map_payload *payload = &snapshot->map_payload[g][k][y];
+                    if (payload->body)
+                        bdestroy(payload->body);
+                    free(payload->gzip);
+                }
+
+        free(snapshot);
+    }
+}
+
+/*  Build a new snapshot from the country data in the database and the resource files. */
+static struct emiss_resource_snapshot *
+snapshot_init(wlpq_conn_ctx_st *conn_ctx)
+{
+    struct emiss_resource_snapshot *snapshot = calloc(1, sizeof(struct emiss_resource_snapshot));
+    check(snapshot, ERR_MEM, EMISS_ERR);
+    snapshot->cdata = calloc(1, sizeof(struct country_data));
+    check(snapshot->cdata, ERR_MEM, EMISS_ERR);
+    check(retrieve_country_data(conn_ctx, snapshot->cdata), ERR_FAIL, EMISS_ERR,
+            "initializing resources: unable to retrieve country data");
+
+    int ret = fill_yeardata_buffer(snapshot->yeardata_formatted,
+                    EMISS_SIZEOF_FORMATTED_YEARDATA);
+    check(ret, ERR_FAIL, EMISS_ERR, "initializing resources: failed formatting year data");
+
+    snapshot->static_resource[0] = asset_to_bstring("index.html");
+    bstring new_html             = asset_to_bstring("new.html");
+    snapshot->static_resource[1] = frmt_new_chart_html(snapshot->cdata, bdata(new_html));
+    bdestroy(new_html);
+    bstring param_js             = asset_to_bstring("js/param.js");
+    snapshot->static_resource[2] = frmt_chart_params_js(bdata(param_js));
+    bdestroy(param_js);
+
+    snapshot->static_resource[3] = asset_to_bstring("js/verge.min.js");
+    snapshot->static_resource[4] = asset_to_bstring("about.html");
+
+    memcpy(snapshot->static_resource_size, (uintmax_t []) {
+        blength(snapshot->static_resource[0]),
+        blength(snapshot->static_resource[1]),
+        blength(snapshot->static_resource[2]),
+        blength(snapshot->static_resource[3]),
+        blength(snapshot->static_resource[4]),
+    }, sizeof(uintmax_t) * EMISS_NSTATICS);
+
+    check(template_compile(&snapshot->template[0], asset_to_bstring("show.html"))
+            && template_compile(&snapshot->template[1], asset_to_bstring("js/chart.js")),
+        ERR_FAIL, EMISS_ERR, "initializing resources: unable to compile templates");
+
+    /*  Should this fail, the region and income group aggregates are left without values and map
+        charts are queried for as requested. */
+    for (size_t k = 0; k < MAP_CHART_NKINDS; ++k)
+        for (size_t g = 0; g < GROUP_COUNT; ++g)
+            for (size_t y = 0; y < MAP_CHART_NYEARS; ++y)
+                snapshot->group_value[k][g][y] = NAN;
+    if (!map_payloads_init(conn_ctx, snapshot))
+        log_warn(ERR_FAIL, EMISS_ERR, "precomputing map charts");
+    emiss_metrics_add(EMISS_METRIC_SNAPSHOT_BUILDS, 1);
+
+    return snapshot;
+error:
+    snapshot_free(snapshot);
+    return 0;
+}
+
+/*  Replace the current snapshot and free the old one once no request can be reading it: the epoch
+    is flipped twice, each time waiting for the readers counted on the previous one to leave, so
+    that those which read the epoch just before a flip are waited for as well. */
+static void
+snapshot_publish(emiss_resource_ctx_st *rsrc_ctx, struct emiss_resource_snapshot *snapshot)
+{
+    struct emiss_resource_snapshot *old = atomic_exchange(&rsrc_ctx->snapshot, snapshot);
+    emiss_metrics_gauge_set(EMISS_GAUGE_SNAPSHOT_TIME, (int64_t) time(0));
+    struct timespec timer = TIMESPEC_INIT_S_MS(0, 5);
+    for (size_t i = 0; i < 2; ++i) {
+        unsigned previous = atomic_fetch_add(&rsrc_ctx->epoch, 1) & 1;
+        while (atomic_load(&rsrc_ctx->readers[previous]))
+            nanosleep(&timer, 0);
+    }
+    snapshot_free(old);
+}
+
+/*  Check for and run a data update, publishing a new snapshot if the data changed. */
+static void
+refresh_run(emiss_resource_ctx_st *rsrc_ctx)
+{
+    int ret = emiss_resource_should_update(rsrc_ctx);
+    check(ret != -1, ERR_FAIL, EMISS_ERR, "obtaining update time");
+    if (!ret)
+        return;
+    ret = run_data_update(rsrc_ctx, ret);
+    check(ret != -1, ERR_FAIL, EMISS_ERR, "updating database with retrieved data");
+    if (!ret)
+        return;
+    struct emiss_resource_snapshot *snapshot = snapshot_init(rsrc_ctx->conn_ctx);
+    check(snapshot, ERR_FAIL, EMISS_ERR, "building a new resource snapshot");
+    snapshot_publish(rsrc_ctx, snapshot);
+    fprintf(stdout, "Resources were rebuilt from updated data.\n");
+error:
+    return;
+}
+
+/*  Wake every EMISS_UPDATE_INTERVAL seconds to refresh the data, until told to stop. */
+static void *
+refresh_thread_start(void *arg)
+{
+    emiss_resource_ctx_st *rsrc_ctx = (emiss_resource_ctx_st *)arg;
+    pthread_mutex_lock(&rsrc_ctx->refresh_lock);
+    while (rsrc_ctx->refresh_continue) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += EMISS_UPDATE_INTERVAL;
+        int ret = 0;
+        while (rsrc_ctx->refresh_continue && ret != ETIMEDOUT)
+            ret = pthread_cond_timedwait(&rsrc_ctx->refresh_cond, &rsrc_ctx->refresh_lock, &wake);
+        if (!rsrc_ctx->refresh_continue)
+            break;
+        pthread_mutex_unlock(&rsrc_ctx->refresh_lock);
+        refresh_run(rsrc_ctx);
+        pthread_mutex_lock(&rsrc_ctx->refresh_lock);
+    }
+    pthread_mutex_unlock(&rsrc_ctx->refresh_lock);
+    return 0;
+}
+
 /*  EXTERN INLINE INSTANTIATIONS */
 
 extern inline void
@@ -787,34 +2317,83 @@ emiss_resource_template_init(emiss_resource_ctx_st *rsrc_ctx)
     template_data->template_count = EMISS_NTEMPLATES;
     memcpy(template_data->template_name[0], "show", 4);
     memcpy(template_data->template_name[1], "chart", 5);
+    memcpy(template_data->template_name[2], "series", 6);
     template_data->template_function[0] = format_chart_html;
     template_data->template_function[1] = forward_to_format;
+    template_data->template_function[2] = format_series;
     return template_data;
 error:
     return 0;
 }
 
+emiss_resource_snapshot_st *
+emiss_resource_snapshot_acquire(emiss_resource_ctx_st *rsrc_ctx, unsigned *epoch)
+{
+    *epoch = atomic_load(&rsrc_ctx->epoch) & 1;
+    atomic_fetch_add(&rsrc_ctx->readers[*epoch], 1);
+    return atomic_load(&rsrc_ctx->snapshot);
+}
+
+void
+emiss_resource_snapshot_release(emiss_resource_ctx_st *rsrc_ctx, unsigned epoch)
+{
+    atomic_fetch_sub(&rsrc_ctx->readers[epoch], 1);
+}
+
+int
+emiss_resource_path(char *buf, size_t size, const char *path)
+{
+    const char *root = getenv(EMISS_RESOURCE_ROOT_ENV);
+    size_t len = strlen(EMISS_RESOURCE_ROOT);
+    if (root && *root && !strncmp(path, EMISS_RESOURCE_ROOT, len)
+        && (path[len] == '/' || !path[len]))
+        return snprintf(buf, size, "%s%s", root, &path[len]) < (int) size;
+    return snprintf(buf, size, "%s", path) < (int) size;
+}
+
+void
+emiss_resource_db_stats(emiss_resource_ctx_st *rsrc_ctx, wlpq_stats_st *stats)
+{
+    wlpq_stats_get(rsrc_ctx ? rsrc_ctx->conn_ctx : 0, stats);
+}
+
 char *
-emiss_resource_static_get(emiss_resource_ctx_st *rsrc_ctx, size_t i)
+emiss_resource_static_get(emiss_resource_snapshot_st *snapshot, size_t i)
 {
-    if (rsrc_ctx && i < EMISS_NSTATICS)
-        return bdata(rsrc_ctx->static_resource[i]);
+    if (snapshot && i < EMISS_NSTATICS)
+        return bdata(snapshot->static_resource[i]);
     return 0;
 }
 
 size_t
-emiss_resource_static_size(emiss_resource_ctx_st *rsrc_ctx, size_t i)
+emiss_resource_static_size(emiss_resource_snapshot_st *snapshot, size_t i)
 {
-    if (rsrc_ctx && i < EMISS_NSTATICS)
-        return blength(rsrc_ctx->static_resource[i]);
+    if (snapshot && i < EMISS_NSTATICS)
+        return blength(snapshot->static_resource[i]);
     return 0;
 }
 
+const emiss_asset_st *
+emiss_resource_asset_get(const char *path)
+{
+    return bsearch(path, emiss_assets, emiss_nassets, sizeof(emiss_asset_st), asset_compare);
+}
+
 emiss_resource_ctx_st *
 emiss_resource_ctx_init()
 {
-    emiss_resource_ctx_st *rsrc_ctx = malloc(sizeof(emiss_resource_ctx_st));
+    emiss_resource_ctx_st *rsrc_ctx = calloc(1, sizeof(emiss_resource_ctx_st));
     check(rsrc_ctx, ERR_MEM, EMISS_ERR);
+    atomic_init(&rsrc_ctx->snapshot, NULL);
+    atomic_init(&rsrc_ctx->epoch, 0);
+    atomic_init(&rsrc_ctx->readers[0], 0);
+    atomic_init(&rsrc_ctx->readers[1], 0);
+    rsrc_ctx->refresh_lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    rsrc_ctx->refresh_cond = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+    rsrc_ctx->arena_lock   = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    rsrc_ctx->admission_lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    rsrc_ctx->admission_cond = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+    rsrc_ctx->flight_lock    = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
 
     rsrc_ctx->conn_ctx = wlpq_conn_ctx_init(0);
     check(rsrc_ctx->conn_ctx, ERR_FAIL, EMISS_ERR, "initializing resources: unable to init db");
@@ -822,51 +2401,32 @@ emiss_resource_ctx_init()
 
     time_t ret = emiss_resource_should_update(rsrc_ctx);
     check(ret != -1, ERR_FAIL, EMISS_ERR, "obtaining update time");
-    if (ret) {
-        emiss_file_data_st retrieved_data;
-        check(emiss_retrieve_data(&retrieved_data), ERR_FAIL, EMISS_ERR,
-                "retrieving data from a remote source");
-        check(run_data_update(rsrc_ctx, &retrieved_data,
-                "../resources/data/in_tui_chart_map.txt", ret) != -1,
-                ERR_FAIL, EMISS_ERR, "updating database with retrieved data");
-    }
-    rsrc_ctx->cdata = calloc(1, sizeof(struct country_data));
-    check(rsrc_ctx->cdata, ERR_MEM, EMISS_ERR);
-    check(retrieve_country_data(rsrc_ctx), ERR_FAIL, EMISS_ERR,
-            "initializing resources: unable to retrieve country data");
-
-    ret = fill_yeardata_buffer(rsrc_ctx->yeardata_formatted, EMISS_SIZEOF_FORMATTED_YEARDATA);
-    check(ret, ERR_FAIL, EMISS_ERR, "initializing resources: failed formatting year data");
-
-    size_t nplacehold[EMISS_NTEMPLATES] = {0};
-    rsrc_ctx->static_resource[0] = read_to_bstring(EMISS_HTML_ROOT"/index.html", 0);
-    bstring new_html             = read_to_bstring(EMISS_HTML_ROOT"/new.html", 0);
-    rsrc_ctx->static_resource[1] = frmt_new_chart_html(rsrc_ctx->cdata, bdata(new_html));
-    bdestroy(new_html);
-    bstring param_js             = read_to_bstring(EMISS_JS_ROOT"/param.js", 0);
-    rsrc_ctx->static_resource[2] = frmt_chart_params_js(bdata(param_js));
-    bdestroy(param_js);
-
-    rsrc_ctx->static_resource[3] = read_to_bstring(EMISS_JS_ROOT"/verge.min.js", 0);
-    rsrc_ctx->static_resource[4] = read_to_bstring(EMISS_HTML_ROOT"/about.html", 0);
-
-    memcpy(rsrc_ctx->static_resource_size, (uintmax_t []) {
-        blength(rsrc_ctx->static_resource[0]),
-        blength(rsrc_ctx->static_resource[1]),
-        blength(rsrc_ctx->static_resource[2]),
-        blength(rsrc_ctx->static_resource[3]),
-        blength(rsrc_ctx->static_resource[4]),
-    }, sizeof(uintmax_t) * EMISS_NSTATICS);
-
-    rsrc_ctx->template[0] = read_to_bstring(EMISS_HTML_ROOT"/show.html", &nplacehold[0]);
-    rsrc_ctx->template[1] = read_to_bstring(EMISS_JS_ROOT"/chart.js", &nplacehold[1]);
-
-    memcpy(rsrc_ctx->template_frmtless_size, (uintmax_t []) {
-        blength(rsrc_ctx->template[0]) - nplacehold[0] * 2,
-        blength(rsrc_ctx->template[1]) - nplacehold[1] * 2,
-    }, sizeof(uintmax_t) * EMISS_NTEMPLATES);
+    /*  Serve the data already in the database if it cannot be updated: the background refresh
+        tries again later. */
+    if (ret && run_data_update(rsrc_ctx, ret) == -1)
+        log_warn(ERR_FAIL, EMISS_ERR, "updating database with retrieved data");
+    struct emiss_resource_snapshot *snapshot = snapshot_init(rsrc_ctx->conn_ctx);
+    check(snapshot, ERR_FAIL, EMISS_ERR, "initializing resources");
+    atomic_store(&rsrc_ctx->snapshot, snapshot);
+    emiss_metrics_gauge_set(EMISS_GAUGE_SNAPSHOT_TIME, (int64_t) time(0));
 
     return rsrc_ctx;
+error:
+    emiss_resource_ctx_free(rsrc_ctx);
+    return 0;
+}
+
+int
+emiss_resource_refresh_start(emiss_resource_ctx_st *rsrc_ctx)
+{
+    check(rsrc_ctx, ERR_NALLOW, EMISS_ERR, "null resource context parameter");
+    check(!rsrc_ctx->refresh_continue, ERR_NALLOW, EMISS_ERR, "refresh thread already running");
+    rsrc_ctx->refresh_continue = 1;
+    int ret = pthread_create(&rsrc_ctx->refresh_thread, NULL, refresh_thread_start, rsrc_ctx);
+    if (ret)
+        rsrc_ctx->refresh_continue = 0;
+    check(!ret, ERR_FAIL, EMISS_ERR, "creating refresh thread");
+    return 1;
 error:
     return 0;
 }
@@ -875,26 +2435,30 @@ void
 emiss_resource_ctx_free(emiss_resource_ctx_st *rsrc_ctx)
 {
     if (rsrc_ctx) {
+        pthread_mutex_lock(&rsrc_ctx->refresh_lock);
+        uint8_t refresh_running = rsrc_ctx->refresh_continue;
+        rsrc_ctx->refresh_continue = 0;
+        pthread_cond_signal(&rsrc_ctx->refresh_cond);
+        pthread_mutex_unlock(&rsrc_ctx->refresh_lock);
+        if (refresh_running)
+            pthread_join(rsrc_ctx->refresh_thread, NULL);
+        pthread_cond_destroy(&rsrc_ctx->refresh_cond);
+        pthread_mutex_destroy(&rsrc_ctx->refresh_lock);
+
+        while (rsrc_ctx->arena_free) {
+            struct arena *next = rsrc_ctx->arena_free->next_free;
+            arena_free(rsrc_ctx->arena_free);
+            rsrc_ctx->arena_free = next;
+        }
+        pthread_mutex_destroy(&rsrc_ctx->arena_lock);
+        pthread_cond_destroy(&rsrc_ctx->admission_cond);
+        pthread_mutex_destroy(&rsrc_ctx->admission_lock);
+        pthread_mutex_destroy(&rsrc_ctx->flight_lock);
+
         if (rsrc_ctx->conn_ctx)
             wlpq_conn_ctx_free(rsrc_ctx->conn_ctx);
 
-        char **cdata_name = rsrc_ctx->cdata->name;
-        unsigned count = rsrc_ctx->cdata->ccount;
-        for (size_t i = 0; i < count; ++i)
-            if (cdata_name[i])
-                free(cdata_name[i]);
-        free(rsrc_ctx->cdata);
-
-        bstring *rsrc = rsrc_ctx->static_resource;
-        for (size_t i = 0; i < EMISS_NSTATICS; ++i)
-            if (rsrc[i])
-                bdestroy(rsrc[i]);
-
-        bstring *template = rsrc_ctx->template;
-        for (size_t i = 0; i < EMISS_NTEMPLATES; ++i)
-            if (template[i])
-                bdestroy(template[i]);
-
+        snapshot_free(atomic_load(&rsrc_ctx->snapshot));
         free(rsrc_ctx);
     }
 }
@@ -9,184 +9,1152 @@
 */
 
 #include "emiss.h"
+#include <errno.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include <curl/curl.h>
-#include <pcre.h>
-#include "zip.h"
+#define MINIZ_HEADER_FILE_ONLY
+#include "miniz.h"
 #include "util_curl.h"
+#include "util_sha256.h"
+
+/*
+**  MACROS
+*/
+
+/*  Exponential backoff before retry attempt n (1-based) of a transfer, in milliseconds. */
+#define FETCH_BACKOFF_MS(attempt)\
+    ((long) EMISS_FETCH_RETRY_BACKOFF_MS << ((attempt) - 1 < 10 ? (attempt) - 1 : 10))
+
+/*  Zip format signatures and the size of a local file header. */
+#define ZIP_LOCAL_HEADER_SIG        0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG      0x02014b50
+#define ZIP_END_OF_CENTRAL_DIR_SIG  0x06054b50
+#define ZIP_DATA_DESCRIPTOR_SIG     0x08074b50
+#define ZIP_LOCAL_HEADER_SIZE       30
+
+#define ZIP_LE16(p) ((uint16_t) ((p)[0] | (p)[1] << 8))
+#define ZIP_LE32(p) ((uint32_t) ZIP_LE16(p) | (uint32_t) ZIP_LE16((p) + 2) << 16)
+#define ZIP_LE64(p) ((uint64_t) ZIP_LE32(p) | (uint64_t) ZIP_LE32((p) + 4) << 32)
+
+/*  No slot: the entry is not parsed. */
+#define SLOT_NONE SIZE_MAX
+
+/*  The manifest of a cache directory, one line per dataset, and its count of tab separated
+    fields: name, sha256, size, fetched, parsed, url, etag, last_modified, source_sha256. */
+#define CACHE_MANIFEST          "manifest.tsv"
+#define CACHE_MANIFEST_NFIELDS  9
+#define CACHE_MANIFEST_HEADER\
+    "#name\tsha256\tsize\tfetched\tparsed\turl\tetag\tlast_modified\tsource_sha256\n"
+
+#define CACHE_READ_SIZE 0x10000
 
 /*
 **  TYPES
 */
 
-struct file_metadata {
-    FILE       *fp;
-    uintmax_t   byte_size;
+/*  A dataset parsed in its turn: live from its transfer when it is the current slot, otherwise
+    buffered until the slots before it are done. */
+struct slot {
+    int             dataset_id;
+    int             done;
+    int             begun;
+    int             unchanged;
+    char           *buf;
+    size_t          len;
+    size_t          capacity;
+    FILE           *cache_fp;
+    int             cache_failed;
+    util_sha256_st  cache_hash;
+    uintmax_t       cache_size;
+};
+
+/*  A dataset in the local cache: its extracted CSV, stored as <sha256>.csv, and what is known of
+    the source it was fetched from. The times are those it was last fetched or found unmodified,
+    and last parsed. */
+struct cache_entry {
+    char                        sha256[65];
+    uintmax_t                   size;
+    time_t                      fetched;
+    time_t                      parsed;
+    char                        url[0x1000];
+    emiss_source_validator_st   validator;
+};
+
+/*  A cache directory, its entries by slot. */
+struct cache {
+    const char             *dir;
+    struct cache_entry      entries[EMISS_NINDICATORS + 1];
+};
+
+/*  The datasets of a fetch in the order they are to be parsed in, see emiss_update_dataset_begin().
+    Each is also written to the cache, if one is enabled, as it is parsed. */
+struct pipeline {
+    emiss_update_ctx_st    *upd_ctx;
+    struct cache           *cache;
+    struct slot             slots[EMISS_NINDICATORS + 1];
+    size_t                  current;
+};
+
+/*  A streaming reader of the local file entries of a zip archive, stopping at the central
+    directory. Entries are inflated as they arrive and checked against their CRC-32. The output
+    buffer wraps around, holding the dictionary of the entry being inflated. */
+struct unzip {
+    int             state;
+    unsigned char   header[ZIP_LOCAL_HEADER_SIZE];
+    size_t          header_len;
+    char            name[0x100];
+    size_t          name_len;
+    size_t          extra_len;
+    size_t          skip;
+    uint16_t        flags;
+    uint16_t        method;
+    uint32_t        crc;
+    uint32_t        crc_expected;
+    uint64_t        remaining;
+    int             zip64;
+    size_t          slot;
+    tinfl_decompressor inflator;
+    size_t          out_ofs;
+    unsigned char   out[TINFL_LZ_DICT_SIZE * 2];
+};
+
+enum unzip_state {
+    UNZIP_HEADER, UNZIP_NAME, UNZIP_EXTRA, UNZIP_DATA, UNZIP_DESCRIPTOR, UNZIP_END
+};
+
+/*  State of a single download in fetch_from_remote(). If the source has a stored content hash but
+    the response carries no validators to compare, the body is held in memory until its hash shows
+    whether it changed. */
+struct transfer {
+    CURL                       *curl;
+    struct curl_slist          *headers;
+    struct pipeline            *pipeline;
+    struct unzip               *unzip;
+    emiss_source_validator_st  *validator;
+    emiss_source_validator_st   response;
+    util_sha256_st              hash;
+    size_t                      slot;
+    size_t                      meta_slot;
+    uintmax_t                   byte_size;
+    uintmax_t                   received;
+    unsigned                    attempts;
+    long                        retry_at;
+    int                         state;
+    int                         conditional;
+    int                         body;
+    int                         changed;
+    char                       *held;
+    size_t                      held_len;
+    size_t                      held_capacity;
+    char                        url[0x1000];
+    char                        error[CURL_ERROR_SIZE];
+};
+
+enum transfer_state {
+    TRANSFER_PENDING, TRANSFER_RUNNING, TRANSFER_DONE, TRANSFER_UNMODIFIED, TRANSFER_FAILED
+};
+
+/*  What is done with a response body, decided at its first byte. */
+enum transfer_body {
+    BODY_UNDECIDED, BODY_FEED, BODY_HOLD, BODY_DISCARD
+};
+
+/*
+**  STATIC VARIABLES
+*/
+
+/*  Connections, DNS and TLS sessions are shared by all transfers, so that files from the same
+    host reuse a connection, both within a fetch and from one update to the next. */
+static pthread_once_t curl_init_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t curl_share_lock[CURL_LOCK_DATA_LAST];
+static CURLSH *curl_share;
+
+/*  The datasets by slot, in the order they are parsed in, and their names in the cache. */
+static const int slot_datasets[EMISS_NINDICATORS + 1] = {
+    DATASET_COUNTRY_CODES, DATASET_CO2E, DATASET_META, DATASET_POPT
+};
+static const char *slot_names[EMISS_NINDICATORS + 1] = {
+    DATASET_0_NAME, DATASET_1_NAME, DATASET_META_NAME, DATASET_2_NAME
 };
 
 /*
 **  FUNCTIONS
 */
 
+/*  The local dataset cache. Files are named by the SHA-256 of their content and listed in the
+    manifest by dataset, so a file is never modified once stored. */
+
+static int
+cache_path(char *path, size_t size, const char *dir, const char *name, const char *ext)
+{
+    int ret = snprintf(path, size, "%s/%s%s", dir, name, ext);
+    return ret > 0 && (size_t) ret < size;
+}
+
+static int
+cache_entry_present(struct cache *cache, size_t i)
+{
+    char path[0x400];
+    return *cache->entries[i].sha256
+        && cache_path(path, sizeof(path), cache->dir, cache->entries[i].sha256, ".csv")
+        && !access(path, R_OK);
+}
+
+/*  Split a line of the manifest at tabs, in place. Returns the count of fields. */
+static size_t
+cache_manifest_split(char *line, char **fields, size_t nfields)
+{
+    size_t n = 0;
+    line[strcspn(line, "\r\n")] = '\0';
+    while (line && n < nfields) {
+        fields[n++] = line;
+        line = strchr(line, '\t');
+        if (line)
+            *line++ = '\0';
+    }
+    return n;
+}
+
+/*  Read the manifest of a cache directory. Returns 1 if it was read, 0 if there is none or -1 on
+    error. */
+static int
+cache_load(struct cache *cache, const char *dir)
+{
+    char path[0x400], line[0x2000];
+    FILE *fp = 0;
+    memset(cache, 0, sizeof(struct cache));
+    cache->dir = dir;
+    check(cache_path(path, sizeof(path), dir, CACHE_MANIFEST, ""),
+        ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+    fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        char *fields[CACHE_MANIFEST_NFIELDS];
+        if (line[0] == '#'
+            || cache_manifest_split(line, fields, CACHE_MANIFEST_NFIELDS) != CACHE_MANIFEST_NFIELDS
+            || strlen(fields[1]) != 64 || strspn(fields[1], "0123456789abcdef") != 64)
+            continue;
+        for (size_t i = 0; i <= EMISS_NINDICATORS; ++i) {
+            if (strcmp(fields[0], slot_names[i]))
+                continue;
+            struct cache_entry *entry = &cache->entries[i];
+            memcpy(entry->sha256, fields[1], sizeof(entry->sha256));
+            entry->size    = (uintmax_t) strtoull(fields[2], 0, 10);
+            entry->fetched = (time_t) strtoll(fields[3], 0, 10);
+            entry->parsed  = (time_t) strtoll(fields[4], 0, 10);
+            snprintf(entry->url, sizeof(entry->url), "%s", fields[5]);
+            snprintf(entry->validator.etag, sizeof(entry->validator.etag), "%s", fields[6]);
+            snprintf(entry->validator.last_modified, sizeof(entry->validator.last_modified),
+                "%s", fields[7]);
+            snprintf(entry->validator.sha256, sizeof(entry->validator.sha256), "%s", fields[8]);
+        }
+    }
+    check(!ferror(fp), ERR_FAIL_A, EMISS_ERR, "reading file", path);
+    fclose(fp);
+    return 1;
+error:
+    if (fp)
+        fclose(fp);
+    return -1;
+}
+
+/*  Write the manifest, replacing the old one only once complete. */
+static int
+cache_save(struct cache *cache)
+{
+    char path[0x400], part[0x400];
+    FILE *fp = 0;
+    check(cache_path(path, sizeof(path), cache->dir, CACHE_MANIFEST, "")
+            && cache_path(part, sizeof(part), cache->dir, CACHE_MANIFEST, ".part"),
+        ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+    fp = fopen(part, "w");
+    check(fp, ERR_FAIL_A, EMISS_ERR, "opening file", part);
+    int ok = fputs(CACHE_MANIFEST_HEADER, fp) >= 0;
+    for (size_t i = 0; ok && i <= EMISS_NINDICATORS; ++i) {
+        struct cache_entry *entry = &cache->entries[i];
+        if (*entry->sha256)
+            ok = fprintf(fp, "%s\t%s\t%ju\t%lld\t%lld\t%s\t%s\t%s\t%s\n", slot_names[i],
+                    entry->sha256, entry->size, (long long) entry->fetched,
+                    (long long) entry->parsed, entry->url, entry->validator.etag,
+                    entry->validator.last_modified, entry->validator.sha256) > 0;
+    }
+    ok = !fclose(fp) && ok;
+    fp = 0;
+    check(ok, ERR_FAIL_A, EMISS_ERR, "writing file", part);
+    check(!rename(part, path), ERR_FAIL_A, EMISS_ERR, "replacing file", path);
+    return 1;
+error:
+    if (fp)
+        fclose(fp);
+    return 0;
+}
+
+/*  Whether every dataset is cached and was fetched, or found unmodified, less than max_age seconds
+    ago. */
+static int
+cache_fresh(struct cache *cache, time_t now, double max_age)
+{
+    for (size_t i = 0; i <= EMISS_NINDICATORS; ++i)
+        if (!cache_entry_present(cache, i) || difftime(now, cache->entries[i].fetched) >= max_age)
+            return 0;
+    return 1;
+}
+
+static void
+cache_slot_discard(struct pipeline *pipeline, size_t i)
+{
+    struct slot *slot = &pipeline->slots[i];
+    char part[0x400];
+    if (slot->cache_fp) {
+        fclose(slot->cache_fp);
+        slot->cache_fp = NULL;
+        if (cache_path(part, sizeof(part), pipeline->cache->dir, slot_names[i], ".csv.part"))
+            remove(part);
+    }
+    slot->cache_failed = 1;
+}
+
+/*  Write the data of a slot to a part file, to be stored under its hash once complete. Failing to
+    cache is not an error: the dataset is then left out of the cache. */
+static void
+cache_slot_write(struct pipeline *pipeline, size_t i, const void *data, size_t len)
+{
+    struct slot *slot = &pipeline->slots[i];
+    char part[0x400];
+    if (!pipeline->cache || slot->cache_failed)
+        return;
+    if (!slot->cache_fp) {
+        if (cache_path(part, sizeof(part), pipeline->cache->dir, slot_names[i], ".csv.part"))
+            slot->cache_fp = fopen(part, "wb");
+        if (!slot->cache_fp) {
+            log_warn(ERR_FAIL_A, EMISS_ERR, "opening cache file for", slot_names[i]);
+            slot->cache_failed = 1;
+            return;
+        }
+        util_sha256_init(&slot->cache_hash);
+        slot->cache_size = 0;
+    }
+    if (fwrite(data, 1, len, slot->cache_fp) != len) {
+        log_warn(ERR_FAIL_A, EMISS_ERR, "writing cache file for", slot_names[i]);
+        cache_slot_discard(pipeline, i);
+        return;
+    }
+    util_sha256_update(&slot->cache_hash, data, len);
+    slot->cache_size += len;
+}
+
+/*  Store the complete data of a slot under its hash, removing the file it replaces. A dataset that
+    could not be cached is dropped from the manifest, so that its source is fetched in full next. */
+static void
+cache_slot_commit(struct pipeline *pipeline, size_t i)
+{
+    struct slot *slot = &pipeline->slots[i];
+    if (!pipeline->cache)
+        return;
+    struct cache_entry *entry = &pipeline->cache->entries[i];
+    char part[0x400], path[0x400], sha256[65];
+    int ok = slot->cache_fp && !slot->cache_failed;
+    if (slot->cache_fp) {
+        ok = !fclose(slot->cache_fp) && ok;
+        slot->cache_fp = NULL;
+    }
+    util_sha256_final_hex(&slot->cache_hash, sha256);
+    ok = ok && cache_path(part, sizeof(part), pipeline->cache->dir, slot_names[i], ".csv.part")
+            && cache_path(path, sizeof(path), pipeline->cache->dir, sha256, ".csv")
+            && !rename(part, path);
+    if (!ok) {
+        if (!slot->cache_failed)
+            log_warn(ERR_FAIL_A, EMISS_ERR, "storing cache file for", slot_names[i]);
+        memset(entry, 0, sizeof(struct cache_entry));
+        return;
+    }
+    if (*entry->sha256 && strcmp(entry->sha256, sha256)) {
+        int shared = 0;
+        for (size_t j = 0; j <= EMISS_NINDICATORS; ++j)
+            shared |= j != i && !strcmp(pipeline->cache->entries[j].sha256, entry->sha256);
+        if (!shared && cache_path(path, sizeof(path), pipeline->cache->dir, entry->sha256, ".csv"))
+            remove(path);
+    }
+    memcpy(entry->sha256, sha256, sizeof(sha256));
+    entry->size = slot->cache_size;
+}
+
+/*  Parse a dataset from a file, checking it against its hash if one is given. */
+static int
+cache_replay_file(emiss_update_ctx_st *upd_ctx, int dataset_id, const char *path,
+    const char *sha256)
+{
+    util_sha256_st hash;
+    char hex[65];
+    FILE *fp  = 0;
+    char *buf = malloc(CACHE_READ_SIZE);
+    int ret   = 0;
+    check(buf, ERR_MEM, EMISS_ERR);
+    fp = fopen(path, "rb");
+    check(fp, ERR_FAIL_A, EMISS_ERR, "opening file", path);
+    util_sha256_init(&hash);
+    check(emiss_update_dataset_begin(upd_ctx, dataset_id), ERR_FAIL, EMISS_ERR,
+        "beginning dataset");
+    size_t n;
+    while ((n = fread(buf, 1, CACHE_READ_SIZE, fp))) {
+        util_sha256_update(&hash, buf, n);
+        check(emiss_update_dataset_push(upd_ctx, buf, n) == 1,
+            ERR_FAIL_A, EMISS_ERR, "parsing file", path);
+    }
+    check(!ferror(fp), ERR_FAIL_A, EMISS_ERR, "reading file", path);
+    util_sha256_final_hex(&hash, hex);
+    check(!sha256 || !strcmp(hex, sha256), ERR_FAIL_A, EMISS_ERR,
+        "verifying the hash of cached file", path);
+    check(emiss_update_dataset_end(upd_ctx), ERR_FAIL, EMISS_ERR, "finishing dataset");
+    ret = 1;
+error:
+    if (fp)
+        fclose(fp);
+    free(buf);
+    return ret;
+}
+
+/*  Begin parsing the dataset of the current slot, along with whatever has been buffered for it. */
+static int
+pipeline_slot_begin(struct pipeline *pipeline)
+{
+    struct slot *slot = &pipeline->slots[pipeline->current];
+    check(emiss_update_dataset_begin(pipeline->upd_ctx, slot->dataset_id),
+        ERR_FAIL, EMISS_ERR, "beginning dataset");
+    slot->begun = 1;
+    if (slot->len)
+        check(emiss_update_dataset_push(pipeline->upd_ctx, slot->buf, slot->len) == 1,
+            ERR_FAIL, EMISS_ERR, "parsing dataset");
+    free(slot->buf);
+    slot->buf = NULL;
+    slot->len = slot->capacity = 0;
+    return 1;
+error:
+    return 0;
+}
+
+static int
+pipeline_push(struct pipeline *pipeline, size_t i, const void *data, size_t len)
+{
+    if (i == SLOT_NONE || !len)
+        return 1;
+    cache_slot_write(pipeline, i, data, len);
+    if (i == pipeline->current) {
+        if (!pipeline->slots[i].begun)
+            check(pipeline_slot_begin(pipeline), ERR_FAIL, EMISS_ERR, "beginning dataset");
+        return emiss_update_dataset_push(pipeline->upd_ctx, data, len) == 1;
+    }
+    struct slot *slot = &pipeline->slots[i];
+    if (slot->len + len > slot->capacity) {
+        size_t capacity = slot->capacity ? slot->capacity : 0x10000;
+        while (capacity < slot->len + len)
+            capacity *= 2;
+        char *buf = realloc(slot->buf, capacity);
+        check(buf, ERR_MEM, EMISS_ERR);
+        slot->buf = buf;
+        slot->capacity = capacity;
+    }
+    memcpy(&slot->buf[slot->len], data, len);
+    slot->len += len;
+    return 1;
+error:
+    return 0;
+}
+
+/*  Mark a slot as complete, or its source as unchanged, and move on past every completed slot.
+    Datasets of unchanged sources are not parsed at all. */
 static int
-decompress_to_disk(const char *src_file, const char *dest_folder,
-    pcre *ignore_rgx, uintmax_t *file_size)
-{
-    struct zip_t *zip = zip_open(src_file, 0, 'r');
-    check(zip, ERR_EXTERN, "zip.h", "could not open archive file")
-    int total = zip_total_entries(zip);
-    check(total > 0, ERR_EXTERN, "zip.h", "archive has no entries or error");
-    int processed = 0,
-        ret = -1,
-        i = 0;
-    *(strrchr(src_file, '.')) = '\0';
+pipeline_slot_end(struct pipeline *pipeline, size_t i, int unchanged)
+{
+    if (i == SLOT_NONE)
+        return 1;
+    pipeline->slots[i].done = 1;
+    pipeline->slots[i].unchanged = unchanged;
+    if (!unchanged)
+        cache_slot_commit(pipeline, i);
+    while (pipeline->current <= EMISS_NINDICATORS && pipeline->slots[pipeline->current].done) {
+        struct slot *slot = &pipeline->slots[pipeline->current];
+        if (!slot->unchanged) {
+            if (!slot->begun)
+                check(pipeline_slot_begin(pipeline), ERR_FAIL, EMISS_ERR, "beginning dataset");
+            check(emiss_update_dataset_end(pipeline->upd_ctx),
+                ERR_FAIL, EMISS_ERR, "finishing dataset");
+            if (pipeline->cache)
+                pipeline->cache->entries[pipeline->current].parsed = time(NULL);
+        }
+        if (++pipeline->current <= EMISS_NINDICATORS && pipeline->slots[pipeline->current].len)
+            check(pipeline_slot_begin(pipeline), ERR_FAIL, EMISS_ERR, "beginning dataset");
+    }
+    return 1;
+error:
+    return 0;
+}
+
+/*  The slot for an archive entry: Metadata_Country to the metadata slot, if any, other metadata
+    is skipped and the rest is indicator data. */
+static size_t
+unzip_entry_slot(struct transfer *transfer, const char *name)
+{
+    if (!strstr(name, "Metadata_"))
+        return transfer->slot;
+    return strstr(name, "Metadata_Country") ? transfer->meta_slot : SLOT_NONE;
+}
+
+/*  Read the local file header in unzip->header and the fields following it. */
+static int
+unzip_entry_begin(struct unzip *unzip)
+{
+    const unsigned char *hdr = unzip->header;
+    unzip->flags        = ZIP_LE16(&hdr[6]);
+    unzip->method       = ZIP_LE16(&hdr[8]);
+    unzip->crc_expected = ZIP_LE32(&hdr[14]);
+    unzip->remaining    = ZIP_LE32(&hdr[18]);
+    unzip->name_len     = ZIP_LE16(&hdr[26]);
+    unzip->extra_len    = ZIP_LE16(&hdr[28]);
+    unzip->zip64        = unzip->remaining == UINT32_MAX;
+    unzip->crc          = 0;
+    unzip->header_len   = 0;
+    check(!(unzip->flags & 1), ERR_NALLOW, EMISS_ERR, "An encrypted archive entry");
+    check(unzip->method == MZ_DEFLATED || unzip->method == 0,
+        ERR_UNDEF, EMISS_ERR, "archive compression method", unzip->method);
+    check(unzip->method == MZ_DEFLATED || !(unzip->flags & 8),
+        ERR_NALLOW, EMISS_ERR, "A stored archive entry of unknown size");
+    check(unzip->name_len < sizeof(unzip->name),
+        ERR_IMPRO, EMISS_ERR, "archive entry name length", (int) unzip->name_len);
+    return 1;
+error:
+    return 0;
+}
+
+static void
+unzip_data_begin(struct transfer *transfer, struct unzip *unzip)
+{
+    unzip->name[unzip->name_len] = '\0';
+    unzip->slot = unzip_entry_slot(transfer, unzip->name);
+    if (unzip->method == MZ_DEFLATED) {
+        tinfl_init(&unzip->inflator);
+        unzip->out_ofs = 0;
+    }
+}
+
+static int
+unzip_data_end(struct transfer *transfer, struct unzip *unzip)
+{
+    check(unzip->crc == unzip->crc_expected, ERR_FAIL_A, EMISS_ERR,
+        "verifying CRC-32 of archive entry", unzip->name);
+    return pipeline_slot_end(transfer->pipeline, unzip->slot, 0);
+error:
+    return 0;
+}
+
+/*  Inflate (or pass through, if stored) entry data, returning the count of bytes consumed or -1. */
+static long
+unzip_data(struct transfer *transfer, struct unzip *unzip, const unsigned char *data, size_t len)
+{
+    if (unzip->method != MZ_DEFLATED) {
+        size_t n = len < unzip->remaining ? len : (size_t) unzip->remaining;
+        unzip->crc = (uint32_t) mz_crc32(unzip->crc, data, n);
+        check(pipeline_push(transfer->pipeline, unzip->slot, data, n),
+            ERR_FAIL, EMISS_ERR, "parsing archive entry");
+        unzip->remaining -= n;
+        if (!unzip->remaining) {
+            check(unzip_data_end(transfer, unzip), ERR_FAIL, EMISS_ERR, "finishing archive entry");
+            unzip->state = UNZIP_HEADER;
+        }
+        return (long) n;
+    }
+    size_t consumed = 0;
+    tinfl_status status;
     do {
-        int pcre_ovec[300];
-        check(zip_entry_openbyindex(zip, i) >= 0, ERR_EXTERN_AT,
-                "zip.h", "error opening archive entry by index",
-                i);
-        const char *entry_name = zip_entry_name(zip);
-        check(entry_name, ERR_EXTERN_AT, "zip.h",
-                "error obtaining current archive entry name", i);
-        if (ignore_rgx)
-            ret = pcre_exec(ignore_rgx, 0, entry_name,
-                    strlen(entry_name), 0, 0,
-                    pcre_ovec, 300);
-        if (ret < 0) {
-            check(ret == PCRE_ERROR_NOMATCH, ERR_EXTERN_AT, "PCRE",
-                    "matching error", ret);
-            char buf[0x500];
-            const char *filename = strstr(entry_name, "Meta") ? "Meta" : src_file;
-            check(snprintf(buf, 0x4FF, "%s/%s.csv", dest_folder, filename) != -1,
-                    ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
-            check(zip_entry_fread(zip, buf) == 0, ERR_EXTERN_AT, "zip.h",
-                "error writing archive entry to file", i);
-            *file_size = zip_entry_size(zip);
-            ++file_size;
-            ++processed;
+        size_t in_len  = len - consumed,
+               out_len = sizeof(unzip->out) - unzip->out_ofs;
+        status = tinfl_decompress(&unzip->inflator, &data[consumed], &in_len,
+                    unzip->out, &unzip->out[unzip->out_ofs], &out_len,
+                    TINFL_FLAG_HAS_MORE_INPUT);
+        check(status >= TINFL_STATUS_DONE, ERR_EXTERN_AT, "miniz", "inflating archive entry",
+            (int) status);
+        consumed += in_len;
+        unzip->crc = (uint32_t) mz_crc32(unzip->crc, &unzip->out[unzip->out_ofs], out_len);
+        check(pipeline_push(transfer->pipeline, unzip->slot, &unzip->out[unzip->out_ofs], out_len),
+            ERR_FAIL, EMISS_ERR, "parsing archive entry");
+        unzip->out_ofs = (unzip->out_ofs + out_len) & (sizeof(unzip->out) - 1);
+        /*  Whole bytes left in the bit buffer at the end were read past the deflate stream. */
+        if (status == TINFL_STATUS_DONE) {
+            size_t ahead = unzip->inflator.m_num_bits >> 3;
+            consumed -= ahead < consumed ? ahead : consumed;
         }
-        zip_entry_close(zip);
-    } while (++i < total);
-    zip_close(zip);
-    return processed;
+    } while (status == TINFL_STATUS_HAS_MORE_OUTPUT
+        || (status == TINFL_STATUS_NEEDS_MORE_INPUT && consumed < len));
+    if (status == TINFL_STATUS_DONE) {
+        if (unzip->flags & 8) {
+            /*  Sizes and CRC follow in a data descriptor. */
+            unzip->header_len = 0;
+            unzip->state = UNZIP_DESCRIPTOR;
+        } else {
+            check(unzip_data_end(transfer, unzip), ERR_FAIL, EMISS_ERR, "finishing archive entry");
+            unzip->state = UNZIP_HEADER;
+        }
+    }
+    return (long) consumed;
 error:
-    if (zip)
-        zip_close(zip);
     return -1;
 }
 
+/*  The size of a data descriptor: a CRC-32 and the two sizes, 4 or 8 bytes each, preceded by an
+    optional signature. Until its first 4 bytes are read, only those are asked for. */
+static size_t
+unzip_descriptor_size(struct unzip *unzip)
+{
+    if (unzip->header_len < 4)
+        return 4;
+    return (unzip->zip64 ? 20 : 12) + (ZIP_LE32(unzip->header) == ZIP_DATA_DESCRIPTOR_SIG ? 4 : 0);
+}
+
+/*  Feed downloaded archive bytes through the reader. */
+static int
+unzip_feed(struct transfer *transfer, const unsigned char *data, size_t len)
+{
+    struct unzip *unzip = transfer->unzip;
+    while (len) {
+        size_t n;
+        switch (unzip->state) {
+            case UNZIP_HEADER:
+                n = ZIP_LOCAL_HEADER_SIZE - unzip->header_len;
+                n = n < len ? n : len;
+                memcpy(&unzip->header[unzip->header_len], data, n);
+                unzip->header_len += n;
+                if (unzip->header_len >= 4 && ZIP_LE32(unzip->header) != ZIP_LOCAL_HEADER_SIG) {
+                    uint32_t sig = ZIP_LE32(unzip->header);
+                    check(sig == ZIP_CENTRAL_HEADER_SIG || sig == ZIP_END_OF_CENTRAL_DIR_SIG,
+                        ERR_IMPRO, EMISS_ERR, "zip archive signature", (int) sig);
+                    unzip->state = UNZIP_END;
+                    break;
+                }
+                if (unzip->header_len == ZIP_LOCAL_HEADER_SIZE) {
+                    check(unzip_entry_begin(unzip),
+                        ERR_FAIL, EMISS_ERR, "reading archive entry header");
+                    unzip->skip  = 0;
+                    unzip->state = UNZIP_NAME;
+                }
+                break;
+            case UNZIP_NAME:
+                n = unzip->name_len - unzip->skip;
+                n = n < len ? n : len;
+                memcpy(&unzip->name[unzip->skip], data, n);
+                unzip->skip += n;
+                if (unzip->skip == unzip->name_len) {
+                    unzip->skip  = 0;
+                    unzip->state = UNZIP_EXTRA;
+                }
+                break;
+            case UNZIP_EXTRA:
+                /*  Only the zip64 sizes are of interest in the extra field, and only in the first
+                    header block; it is read from unzip->header, which is free by now. */
+                n = unzip->extra_len - unzip->skip;
+                n = n < len ? n : len;
+                if (unzip->skip < sizeof(unzip->header)) {
+                    size_t m = sizeof(unzip->header) - unzip->skip;
+                    memcpy(&unzip->header[unzip->skip], data, m < n ? m : n);
+                }
+                unzip->skip += n;
+                if (unzip->skip == unzip->extra_len) {
+                    if (unzip->zip64) {
+                        check(unzip->extra_len >= 20 && ZIP_LE16(unzip->header) == 0x0001,
+                            ERR_IMPRO, EMISS_ERR, "zip64 extra field", (int) unzip->extra_len);
+                        unzip->remaining = ZIP_LE64(&unzip->header[12]);
+                    }
+                    unzip_data_begin(transfer, unzip);
+                    unzip->state = UNZIP_DATA;
+                    if (unzip->method != MZ_DEFLATED && !unzip->remaining) {
+                        check(unzip_data_end(transfer, unzip),
+                            ERR_FAIL, EMISS_ERR, "finishing archive entry");
+                        unzip->state = UNZIP_HEADER;
+                    }
+                }
+                break;
+            case UNZIP_DATA: {
+                long consumed = unzip_data(transfer, unzip, data, len);
+                check(consumed != -1, ERR_FAIL, EMISS_ERR, "reading archive entry");
+                n = (size_t) consumed;
+                break;
+            }
+            case UNZIP_DESCRIPTOR:
+                n = unzip_descriptor_size(unzip) - unzip->header_len;
+                n = n < len ? n : len;
+                memcpy(&unzip->header[unzip->header_len], data, n);
+                unzip->header_len += n;
+                if (unzip->header_len == unzip_descriptor_size(unzip) && unzip->header_len > 4) {
+                    unzip->crc_expected = ZIP_LE32(&unzip->header[unzip->header_len
+                                            - (unzip->zip64 ? 20 : 12)]);
+                    check(unzip_data_end(transfer, unzip),
+                        ERR_FAIL, EMISS_ERR, "finishing archive entry");
+                    unzip->header_len = 0;
+                    unzip->state = UNZIP_HEADER;
+                }
+                break;
+            default:
+                /*  The central directory repeats what was read already. */
+                return 1;
+        }
+        data += n;
+        len  -= n;
+    }
+    return 1;
+error:
+    return 0;
+}
+
+/*  Pass on downloaded bytes, through the zip reader or straight to the slot of the transfer. */
+static int
+transfer_feed(struct transfer *transfer, const char *data, size_t len)
+{
+    return transfer->unzip
+        ? unzip_feed(transfer, (const unsigned char *) data, len)
+        : pipeline_push(transfer->pipeline, transfer->slot, data, len);
+}
+
+/*  Decide what to do with a response body by its validators: one that matches those stored was
+    not modified, one without validators is held until its hash can be compared. */
+static int
+transfer_body_decide(struct transfer *transfer)
+{
+    emiss_source_validator_st *stored   = transfer->validator,
+                              *response = &transfer->response;
+    if (transfer->conditional) {
+        if (*response->etag)
+            return strcmp(response->etag, stored->etag) ? BODY_FEED : BODY_DISCARD;
+        if (*response->last_modified)
+            return strcmp(response->last_modified, stored->last_modified) ? BODY_FEED
+                 : BODY_DISCARD;
+        if (*stored->sha256)
+            return BODY_HOLD;
+    }
+    return BODY_FEED;
+}
+
+static int
+transfer_hold(struct transfer *transfer, const char *data, size_t len)
+{
+    if (transfer->held_len + len > transfer->held_capacity) {
+        size_t capacity = transfer->held_capacity ? transfer->held_capacity : 0x10000;
+        while (capacity < transfer->held_len + len)
+            capacity *= 2;
+        char *held = realloc(transfer->held, capacity);
+        check(held, ERR_MEM, EMISS_ERR);
+        transfer->held = held;
+        transfer->held_capacity = capacity;
+    }
+    memcpy(&transfer->held[transfer->held_len], data, len);
+    transfer->held_len += len;
+    return 1;
+error:
+    return 0;
+}
+
 static size_t
-callback_curl_write_to_file_saving_size(char *buffer,
+callback_curl_write_to_pipeline(char *buffer,
     size_t size, size_t nitems, void *userdata)
 {
-    struct file_metadata *filedata = (struct file_metadata *)userdata;
-    size_t written = fwrite(buffer, size, nitems, filedata->fp);
-    filedata->byte_size += written;
-    return written;
+    struct transfer *transfer = (struct transfer *)userdata;
+    size_t len = size * nitems,
+           off = 0;
+    /*  On a retry, the bytes already passed on are skipped. */
+    if (transfer->received < transfer->byte_size) {
+        uintmax_t behind = transfer->byte_size - transfer->received;
+        off = behind < len ? (size_t) behind : len;
+    }
+    transfer->received += len;
+    if (off < len) {
+        if (transfer->body == BODY_UNDECIDED) {
+            transfer->body = transfer_body_decide(transfer);
+            transfer->changed = transfer->body == BODY_FEED;
+        }
+        util_sha256_update(&transfer->hash, &buffer[off], len - off);
+        int ret = transfer->body == BODY_FEED ? transfer_feed(transfer, &buffer[off], len - off)
+                : transfer->body == BODY_HOLD ? transfer_hold(transfer, &buffer[off], len - off)
+                : 1;
+        if (!ret)
+            return 0;
+        transfer->byte_size += len - off;
+    }
+    return len;
+}
+
+/*  Copy a header value, sans surrounding whitespace, or leave it empty if too long to be used. */
+static void
+header_value_copy(char *dest, size_t size, const char *value, size_t len)
+{
+    while (len && (*value == ' ' || *value == '\t'))
+        ++value, --len;
+    while (len && (value[len - 1] == '\r' || value[len - 1] == '\n' || value[len - 1] == ' '))
+        --len;
+    if (len >= size)
+        len = 0;
+    memcpy(dest, value, len);
+    dest[len] = '\0';
 }
 
 static size_t
-callback_curl_write_to_file(char *buffer,
+callback_curl_header_validators(char *buffer,
     size_t size, size_t nitems, void *userdata)
 {
-    return fwrite(buffer, size, nitems, (FILE *)userdata);
+    emiss_source_validator_st *response = &((struct transfer *)userdata)->response;
+    size_t len = size * nitems;
+    /*  A status line begins a new response, after a redirect or on a retry. */
+    if (len > 5 && !strncmp(buffer, "HTTP/", 5))
+        memset(response, 0, sizeof(emiss_source_validator_st));
+    else if (len > 5 && !strncasecmp(buffer, "ETag:", 5))
+        header_value_copy(response->etag, sizeof(response->etag), &buffer[5], len - 5);
+    else if (len > 14 && !strncasecmp(buffer, "Last-Modified:", 14))
+        header_value_copy(response->last_modified, sizeof(response->last_modified),
+            &buffer[14], len - 14);
+    return len;
+}
+
+static void
+callback_curl_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+    (void) curl, (void) access, (void) userptr;
+    pthread_mutex_lock(&curl_share_lock[data]);
 }
 
+static void
+callback_curl_share_unlock(CURL *curl, curl_lock_data data, void *userptr)
+{
+    (void) curl, (void) userptr;
+    pthread_mutex_unlock(&curl_share_lock[data]);
+}
+
+static void
+curl_global_fini(void)
+{
+    curl_share_cleanup(curl_share);
+    curl_global_cleanup();
+}
+
+/*  Initialize libcurl once per process, cleaned up at exit rather than after every fetch. */
+static void
+curl_global_once(void)
+{
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        log_err(ERR_EXTERN, LCURL, "global initialization failed");
+        return;
+    }
+    for (size_t i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+        pthread_mutex_init(&curl_share_lock[i], NULL);
+    curl_share = curl_share_init();
+    if (curl_share && (curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC,
+                callback_curl_share_lock) != CURLSHE_OK
+            || curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC,
+                callback_curl_share_unlock) != CURLSHE_OK
+            || curl_share_setopt(curl_share, CURLSHOPT_SHARE,
+                CURL_LOCK_DATA_DNS) != CURLSHE_OK
+            || curl_share_setopt(curl_share, CURLSHOPT_SHARE,
+                CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK
+            || curl_share_setopt(curl_share, CURLSHOPT_SHARE,
+                CURL_LOCK_DATA_CONNECT) != CURLSHE_OK)) {
+        log_warn(ERR_EXTERN, LCURL, "sharing connections between transfers");
+        curl_share_cleanup(curl_share);
+        curl_share = NULL;
+    }
+    atexit(curl_global_fini);
+}
+
+static long
+clock_monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/*  Whether a failed transfer may succeed if tried again. */
 static int
-fetch_from_remote(const char **protocols, const char **hosts,
-    const char **uris, const char **query_strings, const char **resources,
-    uintmax_t *file_sizes, size_t nitems)
+transfer_retryable(CURL *curl, CURLcode res)
+{
+    long status = 0;
+    switch (res) {
+        case CURLE_HTTP_RETURNED_ERROR:
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+            return status >= 500 || status == 408 || status == 429;
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*  Make the request conditional on the validators stored for the source, if any. */
+static int
+transfer_conditional_set(struct transfer *transfer)
 {
-    FILE *fp_hdr = 0,
-         *fp_body = 0;
-    CURL *curl = 0;
+    emiss_source_validator_st *stored = transfer->validator;
+    char header[0x180];
+    transfer->conditional = *stored->etag || *stored->last_modified || *stored->sha256;
+    if (*stored->etag) {
+        snprintf(header, sizeof(header), "If-None-Match: %s", stored->etag);
+        struct curl_slist *headers = curl_slist_append(transfer->headers, header);
+        check(headers, ERR_MEM, EMISS_ERR);
+        transfer->headers = headers;
+    }
+    if (*stored->last_modified) {
+        snprintf(header, sizeof(header), "If-Modified-Since: %s", stored->last_modified);
+        struct curl_slist *headers = curl_slist_append(transfer->headers, header);
+        check(headers, ERR_MEM, EMISS_ERR);
+        transfer->headers = headers;
+    }
+    CURLcode res = curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, transfer->headers);
+    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(transfer->error, res));
+    return 1;
+error:
+    return 0;
+}
 
-    struct file_metadata *filedata = 0;
-    filedata = calloc(1, sizeof(struct file_metadata));
-    check(filedata, ERR_MEM, EMISS_ERR);
+/*  Fetch a source found unmodified again, in full, when its dataset is needed after all. */
+static void
+transfer_unconditional(struct transfer *transfer)
+{
+    curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, NULL);
+    curl_slist_free_all(transfer->headers);
+    transfer->headers     = NULL;
+    transfer->conditional = 0;
+    transfer->body        = BODY_UNDECIDED;
+    transfer->byte_size   = 0;
+    transfer->attempts    = 0;
+    transfer->retry_at    = 0;
+    transfer->state       = TRANSFER_PENDING;
+    util_sha256_init(&transfer->hash);
+}
 
-    curl = curl_easy_init();
-    check(curl, ERR_EXTERN, "CURL", "something went wrong initializing CURL handle");
+static int
+transfer_init(struct transfer *transfer)
+{
+    CURLcode res;
+    transfer->curl = curl_easy_init();
+    check(transfer->curl, ERR_EXTERN, LCURL, "something went wrong initializing CURL handle");
+    CURL *curl = transfer->curl;
 
-    char curl_err[CURL_ERROR_SIZE];
-    CURLcode res = curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err);
+    res = curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, transfer->error);
     check(res == CURLE_OK, ERR_EXTERN, LCURL, curl_easy_strerror(res));
+    res = CURL_SET_OPTS(curl, res, transfer->error);
+    check(res, ERR_EXTERN, LCURL, CURL_ERR_MSG(transfer->error, res));
+    res = curl_easy_setopt(curl, CURLOPT_SHARE, curl_share);
+    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(transfer->error, res));
+    res = curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(transfer->error, res));
+    res = curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long) EMISS_FETCH_CONNECT_TIMEOUT);
+    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(transfer->error, res));
+    res = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback_curl_write_to_pipeline);
+    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(transfer->error, res));
+    res = curl_easy_setopt(curl, CURLOPT_WRITEDATA, transfer);
+    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(transfer->error, res));
+    res = curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, callback_curl_header_validators);
+    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(transfer->error, res));
+    res = curl_easy_setopt(curl, CURLOPT_HEADERDATA, transfer);
+    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(transfer->error, res));
+    check(transfer_conditional_set(transfer), ERR_FAIL, EMISS_ERR, "setting request headers");
+    res = curl_easy_setopt(curl, CURLOPT_URL, transfer->url);
+    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(transfer->error, res));
+    res = curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer);
+    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(transfer->error, res));
+    return 1;
+error:
+    return 0;
+}
+
+/*  Hand the transfer to the multi handle. A retry starts from the top, its bytes up to those
+    already passed on are skipped in the write callback. */
+static int
+transfer_start(CURLM *multi, struct transfer *transfer)
+{
+    transfer->received = 0;
+    transfer->error[0] = '\0';
+    transfer->attempts++;
+    CURLMcode mres = curl_multi_add_handle(multi, transfer->curl);
+    check(mres == CURLM_OK, ERR_EXTERN, LCURL, curl_multi_strerror(mres));
+    transfer->state = TRANSFER_RUNNING;
+    return 1;
+error:
+    return 0;
+}
 
-    res = CURL_SET_OPTS(curl, res, curl_err);
-    check(res, ERR_EXTERN, LCURL, CURL_ERR_MSG(curl_err, res));
+/*  Settle a finished transfer as done, unmodified, failed or pending a retry after a backoff. */
+static void
+transfer_finish(CURLM *multi, struct transfer *transfer, CURLcode res)
+{
+    curl_multi_remove_handle(multi, transfer->curl);
+    if (res == CURLE_OK) {
+        long status = 0;
+        curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status);
+        if (status == 304 || transfer->body == BODY_DISCARD) {
+            transfer->state = TRANSFER_UNMODIFIED;
+            return;
+        }
+        util_sha256_final_hex(&transfer->hash, transfer->response.sha256);
+        if (transfer->body == BODY_HOLD) {
+            int unmodified = !strcmp(transfer->response.sha256, transfer->validator->sha256);
+            int fed = unmodified || transfer_feed(transfer, transfer->held, transfer->held_len);
+            free(transfer->held);
+            transfer->held = NULL;
+            transfer->held_len = transfer->held_capacity = 0;
+            transfer->changed = !unmodified;
+            if (unmodified || !fed) {
+                transfer->state = unmodified ? TRANSFER_UNMODIFIED : TRANSFER_FAILED;
+                return;
+            }
+        }
+        if (transfer->unzip) {
+            transfer->state = transfer->unzip->state == UNZIP_END
+                            && (transfer->slot == SLOT_NONE
+                                || transfer->pipeline->slots[transfer->slot].done)
+                            && (transfer->meta_slot == SLOT_NONE
+                                || transfer->pipeline->slots[transfer->meta_slot].done)
+                            ? TRANSFER_DONE : TRANSFER_FAILED;
+            if (transfer->state == TRANSFER_FAILED)
+                log_err(ERR_FAIL_A, EMISS_ERR, "reading an entry of the archive at", transfer->url);
+        } else
+            transfer->state = pipeline_slot_end(transfer->pipeline, transfer->slot, 0)
+                            ? TRANSFER_DONE : TRANSFER_FAILED;
+        if (transfer->state == TRANSFER_DONE)
+            *transfer->validator = transfer->response;
+        return;
+    }
+    if (transfer->attempts <= EMISS_FETCH_MAX_RETRIES && transfer_retryable(transfer->curl, res)) {
+        long backoff = FETCH_BACKOFF_MS(transfer->attempts);
+        log_warn("[%s]: Fetching %s failed: %s, retrying in %ld ms.", EMISS_ERR,
+            transfer->url, CURL_ERR_MSG(transfer->error, res), backoff);
+        transfer->retry_at = clock_monotonic_ms() + backoff;
+        transfer->state = TRANSFER_PENDING;
+    } else {
+        log_err(ERR_EXTERN, LCURL, CURL_ERR_MSG(transfer->error, res));
+        transfer->state = TRANSFER_FAILED;
+    }
+}
 
-    res = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback_curl_write_to_file_saving_size);
-    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(curl_err, res));
+/*  Download all resources at once, at most EMISS_FETCH_MAX_PARALLEL at a time, each retried with
+    exponential backoff on transient errors, passing the data to the parser as it arrives. The
+    transfers are to be set up with their pipeline, slots and validators, the first one holding the
+    country codes. Returns the count of sources fetched or found unmodified, or -1 on error. */
+static int
+fetch_from_remote(const char **protocols, const char **hosts,
+    const char **uris, const char **query_strings, const char **resources,
+    struct transfer *transfers, size_t nitems)
+{
+    CURLM *multi = 0;
+    int ret = 0;
 
-    res = curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, callback_curl_write_to_file);
-    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(curl_err, res));
+    pthread_once(&curl_init_once, curl_global_once);
 
-    res = curl_easy_setopt(curl, CURLOPT_WRITEDATA, filedata);
-    check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(curl_err, res));
+    multi = curl_multi_init();
+    check(multi, ERR_EXTERN, LCURL, "something went wrong initializing CURL multi handle");
+    CURLMcode mres = curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long) nitems);
+    check(mres == CURLM_OK, ERR_EXTERN, LCURL, curl_multi_strerror(mres));
 
-    size_t i = 0;
-    int ret = 0;
-    do {
-        fp_hdr = 0, fp_body = 0;
-        filedata->byte_size = 0;
-        char path[0x100];
-        char url[0x1000];
-        const char  *resource   = resources[i],
-                    *filetype   = strrchr(resource, '.') + 1,
-                    *path_frmt  = strstr(filetype, "js") ? "../resources/js/%s"
-                                : strstr(filetype, "csv") ? "../resources/data/%s"
-                                : "%s.zip",
-                    *url_frmt   = query_strings[i] ? "%s://%s/%s%s?%s"
+    for (size_t i = 0; i < nitems; ++i) {
+        struct transfer *transfer = &transfers[i];
+        const char  *url_frmt   = query_strings[i] ? "%s://%s/%s%s?%s"
                                 : "%s://%s/%s%s";
-        check(snprintf(path, 0xFF, path_frmt, resource) != -1,
+        check(snprintf(transfer->url, 0xFFF, url_frmt, protocols[i], hosts[i], uris[i],
+                resources[i], query_strings[i] ? query_strings[i] : "") != -1,
                 ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+        check(transfer_init(transfer), ERR_FAIL, EMISS_ERR, "setting up transfer");
+    }
 
-        fp_body = fopen(path, "w");
-        check(fp_body, ERR_FAIL, EMISS_ERR, "opening file");
-        filedata->fp = fp_body;
+    size_t settled = 0;
+    while (settled < nitems) {
+        /*  Start pending transfers whose backoff has passed, up to the concurrency limit. */
+        long now = clock_monotonic_ms(),
+             wait_ms = 1000;
+        size_t running = 0;
+        for (size_t i = 0; i < nitems; ++i)
+            running += transfers[i].state == TRANSFER_RUNNING;
+        for (size_t i = 0; i < nitems && running < EMISS_FETCH_MAX_PARALLEL; ++i) {
+            struct transfer *transfer = &transfers[i];
+            if (transfer->state != TRANSFER_PENDING)
+                continue;
+            if (transfer->retry_at > now) {
+                if (transfer->retry_at - now < wait_ms)
+                    wait_ms = transfer->retry_at - now;
+                continue;
+            }
+            check(transfer_start(multi, transfer), ERR_FAIL, EMISS_ERR, "starting transfer");
+            ++running;
+        }
 
-        fp_hdr = fopen("header.log", "a");
-        check(fp_hdr, ERR_FAIL, EMISS_ERR, "opening file");
-        res = curl_easy_setopt(curl, CURLOPT_HEADERDATA, fp_hdr);
-        check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(curl_err, res));
+        int still_running = 0;
+        mres = curl_multi_perform(multi, &still_running);
+        check(mres == CURLM_OK, ERR_EXTERN, LCURL, curl_multi_strerror(mres));
 
-        check(snprintf(url, 0xFFF, url_frmt, protocols[i], hosts[i], uris[i],
-                resource, query_strings[i] ? query_strings[i] : "") != -1,
-                ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
-        res = curl_easy_setopt(curl, CURLOPT_URL, url);
-        check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(curl_err, res));
-
-        res = curl_easy_perform(curl);
-        check(res == CURLE_OK, ERR_EXTERN, LCURL, CURL_ERR_MSG(curl_err, res));
-        ++ret;
-        file_sizes[i] = filedata->byte_size;
-        fclose(fp_body);
-        fclose(fp_hdr);
-    } while (++i < nitems);
-    free(filedata);
-    curl_easy_cleanup(curl);
-    curl_global_cleanup();
-    return ret;
-error:
-    if (curl) {
-        curl_easy_cleanup(curl);
-        curl_global_cleanup();
+        CURLMsg *msg;
+        int msgs_left,
+            finished = 0;
+        while ((msg = curl_multi_info_read(multi, &msgs_left))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            char *private;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &private);
+            struct transfer *transfer = (struct transfer *)private;
+            transfer_finish(multi, transfer, msg->data.result);
+            ++finished;
+            if (transfer->state == TRANSFER_FAILED)
+                goto error;
+            if (transfer->state == TRANSFER_UNMODIFIED && transfer != transfers)
+                check(pipeline_slot_end(transfer->pipeline, transfer->slot, 1)
+                        && pipeline_slot_end(transfer->pipeline, transfer->meta_slot, 1),
+                    ERR_FAIL, EMISS_ERR, "skipping unmodified datasets");
+        }
+        /*  The country codes are needed to parse any other dataset: if they were not modified but
+            another source was, they are fetched again in full. */
+        for (size_t i = 1; i < nitems; ++i)
+            if (transfers[i].changed && transfers[0].state == TRANSFER_UNMODIFIED)
+                transfer_unconditional(&transfers[0]);
+        settled = 0;
+        for (size_t i = 0; i < nitems; ++i)
+            settled += transfers[i].state == TRANSFER_DONE
+                    || transfers[i].state == TRANSFER_UNMODIFIED;
+        /*  Wait for activity or the next retry, unless a slot was just freed. */
+        if (settled < nitems && !finished) {
+            mres = curl_multi_poll(multi, NULL, 0, (int) wait_ms, NULL);
+            check(mres == CURLM_OK, ERR_EXTERN, LCURL, curl_multi_strerror(mres));
+        }
     }
-    if (filedata) {
-        if (filedata->fp)
-            fclose(filedata->fp);
-        free(filedata);
+    if (transfers[0].state == TRANSFER_UNMODIFIED)
+        check(pipeline_slot_end(transfers[0].pipeline, transfers[0].slot, 1),
+            ERR_FAIL, EMISS_ERR, "skipping unmodified datasets");
+    ret = (int) settled;
+    goto cleanup;
+error:
+    ret = -1;
+cleanup:
+    for (size_t i = 0; i < nitems; ++i) {
+        if (transfers[i].state == TRANSFER_RUNNING)
+            curl_multi_remove_handle(multi, transfers[i].curl);
+        if (transfers[i].curl)
+            curl_easy_cleanup(transfers[i].curl);
+        curl_slist_free_all(transfers[i].headers);
+        free(transfers[i].held);
     }
-    if (fp_hdr)
-        fclose(fp_hdr);
-    return -1;
+    if (multi)
+        curl_multi_cleanup(multi);
+    return ret;
 }
 
 /*  PROTYPE IMPLEMENTATIONS */
 
 int
-emiss_retrieve_data(emiss_file_data_st *file_data_dest)
+emiss_retrieve_data(emiss_update_ctx_st *upd_ctx, emiss_source_validator_st *validators)
 {
-    memset(file_data_dest, 0, sizeof(emiss_file_data_st));
     /*  Protocol to use (http or https). */
     const char *protocols[] = {
         EMISS_COUNTRY_CODES_HOST_PROTOCOL,
@@ -217,49 +1185,108 @@ emiss_retrieve_data(emiss_file_data_st *file_data_dest)
         DATASET_1_NAME,
         DATASET_2_NAME
     };
-    uintmax_t *file_sizes = file_data_dest->file_sizes;
+    /*  The datasets in the order they are parsed in, and which of them each resource holds: the
+        country codes, then indicator data and country metadata from the first archive and
+        indicator data from the second. */
+    struct pipeline pipeline = {.upd_ctx = upd_ctx};
+    const size_t slots[]      = {0, 1, 3},
+                 meta_slots[] = {SLOT_NONE, 2, SLOT_NONE};
+    emiss_source_validator_st unconditional[EMISS_NINDICATORS];
+    struct transfer transfers[EMISS_NINDICATORS] = {{0}};
+    struct cache cache;
+    char cache_root[0x400];
+    int ret = 0;
+
+    check(emiss_resource_path(cache_root, sizeof(cache_root), EMISS_CACHE_ROOT),
+        ERR_FAIL, EMISS_ERR, "resolving the path of the dataset cache");
+    const char *offline = getenv(EMISS_OFFLINE_ENV);
+    if (offline && *offline)
+        return emiss_retrieve_from_cache(upd_ctx, strcmp(offline, "1") ? offline : cache_root);
+    /*  Serve a fresh cache as is, otherwise fetch the sources whose datasets are not all cached in
+        full. */
+    if (*cache_root && (!mkdir(cache_root, 0755) || errno == EEXIST)
+        && cache_load(&cache, cache_root) != -1)
+        pipeline.cache = &cache;
+    else
+        log_warn(ERR_FAIL_A, EMISS_ERR, "using the dataset cache at", cache_root);
+    if (pipeline.cache && cache_fresh(&cache, time(NULL), EMISS_CACHE_MAX_AGE))
+        return emiss_retrieve_from_cache(upd_ctx, cache_root);
+
+    for (size_t i = 0; i <= EMISS_NINDICATORS; ++i)
+        pipeline.slots[i].dataset_id = slot_datasets[i];
+    memset(unconditional, 0, sizeof(unconditional));
+    for (size_t i = 0; i < EMISS_NINDICATORS; ++i) {
+        if (validators && pipeline.cache
+            && (!cache_entry_present(&cache, slots[i])
+                || (meta_slots[i] != SLOT_NONE && !cache_entry_present(&cache, meta_slots[i]))))
+            memset(&validators[i], 0, sizeof(emiss_source_validator_st));
+        transfers[i].pipeline  = &pipeline;
+        transfers[i].slot      = slots[i];
+        transfers[i].meta_slot = meta_slots[i];
+        transfers[i].validator = validators ? &validators[i] : &unconditional[i];
+        util_sha256_init(&transfers[i].hash);
+        if (query_strings[i]) {
+            transfers[i].unzip = calloc(1, sizeof(struct unzip));
+            check(transfers[i].unzip, ERR_MEM, EMISS_ERR);
+        }
+    }
     /*  Retrieve remote data. */
-    int ret = fetch_from_remote(protocols,
-                    hosts, uris, query_strings,
-                    resources, file_sizes,
-                    EMISS_NINDICATORS);
+    ret = fetch_from_remote(protocols, hosts, uris, query_strings,
+                resources, transfers, EMISS_NINDICATORS);
     check(ret == EMISS_NINDICATORS, ERR_FAIL, EMISS_ERR,
         "fetching data from the server");
-
-    size_t  i = 1,
-            j = 1;
-    do {
-        const char  *pcre_error_msg,
-                    *exclusion_str = i == 1 ? "Metadata_Indicator" :
-                                    "Metadata_(Indicator|Country)";
-        int pcre_error_offset;
-        pcre *regex = pcre_compile(exclusion_str, 0, &pcre_error_msg, &pcre_error_offset, 0);
-        check(regex, ERR_EXTERN_AT, "PCRE", pcre_error_msg, pcre_error_offset);
-        char path[0x100];
-        snprintf(path, 0xFF, "%s.zip", resources[i]);
-        int filecount = decompress_to_disk(path, EMISS_DATA_ROOT, regex, &file_sizes[j]);
-        check(filecount != -1, ERR_FAIL, EMISS_ERR, "decompressing files");
-        j += filecount;
-        pcre_free(regex);
-    } while (++i < EMISS_NINDICATORS);
-
-    const char *paths[] = {
-        EMISS_DATA_ROOT"/"DATASET_0_NAME".csv",
-        EMISS_DATA_ROOT"/"DATASET_1_NAME".csv",
-        EMISS_DATA_ROOT"/"DATASET_META_NAME".csv",
-        EMISS_DATA_ROOT"/"DATASET_2_NAME".csv"
-    };
-    memcpy(file_data_dest->paths, paths, sizeof(paths));
-    memcpy(file_data_dest->dataset_ids, (int[]) {
-        DATASET_COUNTRY_CODES, DATASET_CO2E, DATASET_META, DATASET_POPT
-    }, (EMISS_NINDICATORS + 1) * sizeof(int));
-    return 1;
+    ret = 1;
+    goto cleanup;
 error:
-    return 0;
+    ret = 0;
+cleanup:
+    if (pipeline.cache) {
+        /*  Record the sources of the datasets that were fetched or found unmodified. */
+        time_t now = time(NULL);
+        for (size_t i = 0; i < EMISS_NINDICATORS; ++i) {
+            if (transfers[i].state != TRANSFER_DONE && transfers[i].state != TRANSFER_UNMODIFIED)
+                continue;
+            size_t entries[] = {slots[i], meta_slots[i]};
+            for (size_t j = 0; j < 2; ++j) {
+                if (entries[j] == SLOT_NONE || !*cache.entries[entries[j]].sha256)
+                    continue;
+                struct cache_entry *entry = &cache.entries[entries[j]];
+                snprintf(entry->url, sizeof(entry->url), "%s", transfers[i].url);
+                entry->validator = *transfers[i].validator;
+                entry->fetched   = now;
+            }
+        }
+        for (size_t i = 0; i <= EMISS_NINDICATORS; ++i)
+            cache_slot_discard(&pipeline, i);
+        if (!cache_save(&cache))
+            log_warn(ERR_FAIL_A, EMISS_ERR, "saving the manifest of", cache_root);
+    }
+    for (size_t i = 0; i < EMISS_NINDICATORS; ++i)
+        free(transfers[i].unzip);
+    for (size_t i = 0; i <= EMISS_NINDICATORS; ++i)
+        free(pipeline.slots[i].buf);
+    return ret;
 }
 
-void *
-emiss_retrieve_async_start()
+int
+emiss_retrieve_from_cache(emiss_update_ctx_st *upd_ctx, const char *dir)
 {
+    struct cache cache;
+    char path[0x400];
+    int manifest = cache_load(&cache, dir);
+    check(manifest != -1, ERR_FAIL_A, EMISS_ERR, "reading the manifest of", dir);
+    for (size_t i = 0; i <= EMISS_NINDICATORS; ++i) {
+        if (manifest)
+            check(cache_entry_present(&cache, i), ERR_FAIL_A, EMISS_ERR,
+                "finding cached dataset", slot_names[i]);
+        check(cache_path(path, sizeof(path), dir,
+                manifest ? cache.entries[i].sha256 : slot_names[i], ".csv"),
+            ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+        check(cache_replay_file(upd_ctx, slot_datasets[i], path,
+                manifest ? cache.entries[i].sha256 : NULL),
+            ERR_FAIL_A, EMISS_ERR, "parsing cached dataset", slot_names[i]);
+    }
+    return 1;
+error:
     return 0;
 }
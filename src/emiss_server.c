@@ -98,20 +98,58 @@ volatile sig_atomic_t terminate;
     else if (!ret)\
         log_warn("[emiss_server]: %s", "Connection was closed before trying to send response.");\
 
+#define UNAVAILABLE_MSG "The server is busy, please retry later."
+
+/*  The version of the Prometheus text format served at EMISS_URI_METRICS. */
+#define METRICS_MIME_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
 /*
 **  TYPES AND STRUCTURES
 */
 
+/*  The URI handlers, by the index their requests are counted and timed by in the metrics. */
+enum handler {
+    HANDLER_INDEX,
+    HANDLER_NEW,
+    HANDLER_PARAM_JS,
+    HANDLER_VERGE_JS,
+    HANDLER_SHOW,
+    HANDLER_CHART_JS,
+    HANDLER_API_SERIES,
+    HANDLER_CSS,
+    HANDLER_FONTS,
+    HANDLER_METRICS,
+    NHANDLERS
+};
+
+/*  A request handler and its data, called by metered_request_handler(). */
+struct metered_handler {
+    mg_request_handler              handler;
+    void                           *cbdata;
+    size_t                          index;
+};
+
 struct emiss_server_ctx {
     struct sigaction                sigactor;
     struct mg_context              *civet_ctx;
     struct mg_callbacks             civet_callbacks;
     struct mg_server_ports          civet_ports[32];
+    struct metered_handler          handler[NHANDLERS];
     emiss_template_st              *template_data;
     int8_t                          ports_count;
     char                           *sys_info;
 };
 
+/*
+**  STATIC VARIABLES
+*/
+
+static const char *handler_uris[NHANDLERS] = {
+    EMISS_URI_INDEX, EMISS_URI_NEW, EMISS_URI_PARAM_JS, EMISS_URI_VERGE_JS, EMISS_URI_SHOW,
+    EMISS_URI_CHART_JS, EMISS_URI_API_SERIES, EMISS_URI_CSS, EMISS_URI_FONTS,
+    EMISS_URI_METRICS
+};
+
 /*
 **  FUNCTIONS
 */
@@ -184,43 +222,118 @@ emiss_conn_printf_function(void *at,
 	return ret;
 }
 
-/*  Request handlers for CivetWeb. */
+/*  Output of a body as is, such as a rendered template or a precomputed and compressed one,
+    from its parts, the sum of which is the Content-Length. */
+static int
+emiss_conn_send_function(void *at,
+    const unsigned http_response_code,
+    const char *restrict mime_type,
+    const char *restrict content_encoding,
+    const struct iovec *iov,
+    const int iovcnt)
+{
+    struct mg_connection *conn = (struct mg_connection *)at;
+    uintmax_t byte_size = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        byte_size += iov[i].iov_len;
+    char extra_headers[0x80] = "";
+    if (content_encoding)
+        snprintf(extra_headers, sizeof(extra_headers),
+            "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n", content_encoding);
+    int ret = mg_printf(conn, HTTP_RESPONSE_HDR, http_response_code,
+                    mg_get_response_code_text(conn, http_response_code),
+                    (unsigned long) byte_size, mime_type, "close", TRANSFER_ENCODING_NONE,
+                    extra_headers);
+    if (ret < 1) {
+        EXPLAIN_SEND_FAILURE(ret);
+        return ret < 0 ? -1 : 418;
+    }
+    int written = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        if (!iov[i].iov_len)
+            continue;
+        ret = mg_write(conn, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 1)
+            return ret;
+        written += ret;
+    }
+    return written;
+}
 
+/*  Whether a content coding is listed in Accept-Encoding, without a q-value of 0. */
 static int
-css_request_handler(struct mg_connection *conn, void *cbdata)
+emiss_conn_accepts_function(void *at, const char *restrict content_encoding)
 {
-	const struct mg_request_info *req_info = mg_get_request_info(conn);
-    int ret = mg_strncasecmp(req_info->request_method, "GET", 3);
-    if (ret)
-        return inl_send_error_response(conn, 405);
+    const char *accepted = mg_get_header((struct mg_connection *)at, "Accept-Encoding");
+    size_t len = strlen(content_encoding);
+    while (accepted && *accepted) {
+        accepted += strspn(accepted, " \t,");
+        size_t token_len = strcspn(accepted, " \t;,");
+        if (token_len == len && !mg_strncasecmp(accepted, content_encoding, len)) {
+            const char *q = strstr(accepted, "q=");
+            const char *next = strchr(accepted, ',');
+            return !q || (next && q > next) || strtod(q + 2, 0) > 0;
+        }
+        accepted = strchr(accepted, ',');
+    }
+    return 0;
+}
 
-    mg_send_mime_file(conn, (const char *)cbdata, UTIL_IANA_MIME_TYPE(CSS));
-	return 200;
+/*  A 503 response to a request refused under load, with the seconds to retry after. */
+static int
+emiss_conn_unavailable_function(void *at, const unsigned retry_after)
+{
+    struct mg_connection *conn = (struct mg_connection *)at;
+    char extra_headers[0x40];
+    snprintf(extra_headers, sizeof(extra_headers), "Retry-After: %u\r\n", retry_after);
+    int ret = mg_printf(conn, HTTP_RESPONSE_HDR, 503,
+                    mg_get_response_code_text(conn, 503),
+                    (unsigned long) (sizeof(UNAVAILABLE_MSG) - 1), UTIL_IANA_MIME_TYPE(TXT),
+                    "close", TRANSFER_ENCODING_NONE, extra_headers);
+    if (ret < 1) {
+        EXPLAIN_SEND_FAILURE(ret);
+        return ret < 0 ? -1 : 418;
+    }
+    return mg_printf(conn, "%s", UNAVAILABLE_MSG);
 }
 
+/*  Request handlers for CivetWeb. */
+
+/*  Serve a file embedded at build time, by the path of the request, from memory: with its ETag,
+    a matching If-None-Match answered with a 304, and gzip'd to a client accepting it. */
 static int
-font_request_handler(struct mg_connection *conn, void *cbdata)
+asset_request_handler(struct mg_connection *conn, void *cbdata)
 {
-	const struct mg_request_info *req_info = mg_get_request_info(conn);
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
     int ret = mg_strncasecmp(req_info->request_method, "GET", 3);
     if (ret)
         return inl_send_error_response(conn, 405);
 
-    char filepath[0x100] = {0};
-    const char *req_font = strchr(strchr(req_info->local_uri, '/') + 1, '/');
-    if (!strstr(req_font, (char *)cbdata)) {
-    	inl_send_error_response(conn, 404);
-    	return 404;
+    (void) cbdata;
+    const emiss_asset_st *asset = emiss_resource_asset_get(req_info->local_uri + 1);
+    if (!asset)
+        return inl_send_error_response(conn, 404);
+    const char *if_none_match = mg_get_header(conn, "If-None-Match");
+    int not_modified = if_none_match && strstr(if_none_match, asset->etag),
+        gzip         = asset->gzip && emiss_conn_accepts_function(conn, "gzip");
+    const unsigned char *data = gzip ? asset->gzip : asset->data;
+    size_t size = not_modified ? 0 : gzip ? asset->gzip_size : asset->size;
+    unsigned code = not_modified ? 304 : 200;
+    char extra_headers[0x100];
+    snprintf(extra_headers, sizeof(extra_headers),
+        "ETag: %s\r\nCache-Control: public, max-age=" CIVET_STATICS_MAX_AGE "\r\n%s%s",
+        asset->etag, asset->gzip ? "Vary: Accept-Encoding\r\n" : "",
+        gzip && !not_modified ? "Content-Encoding: gzip\r\n" : "");
+    ret = mg_printf(conn, HTTP_RESPONSE_HDR, code, mg_get_response_code_text(conn, code),
+                (unsigned long) size, asset->mime_type, "close", TRANSFER_ENCODING_NONE,
+                extra_headers);
+    if (ret >= 1 && size)
+        ret = mg_write(conn, data, size);
+    if (ret < 1) {
+        EXPLAIN_SEND_FAILURE(ret);
+        return ret < 0 ? -1 : 418;
     }
-    const char *f_ext     = strrchr(req_font, '.') + 1;
-    const char *mime_type = f_ext[strlen(f_ext) - 1] == '2' ? UTIL_IANA_MIME_TYPE(WOFF2)
-                            : f_ext[0] == 'w' ? UTIL_IANA_MIME_TYPE(WOFF)
-                            : f_ext[0] == 't' ? UTIL_IANA_MIME_TYPE(TTF)
-                            : f_ext[0] == 's' ? UTIL_IANA_MIME_TYPE(SVG_PLUS_XML_FONT)
-                            : UTIL_IANA_MIME_TYPE(VND_MS_FONTOBJECT);
-    snprintf(filepath, 0xFF, "%s%s", EMISS_FONT_ROOT, req_font);
-	mg_send_mime_file(conn, filepath, mime_type);
-	return 200;
+    return code;
 }
 
 static int
@@ -239,20 +352,21 @@ static_resource_request_handler(struct mg_connection *conn, void *cbdata)
                             ? 2 : !mg_strncasecmp(requested, "/verge.min.js", 2)
                             ? 3 : !mg_strncasecmp(requested, EMISS_URI_ABOUT, 2)
                             ? 4 : 0;
-    const char *resource    = emiss_resource_static_get(rsrc_ctx, rsrc_idx);
+    /*  The resource is read from a single snapshot, in case it is replaced meanwhile. */
+    unsigned epoch;
+    emiss_resource_snapshot_st *snapshot = emiss_resource_snapshot_acquire(rsrc_ctx, &epoch);
+    const char *resource    = emiss_resource_static_get(snapshot, rsrc_idx);
     const char *mime_type   = resource[strlen(resource) - 1] == 's'
                             ? UTIL_IANA_MIME_TYPE(JAVASCRIPT)
                             : UTIL_IANA_MIME_TYPE(HTML);
     ret = mg_printf(conn, HTTP_RESPONSE_HDR,
                 200, UTIL_HTTP_RES_STATUS(HTTP_200_OK),
-                (uintmax_t) emiss_resource_static_size(rsrc_ctx, rsrc_idx),
+                (uintmax_t) emiss_resource_static_size(snapshot, rsrc_idx),
                 mime_type, "close", TRANSFER_ENCODING_NONE, "");
+    if (ret >= 1)
+        ret = mg_printf(conn, "%s", resource);
+    emiss_resource_snapshot_release(rsrc_ctx, epoch);
 
-    if (ret < 1) {
-        EXPLAIN_SEND_FAILURE(ret);
-        return ret < 0 ? -1 : 418;
-    }
-    ret = mg_printf(conn, "%s", resource);
     if (ret < 1) {
         EXPLAIN_SEND_FAILURE(ret);
         return ret < 0 ? -1 : 418;
@@ -286,6 +400,75 @@ template_resource_request_handler(struct mg_connection *conn, void *cbdata)
 	return inl_send_error_response(conn, 404);
 }
 
+/*  Serve the metrics of the process, summed from the counters of each thread at the time of the
+    request, so that handling other requests takes no lock. */
+static int
+metrics_request_handler(struct mg_connection *conn, void *cbdata)
+{
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    int ret = mg_strncasecmp(req_info->request_method, "GET", 3);
+    if (ret)
+        return inl_send_error_response(conn, 405);
+
+    struct emiss_server_ctx *server = (struct emiss_server_ctx *)cbdata;
+    bstring out = bfromcstralloc(0x4000, "");
+    if (!out || !emiss_metrics_format(out, handler_uris, NHANDLERS))
+        goto error;
+    const char *nthreads = mg_get_option(server->civet_ctx, "num_threads");
+    if (bformata(out,
+            "# HELP emiss_http_workers Worker threads of the server.\n"
+            "# TYPE emiss_http_workers gauge\n"
+            "emiss_http_workers %d\n", nthreads ? atoi(nthreads) : 0) != BSTR_OK)
+        goto error;
+    if (server->template_data) {
+        wlpq_stats_st stats;
+        emiss_resource_db_stats(server->template_data->rsrc_ctx, &stats);
+        if (!emiss_metrics_format_db(out, &stats))
+            goto error;
+    }
+    ret = mg_printf(conn, HTTP_RESPONSE_HDR,
+                200, UTIL_HTTP_RES_STATUS(HTTP_200_OK), (unsigned long) blength(out),
+                METRICS_MIME_TYPE, "close", TRANSFER_ENCODING_NONE, "Cache-Control: no-store\r\n");
+    if (ret >= 1)
+        ret = mg_write(conn, bdata(out), blength(out));
+    bdestroy(out);
+    if (ret < 1) {
+        EXPLAIN_SEND_FAILURE(ret);
+        return ret < 0 ? -1 : 418;
+    }
+    return 200;
+error:
+    log_err(ERR_FAIL, EMISS_ERR, "formatting metrics");
+    bdestroy(out);
+    return inl_send_error_response(conn, 500);
+}
+
+/*  Count and time the requests of a handler. */
+static int
+metered_request_handler(struct mg_connection *conn, void *cbdata)
+{
+    struct metered_handler *metered = (struct metered_handler *)cbdata;
+    struct timespec start, end;
+    emiss_metrics_request_begin();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = metered->handler(conn, metered->cbdata);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    int64_t usec = (int64_t) (end.tv_sec - start.tv_sec) * 1000000
+                 + (end.tv_nsec - start.tv_nsec) / 1000;
+    emiss_metrics_request_end(metered->index, ret, usec > 0 ? (uint64_t) usec : 0);
+    return ret;
+}
+
+/*  Set up the handler of a URI, counted and timed in the metrics by its index i. */
+static void
+metered_handler_set(struct emiss_server_ctx *server, size_t i,
+    mg_request_handler handler, void *cbdata)
+{
+    server->handler[i] = (struct metered_handler) {handler, cbdata, i};
+    mg_set_request_handler(server->civet_ctx, handler_uris[i],
+        metered_request_handler, &server->handler[i]);
+}
+
 static void
 dyno_signal_handler(int sig)
 {
@@ -338,28 +521,33 @@ emiss_server_ctx_init(emiss_template_st *template_data)
 
     /*  Associate a function to print output to client connection. */
     template_data->output_function = emiss_conn_printf_function;
+    template_data->send_function = emiss_conn_send_function;
+    template_data->accepts_function = emiss_conn_accepts_function;
+    template_data->unavailable_function = emiss_conn_unavailable_function;
     /*  Hook up template data. */
     server->template_data = template_data;
 
-    /*  Set up request handler callbacks for CivetWeb. */
-    mg_set_request_handler(civet_ctx, EMISS_URI_INDEX,
+    /*  Set up request handler callbacks for CivetWeb, each counted and timed in the metrics. */
+    metered_handler_set(server, HANDLER_INDEX,
             static_resource_request_handler, template_data->rsrc_ctx);
-    mg_set_request_handler(civet_ctx, EMISS_URI_NEW,
+    metered_handler_set(server, HANDLER_NEW,
             static_resource_request_handler, template_data->rsrc_ctx);
-	mg_set_request_handler(civet_ctx, EMISS_URI_PARAM_JS,
+    metered_handler_set(server, HANDLER_PARAM_JS,
             static_resource_request_handler, template_data->rsrc_ctx);
-    mg_set_request_handler(civet_ctx, EMISS_URI_VERGE_JS,
+    metered_handler_set(server, HANDLER_VERGE_JS,
             static_resource_request_handler, template_data->rsrc_ctx);
 
-    mg_set_request_handler(civet_ctx, EMISS_URI_SHOW,
+    metered_handler_set(server, HANDLER_SHOW,
             template_resource_request_handler, server->template_data);
-    mg_set_request_handler(civet_ctx, EMISS_URI_CHART_JS,
+    metered_handler_set(server, HANDLER_CHART_JS,
             template_resource_request_handler, server->template_data);
+    metered_handler_set(server, HANDLER_API_SERIES,
+            template_resource_request_handler, server->template_data);
+
+    metered_handler_set(server, HANDLER_CSS, asset_request_handler, 0);
+    metered_handler_set(server, HANDLER_FONTS, asset_request_handler, 0);
 
-    mg_set_request_handler(civet_ctx, EMISS_URI_STYLE_CSS,
-            css_request_handler, EMISS_RESOURCE_ROOT EMISS_URI_STYLE_CSS);
-    mg_set_request_handler(civet_ctx, EMISS_URI_FONTS,
-            font_request_handler, EMISS_VALID_FONT_NAMES);
+    metered_handler_set(server, HANDLER_METRICS, metrics_request_handler, server);
 
 #ifndef NDEBUG
     mg_set_request_handler(civet_ctx, EMISS_URI_EXIT, exit_request_handler, stdout);
@@ -12,6 +12,7 @@
 #include <math.h>
 #include <pthread.h>
 #include "uthash.h"
+#include "util_ccode.h"
 #include "util_sql.h"
 
 /*
@@ -20,37 +21,90 @@
 
 #define NCALLBACKS 10
 
+/*  Lines above the header row of a Worldbank data file, holding e.g. the "Last Updated Date". */
+#define WORLDBANK_LINESKIP 4
+
+/*  Size of the chunks in which emiss_update_parse_send() reads files. */
+#define READ_CHUNK_SIZE 0x10000
+
 #define DATA_COLUMN_NAME(dataset_id)\
     dataset_id == DATASET_CO2E ? "emission_kt" :\
     dataset_id == DATASET_POPT ? "population_total"\
     : ""
 
+/*  Number of years and of datasets (CO2E and POPT) tracked per country in table Datapoint. */
+#define DATAPOINT_NYEARS (1 + EMISS_YEAR_LAST - EMISS_YEAR_ZERO)
+#define DATAPOINT_NDATASETS 2
+
+/*  Whether a dataset id refers to a column of table Datapoint, and the index for it. */
+#define DATAPOINT_DATASET(dataset_id)\
+    (dataset_id == DATASET_CO2E || dataset_id == DATASET_POPT)
+#define DATAPOINT_IDX(dataset_id)\
+    (dataset_id - DATASET_CO2E)
+
+/*  Column of a year in the Worldbank data files, the first four holding country and indicator. */
+#define DATAPOINT_COLUMN(year)\
+    (4 + (year) - EMISS_DATA_STARTS_FROM)
+#define DATAPOINT_YEAR(column)\
+    (EMISS_DATA_STARTS_FROM + (int) (column) - 4)
+
+/*  The bit of a year in the bitmaps of a fingerprint. */
+#define DATAPOINT_BIT(y)\
+    ((uint64_t) 1 << (y))
+
+#if DATAPOINT_NYEARS > 64
+    #error "Datapoint fingerprints hold a bitmap of at most 64 years."
+#endif
+
 /*
 **  STRUCTURES AND TYPES
 */
 
-/*  A hash table structure to use with uthash.h hash macros.
-    For ISO country codes from country_codes.csv for later access when parsing
-    the Worldbank indicator data files. */
-typedef struct ht_country_code {
+/*  An entry of the ISO country codes from country_codes.csv, kept in an array indexed by code
+    for later access when parsing the Worldbank indicator data files. */
+typedef struct country_code {
     char                        iso3[4];
     char                        iso2[3];
     uint8_t                     is_independent;
     uint8_t                     in_tui_chart;
+} country_code_st;
+
+/*  Compact fingerprint of the values held in table Datapoint for a country, loaded at the start of
+    an update in place of the values themselves: per dataset, a bitmap of the years stored and an
+    order-independent hash of their values. A row parsed is fingerprinted the same way and sent to
+    the database only if it differs. */
+typedef struct ht_datapoint {
+    char                        iso3[4];
+    uint64_t                    stored[DATAPOINT_NDATASETS];
+    uint64_t                    hash[DATAPOINT_NDATASETS];
+    uint8_t                     in_file[DATAPOINT_NDATASETS];
     UT_hash_handle              hh;
-} ht_country_code_st;
+} ht_datapoint_st;
+
+/*  The values of the row being parsed, held until its end to be compared to the fingerprint. */
+typedef struct datapoint_row {
+    uint64_t                    seen;
+    uint64_t                    hash;
+    double                      value[DATAPOINT_NYEARS];
+} datapoint_row_st;
+
+/*  Counts of changes to table Datapoint, reported after each dataset. */
+enum datapoint_count {
+    DP_INSERTED, DP_RESENT, DP_DELETED, DP_UNCHANGED, DP_NCOUNTS
+};
 
 /*  Context structure type emiss_update_ctx_st definition, housing a csv parser wrapper,
-    database connection context pointer, callback data buffer, a hash table of
-    the type defined above (ht_country_code_st) with a count of its items, plus
-    an identifier for the current dataset. */
+    database connection context pointer, callback data buffer, an array of
+    the type defined above (country_code_st) with a count of its items and an
+    index into it by code, plus an identifier for the current dataset. */
 struct emiss_update_ctx {
     wlcsv_ctx_st               *lcsv_ctx;
     wlcsv_state_st             *lcsv_stt;
     char                       *cbdata;
     size_t                      cbdata_max_size;
-    ht_country_code_st         *ccodes;
+    country_code_st            *ccodes;
     int                         ccount;
+    util_ccode_index_st         ccode_index;
     wlpq_conn_ctx_st           *conn_ctx;
     uint8_t                     callback_ids[NCALLBACKS];
     uint8_t                     conn_ctx_free_after_use;
@@ -58,6 +112,19 @@ struct emiss_update_ctx {
     uint8_t                     countries_updated;
     char                      (*tui_chart_worldmap_data)[3];
     int                         tui_chart_worldmap_ccount;
+    ht_datapoint_st            *datapoints;
+    datapoint_row_st            datapoint_row;
+    uint8_t                     datapoints_loaded;
+    size_t                      datapoint_rows;
+    size_t                      datapoint_count[DP_NCOUNTS];
+    time_t                      last_update;
+    uint8_t                     worldbank_ready;
+    uint8_t                     dataset_skip;
+    uint8_t                     dataset_head;
+    char                       *head;
+    size_t                      head_len;
+    size_t                      parsed_total;
+    uint8_t                     failed;
 };
 
 /*
@@ -66,23 +133,241 @@ struct emiss_update_ctx {
 
 /*  STATIC */
 
+/*  The entry of a country code, or NULL if there is none. */
+static inline country_code_st *
+ccode_find(emiss_update_ctx_st *upd_ctx, const char *iso3)
+{
+    int i = util_ccode_index_get(&upd_ctx->ccode_index, iso3, 3);
+    return i < 0 ? NULL : &upd_ctx->ccodes[i];
+}
+
+static int
+enqueue_query(emiss_update_ctx_st *upd_ctx, char *sql)
+{
+    wlpq_query_data_st *query_data = wlpq_query_init(sql, 0, 0, 0, 0, 0, 0);
+    check(query_data, ERR_FAIL, EMISS_ERR, "creating query data struct");
+    check(wlpq_query_queue_enqueue(upd_ctx->conn_ctx, query_data),
+            ERR_FAIL, EMISS_ERR, "appending to db job queue");
+    return 1;
+error:
+    return 0;
+}
+
+static ht_datapoint_st *
+datapoint_get(emiss_update_ctx_st *upd_ctx, const char *iso3)
+{
+    ht_datapoint_st *dp;
+    HASH_FIND(hh, upd_ctx->datapoints, iso3, 3, dp);
+    if (!dp) {
+        dp = calloc(1, sizeof(ht_datapoint_st));
+        check(dp, ERR_MEM, EMISS_ERR);
+        memcpy(dp->iso3, iso3, 3);
+        HASH_ADD(hh, upd_ctx->datapoints, iso3, 3, dp);
+    }
+    return dp;
+error:
+    return NULL;
+}
+
+/*  A hash of a value of year index y. The hashes of a row are summed, in whatever order. */
+static inline uint64_t
+datapoint_hash(int y, double value)
+{
+    uint64_t h;
+    if (value == 0)
+        value = 0;
+    memcpy(&h, &value, sizeof(h));
+    h ^= (uint64_t) (y + 1) * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+static void
+res_datapoints_load(PGresult *res, void *arg)
+{
+    emiss_update_ctx_st *upd_ctx = (emiss_update_ctx_st *)arg;
+    int ntuples = PQntuples(res);
+    for (int i = 0; i < ntuples; ++i) {
+        const char *iso3 = PQgetvalue(res, i, 0);
+        int y = atoi(PQgetvalue(res, i, 1)) - EMISS_YEAR_ZERO;
+        if (strlen(iso3) != 3 || y < 0 || y >= DATAPOINT_NYEARS)
+            continue;
+        ht_datapoint_st *dp = datapoint_get(upd_ctx, iso3);
+        if (!dp)
+            return;
+        for (int d = 0; d < DATAPOINT_NDATASETS; ++d)
+            if (!PQgetisnull(res, i, 2 + d) && !(dp->stored[d] & DATAPOINT_BIT(y))) {
+                dp->stored[d] |= DATAPOINT_BIT(y);
+                dp->hash[d] += datapoint_hash(y, strtod(PQgetvalue(res, i, 2 + d), NULL));
+            }
+    }
+    upd_ctx->datapoints_loaded = 1;
+}
+
+/*  Load the fingerprints of the last ingest. On failure every row parsed is sent, as before. */
+static void
+datapoints_load(emiss_update_ctx_st *upd_ctx)
+{
+    /*  Print doubles exactly, so that unchanged values hash equal to the parsed ones. */
+    char *cmd = "SET extra_float_digits = 3; "
+                "SELECT country_code, yeardata_year, emission_kt, population_total "
+                "FROM Datapoint;";
+    if (wlpq_query_run_blocking(upd_ctx->conn_ctx, cmd, 0, 0, 0,
+            res_datapoints_load, upd_ctx) != 1 || !upd_ctx->datapoints_loaded) {
+        log_warn(ERR_FAIL, EMISS_ERR, "loading datapoints, sending all values");
+        upd_ctx->datapoints_loaded = 0;
+    }
+}
+
+/*  Hold a parsed value of the current row until the end of it. */
+static void
+datapoint_track(emiss_update_ctx_st *upd_ctx, int year, double value)
+{
+    datapoint_row_st *row = &upd_ctx->datapoint_row;
+    int y = year - EMISS_YEAR_ZERO;
+    if (row->seen & DATAPOINT_BIT(y))
+        return;
+    row->seen    |= DATAPOINT_BIT(y);
+    row->hash    += datapoint_hash(y, value);
+    row->value[y] = value;
+}
+
+/*  Print a value with the fewest digits that read back as the same double. */
 static inline int
-binary_search_str_arr(int count, size_t el_size, char (*data)[el_size], char *key)
-{
-    int l = 0,
-        r = count - 1;
-    size_t len = el_size - 1;
-    while (l <= r) {
-        int m = (int) floor((l + r) / 2);
-        int diff = strncmp(data[m], key, len);
-        if (diff < 0)
-            l = m + 1;
-        else if (diff > 0)
-            r = m - 1;
-        else
-            return m;
+datapoint_format(char *buf, size_t size, double value)
+{
+    int ret = snprintf(buf, size, "%.15g", value);
+    if (ret >= 0 && strtod(buf, NULL) != value)
+        ret = snprintf(buf, size, "%.17g", value);
+    return ret;
+}
+
+/*  Upsert the values of the current row, in one statement. */
+static int
+datapoint_row_send(emiss_update_ctx_st *upd_ctx, const char *iso3)
+{
+    const datapoint_row_st *row = &upd_ctx->datapoint_row;
+    const char *column = DATA_COLUMN_NAME(upd_ctx->dataset_id);
+    char buf[0x1000], out[0x1000], insert_sql[0xC00];
+    int len = snprintf(insert_sql, sizeof(insert_sql),
+        "INSERT INTO Datapoint (country_code, yeardata_year, %s) VALUES ", column);
+    for (int y = 0; y < DATAPOINT_NYEARS; ++y) {
+        if (!(row->seen & DATAPOINT_BIT(y)))
+            continue;
+        char str[32];
+        check(datapoint_format(str, sizeof(str), row->value[y]) > 0,
+            ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+        len += snprintf(&insert_sql[len], sizeof(insert_sql) - len, "%s('%s', %d, %s)",
+            row->seen & (DATAPOINT_BIT(y) - 1) ? ", " : "", iso3, EMISS_YEAR_ZERO + y, str);
+        check(len < (int) sizeof(insert_sql), ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
     }
-    return -1;
+    /*  arbiter: a conflict fires an update instead of insert
+        if a datapoint for this country and year already exists. */
+    check(SQL_UPSERT(buf, 0xFFF, out, 0xFFF, insert_sql, "country_code, yeardata_year",
+        "%s=EXCLUDED.%s", column, column) >= 0, ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+    return enqueue_query(upd_ctx, out);
+error:
+    return 0;
+}
+
+/*  Null the values stored for the years in a bitmap of a country, in one statement. */
+static int
+datapoint_delete(emiss_update_ctx_st *upd_ctx, const char *iso3, uint64_t years)
+{
+    char buf[0x200], out[0x200], in[DATAPOINT_NYEARS * 6 + 1] = {0};
+    for (int y = 0, len = 0; y < DATAPOINT_NYEARS; ++y)
+        if (years & DATAPOINT_BIT(y))
+            len += sprintf(&in[len], "%s%d", len ? ", " : "", EMISS_YEAR_ZERO + y);
+    check(SQL_UPDATE_WHERE(buf, 0x1FF, out, 0x1FF, "Datapoint", "%s=NULL",
+        "country_code='%s' AND yeardata_year IN (%s)",
+        DATA_COLUMN_NAME(upd_ctx->dataset_id), iso3, in) >= 0,
+        ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+    return enqueue_query(upd_ctx, out);
+error:
+    return 0;
+}
+
+static inline size_t
+datapoint_popcount(uint64_t bits)
+{
+    return (size_t) __builtin_popcountll(bits);
+}
+
+/*  At the end of a row, compare its fingerprint to the stored one: if they differ, upsert the
+    values of the row and null those stored but no longer present in the file. Empty fields are
+    ignored by the parser, so absence is the only sign of a deleted value. */
+static int
+datapoints_row_end(emiss_update_ctx_st *upd_ctx)
+{
+    datapoint_row_st *row = &upd_ctx->datapoint_row;
+    size_t *count = upd_ctx->datapoint_count;
+    const char *iso3 = upd_ctx->cbdata;
+    if (strlen(iso3) != 3)
+        goto done;
+    upd_ctx->datapoint_rows++;
+    uint64_t stored = 0, hash = 0;
+    int d = DATAPOINT_IDX(upd_ctx->dataset_id);
+    ht_datapoint_st *dp = NULL;
+    if (upd_ctx->datapoints_loaded) {
+        dp = datapoint_get(upd_ctx, iso3);
+        check(dp, ERR_FAIL, EMISS_ERR, "tracking datapoints");
+        dp->in_file[d] = 1;
+        stored = dp->stored[d];
+        hash   = dp->hash[d];
+        if (stored == row->seen && hash == row->hash) {
+            count[DP_UNCHANGED] += datapoint_popcount(row->seen);
+            goto done;
+        }
+        dp->stored[d] = row->seen;
+        dp->hash[d]   = row->hash;
+    }
+    if (row->seen) {
+        check(datapoint_row_send(upd_ctx, iso3), ERR_FAIL, EMISS_ERR, "sending datapoints");
+        count[DP_INSERTED] += datapoint_popcount(row->seen & ~stored);
+        count[DP_RESENT]   += datapoint_popcount(row->seen & stored);
+    }
+    if (stored & ~row->seen) {
+        check(datapoint_delete(upd_ctx, iso3, stored & ~row->seen),
+            ERR_FAIL, EMISS_ERR, "deleting datapoints");
+        count[DP_DELETED] += datapoint_popcount(stored & ~row->seen);
+    }
+done:
+    row->seen = 0;
+    row->hash = 0;
+    return 1;
+error:
+    row->seen = 0;
+    row->hash = 0;
+    return 0;
+}
+
+/*  At the end of a dataset, delete the values of countries no longer present in the file, then
+    report the changes made. */
+static int
+datapoints_file_end(emiss_update_ctx_st *upd_ctx)
+{
+    size_t *count = upd_ctx->datapoint_count;
+    int d = DATAPOINT_IDX(upd_ctx->dataset_id);
+    ht_datapoint_st *dp, *tmp;
+    HASH_ITER(hh, upd_ctx->datapoints, dp, tmp) {
+        if (!dp->in_file[d] && upd_ctx->datapoint_rows && dp->stored[d]) {
+            check(datapoint_delete(upd_ctx, dp->iso3, dp->stored[d]),
+                ERR_FAIL, EMISS_ERR, "deleting datapoints");
+            count[DP_DELETED] += datapoint_popcount(dp->stored[d]);
+            dp->stored[d] = 0;
+            dp->hash[d]   = 0;
+        }
+        dp->in_file[d] = 0;
+    }
+    fprintf(stdout, "Datapoint %s: %zu inserted, %zu resent in changed rows, %zu deleted, "
+        "%zu unchanged.\n", DATA_COLUMN_NAME(upd_ctx->dataset_id), count[DP_INSERTED],
+        count[DP_RESENT], count[DP_DELETED], count[DP_UNCHANGED]);
+    memset(count, 0, sizeof(upd_ctx->datapoint_count));
+    upd_ctx->datapoint_rows = 0;
+    return 1;
+error:
+    return 0;
 }
 
 static void
@@ -90,11 +375,9 @@ cb_codes_independency_status(void *field, size_t len, void* data)
 {
     emiss_update_ctx_st *upd_ctx = (emiss_update_ctx_st *)data;
     const char *str = (const char *)field;
-    char *iso3 = upd_ctx->cbdata;
-    ht_country_code_st *entry;
-    HASH_FIND(hh, upd_ctx->ccodes, iso3, len, entry);
+    country_code_st *entry = ccode_find(upd_ctx, upd_ctx->cbdata);
     if (entry)
-        entry->is_independent = !strncmp(str, "Yes", 3) ? 1 : 0;
+        entry->is_independent = len == 3 && !strncmp(str, "Yes", 3) ? 1 : 0;
 }
 
 static void
@@ -104,9 +387,7 @@ cb_codes_iso_a2(void *field, size_t len, void *data)
         return;
     emiss_update_ctx_st *upd_ctx = (emiss_update_ctx_st *)data;
     const char *str              = (const char *)field;
-    char *iso3                   = upd_ctx->cbdata;
-    ht_country_code_st *entry;
-    HASH_FIND(hh, upd_ctx->ccodes, iso3, 3, entry);
+    country_code_st *entry       = ccode_find(upd_ctx, upd_ctx->cbdata);
     if (entry) {
         memcpy(entry->iso2, str, len);
         memset(upd_ctx->cbdata, 0, 3);
@@ -124,14 +405,13 @@ cb_codes_iso_a3(void *field, size_t len, void *data)
         return;
     emiss_update_ctx_st *upd_ctx = (emiss_update_ctx_st *)data;
     const char *str = (const char *)field;
-    ht_country_code_st *entry = calloc(1, sizeof(struct ht_country_code));
-    check(entry, ERR_MEM, EMISS_ERR);
-    memcpy(entry->iso3, str, len);
-    HASH_ADD(hh, upd_ctx->ccodes, iso3, len, entry);
+    memset(upd_ctx->cbdata, 0, 3);
+    if (upd_ctx->ccount == NCOUNTRY_DATA_SLOTS || len != 3
+        || !util_ccode_index_set(&upd_ctx->ccode_index, str, len, (uint16_t) upd_ctx->ccount))
+        return;
+    memset(&upd_ctx->ccodes[upd_ctx->ccount], 0, sizeof(country_code_st));
+    memcpy(upd_ctx->ccodes[upd_ctx->ccount++].iso3, str, len);
     memcpy(upd_ctx->cbdata, str, len);
-    return;
-error:
-    exit(0);
 }
 
 static void
@@ -179,8 +459,7 @@ cb_country(void *field, size_t len, void *data)
             if (current_col == 1 && tmp_len) {
                 const char *cols, *vals;
                 char insert_sql[0x1000];
-                ht_country_code_st *ccode_entry;
-                HASH_FIND(hh, upd_ctx->ccodes, str, 3, ccode_entry);
+                country_code_st *ccode_entry = ccode_find(upd_ctx, str);
                 if (ccode_entry) {
                     cols = "code_iso_a3, code_iso_a2, name, is_independent, in_tui_chart";
                     vals = "'%s', '%s', $$%s$$, %s, %s";
@@ -236,8 +515,7 @@ cb_country(void *field, size_t len, void *data)
     }
     return;
 error:
-// ADD CLEANUP ROUTINES
-    exit(0);
+    upd_ctx->failed = 1;
 }
 
 static void
@@ -252,11 +530,9 @@ cb_data(void *field, size_t len, void *data)
          *tmp = upd_ctx->cbdata;
 
     unsigned current_col = WLCSV_STATE_MEMB_GET(upd_ctx->lcsv_stt, col);
-    uint8_t dataset_id = upd_ctx->dataset_id;
-	int year = EMISS_DATA_STARTS_FROM + (current_col - 4);
 	wlpq_query_data_st *query_data;
 	const char *set;
-    if (dataset_id == DATASET_META) {
+    if (upd_ctx->dataset_id == DATASET_META) {
 		if (current_col > 3)
 			return;
         const char *where;
@@ -282,27 +558,6 @@ cb_data(void *field, size_t len, void *data)
         } else
             return;
 		query_data = wlpq_query_init(out, 0, 0, 0, 0, 0, 0);
-    } else if (year >= EMISS_YEAR_ZERO && year <= EMISS_YEAR_LAST) {
-        const char *table   = "Datapoint",
-                   *cols    = "country_code, yeardata_year, %s",
-                   *vals    = "'%s', %d, %s",
-                   *arbiter = "country_code, yeardata_year",
-                   *set     = "%s=%s";
-        /*  arbiter: a conflict fires an update instead of insert
-            if a datapoint for this country and year already exists. */
-        char insert_sql[0x100];
-        check(SQL_INSERT_INTO(buf, 0x1FFF, insert_sql, 0xFF,
-            table, cols, vals, DATA_COLUMN_NAME(dataset_id),
-            tmp, year, str) >= 0, ERR_FAIL, EMISS_ERR,
-            "printf'ing to buffer");
-        /*  Remove end-of-query semicolon. */
-        insert_sql[strlen(insert_sql) - 1] = '\0';
-        memset(buf, 0, sizeof(buf));
-        check(SQL_UPSERT(buf, 0x1FFF, out, 0x1FFF, insert_sql,
-            arbiter, set, DATA_COLUMN_NAME(dataset_id), str) >= 0,
-            ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
-		query_data = wlpq_query_init(out, 0, 0, 0, 0, 0, 0);
-
     } else
 		return;
 
@@ -312,22 +567,36 @@ cb_data(void *field, size_t len, void *data)
     return;
 
 error:
-    exit(0);
+    upd_ctx->failed = 1;
 }
 
 static void
-cb_year(void *field, size_t len, void *data)
+cb_datapoint(const wlcsv_value_st *value, void *data)
 {
     emiss_update_ctx_st *upd_ctx = (emiss_update_ctx_st *)data;
-    const char *str = (const char *)field;
-    if (upd_ctx->dataset_id == DATASET_POPT) {
-        printf("%s\n", str);
+    uint8_t dataset_id = upd_ctx->dataset_id;
+    if (!DATAPOINT_DATASET(dataset_id) || WLCSV_STATE_MEMB_GET(upd_ctx->lcsv_stt, row) < 1
+            || value->status == WLCSV_VALUE_EMPTY)
+        return;
+    int year = DATAPOINT_YEAR(WLCSV_STATE_MEMB_GET(upd_ctx->lcsv_stt, col));
+    if (value->status == WLCSV_VALUE_MALFORMED || !isfinite(value->f64)) {
+        log_warn(ERR_FAIL_A, EMISS_ERR, "parsing a datapoint value of", upd_ctx->cbdata);
+        return;
     }
-    int year = atoi(str);
+    datapoint_track(upd_ctx, year, value->f64);
+}
+
+static void
+cb_year(const wlcsv_value_st *value, void *data)
+{
+    emiss_update_ctx_st *upd_ctx = (emiss_update_ctx_st *)data;
+    if (value->status != WLCSV_VALUE_OK)
+        return;
+    int64_t year = value->i64;
     if (upd_ctx->dataset_id == 1 && (year >= EMISS_YEAR_ZERO && year <= EMISS_YEAR_LAST)) {
         char buf[0x100], insert_sql[0x100];
-        check(SQL_INSERT_INTO(buf, 0xFF, insert_sql, 0xFF, "YearData", "year", "%s", str) >= 0,
-                ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
+        check(SQL_INSERT_INTO(buf, 0xFF, insert_sql, 0xFF, "YearData", "year", "%d",
+                (int) year) >= 0, ERR_FAIL, EMISS_ERR, "printf'ing to buffer");
         insert_sql[strlen(insert_sql) - 1] = '\0';
         memset(buf, 0, sizeof(buf));
         check(SQL_INSERT_IF_NCONFLICT(buf, 0xFF, insert_sql, "year") >= 0,
@@ -338,29 +607,15 @@ cb_year(void *field, size_t len, void *data)
     }
     return;
 error:
-    exit(0);
-}
-
-static void
-cb_preview(void *field, size_t len, void *data)
-{
-    if (len) {
-        emiss_update_ctx_st *upd_ctx = (emiss_update_ctx_st *)data;
-        char *str = (char *)field;
-        char *tmp = upd_ctx->cbdata;
-        if (strstr(str, "Last Updated"))
-            memcpy(tmp, str, strlen(str));
-        else if (tmp && strstr(tmp, "Last Updated")) {
-            memset(tmp, 0, strlen(tmp));
-            memcpy(tmp, str, strlen(str));
-        }
-    }
+    upd_ctx->failed = 1;
 }
 
 static void
 eor_flush_cbdata_buffer(void *data)
 {
     emiss_update_ctx_st *upd_ctx = (emiss_update_ctx_st *)data;
+    if (DATAPOINT_DATASET(upd_ctx->dataset_id) && !datapoints_row_end(upd_ctx))
+        upd_ctx->failed = 1;
     memset(upd_ctx->cbdata, 0, strlen(upd_ctx->cbdata));
 }
 
@@ -400,6 +655,87 @@ error:
     return -1;
 }
 
+/*  The date following the "Last Updated Date" label in the lines above the header row of a
+    Worldbank data file, or 0 if there is none. */
+static time_t
+head_last_updated(const char *head)
+{
+    const char *label = "Last Updated Date",
+               *date  = strstr(head, label);
+    if (!date)
+        return 0;
+    date += strlen(label);
+    date += strcspn(date, "0123456789\n");
+    char date_str[11] = {0};
+    size_t len = strspn(date, "0123456789-");
+    memcpy(date_str, date, len < 10 ? len : 10);
+    return len ? parse_last_updated_date(date_str) : 0;
+}
+
+/*  Buffer the first lines of a Worldbank data file until its "Last Updated Date" can be read, and
+    either skip the dataset if it is no newer than the last update or start parsing it. Returns 1
+    while buffering or once decided, -1 on error. */
+static int
+head_check(emiss_update_ctx_st *upd_ctx, const void *data, size_t len, int final)
+{
+    char *head = realloc(upd_ctx->head, upd_ctx->head_len + len + 1);
+    check(head, ERR_MEM, EMISS_ERR);
+    memcpy(&head[upd_ctx->head_len], data, len);
+    upd_ctx->head = head;
+    upd_ctx->head_len += len;
+    head[upd_ctx->head_len] = '\0';
+
+    unsigned lines = 0;
+    for (const char *lf = head; lines < WORLDBANK_LINESKIP && (lf = strchr(lf, '\n')); ++lf)
+        ++lines;
+    if (lines < WORLDBANK_LINESKIP && !final)
+        return 1;
+    time_t updated = head_last_updated(head);
+    upd_ctx->dataset_head = 0;
+    if (updated > 0 && updated <= upd_ctx->last_update)
+        upd_ctx->dataset_skip = 1;
+    else {
+        check(wlcsv_push_begin(upd_ctx->lcsv_ctx) == 1, ERR_EXTERN, WLCSV, "beginning to parse");
+        check(wlcsv_push(upd_ctx->lcsv_ctx, head, upd_ctx->head_len) == 1,
+            ERR_EXTERN, WLCSV, "parsing csv data");
+    }
+    free(upd_ctx->head);
+    upd_ctx->head = NULL;
+    upd_ctx->head_len = 0;
+    return 1;
+error:
+    return -1;
+}
+
+/*  Set up the callbacks and settings common to the Worldbank files, once the country codes are
+    known. */
+static int
+worldbank_setup(emiss_update_ctx_st *upd_ctx)
+{
+    wlcsv_ctx_st *wlcsv_ctx = upd_ctx->lcsv_ctx;
+    uint8_t *callback_ids   = upd_ctx->callback_ids;
+    wlcsv_callbacks_clear_all(wlcsv_ctx);
+    memset(callback_ids, 0, NCALLBACKS);
+
+    wlcsv_state_lineskip_set(upd_ctx->lcsv_stt, WORLDBANK_LINESKIP);
+    check(wlcsv_ignore_regex_set(wlcsv_ctx, EMISS_IGNORE_REGEX) == 1,
+        ERR_EXTERN, WLCSV, "setting ignore regex");
+    callback_ids[0] = wlcsv_callbacks_typed_set(wlcsv_ctx,
+                            ROW, WLCSV_MATCH_NUM(0U), WLCSV_INT64,
+                            cb_year, upd_ctx, 0);
+    /*  Values are parsed by wlcsv, the columns of years out of range have no callback. */
+    for (int year = EMISS_YEAR_ZERO; year <= EMISS_YEAR_LAST; ++year)
+        check(wlcsv_callbacks_typed_set(wlcsv_ctx, COLUMN,
+                WLCSV_MATCH_NUM((unsigned) DATAPOINT_COLUMN(year)), WLCSV_DOUBLE,
+                cb_datapoint, upd_ctx, 0) != UINT8_MAX,
+            ERR_EXTERN, WLCSV, "setting datapoint callback");
+    datapoints_load(upd_ctx);
+    upd_ctx->worldbank_ready = 1;
+    return 1;
+error:
+    return 0;
+}
+
 static int
 read_tui_chart_worldmap_data(emiss_update_ctx_st *upd_ctx, const char *data_path)
 {
@@ -435,17 +771,19 @@ emiss_update_ctx_free(emiss_update_ctx_st *upd_ctx)
         wlcsv_free(upd_ctx->lcsv_ctx);
 		if (upd_ctx->conn_ctx_free_after_use && upd_ctx->conn_ctx)
 			wlpq_conn_ctx_free(upd_ctx->conn_ctx);
-        if (upd_ctx->ccodes) {
-            ht_country_code_st *current, *tmp;
-            HASH_ITER(hh, upd_ctx->ccodes, current, tmp) {
-                HASH_DELETE(hh, upd_ctx->ccodes, current);
-                free(current);
-            }
-        }
+        if (upd_ctx->ccodes)
+            free(upd_ctx->ccodes);
         if (upd_ctx->cbdata)
             free(upd_ctx->cbdata);
         if (upd_ctx->tui_chart_worldmap_data)
             free(upd_ctx->tui_chart_worldmap_data);
+        if (upd_ctx->datapoints) {
+            ht_datapoint_st *current, *tmp;
+            HASH_ITER(hh, upd_ctx->datapoints, current, tmp) {
+                HASH_DELETE(hh, upd_ctx->datapoints, current);
+                free(current);
+            }
+        }
 		free(upd_ctx);
     }
 }
@@ -463,10 +801,13 @@ emiss_update_ctx_init(wlpq_conn_ctx_st *conn_ctx, const char *tui_chart_data)
     check(read_tui_chart_worldmap_data(upd_ctx, tui_chart_data),
             ERR_FAIL, EMISS_ERR, "reading tui.chart worldmap data from file");
 
-    upd_ctx->lcsv_ctx = wlcsv_init(0, 0, upd_ctx, 1, 0, 3, 4, 0, WLCSV_IGNORE_EMPTY_FIELDS);
+    upd_ctx->lcsv_ctx = wlcsv_init(0, 0, upd_ctx, 1, 0, 3, 4 + DATAPOINT_NYEARS, 0,
+                            WLCSV_IGNORE_EMPTY_FIELDS | WLCSV_TOKENIZER_SIMD);
     check(upd_ctx->conn_ctx, ERR_FAIL, EMISS_ERR, "initializing libcsv wrapper structure");
     upd_ctx->lcsv_stt = wlcsv_state_get(upd_ctx->lcsv_ctx);
-    upd_ctx->ccodes   = 0;
+    upd_ctx->ccodes   = calloc(NCOUNTRY_DATA_SLOTS, sizeof(country_code_st));
+    check(upd_ctx->ccodes, ERR_MEM, EMISS_ERR);
+    util_ccode_index_init(&upd_ctx->ccode_index);
 
     return upd_ctx;
 error:
@@ -475,92 +816,158 @@ error:
     return 0;
 }
 
-size_t
-emiss_update_parse_send(emiss_update_ctx_st *upd_ctx,
-    char **paths, uintmax_t *file_sizes, size_t npaths,
-    int *dataset_ids, time_t current_version)
+int
+emiss_update_begin(emiss_update_ctx_st *upd_ctx, time_t last_update)
 {
-    printf("%p\n", (void *) upd_ctx->lcsv_ctx);
-    for (size_t i = 0; i < npaths; i++) {
-        printf("%s\n", paths[i]);
-        printf("%d\n", dataset_ids[i]);
-    }
     if (!wlpq_threads_active(upd_ctx->conn_ctx))
         wlpq_threads_launch_async(upd_ctx->conn_ctx);
     upd_ctx->cbdata_max_size = 0x666;
     upd_ctx->cbdata   = calloc(0x666, sizeof(char));
     check(upd_ctx->cbdata, ERR_MEM, EMISS_ERR);
+    upd_ctx->last_update  = last_update;
+    upd_ctx->parsed_total = 0;
+    upd_ctx->failed       = 0;
+    emiss_metrics_gauge_set(EMISS_GAUGE_INGEST_RUNNING, 1);
+    return 1;
+error:
+    return 0;
+}
 
-    const uintmax_t default_sz  = 0x100000;
-    wlcsv_ctx_st *wlcsv_ctx     = upd_ctx->lcsv_ctx;
-    wlcsv_state_st *wlcsv_stt   = upd_ctx->lcsv_stt;
-    uint8_t *callback_ids       = upd_ctx->callback_ids;
-    callback_ids[0]             = wlcsv_callbacks_set(wlcsv_ctx,
+int
+emiss_update_dataset_begin(emiss_update_ctx_st *upd_ctx, int dataset_id)
+{
+    wlcsv_ctx_st *wlcsv_ctx = upd_ctx->lcsv_ctx;
+    upd_ctx->dataset_id   = dataset_id;
+    upd_ctx->dataset_skip = 0;
+    emiss_metrics_gauge_set(EMISS_GAUGE_INGEST_DATASET, dataset_id);
+    if (dataset_id == DATASET_COUNTRY_CODES) {
+        upd_ctx->ccount = 0;
+        util_ccode_index_init(&upd_ctx->ccode_index);
+        upd_ctx->callback_ids[0] = wlcsv_callbacks_set(wlcsv_ctx,
                                         ROW, WLCSV_MATCH_NUM(0U),
                                         cb_codes_data_header, upd_ctx, 0);
+        check(wlcsv_push_begin(wlcsv_ctx) == 1, ERR_EXTERN, WLCSV, "beginning to parse");
+        return 1;
+    }
+    if (!upd_ctx->worldbank_ready)
+        check(worldbank_setup(upd_ctx), ERR_FAIL, EMISS_ERR, "setting up for Worldbank data");
+    wlcsv_callbacks_eor_set(wlcsv_ctx, eor_wait_until_queries_done);
+    wlcsv_callbacks_default_set(wlcsv_ctx, cb_data, upd_ctx);
+    if (dataset_id == DATASET_META) {
+        wlcsv_state_lineskip_set(upd_ctx->lcsv_stt, 0);
+        wlcsv_state_options_set(upd_ctx->lcsv_stt, WLCSV_IGNORE_EMPTY_FIELDS);
+    } else if (upd_ctx->last_update) {
+        /*  Parsing begins in head_check(), once the date of the data is known. */
+        upd_ctx->dataset_head = 1;
+        return 1;
+    }
+    check(wlcsv_push_begin(wlcsv_ctx) == 1, ERR_EXTERN, WLCSV, "beginning to parse");
+    return 1;
+error:
+    return 0;
+}
 
-    int ret = wlcsv_file_path(wlcsv_ctx, paths[0], strlen(paths[0]));
-    check(ret, ERR_EXTERN, "wlcsv", "setting file path");
-    ret = wlcsv_file_read(wlcsv_ctx, file_sizes[0] ? file_sizes[0] + 10 : default_sz);
-    check(ret, ERR_EXTERN, "wlcsv", "reading csv file");
-    wlcsv_callbacks_clear_all(wlcsv_ctx);
-    memset(callback_ids, 0, NCALLBACKS);
+int
+emiss_update_dataset_push(emiss_update_ctx_st *upd_ctx, const void *data, size_t len)
+{
+    if (upd_ctx->dataset_skip)
+        return 1;
+    emiss_metrics_add(EMISS_METRIC_INGEST_BYTES, len);
+    int ret = upd_ctx->dataset_head ? head_check(upd_ctx, data, len, 0)
+            : wlcsv_push(upd_ctx->lcsv_ctx, data, len) == -1 ? -1 : 1;
+    /*  The callbacks cannot stop the parser, an error in one is seen once the chunk is parsed. */
+    check(!upd_ctx->failed, ERR_FAIL, EMISS_ERR, "sending parsed data");
+    return ret;
+error:
+    return -1;
+}
 
-    /*  Set up some settings and callbacks for the Worldbank files. */
-    wlcsv_state_lineskip_set(wlcsv_stt, 4);
-    ret = wlcsv_ignore_regex_set(wlcsv_ctx, EMISS_IGNORE_REGEX);
-    check(ret, ERR_EXTERN, "wlcsv", "setting ignore regex");
+int
+emiss_update_dataset_end(emiss_update_ctx_st *upd_ctx)
+{
+    wlcsv_ctx_st *wlcsv_ctx = upd_ctx->lcsv_ctx;
+    wlcsv_state_st *wlcsv_stt = upd_ctx->lcsv_stt;
+    uint8_t *callback_ids   = upd_ctx->callback_ids;
+    int dataset_id          = upd_ctx->dataset_id;
+    if (upd_ctx->dataset_head)
+        check(head_check(upd_ctx, "", 0, 1) == 1, ERR_FAIL, EMISS_ERR, "checking data version");
+    if (upd_ctx->dataset_skip)
+        return 1;
+    long long ret = wlcsv_push_end(wlcsv_ctx);
+    check(ret != -1, ERR_EXTERN, WLCSV, "parsing csv data");
+    check(!upd_ctx->failed, ERR_FAIL, EMISS_ERR, "sending parsed data");
+    emiss_metrics_add(EMISS_METRIC_INGEST_ROWS, (uint64_t) ret);
+    emiss_metrics_add(EMISS_METRIC_INGEST_DATASETS, 1);
+    if (dataset_id == DATASET_COUNTRY_CODES) {
+        wlcsv_callbacks_clear_all(wlcsv_ctx);
+        memset(callback_ids, 0, NCALLBACKS);
+        return 1;
+    }
+    upd_ctx->parsed_total += ret;
+    if (dataset_id != DATASET_META) {
+        if (DATAPOINT_DATASET(dataset_id))
+            check(datapoints_file_end(upd_ctx), ERR_FAIL, EMISS_ERR, "finishing dataset");
+        if (!upd_ctx->countries_updated)
+            upd_ctx->countries_updated = 1;
+    } else {
+        wlcsv_callbacks_clear(wlcsv_ctx, callback_ids[5]);
+        callback_ids[5] = 0;
+        wlcsv_state_lineskip_set(wlcsv_stt, WORLDBANK_LINESKIP);
+        wlcsv_state_options_set(wlcsv_stt, WLCSV_IGNORE_EMPTY_FIELDS);
+    }
+    if (callback_ids[0]) {
+        wlcsv_callbacks_clear(wlcsv_ctx, callback_ids[0]);
+        callback_ids[0] = 0;
+    }
+    struct timespec timer = (struct timespec){.tv_sec = 1, .tv_nsec = 0};
+    while (!wlpq_query_queue_empty(upd_ctx->conn_ctx))
+        nanosleep(&timer, NULL);
+    return 1;
+error:
+    return 0;
+}
 
+long long
+emiss_update_end(emiss_update_ctx_st *upd_ctx)
+{
+    free(upd_ctx->head);
+    upd_ctx->head     = NULL;
+    upd_ctx->head_len = 0;
+    emiss_metrics_gauge_set(EMISS_GAUGE_INGEST_RUNNING, 0);
+    return (long long) upd_ctx->parsed_total;
+}
 
-    callback_ids[0] = wlcsv_callbacks_set(wlcsv_ctx,
-                            ROW, WLCSV_MATCH_NUM(0U),
-                            cb_year, upd_ctx, 0);
-    ret = 0;
-    size_t retval = 0;
-    for (size_t i = 1; i < npaths; ++i) {
-        wlcsv_callbacks_eor_set(wlcsv_ctx, eor_wait_until_queries_done);
-        wlcsv_callbacks_default_set(wlcsv_ctx, cb_data, upd_ctx);
-        check(wlcsv_file_path(wlcsv_ctx, paths[i], strlen(paths[i])),
-                ERR_EXTERN, WLCSV, "setting file path");
-        upd_ctx->dataset_id = dataset_ids[i];
-        if (dataset_ids[i] != DATASET_META) {
-            if (current_version) {
-                ret = wlcsv_file_preview(wlcsv_ctx, 3, 0x10000, cb_preview);
-                check(ret, ERR_EXTERN, WLCSV, "obtaining preview of csv file");
-    			char *temp = upd_ctx->cbdata;
-                time_t updated = temp && strlen(temp)
-                                ? parse_last_updated_date(temp)
-                                : 0;
-                if (updated && (updated <= current_version))
-                    continue;
-            }
-            ret = wlcsv_file_read(wlcsv_ctx, file_sizes[i] ?
-                        file_sizes[i] + 10 : default_sz);
-            check(ret, ERR_EXTERN, WLCSV, "reading csv file");
-            if (!upd_ctx->countries_updated)
-                upd_ctx->countries_updated = 1;
-        } else {
-            wlcsv_state_lineskip_set(wlcsv_stt, 0);
-            wlcsv_state_options_set(wlcsv_stt, WLCSV_IGNORE_EMPTY_FIELDS);
-            ret = wlcsv_file_read(wlcsv_ctx, file_sizes[i]);
-            check(ret, ERR_EXTERN, WLCSV, "reading csv file");
-            wlcsv_callbacks_clear(wlcsv_ctx, callback_ids[5]);
-            callback_ids[5] = 0;
-            wlcsv_state_lineskip_set(wlcsv_stt, 4);
-            wlcsv_state_options_set(wlcsv_stt, WLCSV_IGNORE_EMPTY_FIELDS);
-        }
-        if (callback_ids[0]) {
-            wlcsv_callbacks_clear(wlcsv_ctx, callback_ids[0]);
-            callback_ids[0] = 0;
-        }
-        struct timespec timer = (struct timespec){.tv_sec = 1, .tv_nsec = 0};
-        while (!wlpq_query_queue_empty(upd_ctx->conn_ctx))
-            nanosleep(&timer, NULL);
-        retval += ret;
+long long
+emiss_update_parse_send(emiss_update_ctx_st *upd_ctx,
+    char **paths, size_t npaths, int *dataset_ids, time_t current_version)
+{
+    FILE *fp = NULL;
+    char *buf = malloc(READ_CHUNK_SIZE);
+    check(buf, ERR_MEM, EMISS_ERR);
+    check(emiss_update_begin(upd_ctx, current_version), ERR_FAIL, EMISS_ERR, "beginning update");
+    for (size_t i = 0; i < npaths; ++i) {
+        fp = fopen(paths[i], "rb");
+        check(fp, ERR_FAIL_A, EMISS_ERR, "opening file", paths[i]);
+        check(emiss_update_dataset_begin(upd_ctx, dataset_ids[i]),
+            ERR_FAIL, EMISS_ERR, "beginning dataset");
+        size_t nread;
+        while ((nread = fread(buf, 1, READ_CHUNK_SIZE, fp)))
+            check(emiss_update_dataset_push(upd_ctx, buf, nread) == 1,
+                ERR_FAIL, EMISS_ERR, "parsing dataset");
+        check(!ferror(fp), ERR_FAIL, EMISS_ERR, "reading file");
+        check(emiss_update_dataset_end(upd_ctx), ERR_FAIL, EMISS_ERR, "finishing dataset");
+        fclose(fp);
+        fp = NULL;
     }
+    free(buf);
+    long long retval = emiss_update_end(upd_ctx);
     emiss_update_ctx_free(upd_ctx);
     return retval;
 error:
-	emiss_update_ctx_free(upd_ctx);
+    if (fp)
+        fclose(fp);
+    free(buf);
+    emiss_update_end(upd_ctx);
+    emiss_update_ctx_free(upd_ctx);
     return -1;
 }
@@ -0,0 +1,697 @@
+/*! @file       emiss_bench_http.c
+    @brief      HTTP load generator for the server of [Emission](../../include/emiss.h).
+    @details    Replays a weighted mix of request paths over a number of connections, each in a
+                thread of its own, optionally kept alive, and reports throughput and latency
+                percentiles in total and per path. Writes the results as JSON, and compares them
+                against such a file written earlier, failing on a regression.
+                Usage: emiss_bench_http [options], see usage() below.
+    @copyright: (c) Joa Käis [github.com/jiikai] 2018-2019, [MIT](../../LICENSE).
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+/*
+**  INCLUDES
+*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "dbg.h"
+#include "util_bench.h"
+#include "util_json.h"
+
+/*
+**  MACROS
+*/
+
+#define BENCH_ERR "emiss_bench_http"
+
+#define BENCH_MAX_TARGETS   32
+#define BENCH_MAX_PATH      0x400
+#define BENCH_MAX_NAME      0x40
+#define BENCH_MAX_CONNS     0x400
+/*  Room for the response headers, also the size of each read of a body, which is discarded. */
+#define BENCH_BUF_SIZE      0x10000
+/*  Seconds before a send or a receive counts as an error. */
+#define BENCH_IO_TIMEOUT    10
+/*  Initial number of latency samples a thread has room for, per path. */
+#define BENCH_SAMPLES_INIT  0x1000
+
+/*  The default mix: the pages, and the chart scripts each of them loads, map and line, with the
+    weights of a browsing session. */
+#define BENCH_DEFAULT_MIX\
+    "20 index /\n"\
+    "10 new /new\n"\
+    "10 show /show?data_type=co2e&chart_type=line&from_year=1990&to_year=2014"\
+        "&ccode=FIN&ccode=SWE&ccode=NOR\n"\
+    "30 chart_map /js/chart.js?data_type=co2e&chart_type=map&select_year=2010\n"\
+    "30 chart_line /js/chart.js?data_type=co2e&chart_type=line&from_year=1990&to_year=2014"\
+        "&ccode=FIN&ccode=SWE&ccode=NOR\n"
+
+/*
+**  TYPES
+*/
+
+typedef struct bench_target {
+    unsigned        weight;
+    char            name[BENCH_MAX_NAME];
+    char            path[BENCH_MAX_PATH];
+} bench_target_st;
+
+/*  What a thread measured of a path, or, merged, all threads. Latencies are in microseconds. */
+typedef struct bench_stats {
+    uint32_t       *samples;
+    size_t          nsamples;
+    size_t          capacity;
+    uint64_t        errors;
+    uint64_t        bytes;
+} bench_stats_st;
+
+typedef struct bench_worker {
+    pthread_t       thread;
+    uint64_t        seed;
+    uint64_t        connects;
+    int             failed;
+    bench_stats_st  stats[BENCH_MAX_TARGETS];
+    char            buf[BENCH_BUF_SIZE];
+} bench_worker_st;
+
+typedef struct bench_config {
+    const char     *host;
+    const char     *port;
+    const char     *mix_path;
+    const char     *output_path;
+    const char     *baseline_path;
+    unsigned        connections;
+    unsigned        duration;
+    unsigned        warmup;
+    unsigned        wait;
+    double          threshold;
+    int             keep_alive;
+    int             gzip;
+} bench_config_st;
+
+/*
+**  GLOBALS
+*/
+
+static bench_config_st config = {
+    .host = "127.0.0.1", .port = "8080", .connections = 8, .duration = 10, .warmup = 2,
+    .threshold = 10.0
+};
+static bench_target_st targets[BENCH_MAX_TARGETS];
+static size_t ntargets;
+static unsigned total_weight;
+static struct addrinfo *address;
+/*  Monotonic seconds at which measuring starts and ends. Read by the workers without locking:
+    written once before they start, and running only ever goes from 1 to 0. */
+static double measure_from, measure_until;
+static volatile int running = 1;
+
+/*
+**  FUNCTIONS
+*/
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -h host      server address (default 127.0.0.1)\n"
+        "  -p port      server port (default 8080)\n"
+        "  -c n         connections, each in a thread of its own (default 8)\n"
+        "  -d seconds   duration measured (default 10)\n"
+        "  -w seconds   warmup before measuring (default 2)\n"
+        "  -k           keep connections alive\n"
+        "  -z           accept gzip\n"
+        "  -m file      mix of requests, lines of <weight> <name> <path>, # comments\n"
+        "  -W seconds   wait up to this long for the server to accept connections\n"
+        "  -o file      write the results as JSON\n"
+        "  -b file      compare against results written earlier, exit 2 on a regression\n"
+        "  -t percent   regression threshold for -b (default 10)\n", prog);
+}
+
+/*  Parse a mix, one target per line. */
+static int
+parse_mix(const char *mix)
+{
+    const char *line = mix;
+    while (*line) {
+        const char *end = strchr(line, '\n');
+        size_t len = end ? (size_t) (end - line) : strlen(line);
+        char buf[BENCH_MAX_PATH + BENCH_MAX_NAME + 0x20];
+        check(len < sizeof(buf), ERR_FAIL, BENCH_ERR, "parsing mix: line too long");
+        memcpy(buf, line, len);
+        buf[len] = '\0';
+        char *hash = strchr(buf, '#');
+        if (hash)
+            *hash = '\0';
+        char name[BENCH_MAX_NAME], path[BENCH_MAX_PATH], rest;
+        unsigned weight;
+        int n = sscanf(buf, "%u %63s %1023s %c", &weight, name, path, &rest);
+        if (n == 3 && weight && path[0] == '/') {
+            check(ntargets < BENCH_MAX_TARGETS, ERR_FAIL, BENCH_ERR,
+                "parsing mix: too many targets");
+            targets[ntargets].weight = weight;
+            strcpy(targets[ntargets].name, name);
+            strcpy(targets[ntargets].path, path);
+            total_weight += weight;
+            ++ntargets;
+        } else
+            check(n == EOF, ERR_FAIL_A, BENCH_ERR, "parsing mix line", buf);
+        line += len + (end != 0);
+    }
+    check(ntargets, ERR_FAIL, BENCH_ERR, "parsing mix: no targets");
+    return 1;
+error:
+    return 0;
+}
+
+static char *
+read_file(const char *path)
+{
+    char *data = 0;
+    FILE *fp = fopen(path, "rb");
+    check(fp, ERR_FAIL_A, BENCH_ERR, "opening", path);
+    check(!fseek(fp, 0, SEEK_END), ERR_FAIL_A, BENCH_ERR, "seeking", path);
+    long len = ftell(fp);
+    check(len >= 0 && !fseek(fp, 0, SEEK_SET), ERR_FAIL_A, BENCH_ERR, "seeking", path);
+    data = malloc((size_t) len + 1);
+    check(data, ERR_MEM, BENCH_ERR);
+    check(fread(data, 1, (size_t) len, fp) == (size_t) len, ERR_FAIL_A, BENCH_ERR, "reading", path);
+    data[len] = '\0';
+    fclose(fp);
+    return data;
+error:
+    if (fp)
+        fclose(fp);
+    free(data);
+    return 0;
+}
+
+static int
+connect_to_server(void)
+{
+    int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd < 0)
+        return -1;
+    struct timeval timeout = {BENCH_IO_TIMEOUT, 0};
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, address->ai_addr, address->ai_addrlen)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+send_all(int fd, const char *data, size_t len)
+{
+    while (len) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        data += n;
+        len  -= (size_t) n;
+    }
+    return 1;
+}
+
+/*  The value of a header, case-insensitively, within the headers of len bytes. */
+static const char *
+header_value(const char *headers, size_t len, const char *name, size_t *value_len)
+{
+    size_t name_len = strlen(name);
+    const char *line = memchr(headers, '\n', len), *end = headers + len;
+    while (line && ++line < end) {
+        const char *eol = memchr(line, '\n', (size_t) (end - line));
+        if (!eol)
+            break;
+        if ((size_t) (eol - line) > name_len && line[name_len] == ':'
+            && !strncasecmp(line, name, name_len)) {
+            const char *value = line + name_len + 1;
+            while (value < eol && (*value == ' ' || *value == '\t'))
+                ++value;
+            *value_len = (size_t) (eol - value - (eol[-1] == '\r'));
+            return value;
+        }
+        line = eol;
+    }
+    return 0;
+}
+
+/*  Read a response to its end. Returns its status code, or 0 on an error, setting keep to
+    whether the connection can take another request, and adding the bytes read to bytes. */
+static unsigned
+read_response(int fd, char *buf, uint64_t *bytes, int *keep)
+{
+    size_t fill = 0, header_len = 0;
+    const char *end = 0;
+    *keep = 0;
+    while (!end) {
+        if (fill == BENCH_BUF_SIZE - 1)
+            return 0;
+        ssize_t n = recv(fd, &buf[fill], BENCH_BUF_SIZE - 1 - fill, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        fill += (size_t) n;
+        buf[fill] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+    header_len = (size_t) (end - buf) + 4;
+    unsigned minor = 0, status = 0;
+    if (sscanf(buf, "HTTP/1.%u %u", &minor, &status) != 2)
+        return 0;
+
+    /*  HTTP/1.0 closes unless told otherwise, 1.1 keeps alive. */
+    size_t value_len;
+    const char *value = header_value(buf, header_len, "Connection", &value_len);
+    int server_closes = value
+        ? value_len == 5 && !strncasecmp(value, "close", 5)
+        : !minor;
+    value = header_value(buf, header_len, "Content-Length", &value_len);
+    /*  Without a length, the body ends with the connection. */
+    uint64_t remaining = value ? strtoull(value, 0, 10) : UINT64_MAX;
+    uint64_t have = fill - header_len;
+    *bytes += fill;
+    if (value && have >= remaining) {
+        *keep = !server_closes && have == remaining;
+        return status;
+    }
+    remaining -= have;
+    while (remaining) {
+        ssize_t n = recv(fd, buf, BENCH_BUF_SIZE, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || (!n && value))
+            return 0;
+        if (!n)
+            break;
+        *bytes += (uint64_t) n;
+        remaining -= (uint64_t) n > remaining ? remaining : (uint64_t) n;
+    }
+    *keep = value && !server_closes;
+    return status;
+}
+
+static int
+stats_add(bench_stats_st *stats, uint32_t latency)
+{
+    if (stats->nsamples == stats->capacity) {
+        size_t capacity = stats->capacity ? stats->capacity * 2 : BENCH_SAMPLES_INIT;
+        uint32_t *samples = realloc(stats->samples, capacity * sizeof(uint32_t));
+        if (!samples)
+            return 0;
+        stats->samples  = samples;
+        stats->capacity = capacity;
+    }
+    stats->samples[stats->nsamples++] = latency;
+    return 1;
+}
+
+/*  xorshift64*, seeded per thread: the same mix of requests each run. */
+static uint64_t
+next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void *
+worker_run(void *arg)
+{
+    bench_worker_st *worker = arg;
+    char request[BENCH_MAX_PATH + 0x200];
+    int fd = -1;
+    while (running) {
+        unsigned pick = (unsigned) (next_random(&worker->seed) % total_weight);
+        size_t i = 0;
+        while (pick >= targets[i].weight)
+            pick -= targets[i++].weight;
+        int len = snprintf(request, sizeof(request),
+                    "GET %s HTTP/1.1\r\nHost: %s:%s\r\n%sConnection: %s\r\n\r\n",
+                    targets[i].path, config.host, config.port,
+                    config.gzip ? "Accept-Encoding: gzip\r\n" : "",
+                    config.keep_alive ? "keep-alive" : "close");
+        /*  Without keep-alive, a connection is part of the latency of each request. A kept
+            connection the server closed meanwhile is made anew, once. */
+        double start = util_bench_now();
+        uint64_t bytes = 0;
+        unsigned status = 0;
+        for (int reused = fd >= 0, attempt = 0; attempt <= reused && !bytes; ++attempt) {
+            int keep = 0;
+            if (fd < 0) {
+                fd = connect_to_server();
+                ++worker->connects;
+            }
+            status = fd >= 0 && send_all(fd, request, (size_t) len)
+                ? read_response(fd, worker->buf, &bytes, &keep) : 0;
+            if ((!keep || !config.keep_alive) && fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+            if (status || fd >= 0)
+                break;
+        }
+        double end = util_bench_now();
+        if (start < measure_from || end > measure_until)
+            continue;
+        bench_stats_st *stats = &worker->stats[i];
+        stats->bytes += bytes;
+        if (status < 200 || status >= 400)
+            ++stats->errors;
+        else if (!stats_add(stats, (uint32_t) ((end - start) * 1e6))) {
+            worker->failed = 1;
+            break;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    return 0;
+}
+
+static int
+compare_samples(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*  The nearest-rank percentile of sorted samples, in milliseconds. */
+static double
+percentile_ms(const bench_stats_st *stats, double p)
+{
+    if (!stats->nsamples)
+        return 0;
+    size_t rank = (size_t) ceil(p / 100 * (double) stats->nsamples);
+    return stats->samples[rank ? rank - 1 : 0] / 1e3;
+}
+
+static int
+stats_merge(bench_stats_st *into, const bench_stats_st *from)
+{
+    if (from->nsamples) {
+        uint32_t *samples = realloc(into->samples,
+                                (into->nsamples + from->nsamples) * sizeof(uint32_t));
+        if (!samples)
+            return 0;
+        memcpy(&samples[into->nsamples], from->samples, from->nsamples * sizeof(uint32_t));
+        into->samples   = samples;
+        into->nsamples += from->nsamples;
+        into->capacity  = into->nsamples;
+    }
+    into->errors += from->errors;
+    into->bytes  += from->bytes;
+    return 1;
+}
+
+static const double percentiles[] = {50, 90, 99, 99.9};
+static const char *const percentile_keys[] = {"p50", "p90", "p99", "p99_9"};
+
+static void
+print_stats(const char *name, const bench_stats_st *stats, unsigned weight)
+{
+    printf("%-12s %6u %9zu %7" PRIu64 " %9.1f %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+        name, weight, stats->nsamples, stats->errors, (double) stats->nsamples / config.duration,
+        percentile_ms(stats, 50), percentile_ms(stats, 90), percentile_ms(stats, 99),
+        percentile_ms(stats, 99.9), percentile_ms(stats, 100));
+}
+
+static void
+json_stats(util_json_buf_st *json, const bench_stats_st *stats)
+{
+    UTIL_JSON_LITERAL(json, "\"requests\":");
+    util_json_uint(json, stats->nsamples);
+    UTIL_JSON_LITERAL(json, ",\"errors\":");
+    util_json_uint(json, stats->errors);
+    UTIL_JSON_LITERAL(json, ",\"throughput_rps\":");
+    util_json_double(json, round((double) stats->nsamples / config.duration * 10) / 10);
+    UTIL_JSON_LITERAL(json, ",\"bytes_per_s\":");
+    util_json_uint(json, stats->bytes / config.duration);
+    UTIL_JSON_LITERAL(json, ",\"latency_ms\":{");
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+        util_json_char(json, '"');
+        util_json_raw(json, percentile_keys[i], strlen(percentile_keys[i]));
+        UTIL_JSON_LITERAL(json, "\":");
+        util_json_double(json, percentile_ms(stats, percentiles[i]));
+        util_json_char(json, ',');
+    }
+    UTIL_JSON_LITERAL(json, "\"max\":");
+    util_json_double(json, percentile_ms(stats, 100));
+    UTIL_JSON_LITERAL(json, "}");
+}
+
+static char *
+results_json(const bench_stats_st *total, const bench_stats_st *per_target)
+{
+    util_json_buf_st json;
+    if (!util_json_init(&json, 0, 0x1000, UTIL_JSON_ESC_JSON))
+        return 0;
+    UTIL_JSON_LITERAL(&json, "{\"connections\":");
+    util_json_uint(&json, config.connections);
+    UTIL_JSON_LITERAL(&json, ",\"keep_alive\":");
+    if (config.keep_alive)
+        UTIL_JSON_LITERAL(&json, "true");
+    else
+        UTIL_JSON_LITERAL(&json, "false");
+    UTIL_JSON_LITERAL(&json, ",\"gzip\":");
+    if (config.gzip)
+        UTIL_JSON_LITERAL(&json, "true");
+    else
+        UTIL_JSON_LITERAL(&json, "false");
+    UTIL_JSON_LITERAL(&json, ",\"duration_s\":");
+    util_json_uint(&json, config.duration);
+    util_json_char(&json, ',');
+    json_stats(&json, total);
+    UTIL_JSON_LITERAL(&json, ",\"targets\":[");
+    for (size_t i = 0; i < ntargets; ++i) {
+        if (i)
+            util_json_char(&json, ',');
+        UTIL_JSON_LITERAL(&json, "{\"name\":");
+        util_json_str(&json, targets[i].name);
+        UTIL_JSON_LITERAL(&json, ",\"path\":");
+        util_json_str(&json, targets[i].path);
+        UTIL_JSON_LITERAL(&json, ",\"weight\":");
+        util_json_uint(&json, targets[i].weight);
+        util_json_char(&json, ',');
+        json_stats(&json, &per_target[i]);
+        util_json_char(&json, '}');
+    }
+    UTIL_JSON_LITERAL(&json, "]}\n");
+    if (json.failed) {
+        free(json.data);
+        return 0;
+    }
+    return json.data;
+}
+
+/*  Compare against results written earlier, in total and per path by name. Throughput falling
+    or p99 latency rising by more than the threshold is a regression. */
+static int
+compare_baseline(const char *current, const char *baseline)
+{
+    int regressions = 0;
+    printf("\nCompared to %s (threshold %.1f%%):\n", config.baseline_path, config.threshold);
+    /*  Results of other settings compare only roughly. */
+    if (util_bench_json_number(baseline, 0, "connections") != config.connections
+        || !strstr(baseline, config.keep_alive ? "\"keep_alive\":true" : "\"keep_alive\":false")
+        || !strstr(baseline, config.gzip ? "\"gzip\":true" : "\"gzip\":false"))
+        printf("Note: the baseline was measured with other connection settings.\n");
+    printf("%-12s %-16s %10s %10s %8s\n", "target", "metric", "baseline", "current", "change");
+    for (size_t i = 0; i <= ntargets; ++i) {
+        /*  The totals come before the targets; the fields of a target after its name. */
+        const char *name = i ? targets[i - 1].name : "total", *cur, *base, *cur_end, *base_end;
+        if (!i) {
+            cur  = current;
+            base = baseline;
+            cur_end  = strstr(current, "\"targets\"");
+            base_end = strstr(baseline, "\"targets\"");
+        } else {
+            char quoted[BENCH_MAX_NAME + 0x10];
+            snprintf(quoted, sizeof(quoted), "\"name\":\"%s\"", name);
+            cur  = strstr(current, quoted);
+            base = strstr(baseline, quoted);
+            if (!base) {
+                printf("%-12s not in baseline\n", name);
+                continue;
+            }
+            cur_end  = strstr(cur + 1, "\"name\":");
+            base_end = strstr(base + 1, "\"name\":");
+        }
+        static const struct {
+            const char *key;
+            int         higher_is_worse;
+        } metrics[] = {{"throughput_rps", 0}, {"p50", 1}, {"p99", 1}};
+        for (size_t j = 0; j < sizeof(metrics) / sizeof(metrics[0]); ++j) {
+            double then = util_bench_json_number(base, base_end, metrics[j].key),
+                   now  = util_bench_json_number(cur, cur_end, metrics[j].key);
+            if (isnan(then) || isnan(now) || then <= 0)
+                continue;
+            double change = (now - then) / then * 100;
+            int regressed = metrics[j].higher_is_worse
+                ? change > config.threshold : -change > config.threshold;
+            regressions += regressed;
+            printf("%-12s %-16s %10.2f %10.2f %+7.1f%%%s\n", name, metrics[j].key, then, now,
+                change, regressed ? "  REGRESSION" : "");
+        }
+    }
+    return regressions;
+}
+
+/*  Wait up to seconds for the server to accept a connection. */
+static int
+wait_for_server(unsigned seconds)
+{
+    double until = util_bench_now() + seconds;
+    do {
+        int fd = connect_to_server();
+        if (fd >= 0) {
+            close(fd);
+            return 1;
+        }
+        nanosleep(&(struct timespec){0, 100000000}, 0);
+    } while (util_bench_now() < until);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    bench_worker_st *workers = 0;
+    bench_stats_st total = {0}, per_target[BENCH_MAX_TARGETS] = {{0}};
+    char *mix = 0, *results = 0, *baseline = 0;
+    int opt, ret = 1;
+    size_t nstarted = 0;
+    while ((opt = getopt(argc, argv, "h:p:c:d:w:kzm:W:o:b:t:")) != -1) {
+        switch (opt) {
+            case 'h': config.host          = optarg; break;
+            case 'p': config.port          = optarg; break;
+            case 'c': config.connections   = (unsigned) strtoul(optarg, 0, 10); break;
+            case 'd': config.duration      = (unsigned) strtoul(optarg, 0, 10); break;
+            case 'w': config.warmup        = (unsigned) strtoul(optarg, 0, 10); break;
+            case 'k': config.keep_alive    = 1; break;
+            case 'z': config.gzip          = 1; break;
+            case 'm': config.mix_path      = optarg; break;
+            case 'W': config.wait          = (unsigned) strtoul(optarg, 0, 10); break;
+            case 'o': config.output_path   = optarg; break;
+            case 'b': config.baseline_path = optarg; break;
+            case 't': config.threshold     = strtod(optarg, 0); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    check(config.connections && config.connections <= BENCH_MAX_CONNS && config.duration,
+        ERR_FAIL, BENCH_ERR, "parsing arguments: connections and duration must be positive");
+    if (config.mix_path) {
+        mix = read_file(config.mix_path);
+        check(mix, ERR_FAIL_A, BENCH_ERR, "reading mix", config.mix_path);
+    }
+    check(parse_mix(mix ? mix : BENCH_DEFAULT_MIX), ERR_FAIL, BENCH_ERR, "parsing mix");
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int gai = getaddrinfo(config.host, config.port, &hints, &address);
+    check(!gai, ERR_EXTERN, "getaddrinfo", gai_strerror(gai));
+    check(wait_for_server(config.wait), ERR_FAIL_A, BENCH_ERR, "connecting to", config.host);
+
+    workers = calloc(config.connections, sizeof(bench_worker_st));
+    check(workers, ERR_MEM, BENCH_ERR);
+    measure_from  = util_bench_now() + config.warmup;
+    measure_until = measure_from + config.duration;
+    for (; nstarted < config.connections; ++nstarted) {
+        workers[nstarted].seed = 0x9E3779B97F4A7C15ULL * (nstarted + 1);
+        check(!pthread_create(&workers[nstarted].thread, 0, worker_run, &workers[nstarted]),
+            ERR_FAIL, BENCH_ERR, "starting a worker thread");
+    }
+    printf("%s: %u connections, keep-alive %s, %u s after %u s warmup, against %s:%s\n",
+        BENCH_ERR, config.connections, config.keep_alive ? "on" : "off", config.duration,
+        config.warmup, config.host, config.port);
+    fflush(stdout);
+    /*  The workers finish the request they are in when time is up. */
+    for (double left; (left = measure_until - util_bench_now()) > 0;)
+        nanosleep(&(struct timespec){(time_t) left, (long) ((left - floor(left)) * 1e9)}, 0);
+    running = 0;
+    uint64_t connects = 0;
+    int failed = 0;
+    for (size_t i = 0; i < nstarted; ++i) {
+        pthread_join(workers[i].thread, 0);
+        connects += workers[i].connects;
+        failed   |= workers[i].failed;
+        for (size_t j = 0; j < ntargets; ++j) {
+            failed |= !stats_merge(&per_target[j], &workers[i].stats[j])
+                   || !stats_merge(&total, &workers[i].stats[j]);
+        }
+    }
+    nstarted = 0;
+    check(!failed, ERR_MEM, BENCH_ERR);
+
+    printf("%-12s %6s %9s %7s %9s %8s %8s %8s %8s %8s\n", "target", "weight", "requests",
+        "errors", "req/s", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+    for (size_t i = 0; i < ntargets; ++i) {
+        qsort(per_target[i].samples, per_target[i].nsamples, sizeof(uint32_t), compare_samples);
+        print_stats(targets[i].name, &per_target[i], targets[i].weight);
+    }
+    qsort(total.samples, total.nsamples, sizeof(uint32_t), compare_samples);
+    print_stats("total", &total, total_weight);
+    printf("throughput %.1f req/s, %.2f MB/s, %" PRIu64 " connections made\n",
+        (double) total.nsamples / config.duration,
+        (double) total.bytes / config.duration / 1e6, connects);
+
+    results = results_json(&total, per_target);
+    check(results, ERR_MEM, BENCH_ERR);
+    if (config.output_path) {
+        FILE *fp = fopen(config.output_path, "w");
+        check(fp, ERR_FAIL_A, BENCH_ERR, "opening", config.output_path);
+        int written = fputs(results, fp) >= 0;
+        check(!fclose(fp) && written, ERR_FAIL_A, BENCH_ERR, "writing", config.output_path);
+    }
+    if (config.baseline_path) {
+        baseline = read_file(config.baseline_path);
+        check(baseline, ERR_FAIL_A, BENCH_ERR, "reading baseline", config.baseline_path);
+    }
+    /*  Every request failing is no measurement. */
+    check(total.nsamples, ERR_FAIL, BENCH_ERR, "measuring: no request succeeded");
+    ret = baseline && compare_baseline(results, baseline) ? 2 : 0;
+error:
+    running = 0;
+    for (size_t i = 0; i < nstarted; ++i)
+        pthread_join(workers[i].thread, 0);
+    if (workers)
+        for (size_t i = 0; i < config.connections; ++i)
+            for (size_t j = 0; j < ntargets; ++j)
+                free(workers[i].stats[j].samples);
+    for (size_t j = 0; j < ntargets; ++j)
+        free(per_target[j].samples);
+    free(total.samples);
+    free(workers);
+    free(mix);
+    free(results);
+    free(baseline);
+    if (address)
+        freeaddrinfo(address);
+    return ret;
+}
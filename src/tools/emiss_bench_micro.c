@@ -0,0 +1,672 @@
+/*! @file       emiss_bench_micro.c
+    @brief      Micro-benchmarks of the parsing and formatting kernels of
+                [Emission](../../include/emiss.h).
+    @details    Times CSV parsing of the bundled datasets, callback dispatch, SQL building, JSON
+                formatting by the macros and by the builder, string escaping and the formatting of
+                the HTML and year data of a snapshot, with
+                [util_bench.h](../../include/util_bench.h).
+                Reports the median time per call, its MAD, throughput and cycles per byte, writes
+                them as JSON and compares them against such a file written earlier, failing on a
+                regression. Includes the sources of the static kernels, so it links against the
+                rest. Usage: emiss_bench_micro [options], see usage() below.
+    @copyright: (c) Joa Käis [github.com/jiikai] 2018-2019, [MIT](../../LICENSE).
+*/
+
+/*
+**  INCLUDES
+*/
+
+#include "../emiss_resource.c"
+#include "../wlcsv.c"
+
+#include <glob.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "util_bench.h"
+
+/*
+**  MACROS
+*/
+
+#define BENCH_ERR "emiss_bench_micro"
+
+#define BENCH_MAX_CASES     0x40
+#define BENCH_MAX_FILES     0x10
+#define BENCH_MAX_NAME      0x80
+
+/*  As in emiss_update.c: the lines before the header of a Worldbank file. */
+#define BENCH_WORLDBANK_LINESKIP 4
+/*  The Worldbank file countries are read from for the HTML benchmarked. */
+#define BENCH_COUNTRY_FILE "EN.ATM.CO2E.KT.csv"
+
+/*  Fields searched for a callback per call of the dispatch benchmark. */
+#define BENCH_NFIELDS 64
+/*  Entries of the JSON of a map chart formatted. */
+#define BENCH_NENTRIES 200
+/*  Size of the output of the formatting benchmarks. */
+#define BENCH_OUT_SIZE 0x4000
+
+/*
+**  TYPES
+*/
+
+typedef struct bench_case {
+    char            name[BENCH_MAX_NAME];
+    util_bench_ft  *function;
+    void           *arg;
+    util_bench_result_st result;
+} bench_case_st;
+
+/*  A bundled file parsed, as emiss_update.c sets up a Worldbank file, or field by field. */
+struct bench_csv {
+    wlcsv_ctx_st   *ctx;
+    size_t          nfields;
+    double          sum;
+};
+
+/*  Fields of a row and column each, searched for a callback. */
+struct bench_dispatch {
+    wlcsv_ctx_st   *ctx;
+    const char     *field[BENCH_NFIELDS];
+    unsigned        row[BENCH_NFIELDS];
+    unsigned        col[BENCH_NFIELDS];
+    size_t          bytes;
+};
+
+/*  The data of a map chart: codes and values. */
+struct bench_chart {
+    char            code[BENCH_NENTRIES][3];
+    double          value[BENCH_NENTRIES];
+    char            out[BENCH_OUT_SIZE];
+};
+
+struct bench_html {
+    struct country_data *cdata;
+    bstring         html;
+};
+
+/*
+**  GLOBALS
+*/
+
+static struct {
+    const char     *data_dir;
+    const char     *output_path;
+    const char     *baseline_path;
+    const char     *filter;
+    double          threshold;
+    util_bench_config_st bench;
+} config = {
+    .data_dir = "resources/data", .threshold = 10.0,
+    .bench = {.warmup = 0.2, .sample = 0.01, .nsamples = 21}
+};
+static bench_case_st cases[BENCH_MAX_CASES];
+static size_t ncases;
+
+/*
+**  FUNCTIONS
+*/
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -D dir       directory of the csv files (default resources/data)\n"
+        "  -f string    run only the benchmarks with names containing string\n"
+        "  -n samples   samples per benchmark (default 21, at most %d)\n"
+        "  -s ms        minimum duration of a sample (default 10)\n"
+        "  -w ms        warmup per benchmark (default 200)\n"
+        "  -o file      write the results as JSON\n"
+        "  -b file      compare against results written earlier, exit 2 on a regression\n"
+        "  -t percent   regression threshold for -b (default 10)\n",
+        prog, UTIL_BENCH_MAX_SAMPLES);
+}
+
+static int
+case_add(const char *name, util_bench_ft *function, void *arg)
+{
+    check(ncases < BENCH_MAX_CASES, ERR_FAIL, BENCH_ERR, "adding benchmark: too many");
+    if (config.filter && !strstr(name, config.filter))
+        return 1;
+    snprintf(cases[ncases].name, BENCH_MAX_NAME, "%s", name);
+    cases[ncases].function = function;
+    cases[ncases].arg      = arg;
+    ++ncases;
+    return 1;
+error:
+    return 0;
+}
+
+/*  CSV PARSING */
+
+static void
+bench_cb_field(void *field, size_t len, void *data)
+{
+    (void) field;
+    struct bench_csv *csv = data;
+    csv->nfields += len > 0;
+}
+
+static void
+bench_cb_value(const wlcsv_value_st *value, void *data)
+{
+    struct bench_csv *csv = data;
+    ++csv->nfields;
+    if (value->status == WLCSV_VALUE_OK)
+        csv->sum += value->type == WLCSV_DOUBLE ? value->f64 : (double) value->i64;
+}
+
+static size_t
+bench_csv_read(void *arg)
+{
+    struct bench_csv *csv = arg;
+    /*  The ROW callback of the header is disabled by the end of its row on every read. */
+    wlcsv_reset_callbacks(csv->ctx);
+    int parsed = wlcsv_file_read(csv->ctx, 0);
+    return parsed > 0 ? (size_t) parsed : 0;
+}
+
+/*  A Worldbank file, begun by its source, is parsed with the typed callbacks of emiss_update.c;
+    any other file field by field by the default callback. The options choose the tokenizer. */
+static struct bench_csv *
+bench_csv_new(const char *path, unsigned options)
+{
+    struct bench_csv *csv = calloc(1, sizeof(struct bench_csv));
+    check(csv, ERR_MEM, BENCH_ERR);
+    csv->ctx = wlcsv_init(0, bench_cb_field, csv, 0, 0, 1,
+                    EMISS_YEAR_LAST - EMISS_YEAR_ZERO + 1, 0, options);
+    check(csv->ctx, ERR_FAIL, BENCH_ERR, "initializing a csv context");
+    check(wlcsv_file_path(csv->ctx, path, strlen(path)) == 1, ERR_FAIL_A, BENCH_ERR,
+        "setting csv path", path);
+
+    char head[0x40] = {0};
+    FILE *fp = fopen(path, "r");
+    check(fp, ERR_FAIL_A, BENCH_ERR, "opening", path);
+    size_t nread = fread(head, 1, sizeof(head) - 1, fp);
+    fclose(fp);
+    if (nread && strstr(head, "\"Data Source\"")) {
+        wlcsv_state_lineskip_set(wlcsv_state_get(csv->ctx), BENCH_WORLDBANK_LINESKIP);
+        check(wlcsv_ignore_regex_set(csv->ctx, EMISS_IGNORE_REGEX) == 1, ERR_EXTERN, WLCSV,
+            "setting ignore regex");
+        check(wlcsv_callbacks_typed_set(csv->ctx, ROW, WLCSV_MATCH_NUM(0U), WLCSV_INT64,
+                bench_cb_value, csv, 0) != UINT8_MAX,
+            ERR_EXTERN, WLCSV, "setting year callback");
+        for (unsigned year = EMISS_YEAR_ZERO; year <= EMISS_YEAR_LAST; ++year)
+            check(wlcsv_callbacks_typed_set(csv->ctx, COLUMN,
+                    WLCSV_MATCH_NUM(4 + year - EMISS_DATA_STARTS_FROM), WLCSV_DOUBLE,
+                    bench_cb_value, csv, 0) != UINT8_MAX,
+                ERR_EXTERN, WLCSV, "setting datapoint callback");
+    }
+    return csv;
+error:
+    if (csv)
+        wlcsv_free(csv->ctx);
+    free(csv);
+    return 0;
+}
+
+/*  CALLBACK DISPATCH */
+
+static void
+bench_cb_none(void *field, size_t len, void *data)
+{
+    (void) field, (void) len, (void) data;
+}
+
+static size_t
+bench_dispatch(void *arg)
+{
+    struct bench_dispatch *dispatch = arg;
+    wlcsv_ctx_st *ctx = dispatch->ctx;
+    size_t found = 0;
+    for (size_t i = 0; i < BENCH_NFIELDS; ++i) {
+        ctx->state.row = dispatch->row[i];
+        ctx->state.col = dispatch->col[i];
+        found += callbacks_search(ctx, dispatch->field[i],
+                    dispatch->field[i] ? strlen(dispatch->field[i]) : 0) != UINT8_MAX;
+    }
+    util_bench_sink += found;
+    return dispatch->bytes;
+}
+
+/*  A context with callbacks of each kind, as emiss_update.c sets them, and the fields of a kind
+    to search for. The fields of a row or a column match no keyword or regex, and those of a miss
+    nothing, being past the columns of the data. */
+static struct bench_dispatch *
+bench_dispatch_new(wlcsv_callback_match_by_et kind, int miss)
+{
+    static const char *const keywords[] = {
+        "Country Name", "Country Code", "Indicator Name", "Indicator Code", "FIN", "SWE", "NOR"
+    };
+    static const char *const fields[] = {"Finland", "Aruba", "1990", "54321.8", "Europe"};
+    struct bench_dispatch *dispatch = calloc(1, sizeof(struct bench_dispatch));
+    check(dispatch, ERR_MEM, BENCH_ERR);
+    dispatch->ctx = wlcsv_init(0, 0, 0, sizeof(keywords) / sizeof(keywords[0]), 1, 1,
+                        EMISS_YEAR_LAST - EMISS_YEAR_ZERO + 1, 0, 0);
+    check(dispatch->ctx, ERR_FAIL, BENCH_ERR, "initializing a csv context");
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); ++i)
+        check(wlcsv_callbacks_set(dispatch->ctx, KEYWORD, WLCSV_MATCH_STR((char *) keywords[i]),
+                bench_cb_none, 0, 0) != UINT8_MAX,
+            ERR_EXTERN, WLCSV, "setting keyword callback");
+    check(wlcsv_callbacks_set(dispatch->ctx, REGEX, WLCSV_MATCH_STR("^[A-Z]{2}\\.[A-Z]{3}\\."),
+            bench_cb_none, 0, 0) != UINT8_MAX,
+        ERR_EXTERN, WLCSV, "setting regex callback");
+    check(wlcsv_callbacks_set(dispatch->ctx, ROW, WLCSV_MATCH_NUM(0U), bench_cb_none, 0, 0)
+            != UINT8_MAX,
+        ERR_EXTERN, WLCSV, "setting row callback");
+    for (unsigned year = EMISS_YEAR_ZERO; year <= EMISS_YEAR_LAST; ++year)
+        check(wlcsv_callbacks_set(dispatch->ctx, COLUMN,
+                WLCSV_MATCH_NUM(4 + year - EMISS_DATA_STARTS_FROM), bench_cb_none, 0, 0)
+                != UINT8_MAX,
+            ERR_EXTERN, WLCSV, "setting column callback");
+
+    for (size_t i = 0; i < BENCH_NFIELDS; ++i) {
+        const char *field = kind == KEYWORD && !miss ? keywords[i % 7]
+                          : kind == REGEX && !miss ? "EN.ATM.CO2E.KT"
+                          : fields[i % 5];
+        dispatch->field[i] = field;
+        dispatch->row[i]   = kind == ROW && !miss ? 0 : 1 + (unsigned) i;
+        dispatch->col[i]   = kind == COLUMN && !miss
+                           ? 4 + EMISS_YEAR_ZERO - EMISS_DATA_STARTS_FROM
+                             + (unsigned) i % (EMISS_YEAR_LAST - EMISS_YEAR_ZERO + 1)
+                           : 4 + EMISS_YEAR_LAST - EMISS_DATA_STARTS_FROM + 1 + (unsigned) i;
+        dispatch->bytes   += strlen(field);
+    }
+    /*  Compile once, outside the timing. */
+    check(callbacks_compile(dispatch->ctx), ERR_FAIL, BENCH_ERR, "compiling callbacks");
+    return dispatch;
+error:
+    if (dispatch)
+        wlcsv_free(dispatch->ctx);
+    free(dispatch);
+    return 0;
+}
+
+/*  SQL */
+
+/*  The statements of a stored datapoint, as built by cb_datapoint() in emiss_update.c. */
+static size_t
+bench_sql_upsert(void *arg)
+{
+    (void) arg;
+    char buf[0x2000], insert_sql[0x100], out[0x2000];
+    if (SQL_INSERT_INTO(buf, 0x1FFF, insert_sql, 0xFF, "Datapoint",
+            "country_code, yeardata_year, %s", "'%s', %d, %s", "co2_kt", "FIN", 1990,
+            "54321.8") < 0)
+        return 0;
+    insert_sql[strlen(insert_sql) - 1] = '\0';
+    int len = SQL_UPSERT(buf, 0x1FFF, out, 0x1FFF, insert_sql, "country_code, yeardata_year",
+                "%s=%s", "co2_kt", "54321.8");
+    return len > 0 ? (size_t) len : 0;
+}
+
+/*  Nulling the values of a country over years, as datapoint_delete() in emiss_update.c. */
+static size_t
+bench_sql_update(void *arg)
+{
+    (void) arg;
+    char buf[0x200], out[0x200];
+    int len = SQL_UPDATE_WHERE(buf, 0x1FF, out, 0x1FF, "Datapoint", "%s=NULL",
+                "country_code='%s' AND yeardata_year BETWEEN %d AND %d", "co2_kt", "FIN",
+                1990, 2014);
+    return len > 0 ? (size_t) len : 0;
+}
+
+/*  The query of a series of a line chart. */
+static size_t
+bench_sql_select(void *arg)
+{
+    (void) arg;
+    char buf[0x600], out[0x600];
+    int len = SQL_SELECT_JOIN_WHERE(buf, 0x5FF, out, 0x5FF,
+                "YearData.year, Datapoint.co2_kt", "year, co2_kt", "YearData", "LEFT",
+                "Datapoint", "YearData.year = Datapoint.yeardata_year AND "
+                "Datapoint.country_code = '%s'", "YearData.year BETWEEN %u AND %u "
+                "ORDER BY YearData.year", "FIN", 1990U, 2014U);
+    return len > 0 ? (size_t) len : 0;
+}
+
+/*  JSON */
+
+/*  The data of a map chart, by the macros, values printed first, as it was formatted before the
+    builder. */
+static size_t
+bench_json_macros(void *arg)
+{
+    struct bench_chart *chart = arg;
+    size_t len = 0;
+    for (size_t i = 0; i < BENCH_NENTRIES; ++i) {
+        char value[32];
+        snprintf(value, sizeof(value), "%.15g", chart->value[i]);
+        int n = JSON_FRMT_KEY_VALUE_PAIR(&chart->out[len], BENCH_OUT_SIZE - len, "code", "data",
+                    i > 0, chart->code[i], value);
+        if (n < 0 || (size_t) n >= BENCH_OUT_SIZE - len)
+            return 0;
+        len += (size_t) n;
+    }
+    return len;
+}
+
+/*  The same by the builder. */
+static size_t
+bench_json_builder(void *arg)
+{
+    struct bench_chart *chart = arg;
+    util_json_buf_st json;
+    util_json_init(&json, chart->out, BENCH_OUT_SIZE, UTIL_JSON_ESC_JSON);
+    for (size_t i = 0; i < BENCH_NENTRIES; ++i) {
+        UTIL_JSON_LITERAL(&json, "{\"code\":");
+        util_json_str_chars(&json, chart->code[i], 2);
+        UTIL_JSON_LITERAL(&json, ",\"data\":");
+        util_json_double(&json, chart->value[i]);
+        util_json_char(&json, '}');
+        if (i < BENCH_NENTRIES - 1)
+            util_json_char(&json, ',');
+    }
+    return json.failed ? 0 : json.len;
+}
+
+/*  The names of the countries escaped into a quoted JavaScript string, as the series of a line
+    chart; this took the place of escape_single_quotes(). */
+static size_t
+bench_json_escape(void *arg)
+{
+    struct bench_html *data = arg;
+    util_json_buf_st json;
+    char out[BENCH_OUT_SIZE * 2];
+    util_json_init(&json, out, sizeof(out), UTIL_JSON_ESC_JS_QUOTED);
+    for (size_t i = 0; i < data->cdata->ccount; ++i)
+        util_json_str(&json, data->cdata->name[i]);
+    return json.failed ? 0 : data->cdata->total_byte_length_of_names;
+}
+
+/*  SNAPSHOT FORMATTING */
+
+static size_t
+bench_new_chart_html(void *arg)
+{
+    struct bench_html *data = arg;
+    bstring html = frmt_new_chart_html(data->cdata, bdata(data->html));
+    size_t len = html ? (size_t) blength(html) : 0;
+    bdestroy(html);
+    return len;
+}
+
+static size_t
+bench_yeardata(void *arg)
+{
+    (void) arg;
+    char buf[EMISS_SIZEOF_FORMATTED_YEARDATA];
+    int len = fill_yeardata_buffer(buf, sizeof(buf));
+    return len > 0 ? (size_t) len : 0;
+}
+
+/*  The names and codes of the countries of a Worldbank file, as the country data of a
+    snapshot. */
+static void
+bench_cb_country(void *field, size_t len, void *data)
+{
+    struct country_data *cdata = data;
+    if (cdata->ccount >= NCOUNTRY_DATA_SLOTS)
+        return;
+    size_t i = cdata->ccount;
+    /*  A row has been read once its code is. */
+    if (!cdata->name[i]) {
+        cdata->name[i] = calloc(len + 1, 1);
+        if (cdata->name[i]) {
+            memcpy(cdata->name[i], field, len);
+            cdata->total_byte_length_of_names += len;
+        }
+    } else {
+        memcpy(cdata->iso3[i], field, len < 3 ? len : 3);
+        cdata->country_type[i] = 1;
+        ++cdata->ccount;
+    }
+}
+
+static struct country_data *
+bench_country_data_new(void)
+{
+    char path[0x400];
+    wlcsv_ctx_st *ctx = 0;
+    struct country_data *cdata = calloc(1, sizeof(struct country_data));
+    check(cdata, ERR_MEM, BENCH_ERR);
+    snprintf(path, sizeof(path), "%s/%s", config.data_dir, BENCH_COUNTRY_FILE);
+    ctx = wlcsv_init(0, 0, 0, 0, 0, 0, 2, BENCH_WORLDBANK_LINESKIP + 1, 0);
+    check(ctx, ERR_FAIL, BENCH_ERR, "initializing a csv context");
+    check(wlcsv_file_path(ctx, path, strlen(path)) == 1, ERR_FAIL_A, BENCH_ERR,
+        "setting csv path", path);
+    check(wlcsv_callbacks_set(ctx, COLUMN, WLCSV_MATCH_NUM(0U), bench_cb_country, cdata, 0)
+            != UINT8_MAX
+        && wlcsv_callbacks_set(ctx, COLUMN, WLCSV_MATCH_NUM(1U), bench_cb_country, cdata, 0)
+            != UINT8_MAX,
+        ERR_EXTERN, WLCSV, "setting country callbacks");
+    check(wlcsv_file_read(ctx, 0) > 0 && cdata->ccount, ERR_FAIL_A, BENCH_ERR,
+        "reading countries of", path);
+    wlcsv_free(ctx);
+    return cdata;
+error:
+    wlcsv_free(ctx);
+    if (cdata)
+        for (size_t i = 0; i < NCOUNTRY_DATA_SLOTS; ++i)
+            free(cdata->name[i]);
+    free(cdata);
+    return 0;
+}
+
+/*  RESULTS */
+
+static char *
+results_json(void)
+{
+    util_json_buf_st json;
+    if (!util_json_init(&json, 0, 0x1000, UTIL_JSON_ESC_JSON))
+        return 0;
+    UTIL_JSON_LITERAL(&json, "{\"samples\":");
+    util_json_uint(&json, config.bench.nsamples);
+    UTIL_JSON_LITERAL(&json, ",\"cycles\":");
+    if (UTIL_BENCH_HAS_CYCLES)
+        UTIL_JSON_LITERAL(&json, "\"tsc\"");
+    else
+        UTIL_JSON_LITERAL(&json, "null");
+    UTIL_JSON_LITERAL(&json, ",\"cases\":[");
+    for (size_t i = 0; i < ncases; ++i) {
+        const util_bench_result_st *r = &cases[i].result;
+        if (i)
+            util_json_char(&json, ',');
+        UTIL_JSON_LITERAL(&json, "{\"name\":");
+        util_json_str(&json, cases[i].name);
+        UTIL_JSON_LITERAL(&json, ",\"bytes\":");
+        util_json_uint(&json, r->bytes);
+        UTIL_JSON_LITERAL(&json, ",\"iterations\":");
+        util_json_uint(&json, r->iterations);
+        UTIL_JSON_LITERAL(&json, ",\"median_ns\":");
+        util_json_double(&json, round(r->median_ns * 10) / 10);
+        UTIL_JSON_LITERAL(&json, ",\"mad_ns\":");
+        util_json_double(&json, round(r->mad_ns * 10) / 10);
+        UTIL_JSON_LITERAL(&json, ",\"mb_per_s\":");
+        util_json_double(&json, round((double) r->bytes / r->median_ns * 1e3 * 10) / 10);
+        UTIL_JSON_LITERAL(&json, ",\"cycles_per_byte\":");
+        util_json_double(&json, round(r->median_cycles / (double) r->bytes * 1e3) / 1e3);
+        util_json_char(&json, '}');
+    }
+    UTIL_JSON_LITERAL(&json, "]}\n");
+    if (json.failed) {
+        free(json.data);
+        return 0;
+    }
+    return json.data;
+}
+
+/*  Compare medians against results written earlier, by name. A median slower by more than the
+    threshold, and by more than three MADs, so that noise is not taken for one, is a regression. */
+static int
+compare_baseline(const char *baseline)
+{
+    int regressions = 0;
+    printf("\nCompared to %s (threshold %.1f%%):\n", config.baseline_path, config.threshold);
+    printf("%-40s %12s %12s %8s\n", "benchmark", "baseline ns", "current ns", "change");
+    for (size_t i = 0; i < ncases; ++i) {
+        char quoted[BENCH_MAX_NAME + 0x10];
+        snprintf(quoted, sizeof(quoted), "\"name\":\"%.*s\"", BENCH_MAX_NAME - 1, cases[i].name);
+        const char *at = strstr(baseline, quoted);
+        double then = at ? util_bench_json_number(at, strstr(at + 1, "\"name\":"), "median_ns")
+                    : NAN;
+        if (isnan(then) || then <= 0) {
+            printf("%-40s not in baseline\n", cases[i].name);
+            continue;
+        }
+        double now    = cases[i].result.median_ns,
+               change = (now - then) / then * 100;
+        int regressed = change > config.threshold && now - then > 3 * cases[i].result.mad_ns;
+        regressions  += regressed;
+        printf("%-40s %12.1f %12.1f %+7.1f%%%s\n", cases[i].name, then, now, change,
+            regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct bench_csv *csv[BENCH_MAX_FILES] = {0};
+    struct bench_dispatch *dispatch[5] = {0};
+    struct bench_chart *chart = 0;
+    struct bench_html html = {0};
+    char *results = 0, *baseline = 0;
+    size_t ncsv = 0;
+    glob_t files = {0};
+    int opt, ret = 1;
+    while ((opt = getopt(argc, argv, "D:f:n:s:w:o:b:t:")) != -1) {
+        switch (opt) {
+            case 'D': config.data_dir       = optarg; break;
+            case 'f': config.filter         = optarg; break;
+            case 'n': config.bench.nsamples = strtoul(optarg, 0, 10); break;
+            case 's': config.bench.sample   = strtod(optarg, 0) / 1e3; break;
+            case 'w': config.bench.warmup   = strtod(optarg, 0) / 1e3; break;
+            case 'o': config.output_path    = optarg; break;
+            case 'b': config.baseline_path  = optarg; break;
+            case 't': config.threshold      = strtod(optarg, 0); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    check(config.bench.nsamples && config.bench.nsamples <= UTIL_BENCH_MAX_SAMPLES,
+        ERR_FAIL, BENCH_ERR, "parsing arguments: samples out of range");
+
+    /*  Set up every kernel, then time them one by one. */
+    char pattern[0x400];
+    snprintf(pattern, sizeof(pattern), "%s/*.csv", config.data_dir);
+    check(!glob(pattern, 0, 0, &files) && files.gl_pathc, ERR_FAIL_A, BENCH_ERR,
+        "finding the csv files of", config.data_dir);
+    /*  Each file by libcsv and by the SIMD tokenizer. */
+    for (size_t i = 0; i < files.gl_pathc * 2 && ncsv < BENCH_MAX_FILES; ++i) {
+        char name[BENCH_MAX_NAME];
+        const char *path = files.gl_pathv[i / 2], *base = strrchr(path, '/');
+        snprintf(name, sizeof(name), "wlcsv_file_read%s/%.96s", i & 1 ? "_simd" : "",
+            base ? base + 1 : path);
+        csv[ncsv] = bench_csv_new(path, i & 1 ? WLCSV_TOKENIZER_SIMD : 0);
+        check(csv[ncsv], ERR_FAIL_A, BENCH_ERR, "setting up", name);
+        check(case_add(name, bench_csv_read, csv[ncsv++]), ERR_FAIL, BENCH_ERR, "adding");
+    }
+
+    static const struct {
+        const char                 *name;
+        wlcsv_callback_match_by_et  kind;
+        int                         miss;
+    } dispatches[] = {
+        {"callbacks_search/keyword", KEYWORD, 0}, {"callbacks_search/regex", REGEX, 0},
+        {"callbacks_search/row", ROW, 0}, {"callbacks_search/column", COLUMN, 0},
+        {"callbacks_search/miss", COLUMN, 1}
+    };
+    for (size_t i = 0; i < sizeof(dispatches) / sizeof(dispatches[0]); ++i) {
+        dispatch[i] = bench_dispatch_new(dispatches[i].kind, dispatches[i].miss);
+        check(dispatch[i], ERR_FAIL_A, BENCH_ERR, "setting up", dispatches[i].name);
+        check(case_add(dispatches[i].name, bench_dispatch, dispatch[i]), ERR_FAIL, BENCH_ERR,
+            "adding");
+    }
+
+    check(case_add("util_sql/insert_upsert", bench_sql_upsert, 0)
+        && case_add("util_sql/update_where", bench_sql_update, 0)
+        && case_add("util_sql/select_join_where", bench_sql_select, 0),
+        ERR_FAIL, BENCH_ERR, "adding");
+
+    chart = malloc(sizeof(struct bench_chart));
+    check(chart, ERR_MEM, BENCH_ERR);
+    for (size_t i = 0; i < BENCH_NENTRIES; ++i) {
+        chart->code[i][0] = (char) ('A' + i / 26 % 26);
+        chart->code[i][1] = (char) ('A' + i % 26);
+        chart->code[i][2] = '\0';
+        chart->value[i]   = (double) (i * 7919 % 100000) / 10 + 0.5;
+    }
+    check(case_add("util_json/macros_map", bench_json_macros, chart)
+        && case_add("util_json/builder_map", bench_json_builder, chart),
+        ERR_FAIL, BENCH_ERR, "adding");
+
+    html.cdata = bench_country_data_new();
+    check(html.cdata, ERR_FAIL, BENCH_ERR, "setting up country data");
+    html.html = asset_to_bstring("new.html");
+    check(html.html, ERR_FAIL, BENCH_ERR, "setting up new.html");
+    check(case_add("util_json/escape_js_quoted", bench_json_escape, &html)
+        && case_add("frmt_new_chart_html", bench_new_chart_html, &html)
+        && case_add("fill_yeardata_buffer", bench_yeardata, 0),
+        ERR_FAIL, BENCH_ERR, "adding");
+
+    printf("%s: %zu samples of %.0f ms after %.0f ms warmup, cycles %s\n", BENCH_ERR,
+        config.bench.nsamples, config.bench.sample * 1e3, config.bench.warmup * 1e3,
+        UTIL_BENCH_HAS_CYCLES ? "of the time-stamp counter" : "not available");
+    printf("%-40s %8s %12s %7s %9s %8s\n", "benchmark", "bytes", "median ns", "MAD %",
+        "MB/s", "cyc/B");
+    for (size_t i = 0; i < ncases; ++i) {
+        util_bench_result_st *r = &cases[i].result;
+        check(util_bench_run(cases[i].function, cases[i].arg, &config.bench, r),
+            ERR_FAIL_A, BENCH_ERR, "running", cases[i].name);
+        printf("%-40s %8zu %12.1f %7.2f %9.1f %8.3f\n", cases[i].name, r->bytes, r->median_ns,
+            r->mad_ns / r->median_ns * 100, (double) r->bytes / r->median_ns * 1e3,
+            r->median_cycles / (double) r->bytes);
+        fflush(stdout);
+    }
+
+    results = results_json();
+    check(results, ERR_MEM, BENCH_ERR);
+    if (config.output_path) {
+        FILE *fp = fopen(config.output_path, "w");
+        check(fp, ERR_FAIL_A, BENCH_ERR, "opening", config.output_path);
+        int written = fputs(results, fp) >= 0;
+        check(!fclose(fp) && written, ERR_FAIL_A, BENCH_ERR, "writing", config.output_path);
+    }
+    if (config.baseline_path) {
+        FILE *fp = fopen(config.baseline_path, "rb");
+        check(fp, ERR_FAIL_A, BENCH_ERR, "opening baseline", config.baseline_path);
+        bstring contents = bread((bNread) fread, fp);
+        fclose(fp);
+        check(contents, ERR_FAIL_A, BENCH_ERR, "reading baseline", config.baseline_path);
+        baseline = bstr2cstr(contents, '?');
+        bdestroy(contents);
+        check(baseline, ERR_MEM, BENCH_ERR);
+    }
+    ret = baseline && compare_baseline(baseline) ? 2 : 0;
+error:
+    for (size_t i = 0; i < ncsv; ++i) {
+        wlcsv_free(csv[i]->ctx);
+        free(csv[i]);
+    }
+    for (size_t i = 0; i < sizeof(dispatch) / sizeof(dispatch[0]); ++i)
+        if (dispatch[i]) {
+            wlcsv_free(dispatch[i]->ctx);
+            free(dispatch[i]);
+        }
+    if (html.cdata)
+        for (size_t i = 0; i < NCOUNTRY_DATA_SLOTS; ++i)
+            free(html.cdata->name[i]);
+    free(html.cdata);
+    bdestroy(html.html);
+    free(chart);
+    free(results);
+    bcstrfree(baseline);
+    globfree(&files);
+    return ret;
+}
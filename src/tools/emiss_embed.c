@@ -0,0 +1,204 @@
+/*! @file       emiss_embed.c
+    @brief      Build tool embedding the files served by [Emission](../../include/emiss.h).
+    @details    Writes a C source defining emiss_assets, a table of the files given, by their
+                paths relative to a root directory, sorted, with their content, MIME type, ETag
+                and a gzip'd variant. Usage: emiss_embed <output.c> <root> <path>...
+    @copyright: (c) Joa Käis [github.com/jiikai] 2018-2019, [MIT](../../LICENSE).
+*/
+
+/*
+**  INCLUDES
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbg.h"
+#include "miniz.h"
+#include "util_server.h"
+#include "util_sha256.h"
+
+/*
+**  MACROS
+*/
+
+#define EMBED_ERR "emiss_embed"
+
+/*  A gzip'd variant is kept if it saves at least an eighth of the size. */
+#define EMBED_GZIP_WORTH(size, gzip_size) ((gzip_size) < (size) - (size) / 8)
+
+/*  Bytes per line of an array in the output. */
+#define EMBED_BYTES_PER_LINE 16
+
+/*
+**  TYPES
+*/
+
+/*  The MIME types served by file extension. */
+static const struct {
+    const char     *extension;
+    int             mime_type;
+} embed_mime_types[] = {
+    {".html", HTML}, {".css", CSS}, {".js", JAVASCRIPT}, {".woff2", WOFF2}, {".woff", WOFF},
+    {".ttf", TTF}, {".svg", SVG_PLUS_XML_FONT}, {".eot", VND_MS_FONTOBJECT}, {".txt", TXT}
+};
+
+/*
+**  FUNCTIONS
+*/
+
+static int
+path_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static const char *
+mime_type_of(const char *path)
+{
+    size_t len = strlen(path);
+    for (size_t i = 0; i < sizeof(embed_mime_types) / sizeof(embed_mime_types[0]); ++i) {
+        size_t ext_len = strlen(embed_mime_types[i].extension);
+        if (len > ext_len && !strcmp(&path[len - ext_len], embed_mime_types[i].extension))
+            return UTIL_IANA_MIME_TYPE(embed_mime_types[i].mime_type);
+    }
+    return 0;
+}
+
+static unsigned char *
+read_file(const char *root, const char *path, size_t *size)
+{
+    char full_path[0x400];
+    unsigned char *data = 0;
+    FILE *fp = 0;
+    check(snprintf(full_path, sizeof(full_path), "%s/%s", root, path) < (int) sizeof(full_path),
+        ERR_FAIL_A, EMBED_ERR, "building path of", path);
+    fp = fopen(full_path, "rb");
+    check(fp, ERR_FAIL_A, EMBED_ERR, "opening", full_path);
+    check(!fseek(fp, 0, SEEK_END), ERR_FAIL_A, EMBED_ERR, "seeking", full_path);
+    long len = ftell(fp);
+    check(len >= 0 && !fseek(fp, 0, SEEK_SET), ERR_FAIL_A, EMBED_ERR, "seeking", full_path);
+    data = malloc((size_t) len + 1);
+    check(data, ERR_MEM, EMBED_ERR);
+    check(fread(data, 1, (size_t) len, fp) == (size_t) len, ERR_FAIL_A, EMBED_ERR,
+        "reading", full_path);
+    fclose(fp);
+    *size = (size_t) len;
+    return data;
+error:
+    if (fp)
+        fclose(fp);
+    free(data);
+    return 0;
+}
+
+/*  The same gzip member as served for the precomputed map charts. */
+static unsigned char *
+gzip_compress(const unsigned char *src, size_t len, size_t *gzip_size)
+{
+    static const unsigned char header[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 2, 3};
+    size_t deflated_size;
+    unsigned char *gzip = 0;
+    void *deflated = tdefl_compress_mem_to_heap(src, len, &deflated_size, TDEFL_MAX_PROBES_MASK);
+    check(deflated, ERR_EXTERN, "miniz", "compressing asset");
+    gzip = malloc(sizeof(header) + deflated_size + 8);
+    check(gzip, ERR_MEM, EMBED_ERR);
+    memcpy(gzip, header, sizeof(header));
+    memcpy(&gzip[sizeof(header)], deflated, deflated_size);
+    unsigned char *trailer = &gzip[sizeof(header) + deflated_size];
+    mz_ulong crc = mz_crc32(MZ_CRC32_INIT, src, len);
+    for (size_t i = 0; i < 4; ++i) {
+        trailer[i]     = (unsigned char) (crc >> 8 * i);
+        trailer[4 + i] = (unsigned char) ((uint32_t) len >> 8 * i);
+    }
+    *gzip_size = sizeof(header) + deflated_size + 8;
+error:
+    mz_free(deflated);
+    return gzip;
+}
+
+/*  Write bytes as the initializer of an array, NUL terminated past size. */
+static int
+write_array(FILE *out, const char *name, size_t i, const unsigned char *data, size_t size)
+{
+    if (fprintf(out, "static const unsigned char %s_%zu[%zu] = {", name, i, size + 1) < 0)
+        return 0;
+    for (size_t j = 0; j < size; ++j)
+        if (fprintf(out, "%s%u,", j % EMBED_BYTES_PER_LINE ? "" : "\n    ", data[j]) < 0)
+            return 0;
+    return fprintf(out, "\n    0\n};\n\n") >= 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    FILE *out = 0, *closing;
+    char *output = argc > 1 ? argv[1] : 0;
+    char (*etags)[UTIL_SHA256_HEX_LEN + 1] = 0;
+    size_t *sizes = 0, *gzip_sizes = 0;
+    check(argc > 3, ERR_FAIL, EMBED_ERR, "parsing arguments: usage: <output.c> <root> <path>...");
+    const char *root = argv[2];
+    char **paths = &argv[3];
+    size_t npaths = (size_t) argc - 3;
+    qsort(paths, npaths, sizeof(char *), path_compare);
+
+    out = fopen(output, "w");
+    check(out, ERR_FAIL_A, EMBED_ERR, "opening", output);
+    check(fprintf(out, "/*  Generated by emiss_embed from %s: do not edit. */\n\n"
+                "#include \"emiss.h\"\n\n", root) >= 0,
+        ERR_FAIL_A, EMBED_ERR, "writing", output);
+
+    /*  The content of each file and the variant of those compressing, then the table. */
+    etags      = calloc(npaths, sizeof(*etags));
+    sizes      = calloc(npaths, sizeof(size_t));
+    gzip_sizes = calloc(npaths, sizeof(size_t));
+    check(etags && sizes && gzip_sizes, ERR_MEM, EMBED_ERR);
+    for (size_t i = 0; i < npaths; ++i) {
+        check(mime_type_of(paths[i]), ERR_FAIL_A, EMBED_ERR, "finding a MIME type for", paths[i]);
+        unsigned char *data = read_file(root, paths[i], &sizes[i]);
+        check(data, ERR_FAIL_A, EMBED_ERR, "reading", paths[i]);
+        util_sha256_st hash;
+        util_sha256_init(&hash);
+        util_sha256_update(&hash, data, sizes[i]);
+        util_sha256_final_hex(&hash, etags[i]);
+        unsigned char *gzip = gzip_compress(data, sizes[i], &gzip_sizes[i]);
+        if (!gzip || !EMBED_GZIP_WORTH(sizes[i], gzip_sizes[i]))
+            gzip_sizes[i] = 0;
+        int ret = write_array(out, "asset", i, data, sizes[i])
+               && (!gzip_sizes[i] || write_array(out, "asset_gzip", i, gzip, gzip_sizes[i]));
+        free(data);
+        free(gzip);
+        check(ret, ERR_FAIL_A, EMBED_ERR, "writing", output);
+    }
+    check(fprintf(out, "const emiss_asset_st emiss_assets[] = {\n") >= 0,
+        ERR_FAIL_A, EMBED_ERR, "writing", output);
+    for (size_t i = 0; i < npaths; ++i) {
+        int ret = fprintf(out, "    {\"%s\", \"%s\", \"\\\"%.16s\\\"\", asset_%zu, %zu, ",
+                    paths[i], mime_type_of(paths[i]), etags[i], i, sizes[i]);
+        ret = ret < 0 ? ret : gzip_sizes[i]
+            ? fprintf(out, "asset_gzip_%zu, %zu},\n", i, gzip_sizes[i])
+            : fprintf(out, "0, 0},\n");
+        check(ret >= 0, ERR_FAIL_A, EMBED_ERR, "writing", output);
+    }
+    check(fprintf(out, "};\n\nconst size_t emiss_nassets = %zu;\n", npaths) >= 0,
+        ERR_FAIL_A, EMBED_ERR, "writing", output);
+    closing = out;
+    out     = 0;
+    check(!fclose(closing), ERR_FAIL_A, EMBED_ERR, "closing", output);
+    free(etags);
+    free(sizes);
+    free(gzip_sizes);
+    return 0;
+error:
+    free(etags);
+    free(sizes);
+    free(gzip_sizes);
+    if (out)
+        fclose(out);
+    /*  Nothing is left for make to take as up to date. */
+    if (output && argc > 3)
+        remove(output);
+    return 1;
+}
@@ -11,10 +11,19 @@
 
 #include "wlcsv.h"
 #include <ctype.h>
+#include <limits.h>
+#include <locale.h>
+#include <math.h>
 #include <stdalign.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include "dbg.h"
+#include "uthash.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define TOKENIZER_X86 1
+    #include <immintrin.h>
+#endif
 
 /*
 **  MACROS
@@ -36,20 +45,104 @@
 #define CONTAINER_OF(pointer, type, member)\
     ((type *)((char *)(pointer) - offsetof(type, member)))
 
+/*  Number of bytes classified at once by the SIMD tokenizer, one bit per byte in a mask. */
+#define TOKENIZER_BLOCK_SIZE 64
+
+/*  Default size of the chunks read from a file by wlcsv_file_read(). */
+#define WLCSV_READ_CHUNK_SIZE 0x10000
+
+/*  Fields longer than this are not memoized per column by the ignore regex. */
+#define IGNORE_MEMO_LEN 48
+
+/*  PCRE before 8.20 has no JIT; studying then merely optimizes the pattern. */
+#ifndef PCRE_STUDY_JIT_COMPILE
+    #define PCRE_STUDY_JIT_COMPILE 0
+#endif
+
+/*  The state of libcsv between the fields of a row begun, private to libcsv.c. */
+#define LIBCSV_FIELD_NOT_BEGUN 1
+
+/*  Space or tab, as trimmed from field edges by libcsv. */
+#define TOKENIZER_IS_SPACE(c)\
+    ((c) == CSV_SPACE || (c) == CSV_TAB)
+
 /*
 **  STRUCTURES & TYPES
 */
 
+/*  Character class bitmasks of a single tokenizer block. */
+struct block_masks {
+    uint64_t                        delim;
+    uint64_t                        quote;
+    uint64_t                        term;
+};
+
+/*  A function type for block classifiers, selected at runtime by CPU support. */
+typedef void block_classify_ft(const uint8_t *block, uint8_t delim, uint8_t quote,
+    struct block_masks *masks);
+
+/*  A compiled, studied (and if possible JIT-compiled) PCRE regex.
+
+    @member code, extra:        The compiled pattern and its study data.
+    @member min_length:         Shortest possible match length, or -1 if not known.
+    @member numeric_excluded:   Whether no match can occur within a number (see
+                                regex_excludes_numeric()), letting numeric fields skip PCRE.
+*/
+struct regex {
+    pcre                           *code;
+    pcre_extra                     *extra;
+    int                             min_length;
+    bool                            numeric_excluded;
+};
+
+/*  Lower bounds for any match of a regex fragment, as derived by regex_bound_alt().
+
+    @member excluded:       No match can occur within a number.
+    @member non_numeric:    Every match contains a byte that no number does.
+    @member dots:           Every match contains at least this many '.' (capped at 2).
+*/
+struct regex_bound {
+    bool                            excluded;
+    bool                            non_numeric;
+    unsigned                        dots;
+};
+
+/*  The ignore regex decision last made for a column. */
+struct ignore_memo {
+    bool                            valid;
+    bool                            ignore;
+    uint8_t                         len;
+    char                            text[IGNORE_MEMO_LEN];
+};
+
+/*  A csv stream being pushed in chunks, see wlcsv_push(). Input not yet tokenized, i.e. the
+    field still incomplete at the end of the last chunk, is kept in buf. */
+struct push_state {
+    uint8_t                        *buf;
+    size_t                          len;
+    size_t                          capacity;
+    size_t                          parsed;
+    unsigned                        skipped;
+    bool                            active;
+    bool                            libcsv;
+    bool                            row_begun;
+};
+
 struct wlcsv_callback_entry {
     bool                            once;
+    bool                            active;
+    uint8_t                         id;
     wlcsv_callback_match_by_et      match_by;
     union {
         unsigned                    row_or_col;
         char                       *key;
-        pcre                       *rgx;
     };
+    struct regex                    rgx;
+    wlcsv_value_type_et             type;
     wlcsv_callback_ft              *function;
+    wlcsv_typed_callback_ft        *typed_function;
     void                           *data;
+    UT_hash_handle                  hh;
 };
 
 /*  Main context @struct for wlcsv.
@@ -57,39 +150,56 @@ struct wlcsv_callback_entry {
     @member parser:         The csv parser structure from [libcsv](../include/dep/csv.h).
     @member path, path_len: Path to the csv file to be parsed next and its length.
     @member ignore_regex:   PCRE regular expression, on match the field is ignored.
+    @member ignore_memo,
+            ignore_memo_count:  Per column, the last field text tested against ignore_regex and
+                                the decision made, and the number of columns covered.
     @member callbacks:      An anonymous inner @struct, containing:
         @member eor_callback:   An optional, user-provided function called at the end of every row.
-        @member tb, tbl_length: Table of callback entries and their count.
-        @member tbl_idx_skip:   An array for traversing the table omitting disabled callbacks.
-        @member tbl_idx_type:   The starting indices for each type of callback.
-        @member tbl_offs_col:   A count of (active) COLUMN callbacks encountered earlier on the row.
+        @member tbl, tbl_length,
+                tbl_capacity:   Table of callback entries indexed by id, its used and allocated size.
+        @member compiled:       Whether the lookup structures below reflect the table.
+        @member key_hash:       Active KEYWORD entries hashed by key.
+        @member row_hash:       Active ROW entries hashed by row number.
+        @member rgx_ids:        Ids of active REGEX entries in the order they are tried.
+        @member col_ids:        Ids of active COLUMN entries indexed directly by column number.
+        @member row_cached,
+                row_id:         The row last looked up from row_hash and the id found for it.
     @member state:          A structure storing the current state of parsing.
+    @member push:           State of a stream being parsed with wlcsv_push().
+    @member block_classify: Block classifier used by the SIMD tokenizer.
 
-    @remark tbl_offs_col is nullified internally after each row.
+    @remark The lookup structures are rebuilt lazily by callbacks_compile() on the first field
+    after any change to the table, so that finding a callback costs one hash lookup per keyword
+    field, one per row and an array index per column; only regexes are tried one by one.
     @remark ROW callbacks are automatically disabled after the relevant row has passed.
-    @remark The callback table tbl is traversed using skip_idx as follows:
-        0. Initialize i = 0.
-        Repeat:
-        1. If skip_idx[i] == UINT8_MAX, quit. Otherwise inspect callback entry at tbl[skip_idx[i]].
-        2. If a match is found, return the index number skip_idx[i].
-           Otherwise set i = skip_idx[skip_idx[i]].
 */
 
 struct wlcsv_ctx {
     struct csv_parser           parser;
     size_t                      path_len;
     char                       *path;
-    pcre                       *ignore_regex;
+    struct regex                ignore_regex;
+    struct ignore_memo         *ignore_memo;
+    unsigned                    ignore_memo_count;
     struct {
         wlcsv_callback_ft          *preview_callback;
         wlcsv_eor_callback_ft      *eor_callback;
-        wlcsv_callback_entry_st    *tbl[WLCSV_NCALLBACKS_MAX];
-        uint8_t                     tbl_length;
-        uint8_t                     tbl_idx_skip[WLCSV_NCALLBACKS_MAX];
-        uint8_t                     tbl_idx_type[WLCSV_NCALLBACK_MATCH_TYPES];
-        uint8_t                     tbl_offs_col;
+        wlcsv_callback_entry_st   **tbl;
+        unsigned                    tbl_length;
+        unsigned                    tbl_capacity;
+        bool                        compiled;
+        wlcsv_callback_entry_st    *key_hash;
+        wlcsv_callback_entry_st    *row_hash;
+        uint8_t                    *rgx_ids;
+        unsigned                    rgx_count;
+        uint8_t                    *col_ids;
+        unsigned                    col_count;
+        unsigned                    row_cached;
+        uint8_t                     row_id;
     } callbacks;
     wlcsv_state_st              state;
+    struct push_state           push;
+    block_classify_ft          *block_classify;
 };
 
 /*
@@ -98,103 +208,567 @@ struct wlcsv_ctx {
 
 /*  STATIC */
 
-static inline int
-file_skip_lines(FILE *fp, int line_offset)
+/*  REGEX PREFILTER
+
+    A pattern is scanned for what any of its matches must contain: a byte that cannot occur in a
+    number (anything but digits, '.', 'e', 'E', '+' and '-') or at least two '.'. If either holds
+    for every alternative, no match can occur within a number, and numeric fields need not be
+    passed to PCRE at all. Constructs not understood make the scan give up conservatively. */
+
+static struct regex_bound
+regex_bound_alt(const char **p, bool *ok);
+
+static inline struct regex_bound
+regex_bound_literal(char c)
 {
-    char buffer[0x1000];
-    int i = 0;
-    while (i < line_offset && fgets(buffer, 0xFFF, fp))
-        ++i;
-    return i;
+    bool non_numeric = !isdigit((unsigned char) c) && !strchr(".eE+-", c);
+    return (struct regex_bound){non_numeric, non_numeric, c == '.'};
+}
+
+/*  Skip over a character class, whose bounds are conservatively left empty. */
+static inline bool
+regex_skip_class(const char **p)
+{
+    const char *c = *p + 1;
+    if (*c == '^')
+        ++c;
+    if (*c == ']')
+        ++c;
+    for (; *c && *c != ']'; ++c)
+        if (*c == '\\' && c[1])
+            ++c;
+        else if (*c == '[' && c[1] == ':') {
+            const char *end = strstr(c, ":]");
+            if (!end)
+                return false;
+            c = end + 1;
+        }
+    if (!*c)
+        return false;
+    *p = c + 1;
+    return true;
+}
+
+/*  Parse a group opened at *p, advancing past its closing parenthesis. */
+static struct regex_bound
+regex_bound_group(const char **p, bool *ok, bool *zero_width)
+{
+    struct regex_bound bound = {false, false, 0};
+    const char *c = *p + 1;
+    *zero_width = false;
+    if (*c == '?') {
+        ++c;
+        if (*c == ':' || *c == '|')
+            ++c;
+        else if (*c == '=' || *c == '!' || (*c == '<' && (c[1] == '=' || c[1] == '!'))) {
+            c += *c == '<' ? 2 : 1;
+            *zero_width = true;
+        } else if (*c == '<' || *c == '\'' || (*c == 'P' && c[1] == '<')) {
+            char close = *c == '\'' ? '\'' : '>';
+            c = strchr(c, close);
+            if (!c)
+                goto BAIL;
+            ++c;
+        } else {
+            /* Option settings, of which extended mode would change what is literal. */
+            while (*c && strchr("imsJU-", *c))
+                ++c;
+            if (*c == ')') {
+                *p = c + 1;
+                *zero_width = true;
+                return bound;
+            }
+            if (*c != ':')
+                goto BAIL;
+            ++c;
+        }
+    }
+    *p = c;
+    struct regex_bound inner = regex_bound_alt(p, ok);
+    if (!*ok || **p != ')')
+        goto BAIL;
+    ++*p;
+    return *zero_width ? bound : inner;
+BAIL:
+    *ok = false;
+    return bound;
+}
+
+/*  Parse a concatenation of quantified atoms up to '|', ')' or the end of the pattern. */
+static struct regex_bound
+regex_bound_seq(const char **p, bool *ok)
+{
+    struct regex_bound seq = {false, false, 0};
+    while (*ok && **p && **p != '|' && **p != ')') {
+        struct regex_bound atom = {false, false, 0};
+        bool zero_width = false;
+        char c = **p;
+        switch (c) {
+            case '(':
+                atom = regex_bound_group(p, ok, &zero_width);
+                break;
+            case '[':
+                *ok = regex_skip_class(p);
+                break;
+            case '\\':
+                c = (*p)[1];
+                if (!c || (isalnum((unsigned char) c) && !strchr("dDwWsSbBAzZG", c)))
+                    *ok = false;
+                else if (isalnum((unsigned char) c))
+                    zero_width = strchr("bBAzZG", c) != NULL;
+                else
+                    atom = regex_bound_literal(c);
+                *p += 2;
+                break;
+            case '^':
+            case '$':
+                zero_width = true;
+                ++*p;
+                break;
+            case '*':
+            case '+':
+            case '?':
+            case '{':
+                *ok = false;
+                break;
+            case '.':
+                ++*p;
+                break;
+            default:
+                atom = regex_bound_literal(c);
+                ++*p;
+        }
+        if (!*ok)
+            break;
+        unsigned min = 1;
+        c = **p;
+        if (c == '*' || c == '?') {
+            min = 0;
+            ++*p;
+        } else if (c == '+')
+            ++*p;
+        else if (c == '{') {
+            char *end;
+            min = strtoul(*p + 1, &end, 10);
+            if (end == *p + 1)
+                *ok = false;
+            else {
+                if (*end == ',')
+                    while (isdigit((unsigned char) *++end));
+                if (*end != '}')
+                    *ok = false;
+                *p = end + 1;
+            }
+        } else
+            c = 0;
+        if (c && (**p == '?' || **p == '+'))
+            ++*p;
+        if (zero_width || !min)
+            continue;
+        seq.dots += atom.dots && min > 1 ? 2 : atom.dots;
+        if (seq.dots > 2)
+            seq.dots = 2;
+        seq.non_numeric |= atom.non_numeric;
+        seq.excluded |= atom.excluded || seq.non_numeric || seq.dots == 2;
+    }
+    return seq;
+}
+
+/*  Parse an alternation, of which every branch must satisfy a bound for the whole to do so. */
+static struct regex_bound
+regex_bound_alt(const char **p, bool *ok)
+{
+    struct regex_bound alt = regex_bound_seq(p, ok);
+    while (*ok && **p == '|') {
+        ++*p;
+        struct regex_bound seq = regex_bound_seq(p, ok);
+        alt.excluded &= seq.excluded;
+        alt.non_numeric &= seq.non_numeric;
+        if (seq.dots < alt.dots)
+            alt.dots = seq.dots;
+    }
+    return alt;
+}
+
+/*  Whether no match of pattern can occur within a number, i.e. a field consisting only of
+    digits, 'e', 'E', '+', '-' and at most a single '.'. */
+static bool
+regex_excludes_numeric(const char *pattern)
+{
+    bool ok = true;
+    struct regex_bound bound = regex_bound_alt(&pattern, &ok);
+    return ok && !*pattern && bound.excluded;
+}
+
+static inline bool
+field_is_numeric(const char *str, size_t len)
+{
+    unsigned dots = 0;
+    for (size_t i = 0; i < len; ++i) {
+        char c = str[i];
+        if (c == '.') {
+            if (++dots > 1)
+                return false;
+        } else if (!isdigit((unsigned char) c) && c != 'e' && c != 'E' && c != '+' && c != '-')
+            return false;
+    }
+    return true;
+}
+
+static void
+regex_free(struct regex *rgx)
+{
+    if (rgx->extra)
+        pcre_free_study(rgx->extra);
+    if (rgx->code)
+        pcre_free(rgx->code);
+    memset(rgx, 0, sizeof(*rgx));
+}
+
+static int
+regex_compile(struct regex *rgx, const char *pattern)
+{
+    const char *error_msg;
+    int error_offset;
+    memset(rgx, 0, sizeof(*rgx));
+    rgx->code = pcre_compile(pattern, 0, &error_msg, &error_offset, 0);
+    check(rgx->code, ERR_EXTERN_AT, "PCRE", error_msg, error_offset);
+    rgx->extra = pcre_study(rgx->code, PCRE_STUDY_JIT_COMPILE, &error_msg);
+    if (error_msg)
+        log_warn(ERR_EXTERN, "PCRE", error_msg);
+    if (pcre_fullinfo(rgx->code, rgx->extra, PCRE_INFO_MINLENGTH, &rgx->min_length))
+        rgx->min_length = -1;
+    rgx->numeric_excluded = regex_excludes_numeric(pattern);
+    return 1;
+error:
+    return 0;
+}
+
+/*  Whether a field is known not to match without running PCRE. */
+static inline bool
+regex_prefilter(const struct regex *rgx, const char *str, size_t len)
+{
+    return (rgx->min_length > 0 && len < (size_t) rgx->min_length)
+        || (rgx->numeric_excluded && field_is_numeric(str, len));
+}
+
+static inline bool
+regex_exec(const struct regex *rgx, const char *str, size_t len)
+{
+    int ret = pcre_exec(rgx->code, rgx->extra, str, len, 0, 0, 0, 0);
+    if (ret >= 0)
+        return true;
+    if (ret != PCRE_ERROR_NOMATCH)
+        log_err(ERR_EXTERN_AT, "PCRE", "matching error", ret);
+    return false;
+}
+
+/*  Test a field against the ignore regex. Decisions are memoized per column, as columns such as
+    indicator names and codes tend to repeat the same value on every row. */
+static bool
+ignore_regex_match(wlcsv_ctx_st *ctx, const char *str, size_t len)
+{
+    const struct regex *rgx = &ctx->ignore_regex;
+    if (regex_prefilter(rgx, str, len))
+        return false;
+    unsigned col = ctx->state.col;
+    struct ignore_memo *memo = NULL;
+    if (len <= IGNORE_MEMO_LEN) {
+        if (col >= ctx->ignore_memo_count) {
+            unsigned count = col < 16 ? 16 : col * 2;
+            memo = realloc(ctx->ignore_memo, count * sizeof(struct ignore_memo));
+            if (memo) {
+                memset(&memo[ctx->ignore_memo_count], 0,
+                    (count - ctx->ignore_memo_count) * sizeof(struct ignore_memo));
+                ctx->ignore_memo = memo;
+                ctx->ignore_memo_count = count;
+            }
+        }
+        if (col < ctx->ignore_memo_count) {
+            memo = &ctx->ignore_memo[col];
+            if (memo->valid && memo->len == len && !memcmp(memo->text, str, len))
+                return memo->ignore;
+        } else
+            memo = NULL;
+    }
+    bool ignore = regex_exec(rgx, str, len);
+    if (memo) {
+        memo->valid = true;
+        memo->ignore = ignore;
+        memo->len = len;
+        memcpy(memo->text, str, len);
+    }
+    return ignore;
+}
+
+/*  NUMBER PARSING
+
+    Typed fields are parsed in place, without copying or regard to the current locale. Integers
+    are accumulated with overflow checks. A decimal with at most 19 significant digits, a mantissa
+    of at most 2^53 and a power of ten within +-22 is converted exactly by a single multiplication
+    or division (Clinger's fast path); anything else is handed to strtod(), on a copy with '.'
+    replaced by the locale decimal point. */
+
+static const double pow10_exact[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static bool
+number_parse_int64(const char *str, size_t len, int64_t *out)
+{
+    const char *p = str, *end = str + len;
+    bool negative = false;
+    if (p < end && (*p == '+' || *p == '-'))
+        negative = *p++ == '-';
+    if (p == end)
+        return false;
+    uint64_t limit = negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX, value = 0;
+    for (; p < end; ++p) {
+        unsigned digit = (unsigned char) *p - '0';
+        if (digit > 9 || value > (limit - digit) / 10)
+            return false;
+        value = value * 10 + digit;
+    }
+    *out = negative ? (int64_t) (0 - value) : (int64_t) value;
+    return true;
+}
+
+static bool
+number_parse_double_slow(const char *str, size_t len, double *out)
+{
+    const char *point = localeconv()->decimal_point;
+    size_t point_len = strlen(point);
+    char buffer[128], *copy = buffer, *end;
+    size_t size = len * point_len + 1;
+    if (size > sizeof(buffer) && !(copy = malloc(size)))
+        return false;
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i)
+        if (str[i] == '.') {
+            memcpy(&copy[n], point, point_len);
+            n += point_len;
+        } else
+            copy[n++] = str[i];
+    copy[n] = '\0';
+    *out = strtod(copy, &end);
+    bool ok = end == copy + n;
+    if (copy != buffer)
+        free(copy);
+    return ok;
+}
+
+static bool
+number_parse_double(const char *str, size_t len, double *out)
+{
+    const char *p = str, *end = str + len;
+    bool negative = false, digits = false, truncated = false;
+    if (p < end && (*p == '+' || *p == '-'))
+        negative = *p++ == '-';
+    uint64_t mantissa = 0;
+    int significant = 0, exp10 = 0;
+    for (; p < end && isdigit((unsigned char) *p); ++p, digits = true)
+        if (significant < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            significant += mantissa != 0;
+        } else {
+            truncated |= *p != '0';
+            ++exp10;
+        }
+    if (p < end && *p == '.') {
+        for (++p; p < end && isdigit((unsigned char) *p); ++p, digits = true)
+            if (significant < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                significant += mantissa != 0;
+                --exp10;
+            } else
+                truncated |= *p != '0';
+    }
+    if (!digits)
+        return false;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        bool exp_negative = false;
+        int exp = 0;
+        if (++p < end && (*p == '+' || *p == '-'))
+            exp_negative = *p++ == '-';
+        if (p == end)
+            return false;
+        for (; p < end && isdigit((unsigned char) *p); ++p)
+            if (exp < 100000)
+                exp = exp * 10 + (*p - '0');
+        exp10 += exp_negative ? -exp : exp;
+    }
+    if (p != end)
+        return false;
+    if (!mantissa) {
+        *out = negative ? -0.0 : 0.0;
+        return true;
+    }
+    if (truncated || mantissa > (UINT64_C(1) << 53) || exp10 < -22 || exp10 > 22)
+        return number_parse_double_slow(str, len, out);
+    double value = (double) mantissa;
+    value = exp10 < 0 ? value / pow10_exact[-exp10] : value * pow10_exact[exp10];
+    *out = negative ? -value : value;
+    return true;
+}
+
+static inline void
+number_parse(wlcsv_value_st *value, wlcsv_value_type_et type, const char *str, size_t len)
+{
+    value->type = type;
+    value->status = WLCSV_VALUE_OK;
+    if (!str || !len)
+        value->status = WLCSV_VALUE_EMPTY;
+    else if (type == WLCSV_INT64 ? !number_parse_int64(str, len, &value->i64)
+                : !number_parse_double(str, len, &value->f64))
+        value->status = WLCSV_VALUE_MALFORMED;
+    if (value->status == WLCSV_VALUE_OK)
+        return;
+    if (type == WLCSV_INT64)
+        value->i64 = 0;
+    else
+        value->f64 = NAN;
+}
+
+static inline void
+callbacks_entry_free(wlcsv_callback_entry_st *entry)
+{
+    if (entry->match_by == REGEX)
+        regex_free(&entry->rgx);
+    else if (entry->match_by == KEYWORD)
+        free(entry->key);
+    free(entry);
+}
+
+/*  Invalidate the lookup structures. Must precede freeing any entry, as the hash heads are
+    entries themselves. */
+static inline void
+callbacks_decompile(wlcsv_ctx_st *ctx)
+{
+    HASH_CLEAR(hh, ctx->callbacks.key_hash);
+    HASH_CLEAR(hh, ctx->callbacks.row_hash);
+    ctx->callbacks.compiled = false;
 }
 
 static inline void
 callbacks_clear_all(wlcsv_ctx_st *ctx, bool final)
 {
     wlcsv_callback_entry_st **tbl = ctx->callbacks.tbl;
-    uint8_t length = ctx->callbacks.tbl_length;
-    for (uint8_t i = final ? 0 : 1; i < length; ++i)
+    if (!tbl)
+        return;
+    callbacks_decompile(ctx);
+    for (unsigned i = final ? 0 : 1; i < ctx->callbacks.tbl_length; ++i)
         if (tbl[i]) {
-            if (tbl[i]->match_by == REGEX)
-                pcre_free(tbl[i]->rgx);
-            else if (tbl[i]->match_by == KEYWORD)
-                free(tbl[i]->key);
-            free(tbl[i]);
+            callbacks_entry_free(tbl[i]);
             tbl[i] = NULL;
         }
 
-    if (!final) {
-        memset(ctx->callbacks.tbl_idx_skip, 0, sizeof(ctx->callbacks.tbl_idx_skip));
-        ctx->callbacks.tbl_idx_skip[DEFAULT_CALLBACK_IDX] = UINT8_MAX;
+    if (final) {
+        free(tbl);
+        free(ctx->callbacks.rgx_ids);
+        free(ctx->callbacks.col_ids);
+    } else
+        ctx->callbacks.tbl_length = DEFAULT_CALLBACK_IDX + 1;
+}
+
+/*  Rebuild the lookup structures from the active entries of the callback table. The table is
+    walked from the most recent entry backwards, so that among entries matching the same key,
+    row or column the one set last takes precedence. */
+static int
+callbacks_compile(wlcsv_ctx_st *ctx)
+{
+    wlcsv_callback_entry_st **tbl = ctx->callbacks.tbl, *found;
+    unsigned i, ncols = 0;
+    callbacks_decompile(ctx);
+    for (i = DEFAULT_CALLBACK_IDX + 1; i < ctx->callbacks.tbl_length; ++i)
+        if (tbl[i] && tbl[i]->active && tbl[i]->match_by == COLUMN && tbl[i]->row_or_col >= ncols)
+            ncols = tbl[i]->row_or_col + 1;
+    if (ncols > ctx->callbacks.col_count) {
+        uint8_t *col_ids = realloc(ctx->callbacks.col_ids, ncols);
+        check(col_ids, ERR_MEM, WLCSV);
+        ctx->callbacks.col_ids = col_ids;
     }
+    if (ncols)
+        memset(ctx->callbacks.col_ids, UINT8_MAX, ncols);
+    ctx->callbacks.col_count = ncols;
+    ctx->callbacks.rgx_count = 0;
+
+    for (i = ctx->callbacks.tbl_length - 1; i > DEFAULT_CALLBACK_IDX; --i) {
+        wlcsv_callback_entry_st *entry = tbl[i];
+        if (!entry || !entry->active)
+            continue;
+        switch (entry->match_by) {
+            case KEYWORD:
+                HASH_FIND_STR(ctx->callbacks.key_hash, entry->key, found);
+                if (!found)
+                    HASH_ADD_KEYPTR(hh, ctx->callbacks.key_hash,
+                        entry->key, strlen(entry->key), entry);
+                break;
+            case REGEX:
+                ctx->callbacks.rgx_ids[ctx->callbacks.rgx_count++] = entry->id;
+                break;
+            case ROW:
+                HASH_FIND(hh, ctx->callbacks.row_hash, &entry->row_or_col,
+                    sizeof(unsigned), found);
+                if (!found)
+                    HASH_ADD(hh, ctx->callbacks.row_hash, row_or_col, sizeof(unsigned), entry);
+                break;
+            case COLUMN:
+                if (ctx->callbacks.col_ids[entry->row_or_col] == UINT8_MAX)
+                    ctx->callbacks.col_ids[entry->row_or_col] = entry->id;
+                break;
+        }
+    }
+    ctx->callbacks.row_cached = UINT_MAX;
+    ctx->callbacks.compiled = true;
+    return 1;
+error:
+    return 0;
 }
 
 /* Enable/disable a callback. */
 static inline void
 callbacks_toggle(wlcsv_ctx_st *ctx, uint8_t i)
 {
-    uint8_t *skip_idx = ctx->callbacks.tbl_idx_skip;
-    uint8_t j, prev, next = skip_idx[i];
-    /*  Locate the first active preceding callback index.
-        Entry skip_idx[0] houses the index of the first active entry. */
-    for (j = 0, prev = skip_idx[0]; prev < i; prev = skip_idx[j])
-        j = prev;
-
-    if (ctx->callbacks.tbl[i]->match_by == COLUMN) {
-        uint8_t col_offs = ctx->callbacks.tbl_offs_col;
-        if (next && i == col_offs)
-             ctx->callbacks.tbl_offs_col = skip_idx[i];
-        else if (!next && i < col_offs)
-            ctx->callbacks.tbl_offs_col = i;
-    }
-    uint8_t tmp = skip_idx[j];
-    skip_idx[j] = next ? next : i;
-    skip_idx[i] = next ? 0 : tmp;
+    ctx->callbacks.tbl[i]->active = !ctx->callbacks.tbl[i]->active;
+    callbacks_decompile(ctx);
 }
 
 static inline uint8_t
 callbacks_search(wlcsv_ctx_st *ctx, const char *field_str, size_t len)
 {
-    wlcsv_callback_entry_st **tbl = ctx->callbacks.tbl;
+    if (!ctx->callbacks.compiled && !callbacks_compile(ctx))
+        return UINT8_MAX;
+    wlcsv_callback_entry_st **tbl = ctx->callbacks.tbl, *found;
     unsigned  col = ctx->state.col,
               row = ctx->state.row;
-    uint8_t *skip_idx = ctx->callbacks.tbl_idx_skip;
-    uint8_t i,
-        rgx_i = ctx->callbacks.tbl_idx_type[REGEX],
-        row_i = ctx->callbacks.tbl_idx_type[ROW],
-        col_i = ctx->callbacks.tbl_idx_type[COLUMN],
-        col_offs = ctx->callbacks.tbl_offs_col;
-    for (i = skip_idx[0]; i < rgx_i; i = skip_idx[i]) {
-        int ret = strncmp(field_str, tbl[i]->key, len);
-        if (!ret)
-            goto MATCH;
-        if (ret < 0) {
-            i = skip_idx[i];
-            break;
+    uint8_t i;
+    if (field_str) {
+        if (ctx->callbacks.key_hash) {
+            HASH_FIND(hh, ctx->callbacks.key_hash, field_str, len, found);
+            if (found) {
+                i = found->id;
+                goto MATCH;
+            }
+        }
+        for (unsigned j = 0; j < ctx->callbacks.rgx_count; ++j) {
+            i = ctx->callbacks.rgx_ids[j];
+            if (!regex_prefilter(&tbl[i]->rgx, field_str, len)
+                    && regex_exec(&tbl[i]->rgx, field_str, len))
+                goto MATCH;
         }
     }
-    for (i = i; i < row_i; i = skip_idx[i]) {
-        int ret = pcre_exec(tbl[i]->rgx, 0, field_str, len, 0, 0, 0, 0);
-        if (ret >= 0)
+    if (ctx->callbacks.row_hash) {
+        if (ctx->callbacks.row_cached != row) {
+            HASH_FIND(hh, ctx->callbacks.row_hash, &row, sizeof(unsigned), found);
+            ctx->callbacks.row_cached = row;
+            ctx->callbacks.row_id = found ? found->id : UINT8_MAX;
+        }
+        if ((i = ctx->callbacks.row_id) != UINT8_MAX)
             goto MATCH;
-        else if (ret != PCRE_ERROR_NOMATCH)
-            log_err(ERR_EXTERN_AT, "PCRE", "matching error", ret);
     }
-    uint8_t j = UINT8_MAX;
-    for (i = i; i < col_i; i = j) {
-        if (tbl[i]->row_or_col == row)
-            goto MATCH;
-        j = skip_idx[i];
-        if (tbl[i]->row_or_col < row)
-            callbacks_toggle(ctx, i);
-    }
-    i = col_offs;
-    for (i = col_offs; i != UINT8_MAX; i = skip_idx[i])
-        if (tbl[i]->row_or_col <= col) {
-            ctx->callbacks.tbl_offs_col = skip_idx[i];
-            if (tbl[i]->row_or_col == col)
-                goto MATCH;
-        }
+    if (col < ctx->callbacks.col_count && (i = ctx->callbacks.col_ids[col]) != UINT8_MAX)
+        goto MATCH;
 
     return UINT8_MAX;
 MATCH:
@@ -206,49 +780,27 @@ MATCH:
 static inline uint8_t
 callbacks_enlist(wlcsv_ctx_st *ctx, wlcsv_callback_entry_st *entry)
 {
-    wlcsv_callback_match_by_et type = entry->match_by;
-    wlcsv_callback_entry_st **tbl = ctx->callbacks.tbl;
-    uint8_t i = ctx->callbacks.tbl_idx_type[type];
-    if (!tbl[i])
-        tbl[i] = entry;
-    else {
-        wlcsv_callback_entry_st *elem = tbl[i];
-        if (type == COLUMN || type == ROW)
-            while (elem && elem->row_or_col < entry->row_or_col)
-                elem = tbl[++i];
-        else
-            while (elem && strcmp(elem->key, entry->key) < 0)
-                elem = tbl[++i];
-        if (!elem)
-            tbl[i] = entry;
-        else {
-            uint8_t j = i + 1;
-            while (tbl[j])
-                ++j;
-            while (j >= i) {
-                tbl[j] = tbl[j - 1];
-                --j;
-            }
-            tbl[i] = entry;
-        }
+    unsigned length = ctx->callbacks.tbl_length;
+    check(length < WLCSV_NCALLBACKS_MAX, ERR_FAIL_N, WLCSV,
+        "enlisting: callback table full, maximum", WLCSV_NCALLBACKS_MAX);
+    if (length == ctx->callbacks.tbl_capacity) {
+        unsigned capacity = length * 2 < WLCSV_NCALLBACKS_MAX ? length * 2 : WLCSV_NCALLBACKS_MAX;
+        wlcsv_callback_entry_st **tbl = realloc(ctx->callbacks.tbl, capacity * sizeof(*tbl));
+        check(tbl, ERR_MEM, WLCSV);
+        ctx->callbacks.tbl = tbl;
+        uint8_t *rgx_ids = realloc(ctx->callbacks.rgx_ids, capacity);
+        check(rgx_ids, ERR_MEM, WLCSV);
+        ctx->callbacks.rgx_ids = rgx_ids;
+        ctx->callbacks.tbl_capacity = capacity;
     }
-    callbacks_toggle(ctx, i);
-    return i;
-}
-
-static inline void
-callbacks_reset(struct wlcsv_ctx *ctx)
-{
-    wlcsv_callback_entry_st **tbl = ctx->callbacks.tbl;
-    ctx->callbacks.tbl_offs_col = ctx->callbacks.tbl_idx_type[COLUMN];
-    uint8_t i,
-            length = ctx->callbacks.tbl_length,
-           *skip_idx = ctx->callbacks.tbl_idx_skip;
-    for (i = 0; i < length - 1; ++i)
-        if (tbl[i + 1])
-            skip_idx[i] = i + 1;
-
-    skip_idx[i] = UINT8_MAX;
+    entry->id = length;
+    entry->active = true;
+    ctx->callbacks.tbl[length] = entry;
+    ctx->callbacks.tbl_length = length + 1;
+    ctx->callbacks.compiled = false;
+    return length;
+error:
+    return UINT8_MAX;
 }
 
 static void
@@ -260,21 +812,20 @@ callbacks_forward(void *field, size_t len, void *data)
                     : false;
     if (process) {
         const char *str = (const char *)field;
-        if (field && len && ctx->ignore_regex) {
-            /* Check if this field should be ignored. */
-            int ret = pcre_exec(ctx->ignore_regex, 0,
-                        str, len, 0, 0, 0, 0);
-            if (ret >= 0)
-                goto CONTINUE;
-            if (ret != PCRE_ERROR_NOMATCH)
-                log_err(ERR_EXTERN_AT, "PCRE", "matching error", ret);
-        }
+        /* Check if this field should be ignored. */
+        if (field && len && ctx->ignore_regex.code && ignore_regex_match(ctx, str, len))
+            goto CONTINUE;
         wlcsv_callback_entry_st **tbl = ctx->callbacks.tbl;
         uint8_t i = callbacks_search(ctx, str, len);
-        if (i != UINT8_MAX)
-            tbl[i]->function(field, len,
-                    (tbl[i]->data ? tbl[i]->data : DEFAULT_CALLBACK_DATA(tbl)));
-        else if (tbl[DEFAULT_CALLBACK_IDX]->function)
+        if (i != UINT8_MAX) {
+            void *cb_data = tbl[i]->data ? tbl[i]->data : DEFAULT_CALLBACK_DATA(tbl);
+            if (tbl[i]->type != WLCSV_TEXT) {
+                wlcsv_value_st value;
+                number_parse(&value, tbl[i]->type, str, len);
+                tbl[i]->typed_function(&value, cb_data);
+            } else
+                tbl[i]->function(field, len, cb_data);
+        } else if (tbl[DEFAULT_CALLBACK_IDX]->function)
             DEFAULT_CALLBACK(tbl, field, len, DEFAULT_CALLBACK_DATA(tbl));
     }
 CONTINUE:
@@ -300,16 +851,15 @@ static void
 callbacks_eor(int terminator, void *data)
 {
     struct wlcsv_ctx *ctx = (struct wlcsv_ctx *)data;
-    uint8_t first_col_match = ctx->callbacks.tbl_idx_type[COLUMN];
-    uint8_t *skip_idx = ctx->callbacks.tbl_idx_skip;
-    while (!skip_idx[first_col_match]) {
-        if (first_col_match == ctx->callbacks.tbl_length) {
-            first_col_match = UINT8_MAX;
-            break;
-        }
-        ++first_col_match;
+    if (!ctx->callbacks.compiled)
+        callbacks_compile(ctx);
+    if (ctx->callbacks.row_hash) {
+        /* Disable the ROW callback of the row just ended. */
+        wlcsv_callback_entry_st *found;
+        HASH_FIND(hh, ctx->callbacks.row_hash, &ctx->state.row, sizeof(unsigned), found);
+        if (found)
+            callbacks_toggle(ctx, found->id);
     }
-    ctx->callbacks.tbl_offs_col = first_col_match;
     if (ctx->callbacks.eor_callback)
         ctx->callbacks.eor_callback(DEFAULT_CALLBACK_DATA(ctx->callbacks.tbl));
     callbacks_eor_update_state(ctx, terminator);
@@ -324,6 +874,267 @@ callbacks_eor_preview(int terminator, void *data)
     ctx->state.row++;
 }
 
+/*  SIMD TOKENIZER
+
+    Each block of input is classified into bitmasks of delimiter, quote and line terminator
+    positions. Quoted regions are derived from a prefix-xor over the quote mask, carried over
+    block boundaries, so that the remaining delimiters and terminators mark field boundaries.
+    Fields are then trimmed and unquoted in place and forwarded exactly as libcsv would. */
+
+static void
+block_classify_scalar(const uint8_t *block, uint8_t delim, uint8_t quote,
+    struct block_masks *masks)
+{
+    uint64_t d = 0, q = 0, t = 0;
+    for (unsigned i = 0; i < TOKENIZER_BLOCK_SIZE; ++i) {
+        uint64_t bit = (uint64_t) 1 << i;
+        uint8_t c = block[i];
+        if (c == delim)
+            d |= bit;
+        else if (c == quote)
+            q |= bit;
+        else if (c == CSV_CR || c == CSV_LF)
+            t |= bit;
+    }
+    masks->delim = d;
+    masks->quote = q;
+    masks->term  = t;
+}
+
+#ifdef TOKENIZER_X86
+__attribute__((target("sse2")))
+static void
+block_classify_sse2(const uint8_t *block, uint8_t delim, uint8_t quote,
+    struct block_masks *masks)
+{
+    const __m128i vd = _mm_set1_epi8((char) delim),
+                  vq = _mm_set1_epi8((char) quote),
+                  vr = _mm_set1_epi8(CSV_CR),
+                  vn = _mm_set1_epi8(CSV_LF);
+    uint64_t d = 0, q = 0, t = 0;
+    for (unsigned i = 0; i < TOKENIZER_BLOCK_SIZE; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + i));
+        d |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, vd)) << i;
+        q |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, vq)) << i;
+        t |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(v, vr), _mm_cmpeq_epi8(v, vn))) << i;
+    }
+    masks->delim = d;
+    masks->quote = q;
+    masks->term  = t;
+}
+
+__attribute__((target("avx2")))
+static void
+block_classify_avx2(const uint8_t *block, uint8_t delim, uint8_t quote,
+    struct block_masks *masks)
+{
+    const __m256i vd = _mm256_set1_epi8((char) delim),
+                  vq = _mm256_set1_epi8((char) quote),
+                  vr = _mm256_set1_epi8(CSV_CR),
+                  vn = _mm256_set1_epi8(CSV_LF);
+    uint64_t d = 0, q = 0, t = 0;
+    for (unsigned i = 0; i < TOKENIZER_BLOCK_SIZE; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(block + i));
+        d |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vd)) << i;
+        q |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vq)) << i;
+        t |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_cmpeq_epi8(v, vr), _mm256_cmpeq_epi8(v, vn))) << i;
+    }
+    masks->delim = d;
+    masks->quote = q;
+    masks->term  = t;
+}
+#endif
+
+static block_classify_ft *
+block_classify_select(void)
+{
+#ifdef TOKENIZER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return block_classify_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return block_classify_sse2;
+#endif
+    return block_classify_scalar;
+}
+
+/*  Sets every bit from a set bit up to (but excluding) the next set bit. */
+static inline uint64_t
+prefix_xor(uint64_t bits)
+{
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+static inline unsigned
+trailing_zeros(uint64_t bits)
+{
+#ifdef __GNUC__
+    return (unsigned) __builtin_ctzll(bits);
+#else
+    unsigned n = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+/*  Forward the field buf[start, end) terminated by `terminator` (-1 at end of data).
+    Returns false if the field is not one libcsv would parse the same way as the masks imply,
+    i.e. it holds a quote in an unquoted field, an unterminated quoted field or data after the
+    closing quote. Nothing is modified or forwarded in that case. */
+static bool
+tokenizer_field_submit(struct wlcsv_ctx *ctx, uint8_t *buf, size_t start, size_t end,
+    int terminator, bool *row_begun)
+{
+    const uint8_t delim = ctx->parser.delim_char,
+                  quote = ctx->parser.quote_char;
+    bool eor = terminator != delim;
+    while (start < end && TOKENIZER_IS_SPACE(buf[start]) && buf[start] != delim)
+        ++start;
+
+    if (start == end) {
+        /*  Like libcsv, do not report whitespace-only lines as rows. */
+        if (eor && !*row_begun)
+            return true;
+        buf[end] = '\0';
+        callbacks_forward(ctx->parser.options & CSV_EMPTY_IS_NULL ? NULL : &buf[start], 0, ctx);
+    } else if (buf[start] == quote) {
+        size_t i, close = 0, nescaped = 0;
+        for (i = start + 1; i < end; ++i)
+            if (buf[i] == quote) {
+                if (i + 1 < end && buf[i + 1] == quote) {
+                    ++nescaped;
+                    ++i;
+                } else {
+                    close = i;
+                    break;
+                }
+            }
+        if (!close)
+            return false;
+        for (i = close + 1; i < end; ++i)
+            if (!TOKENIZER_IS_SPACE(buf[i]))
+                return false;
+
+        size_t w = close;
+        if (nescaped) {
+            /*  Collapse each escaped quote pair into a single quote. */
+            size_t r = start + 1;
+            for (w = start + 1; r < close; ++w) {
+                buf[w] = buf[r];
+                r += buf[r] == quote ? 2 : 1;
+            }
+        }
+        buf[w] = '\0';
+        callbacks_forward(&buf[start + 1], w - start - 1, ctx);
+    } else {
+        if (memchr(&buf[start], quote, end - start))
+            return false;
+        while (TOKENIZER_IS_SPACE(buf[end - 1]))
+            --end;
+        buf[end] = '\0';
+        callbacks_forward(&buf[start], end - start, ctx);
+    }
+
+    if (eor) {
+        callbacks_eor(terminator, ctx);
+        *row_begun = false;
+    } else
+        *row_begun = true;
+    return true;
+}
+
+/*  Tokenize len bytes of buf, which must have room for a terminating NULL byte at buf[len] and
+    begin at a field boundary. Unless final, the field still open at the end of buf is left for
+    the next call with more data, and csv_fini() is not called. The count of bytes consumed is
+    stored in consumed. Returns false on a libcsv error. */
+static bool
+tokenizer_simd_parse(struct wlcsv_ctx *ctx, uint8_t *buf, size_t len, bool final,
+    size_t *consumed)
+{
+    const uint8_t delim = ctx->parser.delim_char,
+                  quote = ctx->parser.quote_char;
+    block_classify_ft *classify = ctx->block_classify;
+    struct block_masks masks;
+    uint8_t tail[TOKENIZER_BLOCK_SIZE];
+    uint64_t in_quotes = 0;
+    size_t field_start = 0;
+    bool row_begun = ctx->push.row_begun;
+
+    for (size_t offs = 0; offs < len; offs += TOKENIZER_BLOCK_SIZE) {
+        if (len - offs >= TOKENIZER_BLOCK_SIZE)
+            classify(&buf[offs], delim, quote, &masks);
+        else {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, &buf[offs], len - offs);
+            classify(tail, delim, quote, &masks);
+        }
+        uint64_t quoted = prefix_xor(masks.quote) ^ in_quotes;
+        in_quotes = (uint64_t) 0 - (quoted >> 63);
+        uint64_t structural = (masks.delim | masks.term) & ~quoted;
+        while (structural) {
+            size_t pos = offs + trailing_zeros(structural);
+            structural &= structural - 1;
+            if (!tokenizer_field_submit(ctx, buf, field_start, pos, buf[pos], &row_begun))
+                goto FALLBACK;
+            field_start = pos + 1;
+        }
+    }
+    ctx->push.row_begun = row_begun;
+    if (!final) {
+        *consumed = field_start;
+        return true;
+    }
+    /*  Finish the last row as csv_fini() does. */
+    bool pending = row_begun;
+    for (size_t i = field_start; !pending && i < len; ++i)
+        pending = !TOKENIZER_IS_SPACE(buf[i]);
+    if (pending && !tokenizer_field_submit(ctx, buf, field_start, len, -1, &row_begun))
+        goto FALLBACK;
+    ctx->push.row_begun = false;
+    *consumed = len;
+    return true;
+
+FALLBACK:
+    /*  Let libcsv take over from the start of the irregular field, and for the rest of a pushed
+        stream. It has parsed nothing yet, so it is told whether that field follows others of the
+        same row: the column and row counts go on from the state of the wrapper. */
+    ctx->push.libcsv = true;
+    if (row_begun)
+        ctx->parser.pstate = LIBCSV_FIELD_NOT_BEGUN;
+    *consumed = field_start + csv_parse(&ctx->parser, &buf[field_start], len - field_start,
+                                    callbacks_forward, callbacks_eor, ctx);
+    if (final)
+        csv_fini(&ctx->parser, callbacks_forward, callbacks_eor, ctx);
+    return *consumed == len;
+}
+
+/*  Skip over lines until lineskip lines have been skipped from the start of a pushed stream.
+    Returns the count of bytes skipped from data. */
+static size_t
+push_skip_lines(struct wlcsv_ctx *ctx, const uint8_t *data, size_t len)
+{
+    size_t offs = 0;
+    while (ctx->push.skipped < ctx->state.lineskip && offs < len) {
+        const uint8_t *lf = memchr(&data[offs], CSV_LF, len - offs);
+        if (!lf)
+            return len;
+        offs = lf - data + 1;
+        ctx->push.skipped++;
+    }
+    return offs;
+}
+
 /*  IMPLEMENTATIONS FOR FUNCTION PROTOTYPES */
 
 void
@@ -334,8 +1145,9 @@ wlcsv_free(struct wlcsv_ctx *ctx)
             free(ctx->path);
         if (&ctx->parser)
             csv_free(&ctx->parser);
-        if (ctx->ignore_regex)
-            pcre_free(ctx->ignore_regex);
+        regex_free(&ctx->ignore_regex);
+        free(ctx->ignore_memo);
+        free(ctx->push.buf);
         callbacks_clear_all(ctx, true);
         free(ctx);
     }
@@ -357,31 +1169,26 @@ wlcsv_init(char *ignore_rgx, wlcsv_callback_ft *default_callback,
     check(ctx, ERR_MEM, WLCSV);
     memset(ctx, 0, sizeof(struct wlcsv_ctx));
 
-    ctx->ignore_regex = 0;
-    if (ignore_rgx) {
-        const char *error_msg;
-        int error_offset;
-        ctx->ignore_regex = pcre_compile(ignore_rgx, 0, &error_msg, &error_offset, 0);
-        if (!ctx->ignore_regex)
-            log_err(ERR_EXTERN_AT, "PCRE", error_msg, error_offset);
-    }
+    if (ignore_rgx)
+        regex_compile(&ctx->ignore_regex, ignore_rgx);
     memset(&ctx->state, 0, sizeof(ctx->state));
     memset(&ctx->callbacks, 0, sizeof(ctx->callbacks));
-    ctx->callbacks.tbl_length            =  callback_tbl_size;
-    ctx->callbacks.tbl_idx_type[KEYWORD] = 1;
-    ctx->callbacks.tbl_idx_type[REGEX]   = 1 + nkeycallbacks;
-    ctx->callbacks.tbl_idx_type[ROW]     = ctx->callbacks.tbl_idx_type[REGEX] + nrgxcallbacks;
-    ctx->callbacks.tbl_idx_type[COLUMN]  = ctx->callbacks.tbl_idx_type[ROW] + nrowcallbacks;
+    /* The per-type counts only presize the table, which grows as needed. */
+    ctx->callbacks.tbl = calloc(callback_tbl_size, sizeof(wlcsv_callback_entry_st *));
+    check(ctx->callbacks.tbl, ERR_MEM, WLCSV);
+    ctx->callbacks.rgx_ids = malloc(callback_tbl_size);
+    check(ctx->callbacks.rgx_ids, ERR_MEM, WLCSV);
+    ctx->callbacks.tbl_capacity = callback_tbl_size;
+    ctx->callbacks.tbl_length   = DEFAULT_CALLBACK_IDX + 1;
 
     ctx->callbacks.tbl[DEFAULT_CALLBACK_IDX] = calloc(1, sizeof(wlcsv_callback_entry_st));
-    check(ctx, ERR_MEM, WLCSV);
+    check(ctx->callbacks.tbl[DEFAULT_CALLBACK_IDX], ERR_MEM, WLCSV);
     ctx->callbacks.tbl[DEFAULT_CALLBACK_IDX]->function  = default_callback;
     ctx->callbacks.tbl[DEFAULT_CALLBACK_IDX]->data      = default_callback_data;
-    ctx->callbacks.tbl_idx_skip[DEFAULT_CALLBACK_IDX]   = UINT8_MAX;
 
-    ctx->callbacks.tbl_offs_col = ctx->callbacks.tbl_idx_type[COLUMN];
     ctx->state.options = options;
     ctx->state.lineskip = offset;
+    ctx->block_classify = block_classify_select();
 
     int ret = csv_init(&ctx->parser, options & WLCSV_IGNORE_EMPTY_FIELDS
                 ? CSV_APPEND_NULL | CSV_EMPTY_IS_NULL
@@ -496,43 +1303,28 @@ wlcsv_file_read(struct wlcsv_ctx *ctx, size_t buf_size)
     void *buffer = NULL;
     fp = fopen(ctx->path, "r");
     check(fp, ERR_FAIL, WLCSV, "opening file")
-    rewind(fp);
-    unsigned ret = 0;
-    if (ctx->state.lineskip) {
-        unsigned skip = ctx->state.lineskip;
-        ret = file_skip_lines(fp, skip);
-        check(ret == skip, ERR_FAIL, WLCSV, "unexpected EOF or error");
-    }
-    ctx->state.col = 0;
-    ctx->state.row = 0;
-    buf_size      += 0x100;
-    buffer         = calloc(1, buf_size);
+    if (!buf_size)
+        buf_size = WLCSV_READ_CHUNK_SIZE;
+    buffer = malloc(buf_size);
     check(buffer, ERR_MEM, WLCSV);
+    check(wlcsv_push_begin(ctx) == 1, ERR_FAIL, WLCSV, "beginning to parse");
 
-    size_t read  = fread(buffer, 1, buf_size, fp);
-    check(read, ERR_FAIL, WLCSV, "no data to read");
-    size_t parsed = 0;
-    while (read == buf_size) {
-        void *ptr = buffer;
-        buf_size *= 2;
-        buffer = realloc(ptr, buf_size);
-        check(buffer, ERR_MEM, WLCSV);
-        read += fread((uint8_t *)buffer + (buf_size / 2), 1, buf_size, fp);
-    }
-    if (feof(fp)) {
-        parsed = csv_parse(&ctx->parser,
-                    buffer, read, callbacks_forward,
-                    callbacks_eor, ctx);
-        check(parsed == read, ERR_EXTERN, "libcsv",
-            csv_strerror(csv_error(&ctx->parser)));
-        csv_fini(&ctx->parser, callbacks_forward, callbacks_eor, ctx);
-    } else
-        log_err(ERR_FAIL, WLCSV, "an error occured during read operation");
+    size_t read, total = 0;
+    while ((read = fread(buffer, 1, buf_size, fp))) {
+        check(wlcsv_push(ctx, buffer, read) == 1, ERR_FAIL, WLCSV, "parsing file");
+        total += read;
+    }
+    check(!ferror(fp), ERR_FAIL, WLCSV, "an error occured during read operation");
+    check(total, ERR_FAIL, WLCSV, "no data to read");
+    int parsed = wlcsv_push_end(ctx);
+    check(parsed != -1, ERR_FAIL, WLCSV, "parsing file");
 
     fclose(fp);
     free(buffer);
     return parsed;
 error:
+    if (ctx->push.active)
+        wlcsv_push_end(ctx);
     if (fp)
         fclose(fp);
     if (buffer)
@@ -540,12 +1332,103 @@ error:
     return -1;
 }
 
+int
+wlcsv_push_begin(struct wlcsv_ctx *ctx)
+{
+    if (!ctx) {
+        log_err(ERR_NALLOW, WLCSV, "NULL ctx parameter");
+        return 0;
+    }
+    check(!ctx->push.active, ERR_FAIL, WLCSV, "beginning stream: previous not ended");
+    ctx->state.col      = 0;
+    ctx->state.row      = 0;
+    ctx->push.len       = 0;
+    ctx->push.parsed    = 0;
+    ctx->push.skipped   = 0;
+    ctx->push.row_begun = false;
+    ctx->push.libcsv    = !(ctx->state.options & WLCSV_TOKENIZER_SIMD);
+    ctx->push.active    = true;
+    return 1;
+error:
+    return -1;
+}
+
+int
+wlcsv_push(struct wlcsv_ctx *ctx, const void *data, size_t len)
+{
+    if (!ctx) {
+        log_err(ERR_NALLOW, WLCSV, "NULL ctx parameter");
+        return 0;
+    }
+    check(ctx->push.active, ERR_FAIL, WLCSV, "pushing data: no stream begun");
+    size_t skip = push_skip_lines(ctx, data, len);
+    const uint8_t *bytes = (const uint8_t *)data + skip;
+    len -= skip;
+    if (!len)
+        return 1;
+    if (ctx->push.libcsv) {
+        size_t parsed = csv_parse(&ctx->parser, bytes, len, callbacks_forward, callbacks_eor, ctx);
+        ctx->push.parsed += parsed;
+        check(parsed == len, ERR_EXTERN, "libcsv", csv_strerror(csv_error(&ctx->parser)));
+        return 1;
+    }
+    /*  Append to what is left of the previous chunk, with room for a NULL byte. */
+    struct push_state *push = &ctx->push;
+    if (push->len + len + 1 > push->capacity) {
+        size_t capacity = push->capacity ? push->capacity : 0x1000;
+        while (capacity < push->len + len + 1)
+            capacity *= 2;
+        uint8_t *buf = realloc(push->buf, capacity);
+        check(buf, ERR_MEM, WLCSV);
+        push->buf = buf;
+        push->capacity = capacity;
+    }
+    memcpy(&push->buf[push->len], bytes, len);
+    push->len += len;
+    size_t consumed;
+    bool ok = tokenizer_simd_parse(ctx, push->buf, push->len, false, &consumed);
+    push->parsed += consumed;
+    check(ok, ERR_EXTERN, "libcsv", csv_strerror(csv_error(&ctx->parser)));
+    push->len -= consumed;
+    memmove(push->buf, &push->buf[consumed], push->len);
+    return 1;
+error:
+    return -1;
+}
+
+int
+wlcsv_push_end(struct wlcsv_ctx *ctx)
+{
+    if (!ctx) {
+        log_err(ERR_NALLOW, WLCSV, "NULL ctx parameter");
+        return 0;
+    }
+    struct push_state *push = &ctx->push;
+    check(push->active, ERR_FAIL, WLCSV, "ending stream: no stream begun");
+    push->active = false;
+    check(push->skipped == ctx->state.lineskip, ERR_FAIL, WLCSV, "unexpected end of data");
+    if (push->libcsv)
+        csv_fini(&ctx->parser, callbacks_forward, callbacks_eor, ctx);
+    else {
+        size_t consumed;
+        bool ok = tokenizer_simd_parse(ctx, push->buf, push->len, true, &consumed);
+        push->parsed += consumed;
+        push->len = 0;
+        check(ok, ERR_EXTERN, "libcsv", csv_strerror(csv_error(&ctx->parser)));
+    }
+    return push->parsed;
+error:
+    csv_fini(&ctx->parser, NULL, NULL, NULL);
+    push->len = 0;
+    return -1;
+}
+
 int
 wlcsv_callbacks_active(wlcsv_ctx_st *ctx, uint8_t i)
 {
     if (ctx)
-        if (ctx->callbacks.tbl[i])
-            return ctx->callbacks.tbl_idx_skip[i] ? 1 : 0;
+        if (i < ctx->callbacks.tbl_length && ctx->callbacks.tbl[i])
+            return ctx->callbacks.tbl[i]->active ? 1 : 0;
         else
             log_err(ERR_FAIL, WLCSV, "retrieving active state: not found in callback table.");
     else
@@ -558,14 +1441,9 @@ wlcsv_callbacks_clear(wlcsv_ctx_st *ctx, uint8_t i)
 {
     if (ctx) {
         wlcsv_callback_entry_st **tbl = ctx->callbacks.tbl;
-        if (tbl[i]) {
-            if (ctx->callbacks.tbl_idx_skip[i])
-                callbacks_toggle(ctx, i);
-            if (tbl[i]->match_by == REGEX)
-                pcre_free(tbl[i]->rgx);
-            else if (tbl[i]->match_by == KEYWORD)
-                free(tbl[i]->key);
-            free(tbl[i]);
+        if (i != DEFAULT_CALLBACK_IDX && i < ctx->callbacks.tbl_length && tbl[i]) {
+            callbacks_decompile(ctx);
+            callbacks_entry_free(tbl[i]);
             tbl[i] = NULL;
             return 1;
         } else
@@ -613,9 +1491,10 @@ wlcsv_callbacks_set(struct wlcsv_ctx *ctx,
         void *callback_data,
         unsigned once)
 {
+    wlcsv_callback_entry_st *entry = NULL;
     check(ctx, ERR_NALLOW, WLCSV, "NULL parameter");
 
-    wlcsv_callback_entry_st *entry = calloc(1, sizeof(wlcsv_callback_entry_st));
+    entry = calloc(1, sizeof(wlcsv_callback_entry_st));
     check(entry, ERR_MEM, WLCSV);
 
     entry->function = callback;
@@ -630,13 +1509,35 @@ wlcsv_callbacks_set(struct wlcsv_ctx *ctx,
         entry->key = calloc(len + 1, sizeof(char));
         check(entry->key, ERR_MEM, WLCSV);
         memcpy(entry->key, match_to->key_or_rgx, len);
-    } else {
-        const char *error_msg;
-        int error_offset;
-        entry->rgx = pcre_compile(match_to->key_or_rgx, 0, &error_msg, &error_offset, 0);
-        check(entry->rgx, ERR_FAIL, WLCSV, "compiling regex");
+    } else
+        check(regex_compile(&entry->rgx, match_to->key_or_rgx), ERR_FAIL, WLCSV, "compiling regex");
+    uint8_t id = callbacks_enlist(ctx, entry);
+    check(id != UINT8_MAX, ERR_FAIL, WLCSV, "setting callback");
+    return id;
+error:
+    if (entry)
+        callbacks_entry_free(entry);
+    return UINT8_MAX;
+}
+
+uint8_t
+wlcsv_callbacks_typed_set(struct wlcsv_ctx *ctx,
+        wlcsv_callback_match_by_et match_by,
+        wlcsv_callback_match_to_ut *match_to,
+        wlcsv_value_type_et type,
+        wlcsv_typed_callback_ft *callback,
+        void *callback_data,
+        unsigned once)
+{
+    check(type == WLCSV_INT64 || type == WLCSV_DOUBLE, ERR_FAIL, WLCSV,
+        "setting typed callback: type not numeric");
+    check(callback, ERR_NALLOW, WLCSV, "NULL callback parameter");
+    uint8_t id = wlcsv_callbacks_set(ctx, match_by, match_to, NULL, callback_data, once);
+    if (id != UINT8_MAX) {
+        ctx->callbacks.tbl[id]->type = type;
+        ctx->callbacks.tbl[id]->typed_function = callback;
     }
-    return callbacks_enlist(ctx, entry);
+    return id;
 error:
     return UINT8_MAX;
 }
@@ -645,15 +1546,30 @@ int
 wlcsv_callbacks_toggle(wlcsv_ctx_st *ctx, uint8_t id)
 {
     if (ctx)
-        if (ctx->callbacks.tbl[id])
+        if (id != DEFAULT_CALLBACK_IDX && id < ctx->callbacks.tbl_length && ctx->callbacks.tbl[id]) {
             callbacks_toggle(ctx, id);
-        else
+            return 1;
+        } else
             log_err(ERR_FAIL, WLCSV, "toggling: not found in callback table.");
-    else
+    else {
         log_warn(ERR_NALLOW, WLCSV, "NULL ctx parameter");
+        return 0;
+    }
     return -1;
 }
 
+void
+wlcsv_reset_callbacks(wlcsv_ctx_st *ctx)
+{
+    if (ctx) {
+        for (unsigned i = DEFAULT_CALLBACK_IDX + 1; i < ctx->callbacks.tbl_length; ++i)
+            if (ctx->callbacks.tbl[i])
+                ctx->callbacks.tbl[i]->active = true;
+        callbacks_decompile(ctx);
+    } else
+        log_warn(ERR_NALLOW, WLCSV, "NULL parameter");
+}
+
 int
 wlcsv_ignore_regex_set(struct wlcsv_ctx *ctx, char *regex)
 {
@@ -661,15 +1577,12 @@ wlcsv_ignore_regex_set(struct wlcsv_ctx *ctx, char *regex)
         log_err(ERR_NALLOW, WLCSV, "NULL parameter");
         return 0;
     }
-    if (ctx->ignore_regex)
-        pcre_free(ctx->ignore_regex);
-    ctx->ignore_regex = 0;
-    if (regex) {
-        const char *error_msg;
-        int error_offset;
-        ctx->ignore_regex = pcre_compile(regex, 0, &error_msg, &error_offset, 0);
-        check(ctx->ignore_regex, ERR_EXTERN_AT, "PCRE", error_msg, error_offset);
-    }
+    regex_free(&ctx->ignore_regex);
+    free(ctx->ignore_memo);
+    ctx->ignore_memo = NULL;
+    ctx->ignore_memo_count = 0;
+    if (regex)
+        check(regex_compile(&ctx->ignore_regex, regex), ERR_FAIL, WLCSV, "compiling regex");
     return 1;
 error:
     return -1;
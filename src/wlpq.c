@@ -89,7 +89,11 @@ struct wlpq_conn_ctx {
     volatile atomic_bool            qqueue_empty;
     volatile atomic_flag            qqueue_lock;
     volatile atomic_bool            thread_continue;
+    volatile atomic_uint            qqueue_length;
+    volatile atomic_uint_fast64_t   nsent;
+    volatile atomic_uint_fast64_t   nfailed;
     volatile wlpq_thread_state_et   thread_state[MAX_NTHRD];
+    volatile uint8_t                pgconn_iostate[MAX_NTHRD][MAX_NCONN_THRD];
     pthread_t                       thread_pt_id[MAX_NTHRD];
     unsigned                        thread_nconn;
 };
@@ -100,7 +104,7 @@ struct query_thread_ctx {
     PGconn                        **pgconn;
     wlpq_query_data_st            **pgconn_qr_dt;
     struct pollfd                   pgconn_sockfds[MAX_NCONN_THRD];
-    volatile uint8_t                pgconn_iostate[MAX_NCONN_THRD];
+    volatile uint8_t               *pgconn_iostate;
     unsigned                        nthread;
 };
 
@@ -542,6 +546,7 @@ send_poll_loop(void *arg)
                 /*  Break loop when thrd_continue was set in qqueue_dequeue(). */
                 if (!item)
                     goto EXIT;
+                atomic_fetch_sub_explicit(&conn_ctx->qqueue_length, 1, memory_order_relaxed);
 
                 wlpq_query_data_st *data = item->data;
                 free(item);
@@ -564,8 +569,10 @@ send_poll_loop(void *arg)
                     inl_print_query_data(data, stderr);
                     wlpq_query_free(data);
                     pgconn_iostate[i] = PGCONN_IOSTATE_ERROR;
+                    atomic_fetch_add_explicit(&conn_ctx->nfailed, 1, memory_order_relaxed);
                     goto EXIT;
                 }
+                atomic_fetch_add_explicit(&conn_ctx->nsent, 1, memory_order_relaxed);
                 if (data->lock_until_complete) {
                     wlpq_query_free(data);
                     data = NULL;
@@ -581,6 +588,9 @@ send_poll_loop(void *arg)
             empty = atomic_load_explicit(qqueue_empty, memory_order_relaxed);
         }
         *err_total += err_query + err_poll;
+        if (err_query + err_poll)
+            atomic_fetch_add_explicit(&conn_ctx->nfailed, err_query + err_poll,
+                memory_order_relaxed);
     }
 EXIT:
     *thrd_state = *err_total ? FAIL : SUCC;
@@ -595,6 +605,7 @@ init_query_thread_ctx(wlpq_conn_ctx_st *conn_ctx, uint8_t nthread)
     check(thrd_ctx, ERR_MEM, WLPQ);
     thrd_ctx->nthread = nthread;
     thrd_ctx->conn_ctx = conn_ctx;
+    thrd_ctx->pgconn_iostate = conn_ctx->pgconn_iostate[nthread];
     unsigned nconn = conn_ctx->thread_nconn;
     thrd_ctx->pgconn = calloc(nconn, sizeof(PGconn *));
     check(thrd_ctx->pgconn, ERR_MEM, WLPQ);
@@ -660,8 +671,13 @@ wlpq_conn_ctx_init(char *db_url)
     size_t len;
     char buffer[0x800];
     if (!db_url) {
+        const char *env_url = getenv(WLPQ_DATABASE_URL_ENV);
+        check(env_url && *env_url, ERR_FAIL_A, WLPQ, "reading environment variable",
+            WLPQ_DATABASE_URL_ENV);
+        /* Require SSL, unless the URL sets a mode of its own, as for a local database. */
         db_url = buffer;
-        snprintf(db_url, 0x7FF, "%s?%s", getenv(WLPQ_DATABASE_URL_ENV), "sslmode=require");
+        snprintf(db_url, 0x7FF, "%s%s", env_url, strstr(env_url, "sslmode=") ? ""
+            : strchr(env_url, '?') ? "&sslmode=require" : "?sslmode=require");
     }
     len = strlen(db_url) + 1;
     conn_info = malloc(sizeof(char) * len);
@@ -673,6 +689,9 @@ wlpq_conn_ctx_init(char *db_url)
     atomic_flag_clear_explicit(&conn_ctx->qqueue_lock, memory_order_relaxed);
     atomic_init(&conn_ctx->thread_continue, false);
     atomic_init(&conn_ctx->qqueue_empty, true);
+    atomic_init(&conn_ctx->qqueue_length, 0);
+    atomic_init(&conn_ctx->nsent, 0);
+    atomic_init(&conn_ctx->nfailed, 0);
     struct queue_elem *qqueue_head = NULL;
     conn_ctx->qqueue_head = qqueue_head;
     conn_ctx->qqueue_tail = qqueue_head;
@@ -680,6 +699,7 @@ wlpq_conn_ctx_init(char *db_url)
     conn_ctx->notify_cb_arg = NULL;
     return conn_ctx;
 error:
+    free(conn_ctx);
     return 0;
 }
 
@@ -751,6 +771,7 @@ wlpq_query_queue_enqueue(wlpq_conn_ctx_st *conn_ctx, wlpq_query_data_st *qr_dt)
     el->data = qr_dt;
     el->conn = NULL;
     el->conn_id = 0;
+    atomic_fetch_add_explicit(&conn_ctx->qqueue_length, 1, memory_order_relaxed);
     queue_enqueue_item(el, &conn_ctx->qqueue_head, &conn_ctx->qqueue_tail,
         &conn_ctx->qqueue_lock, &conn_ctx->qqueue_empty);
     return 1;
@@ -793,6 +814,43 @@ error:
     return -1;
 }
 
+void
+wlpq_stats_get(wlpq_conn_ctx_st *conn_ctx, wlpq_stats_st *stats)
+{
+    memset(stats, 0, sizeof(wlpq_stats_st));
+    if (!conn_ctx)
+        return;
+    stats->queue_length = atomic_load_explicit(&conn_ctx->qqueue_length, memory_order_relaxed);
+    stats->nsent        = atomic_load_explicit(&conn_ctx->nsent, memory_order_relaxed);
+    stats->nfailed      = atomic_load_explicit(&conn_ctx->nfailed, memory_order_relaxed);
+    stats->nthreads     = MAX_NTHRD;
+    stats->nconn        = conn_ctx->thread_nconn;
+    for (size_t i = 0; i < MAX_NTHRD; ++i) {
+        stats->thread_state[i] = conn_ctx->thread_state[i];
+        for (size_t j = 0; j < stats->nconn; ++j) {
+            uint8_t iostate = conn_ctx->pgconn_iostate[i][j];
+            stats->conn_iostate[i][j] = iostate;
+            if (iostate == PGCONN_IOSTATE_SEND || iostate == PGCONN_IOSTATE_WAIT
+                    || iostate == PGCONN_IOSTATE_FLUSH)
+                ++stats->in_flight;
+        }
+    }
+}
+
+const char *
+wlpq_stats_iostate_name(uint8_t iostate)
+{
+    switch (iostate) {
+        case PGCONN_IOSTATE_IDLE:   return "idle";
+        case PGCONN_IOSTATE_SEND:   return "send";
+        case PGCONN_IOSTATE_WAIT:   return "wait";
+        case PGCONN_IOSTATE_FLUSH:  return "flush";
+        case PGCONN_IOSTATE_EXIT:   return "exit";
+        case PGCONN_IOSTATE_ERROR:  return "error";
+        default:                    return "unknown";
+    }
+}
+
 uint8_t
 wlpq_threads_active(wlpq_conn_ctx_st *conn_ctx)
 {
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Benchmark the server over HTTP: start it on a port of its own, against the Postgres database
+# in DATABASE_URL, run the load generator and write its results, compared to a baseline if any.
+# Usage: bench_http.sh <generator> <results.json> [<baseline.json>]
+#
+# BENCH_PORT    port to start the server on (default 8089)
+# BENCH_START   0 to measure a server already running at BENCH_HOST:BENCH_PORT instead
+# BENCH_HOST    address of such a server (default 127.0.0.1)
+# BENCH_ARGS    further options of the generator, as -c 32 -d 30 -k; -? lists them
+# BENCH_MIX     file of the mix of requests, lines of <weight> <name> <path>
+# EMISS_OFFLINE as for the server, data read from this directory (default ../resources/data)
+
+GENERATOR=$1
+RESULTS=$2
+BASELINE=$3
+BENCH_HOST=${BENCH_HOST:-127.0.0.1}
+BENCH_PORT=${BENCH_PORT:-8089}
+BENCH_START=${BENCH_START:-1}
+
+if [ -z "$GENERATOR" ] || [ -z "$RESULTS" ]; then
+    echo "Usage: $0 <generator> <results.json> [<baseline.json>]" >&2
+    exit 1
+fi
+mkdir -p "$(dirname "$RESULTS")"
+
+SERVER_PID=
+if [ "$BENCH_START" != 0 ]; then
+    if [ -z "$DATABASE_URL" ]; then
+        echo "$0: set DATABASE_URL, as postgres://localhost/emiss?sslmode=disable" >&2
+        exit 1
+    fi
+    # The server finds its data and cache relative to bin/, and its port in PORT.
+    (cd bin && PORT=$BENCH_PORT EMISS_OFFLINE=${EMISS_OFFLINE:-../resources/data} \
+        exec ./emiss) > "${RESULTS%.json}-server.log" 2>&1 &
+    SERVER_PID=$!
+    trap 'kill -TERM $SERVER_PID 2>/dev/null; wait $SERVER_PID 2>/dev/null' EXIT INT TERM
+fi
+
+# Loading the data on a first start takes a while.
+# shellcheck disable=SC2086
+"$GENERATOR" -h "$BENCH_HOST" -p "$BENCH_PORT" -W 120 -o "$RESULTS" \
+    ${BENCH_MIX:+-m "$BENCH_MIX"} ${BASELINE:+-b "$BASELINE"} $BENCH_ARGS
+STATUS=$?
+if [ -n "$SERVER_PID" ] && ! kill -0 "$SERVER_PID" 2>/dev/null; then
+    echo "$0: the server exited, see ${RESULTS%.json}-server.log" >&2
+    STATUS=1
+fi
+exit $STATUS
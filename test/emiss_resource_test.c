@@ -0,0 +1,539 @@
+#include "minunit.h"
+/*  Admission waits short enough for the tests to time out in. */
+#define EMISS_ADMISSION_WAIT_MS 100
+/*  Results of the database, given by the tests. */
+#define PQntuples fake_PQntuples
+#define PQgetvalue fake_PQgetvalue
+#include "../src/emiss_resource.c"
+
+/*  A result of rows of the columns of SQL_SELECT_COUNTRY_ORDER_BY(). */
+struct fake_result {
+    int                 nrows;
+    const char         *(*rows)[8];
+};
+
+int
+fake_PQntuples(const PGresult *res)
+{
+    return ((const struct fake_result *) res)->nrows;
+}
+
+char *
+fake_PQgetvalue(const PGresult *res, int row, int column)
+{
+    return (char *) ((const struct fake_result *) res)->rows[row][column];
+}
+
+#define TEST_NCOUNTRIES 40
+
+/*  Countries XAA, XAB, ... by id, in the order of their codes. */
+static struct country_data cdata;
+
+static void
+cdata_init(void)
+{
+    util_ccode_index_init(&cdata.index);
+    for (size_t i = 0; i < TEST_NCOUNTRIES; ++i) {
+        snprintf(cdata.iso3[i], sizeof(cdata.iso3[i]), "X%c%c", (char) ('A' + i / 26),
+            (char) ('A' + i % 26));
+        util_ccode_index_set(&cdata.index, cdata.iso3[i], 3, (uint16_t) i);
+    }
+    cdata.ccount = TEST_NCOUNTRIES;
+}
+
+/*  Parse qstr and compare what is found invalid, if anything, and the canonical query string. */
+static bool
+parse_check(struct chart_request *req, const char *qstr, enum chart_type chart_type,
+    const char *invalid, const char *canonical)
+{
+    const char *found = chart_request_parse(req, &cdata, qstr, chart_type);
+    if (invalid ? !found || strcmp(found, invalid) : found != NULL) {
+        log_err("[mu]: \"%s\": expected %s invalid, got %s", qstr, invalid ? invalid : "none",
+            found ? found : "none");
+        return false;
+    }
+    if (canonical && strcmp(req->canonical, canonical)) {
+        log_err("[mu]: \"%s\": expected \"%s\", got \"%s\"", qstr, canonical, req->canonical);
+        return false;
+    }
+    return true;
+}
+
+/*  Countries deduplicated into the order of their ids, years clamped, unknown parameters and empty
+    values ignored and the parameters of the canonical query string in a fixed order. */
+char *
+test_line_chart()
+{
+    struct chart_request req;
+    cdata_init();
+    mu_assert(parse_check(&req, "ccode=XAC&to_year=2000&count=3&ccode=xaa&from_year=1990"
+            "&data_type=co2e&chart_type=line&ccode=XAC&format=&unknown=1", CHART_NONE, NULL,
+            "data_type=co2e&chart_type=line&from_year=1990&to_year=2000&ccode=XAA&ccode=XAC"),
+        "parsing a line chart");
+    mu_assert(req.chart_type == CHART_LINE && req.dataset == DATASET_CO2E && !req.per_capita
+        && req.nkinds == 1 && req.ncountries == 2 && req.country[0] == 0 && req.country[1] == 2
+        && req.from_year == 1990 && req.to_year == 2000 && !req.format, "the request parsed");
+    char canonical[0x100];
+    snprintf(canonical, sizeof(canonical), "data_type=co2e_percapita&data_type=population"
+        "&chart_type=line&from_year=%u&to_year=%u&ccode=XBA&format=csv", EMISS_YEAR_ZERO,
+        EMISS_YEAR_LAST);
+    mu_assert(parse_check(&req, "data_type=population&data_type=co2e_percapita&from_year=1000"
+            "&to_year=9999&ccode=XBA&format=csv", CHART_LINE, NULL, canonical),
+        "parsing several indicators, clamping years");
+    mu_assert(req.nkinds == 2 && req.kind[0] == 1 && req.kind[1] == 2 && req.per_capita
+        && req.format == SERIES_CSV, "the indicators parsed");
+    mu_assert(parse_check(&req, "&&data_type=co2e&&from_year=1990&to_year=1991&ccode=XAA&",
+            CHART_LINE, NULL, NULL), "parsing empty parameters");
+    /*  Years clamped into one, past the last of the years formatted for the categories. */
+    char qstr[0x100];
+    snprintf(qstr, sizeof(qstr), "data_type=co2e&from_year=%u&to_year=%u&ccode=XAA",
+        EMISS_YEAR_LAST, EMISS_YEAR_LAST);
+    mu_assert(parse_check(&req, qstr, CHART_LINE, "to_year", NULL)
+        && parse_check(&req, "data_type=co2e&from_year=9998&to_year=9999&ccode=XAA", CHART_LINE,
+            "to_year", NULL), "a line chart of a single year");
+    return NULL;
+}
+
+char *
+test_map_chart()
+{
+    struct chart_request req;
+    mu_assert(parse_check(&req, "group=income&select_year=2000&data_type=co2e_percapita"
+            "&chart_type=map&ccode=XAA", CHART_NONE, NULL,
+            "data_type=co2e_percapita&chart_type=map&select_year=2000&group=income"),
+        "parsing a map chart");
+    mu_assert(req.grouping == GROUPING_INCOME && req.from_year == 2000 && req.to_year == 2000
+        && !req.ncountries, "the request parsed");
+    mu_assert(parse_check(&req, "data_type=co2e&chart_type=map", CHART_NONE, "select_year", NULL)
+        && parse_check(&req, "data_type=co2e&data_type=population&select_year=2000",
+            CHART_MAP, "data_type", NULL), "a map chart without a year or of two indicators");
+    return NULL;
+}
+
+/*  The first parameter found invalid, repeated where it may not be, or missing. */
+char *
+test_invalid()
+{
+    const struct {
+        const char     *qstr;
+        const char     *invalid;
+    } cases[] = {
+        {"", "data_type"},
+        {"data_type=co2&from_year=1990&to_year=2000&ccode=XAA", "data_type"},
+        {"data_type=co2e&chart_type=pie", "chart_type"},
+        {"data_type=co2e&chart_type=line&chart_type=line", "chart_type"},
+        {"data_type=co2e&from_year=1990&from_year=1991", "from_year"},
+        {"data_type=co2e&from_year=199O&to_year=2000&ccode=XAA", "from_year"},
+        {"data_type=co2e&from_year=19900&to_year=2000&ccode=XAA", "from_year"},
+        {"data_type=co2e&to_year=2000&ccode=XAA", "from_year"},
+        {"data_type=co2e&from_year=2000&to_year=1990&ccode=XAA", "to_year"},
+        {"data_type=co2e&from_year=2000&to_year=2000&ccode=XAA", "to_year"},
+        {"data_type=co2e&from_year=1990&to_year=2000", "ccode"},
+        {"data_type=co2e&from_year=1990&to_year=2000&ccode=XZZ", "ccode"},
+        {"data_type=co2e&from_year=1990&to_year=2000&ccode=XA", "ccode"},
+        {"data_type=co2e&from_year=1990&to_year=2000&ccode=XAA&group=region", "group"},
+        {"data_type=co2e&group=continent", "group"},
+        {"data_type=co2e&format=xml", "format"},
+        {"data_type=co2e&format=csv&format=csv", "format"}
+    };
+    struct chart_request req;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+        mu_assert(parse_check(&req, cases[i].qstr, CHART_LINE, cases[i].invalid, NULL),
+            "finding a parameter invalid");
+    return NULL;
+}
+
+/*  Countries are counted once however often repeated, up to EMISS_CHART_MAX_COUNTRIES. */
+char *
+test_country_count()
+{
+    static char qstr[0x4000];
+    struct chart_request req;
+    int n = snprintf(qstr, sizeof(qstr), "data_type=co2e&from_year=1990&to_year=2000");
+    for (unsigned i = 0; i < 0x101; ++i)
+        n += snprintf(&qstr[n], sizeof(qstr) - n, "&ccode=XAA");
+    for (unsigned i = 1; i < EMISS_CHART_MAX_COUNTRIES; ++i)
+        n += snprintf(&qstr[n], sizeof(qstr) - n, "&ccode=%s", cdata.iso3[i]);
+    mu_assert(parse_check(&req, qstr, CHART_LINE, NULL, NULL)
+        && req.ncountries == EMISS_CHART_MAX_COUNTRIES, "counting a country repeated");
+    snprintf(&qstr[n], sizeof(qstr) - n, "&ccode=%s", cdata.iso3[EMISS_CHART_MAX_COUNTRIES]);
+    mu_assert(parse_check(&req, qstr, CHART_LINE, "ccode", NULL), "counting too many countries");
+    return NULL;
+}
+
+/*  Country data stored from a result, and a result of too many rows flagged failed for the
+    snapshot to be rejected, without exiting. */
+char *
+test_country_data_result()
+{
+    const char *rows[][8] = {
+        {"XAA", "XA", "Country A", "1", "2", "t", "f", "t"},
+        {"XAB", "", "Country B", "3", "4", "f", "t", "f"}
+    };
+    struct country_data *stored = calloc(1, sizeof(struct country_data));
+    mu_assert(stored, "allocating");
+    struct fake_result res = {2, rows};
+    callback_countrydata_res_handler((PGresult *) &res, stored);
+    mu_assert(!stored->failed && stored->ccount == 2 && !strcmp(stored->iso3[1], "XAB")
+        && !strcmp(stored->name[0], "Country A") && stored->total_byte_length_of_names == 18
+        && util_ccode_index_get(&stored->index, "XA", 2) == 0
+        && stored->country_type[0] == 1 && stored->country_type[1] == 4
+        && stored->region_and_income[1] == (3 | 4 << 4), "storing country data");
+    for (size_t i = 0; i < stored->ccount; ++i)
+        free(stored->name[i]);
+    memset(stored, 0, sizeof(struct country_data));
+
+    res.nrows = NCOUNTRY_DATA_SLOTS + 1;
+    callback_countrydata_res_handler((PGresult *) &res, stored);
+    mu_assert(stored->failed && !stored->ccount, "flagging too many rows");
+    free(stored);
+    return NULL;
+}
+
+/*  A resource context with just the state of its arenas, admission and flights. */
+static emiss_resource_ctx_st rsrc;
+
+static void
+rsrc_init(void)
+{
+    memset(&rsrc, 0, sizeof(rsrc));
+    pthread_mutex_init(&rsrc.arena_lock, NULL);
+    pthread_mutex_init(&rsrc.admission_lock, NULL);
+    pthread_cond_init(&rsrc.admission_cond, NULL);
+    pthread_mutex_init(&rsrc.flight_lock, NULL);
+}
+
+/*  Allocations aligned and apart, a request outgrowing the first block given one of its own, and
+    an arena released back to the free list with its first block alone, up to ARENA_NFREE_MAX. */
+char *
+test_arena()
+{
+    rsrc_init();
+    struct arena *arena = arena_acquire(&rsrc);
+    mu_assert(arena && arena->block && !arena->block->next, "taking a new arena");
+    struct arena_block *first = arena->block;
+    char *a = arena_alloc(arena, 1), *b = arena_alloc(arena, 3), *c = arena_alloc(arena, 0x100);
+    mu_assert(a && b && c && !((uintptr_t) a % sizeof(max_align_t))
+        && b - a == sizeof(max_align_t) && c - b == sizeof(max_align_t), "allocating aligned");
+    memset(c, 0xff, 0x100);
+    char *big = arena_alloc(arena, ARENA_BLOCK_SIZE + 1);
+    mu_assert(big && arena->block != first && arena->block->next == first
+        && arena->block->size >= ARENA_BLOCK_SIZE + 1, "allocating past the first block");
+    memset(big, 0xff, ARENA_BLOCK_SIZE + 1);
+    mu_assert(arena_alloc(arena, 1) && arena->block->next->next == first,
+        "allocating past a full block");
+
+    arena_release(&rsrc, arena);
+    mu_assert(rsrc.arena_free == arena && rsrc.arena_nfree == 1 && arena->block == first
+        && !first->next && !first->used, "releasing an arena");
+    mu_assert(arena_acquire(&rsrc) == arena && !rsrc.arena_free && !rsrc.arena_nfree,
+        "taking a released arena");
+
+    struct arena *held[ARENA_NFREE_MAX + 2] = {arena};
+    for (size_t i = 1; i < ARENA_NFREE_MAX + 2; ++i)
+        mu_assert((held[i] = arena_acquire(&rsrc)), "taking a new arena");
+    for (size_t i = 0; i < ARENA_NFREE_MAX + 2; ++i)
+        arena_release(&rsrc, held[i]);
+    mu_assert(rsrc.arena_nfree == ARENA_NFREE_MAX, "keeping at most ARENA_NFREE_MAX");
+    while (rsrc.arena_free) {
+        arena = rsrc.arena_free;
+        rsrc.arena_free = arena->next_free;
+        arena_free(arena);
+    }
+    return NULL;
+}
+
+static double
+elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+static void *
+admission_thread(void *admitted)
+{
+    *(int *) admitted = admission_acquire(&rsrc);
+    return NULL;
+}
+
+/*  Requests admitted at once up to EMISS_ADMISSION_MAX_RUNNING, the next one waiting for a turn
+    until EMISS_ADMISSION_WAIT_MS and taking one given meanwhile, and none waiting beyond
+    EMISS_ADMISSION_MAX_WAITING. */
+char *
+test_admission()
+{
+    rsrc_init();
+    for (unsigned i = 0; i < EMISS_ADMISSION_MAX_RUNNING; ++i)
+        mu_assert(admission_acquire(&rsrc), "admitting at once");
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mu_assert(!admission_acquire(&rsrc) && elapsed_ms(&start) >= EMISS_ADMISSION_WAIT_MS * 0.9
+        && rsrc.admission_running == EMISS_ADMISSION_MAX_RUNNING && !rsrc.admission_waiting,
+        "refusing after the wait");
+
+    int admitted = -1;
+    pthread_t thread;
+    mu_assert(!pthread_create(&thread, NULL, admission_thread, &admitted), "starting a request");
+    for (unsigned waiting = 0; !waiting; ) {
+        pthread_mutex_lock(&rsrc.admission_lock);
+        waiting = rsrc.admission_waiting;
+        pthread_mutex_unlock(&rsrc.admission_lock);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    admission_release(&rsrc);
+    pthread_join(thread, NULL);
+    mu_assert(admitted == 1 && elapsed_ms(&start) < EMISS_ADMISSION_WAIT_MS / 2
+        && rsrc.admission_running == EMISS_ADMISSION_MAX_RUNNING && !rsrc.admission_waiting,
+        "admitting in a turn given");
+
+    rsrc.admission_waiting = EMISS_ADMISSION_MAX_WAITING;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mu_assert(!admission_acquire(&rsrc) && elapsed_ms(&start) < EMISS_ADMISSION_WAIT_MS / 2
+        && rsrc.admission_waiting == EMISS_ADMISSION_MAX_WAITING, "refusing at once");
+    rsrc.admission_waiting = 0;
+    for (unsigned i = 0; i < EMISS_ADMISSION_MAX_RUNNING; ++i)
+        admission_release(&rsrc);
+    mu_assert(!rsrc.admission_running && admission_acquire(&rsrc), "admitting once released");
+    admission_release(&rsrc);
+    return NULL;
+}
+
+/*  A client of the stand-in server, with the response it was sent. */
+struct client {
+    unsigned            status;
+    unsigned            retry_after;
+    char                body[0x80];
+    struct chart_request *req;
+    retrieve_ft        *retrieve;
+};
+
+static int
+client_send(void *at, const unsigned http_response_code, const char *restrict mime_type,
+    const char *restrict content_encoding, const struct iovec *iov, const int iovcnt)
+{
+    struct client *client = at;
+    (void) mime_type, (void) content_encoding;
+    client->status = http_response_code;
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        memcpy(&client->body[len], iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    client->body[len] = '\0';
+    return 1;
+}
+
+static int
+client_unavailable(void *at, const unsigned retry_after)
+{
+    struct client *client = at;
+    client->status      = 503;
+    client->retry_after = retry_after;
+    return 1;
+}
+
+/*  A query held until the gate is opened, counting the times it is sent. */
+static struct {
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    bool                open;
+    unsigned            nqueries;
+} gate = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, 0};
+
+static void
+gate_set(bool open)
+{
+    pthread_mutex_lock(&gate.lock);
+    gate.open = open;
+    pthread_cond_broadcast(&gate.cond);
+    pthread_mutex_unlock(&gate.lock);
+}
+
+static int
+retrieve_gated(emiss_template_st *template_data, struct emiss_resource_snapshot *snapshot,
+    struct arena *arena, const struct chart_request *req, void *cbdata)
+{
+    (void) arena;
+    pthread_mutex_lock(&gate.lock);
+    gate.nqueries++;
+    while (!gate.open)
+        pthread_cond_wait(&gate.cond, &gate.lock);
+    pthread_mutex_unlock(&gate.lock);
+    char body[0x80];
+    int len = snprintf(body, sizeof(body), "%p %s", (void *) snapshot, req->canonical);
+    return template_data->send_function(cbdata, 200, "text/plain", 0,
+                &(struct iovec) {body, (size_t) len}, 1);
+}
+
+static emiss_template_st flight_template = {
+    .rsrc_ctx = &rsrc, .send_function = client_send, .unavailable_function = client_unavailable
+};
+
+static struct emiss_resource_snapshot *flight_snapshot = (struct emiss_resource_snapshot *) &cdata;
+
+static void *
+flight_thread(void *at)
+{
+    struct client *client = at;
+    retrieve_coalesced(&flight_template, flight_snapshot, NULL, client->req,
+        client->retrieve ? client->retrieve : retrieve_gated, client);
+    return NULL;
+}
+
+/*  Wait for the flight of req to be led and joined by njoined. */
+static void
+flight_wait(const struct chart_request *req, unsigned njoined)
+{
+    for (bool found = false; !found; ) {
+        pthread_mutex_lock(&rsrc.flight_lock);
+        for (struct flight *flight = rsrc.flight; flight; flight = flight->next)
+            found |= !strcmp(flight->canonical, req->canonical) && flight->njoined == njoined;
+        pthread_mutex_unlock(&rsrc.flight_lock);
+    }
+}
+
+#define NCLIENTS 8
+
+/*  Identical requests arriving while the first is answered are sent its response, the database
+    queried once for them all, and a request of its own leads a flight of its own. */
+char *
+test_flight()
+{
+    rsrc_init();
+    struct chart_request req = {0}, other = {0};
+    strcpy(req.canonical, "data_type=co2e&chart_type=map&select_year=2000");
+    strcpy(other.canonical, "data_type=co2e&chart_type=map&select_year=2001");
+    struct client client[NCLIENTS + 1] = {{0}};
+    pthread_t thread[NCLIENTS + 1];
+    gate_set(false);
+    gate.nqueries = 0;
+    for (unsigned i = 0; i < NCLIENTS + 1; ++i) {
+        client[i].req = i < NCLIENTS ? &req : &other;
+        mu_assert(!pthread_create(&thread[i], NULL, flight_thread, &client[i]),
+            "starting a request");
+        flight_wait(client[i].req, i < NCLIENTS ? i : 0);
+    }
+    gate_set(true);
+    for (unsigned i = 0; i < NCLIENTS + 1; ++i)
+        pthread_join(thread[i], NULL);
+    mu_assert(gate.nqueries == 2 && !rsrc.flight, "querying once per distinct request");
+    char expected[0x80];
+    for (unsigned i = 0; i < NCLIENTS + 1; ++i) {
+        snprintf(expected, sizeof(expected), "%p %s", (void *) flight_snapshot,
+            client[i].req->canonical);
+        mu_assert(client[i].status == 200 && !strcmp(client[i].body, expected),
+            "sending the response of the flight");
+    }
+    mu_assert(!rsrc.admission_running, "releasing admission");
+    return NULL;
+}
+
+/*  A request joining a flight not answered within EMISS_ADMISSION_WAIT_MS is refused, and the
+    flight left to its leader. */
+char *
+test_flight_timeout()
+{
+    rsrc_init();
+    struct chart_request req = {0};
+    strcpy(req.canonical, "data_type=co2e&chart_type=map&select_year=2000");
+    struct client client[2] = {{.req = &req}, {.req = &req}};
+    pthread_t thread[2];
+    gate_set(false);
+    gate.nqueries = 0;
+    mu_assert(!pthread_create(&thread[0], NULL, flight_thread, &client[0]), "starting a request");
+    flight_wait(&req, 0);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    flight_thread(&client[1]);
+    mu_assert(client[1].status == 503 && client[1].retry_after == EMISS_ADMISSION_RETRY_AFTER
+        && elapsed_ms(&start) >= EMISS_ADMISSION_WAIT_MS * 0.9, "refusing after the wait");
+    pthread_mutex_lock(&rsrc.flight_lock);
+    bool left = rsrc.flight && !rsrc.flight->njoined && !rsrc.flight->done;
+    pthread_mutex_unlock(&rsrc.flight_lock);
+    mu_assert(left, "leaving the flight");
+    gate_set(true);
+    pthread_join(thread[0], NULL);
+    mu_assert(gate.nqueries == 1 && client[0].status == 200 && !rsrc.flight,
+        "answering the leader");
+    return NULL;
+}
+
+/*  The same held query answering another endpoint, prefixed by its name. */
+static int
+retrieve_gated_other(emiss_template_st *template_data, struct emiss_resource_snapshot *snapshot,
+    struct arena *arena, const struct chart_request *req, void *cbdata)
+{
+    struct chart_request other = *req;
+    memcpy(other.canonical, "other ", 6);
+    memcpy(&other.canonical[6], req->canonical, strlen(req->canonical) + 1);
+    return retrieve_gated(template_data, snapshot, arena, &other, cbdata);
+}
+
+/*  Requests of the same canonical query to different endpoints lead flights of their own, and a
+    series request leaving its format to the default is keyed as one naming it. */
+char *
+test_flight_endpoints()
+{
+    rsrc_init();
+    struct chart_request req, named;
+    mu_assert(parse_check(&req, "data_type=co2e&from_year=1990&to_year=2000&ccode=XAA",
+            CHART_LINE, NULL, NULL)
+        && parse_check(&named, "data_type=co2e&from_year=1990&to_year=2000&ccode=XAA"
+            "&format=csv", CHART_LINE, NULL, NULL), "parsing");
+    struct chart_request chart = req;
+    series_request_format(&req);
+    series_request_format(&named);
+    mu_assert(req.format == SERIES_CSV && !strcmp(req.canonical, named.canonical)
+        && strcmp(req.canonical, chart.canonical), "resolving the default format");
+
+    struct client client[2] = {{.req = &chart}, {.req = &chart, .retrieve = retrieve_gated_other}};
+    pthread_t thread[2];
+    gate_set(false);
+    gate.nqueries = 0;
+    mu_assert(!pthread_create(&thread[0], NULL, flight_thread, &client[0]), "starting a request");
+    flight_wait(&chart, 0);
+    mu_assert(!pthread_create(&thread[1], NULL, flight_thread, &client[1]), "starting a request");
+    /*  Until the second queries of its own, or joins the flight of the first. */
+    for (bool settled = false; !settled; ) {
+        pthread_mutex_lock(&gate.lock);
+        settled = gate.nqueries == 2;
+        pthread_mutex_unlock(&gate.lock);
+        pthread_mutex_lock(&rsrc.flight_lock);
+        for (struct flight *flight = rsrc.flight; flight; flight = flight->next)
+            settled |= flight->njoined > 0;
+        pthread_mutex_unlock(&rsrc.flight_lock);
+    }
+    gate_set(true);
+    for (unsigned i = 0; i < 2; ++i)
+        pthread_join(thread[i], NULL);
+    mu_assert(gate.nqueries == 2 && !rsrc.flight, "querying once per endpoint");
+    char expected[2][0x80];
+    snprintf(expected[0], sizeof(expected[0]), "%p %s", (void *) flight_snapshot, chart.canonical);
+    snprintf(expected[1], sizeof(expected[1]), "%p other %s", (void *) flight_snapshot,
+        chart.canonical);
+    for (unsigned i = 0; i < 2; ++i)
+        mu_assert(client[i].status == 200 && !strcmp(client[i].body, expected[i]),
+            "answering each endpoint by its own function");
+    return NULL;
+}
+
+char *
+all_tests()
+{
+    mu_suite_start();
+    mu_run_test(test_line_chart);
+    mu_run_test(test_map_chart);
+    mu_run_test(test_invalid);
+    mu_run_test(test_country_count);
+    mu_run_test(test_country_data_result);
+    mu_run_test(test_arena);
+    mu_run_test(test_admission);
+    mu_run_test(test_flight);
+    mu_run_test(test_flight_timeout);
+    mu_run_test(test_flight_endpoints);
+    return NULL;
+}
+
+RUN_TESTS(all_tests)
@@ -0,0 +1,692 @@
+#include "minunit.h"
+#include <stdbool.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*  The sources are served from resources/data by a stand-in server on the loopback interface,
+    the datasets are taken by a stand-in of the update instead of a database, and the age at which
+    the cache goes stale is set by the tests, which run in order on the same cache. */
+static char test_host[0x20];
+static double test_cache_max_age;
+
+#define EMISS_WORLDBANK_HOST                test_host
+#define EMISS_WORLDBANK_HOST_PROTOCOL       "http"
+#define EMISS_COUNTRY_CODES_HOST            test_host
+#define EMISS_COUNTRY_CODES_HOST_PROTOCOL   "http"
+#define EMISS_CACHE_MAX_AGE                 test_cache_max_age
+#define EMISS_FETCH_RETRY_BACKOFF_MS        10
+#define emiss_update_dataset_begin          fake_dataset_begin
+#define emiss_update_dataset_push           fake_dataset_push
+#define emiss_update_dataset_end            fake_dataset_end
+
+#include "../src/emiss_retrieve.c"
+
+#define TEST_DATA_DIR "resources/data"
+
+/*
+**  THE STAND-IN UPDATE
+*/
+
+/*  The datasets parsed, in order, and the SHA-256 of the data passed for each, by slot. */
+struct fake_update {
+    size_t          norder;
+    size_t          order[0x10];
+    int             current;
+    util_sha256_st  hash;
+    char            sha256[EMISS_NINDICATORS + 1][65];
+};
+
+static size_t
+fake_slot(int dataset_id)
+{
+    for (size_t i = 0; i <= EMISS_NINDICATORS; ++i)
+        if (slot_datasets[i] == dataset_id)
+            return i;
+    return SLOT_NONE;
+}
+
+int
+fake_dataset_begin(emiss_update_ctx_st *upd_ctx, int dataset_id)
+{
+    struct fake_update *fake = (struct fake_update *)upd_ctx;
+    if (fake->current != -1 || fake_slot(dataset_id) == SLOT_NONE || fake->norder == 0x10)
+        return 0;
+    fake->current = dataset_id;
+    fake->order[fake->norder++] = fake_slot(dataset_id);
+    util_sha256_init(&fake->hash);
+    return 1;
+}
+
+int
+fake_dataset_push(emiss_update_ctx_st *upd_ctx, const void *data, size_t len)
+{
+    struct fake_update *fake = (struct fake_update *)upd_ctx;
+    if (fake->current == -1)
+        return -1;
+    util_sha256_update(&fake->hash, data, len);
+    return 1;
+}
+
+int
+fake_dataset_end(emiss_update_ctx_st *upd_ctx)
+{
+    struct fake_update *fake = (struct fake_update *)upd_ctx;
+    if (fake->current == -1)
+        return 0;
+    util_sha256_final_hex(&fake->hash, fake->sha256[fake_slot(fake->current)]);
+    fake->current = -1;
+    return 1;
+}
+
+static emiss_update_ctx_st *
+fake_reset(struct fake_update *fake)
+{
+    memset(fake, 0, sizeof(struct fake_update));
+    fake->current = -1;
+    return (emiss_update_ctx_st *)fake;
+}
+
+/*
+**  THE STAND-IN SERVER
+*/
+
+/*  A source as served: its body, validators and what was asked of it. */
+struct resource {
+    const char     *path;
+    char           *body;
+    size_t          len;
+    char            sha256[65];
+    char            etag[0x40];
+    char            last_modified[0x40];
+    unsigned        requests;
+    unsigned        not_modified;
+    char            if_none_match[0x40];
+    char            if_modified_since[0x40];
+};
+
+/*  The sources in the order of the validators of emiss_retrieve_data(). With conditions not
+    honored, every request is answered in full, with whatever validators are set. */
+static struct server {
+    pthread_mutex_t lock;
+    pthread_t       thread;
+    int             fd;
+    bool            honor_conditions;
+    struct resource resources[EMISS_NINDICATORS];
+} server = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .honor_conditions = true,
+    .resources = {
+        {.path = "/" EMISS_COUNTRY_CODES_REL_URI DATASET_0_NAME ".csv"},
+        {.path = "/" EMISS_WORLDBANK_REL_URI DATASET_1_NAME "?"
+            EMISS_WORLDBANK_QSTR_DOWNLOAD_FORMAT},
+        {.path = "/" EMISS_WORLDBANK_REL_URI DATASET_2_NAME "?"
+            EMISS_WORLDBANK_QSTR_DOWNLOAD_FORMAT}
+    }
+};
+
+/*  Copy the value of a request header, if present, to value. */
+static void
+request_header(const char *request, const char *name, char *value, size_t size)
+{
+    size_t name_len = strlen(name);
+    *value = '\0';
+    for (const char *line = strstr(request, "\r\n"); line; line = strstr(line + 2, "\r\n"))
+        if (!strncasecmp(line + 2, name, name_len) && line[2 + name_len] == ':') {
+            const char *start = line + 3 + name_len;
+            start += strspn(start, " ");
+            snprintf(value, size, "%.*s", (int) strcspn(start, "\r\n"), start);
+            return;
+        }
+}
+
+static bool
+send_all(int fd, const char *data, size_t len)
+{
+    while (len) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        data += n;
+        len  -= (size_t) n;
+    }
+    return true;
+}
+
+/*  Answer a single request on a connection, then close it. */
+static void
+server_respond(int fd)
+{
+    char request[0x2000], path[0x400], header[0x400];
+    size_t len = 0;
+    while (len < sizeof(request) - 1) {
+        ssize_t n = recv(fd, &request[len], sizeof(request) - 1 - len, 0);
+        if (n <= 0)
+            return;
+        len += (size_t) n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n"))
+            break;
+    }
+    if (sscanf(request, "GET %1023s HTTP/1.1", path) != 1)
+        return;
+    pthread_mutex_lock(&server.lock);
+    struct resource *rsrc = NULL;
+    for (size_t i = 0; i < EMISS_NINDICATORS; ++i)
+        if (!strcmp(path, server.resources[i].path))
+            rsrc = &server.resources[i];
+    if (!rsrc) {
+        pthread_mutex_unlock(&server.lock);
+        const char *not_found = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                                "Connection: close\r\n\r\n";
+        send_all(fd, not_found, strlen(not_found));
+        return;
+    }
+    rsrc->requests++;
+    request_header(request, "If-None-Match", rsrc->if_none_match, sizeof(rsrc->if_none_match));
+    request_header(request, "If-Modified-Since", rsrc->if_modified_since,
+        sizeof(rsrc->if_modified_since));
+    bool not_modified = server.honor_conditions
+                    && ((*rsrc->etag && !strcmp(rsrc->if_none_match, rsrc->etag))
+                        || (!*rsrc->if_none_match && *rsrc->last_modified
+                            && !strcmp(rsrc->if_modified_since, rsrc->last_modified)));
+    rsrc->not_modified += not_modified;
+    int n = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Length: %zu\r\n"
+                "Connection: close\r\n", not_modified ? "304 Not Modified" : "200 OK",
+                not_modified ? 0 : rsrc->len);
+    if (*rsrc->etag)
+        n += snprintf(&header[n], sizeof(header) - n, "ETag: %s\r\n", rsrc->etag);
+    if (*rsrc->last_modified)
+        n += snprintf(&header[n], sizeof(header) - n, "Last-Modified: %s\r\n",
+                rsrc->last_modified);
+    n += snprintf(&header[n], sizeof(header) - n, "\r\n");
+    char *body = not_modified ? NULL : rsrc->body;
+    size_t body_len = not_modified ? 0 : rsrc->len;
+    pthread_mutex_unlock(&server.lock);
+    if (send_all(fd, header, (size_t) n) && body)
+        send_all(fd, body, body_len);
+}
+
+static void *
+server_run(void *arg)
+{
+    (void) arg;
+    int fd;
+    while ((fd = accept(server.fd, NULL, NULL)) != -1) {
+        server_respond(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static bool
+server_start(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+    server.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server.fd == -1 || bind(server.fd, (struct sockaddr *)&addr, sizeof(addr))
+        || listen(server.fd, 16) || getsockname(server.fd, (struct sockaddr *)&addr, &addr_len))
+        return false;
+    snprintf(test_host, sizeof(test_host), "127.0.0.1:%u", (unsigned) ntohs(addr.sin_port));
+    return !pthread_create(&server.thread, NULL, server_run, NULL);
+}
+
+static void
+server_stop(void)
+{
+    shutdown(server.fd, SHUT_RDWR);
+    close(server.fd);
+    pthread_join(server.thread, NULL);
+}
+
+/*  Set the body a source is served with. */
+static void
+server_body_set(size_t i, char *body, size_t len)
+{
+    pthread_mutex_lock(&server.lock);
+    struct resource *rsrc = &server.resources[i];
+    free(rsrc->body);
+    rsrc->body = body;
+    rsrc->len  = len;
+    util_sha256_st hash;
+    util_sha256_init(&hash);
+    util_sha256_update(&hash, body, len);
+    util_sha256_final_hex(&hash, rsrc->sha256);
+    pthread_mutex_unlock(&server.lock);
+}
+
+/*  Set the validators of every source, empty if NULL, and forget the requests seen. */
+static void
+server_validators_set(const char *etag, const char *last_modified)
+{
+    pthread_mutex_lock(&server.lock);
+    for (size_t i = 0; i < EMISS_NINDICATORS; ++i) {
+        struct resource *rsrc = &server.resources[i];
+        if (etag)
+            snprintf(rsrc->etag, sizeof(rsrc->etag), "\"%s-%zu\"", etag, i);
+        else
+            *rsrc->etag = '\0';
+        snprintf(rsrc->last_modified, sizeof(rsrc->last_modified), "%s",
+            last_modified ? last_modified : "");
+        rsrc->requests = rsrc->not_modified = 0;
+    }
+    pthread_mutex_unlock(&server.lock);
+}
+
+/*
+**  TEST DATA
+*/
+
+static char *
+file_read(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    char *data = NULL;
+    long size = -1;
+    if (fp && !fseek(fp, 0, SEEK_END) && (size = ftell(fp)) >= 0 && !fseek(fp, 0, SEEK_SET)
+        && (data = malloc((size_t) size + 1)) && fread(data, 1, (size_t) size, fp) == (size_t) size)
+        *len = (size_t) size;
+    else {
+        free(data);
+        data = NULL;
+    }
+    if (fp)
+        fclose(fp);
+    return data;
+}
+
+static bool
+file_sha256(const char *path, char sha256[65])
+{
+    size_t len;
+    char *data = file_read(path, &len);
+    if (!data)
+        return false;
+    util_sha256_st hash;
+    util_sha256_init(&hash);
+    util_sha256_update(&hash, data, len);
+    util_sha256_final_hex(&hash, sha256);
+    free(data);
+    return true;
+}
+
+/*  The SHA-256 of the data files, by slot. */
+static char data_sha256[EMISS_NINDICATORS + 1][65];
+
+/*  An entry of an archive: a data file, or text if no path is given. */
+struct entry {
+    const char     *name;
+    const char     *path;
+    const char     *text;
+    bool            deflate;
+};
+
+static void
+le_put(char *p, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+        p[i] = (char) (value >> (8 * i) & 0xFF);
+}
+
+/*  An archive of the entries, of local file headers followed by an empty central directory: as
+    much of the format as is read from a stream. */
+static char *
+zip_build(const struct entry *entries, size_t nentries, const char *append, size_t *len)
+{
+    size_t capacity = 22;
+    char **datas = calloc(nentries, sizeof(char *));
+    size_t *lens = calloc(nentries, sizeof(size_t));
+    char *zip = NULL;
+    for (size_t i = 0; datas && lens && i < nentries; ++i) {
+        if (entries[i].path) {
+            if (!(datas[i] = file_read(entries[i].path, &lens[i])))
+                goto cleanup;
+            if (append && i == 0) {
+                char *data = realloc(datas[i], lens[i] + strlen(append));
+                if (!data)
+                    goto cleanup;
+                datas[i] = data;
+                memcpy(&datas[i][lens[i]], append, strlen(append));
+                lens[i] += strlen(append);
+            }
+        } else {
+            lens[i] = strlen(entries[i].text);
+            datas[i] = strdup(entries[i].text);
+        }
+        capacity += ZIP_LOCAL_HEADER_SIZE + strlen(entries[i].name) + lens[i];
+    }
+    if (!datas || !lens || !(zip = malloc(capacity)))
+        goto cleanup;
+    *len = 0;
+    for (size_t i = 0; i < nentries; ++i) {
+        char *p = &zip[*len];
+        size_t name_len = strlen(entries[i].name), size = lens[i];
+        uint32_t crc = (uint32_t) mz_crc32(MZ_CRC32_INIT, (unsigned char *)datas[i], lens[i]);
+        void *deflated = NULL;
+        if (entries[i].deflate) {
+            deflated = tdefl_compress_mem_to_heap(datas[i], lens[i], &size,
+                            TDEFL_DEFAULT_MAX_PROBES);
+            if (!deflated) {
+                free(zip);
+                zip = NULL;
+                goto cleanup;
+            }
+        }
+        memset(p, 0, ZIP_LOCAL_HEADER_SIZE);
+        le_put(&p[0], ZIP_LOCAL_HEADER_SIG, 4);
+        le_put(&p[4], 20, 2);
+        le_put(&p[8], deflated ? MZ_DEFLATED : 0, 2);
+        le_put(&p[14], crc, 4);
+        le_put(&p[18], size, 4);
+        le_put(&p[22], lens[i], 4);
+        le_put(&p[26], name_len, 2);
+        memcpy(&p[ZIP_LOCAL_HEADER_SIZE], entries[i].name, name_len);
+        memcpy(&p[ZIP_LOCAL_HEADER_SIZE + name_len], deflated ? deflated : datas[i], size);
+        *len += ZIP_LOCAL_HEADER_SIZE + name_len + size;
+        free(deflated);
+    }
+    memset(&zip[*len], 0, 22);
+    le_put(&zip[*len], ZIP_END_OF_CENTRAL_DIR_SIG, 4);
+    *len += 22;
+cleanup:
+    for (size_t i = 0; datas && i < nentries; ++i)
+        free(datas[i]);
+    free(datas);
+    free(lens);
+    return zip;
+}
+
+/*  Serve the data files as the sources would: the country codes as is, the indicators in
+    archives with their metadata, the data of one entry deflated. Text is appended to the data of
+    the population archive, if given. */
+static bool
+server_bodies_set(const char *append)
+{
+    const struct entry co2e[] = {
+        {"API_" DATASET_1_NAME "_DS2_en_csv_v2.csv", TEST_DATA_DIR "/" DATASET_1_NAME ".csv",
+            NULL, true},
+        {"Metadata_Indicator_API_" DATASET_1_NAME "_DS2_en_csv_v2.csv", NULL,
+            "\"INDICATOR_CODE\",\"INDICATOR_NAME\"\n", false},
+        {"Metadata_Country_API_" DATASET_1_NAME "_DS2_en_csv_v2.csv",
+            TEST_DATA_DIR "/" DATASET_META_NAME ".csv", NULL, false}
+    };
+    const struct entry popt[] = {
+        {"API_" DATASET_2_NAME "_DS2_en_csv_v2.csv", TEST_DATA_DIR "/" DATASET_2_NAME ".csv",
+            NULL, false},
+        {"Metadata_Country_API_" DATASET_2_NAME "_DS2_en_csv_v2.csv",
+            TEST_DATA_DIR "/" DATASET_META_NAME ".csv", NULL, true}
+    };
+    size_t len[EMISS_NINDICATORS];
+    char *bodies[EMISS_NINDICATORS] = {
+        file_read(TEST_DATA_DIR "/" DATASET_0_NAME ".csv", &len[0]),
+        zip_build(co2e, 3, NULL, &len[1]),
+        zip_build(popt, 2, append, &len[2])
+    };
+    if (!bodies[0] || !bodies[1] || !bodies[2]) {
+        for (size_t i = 0; i < EMISS_NINDICATORS; ++i)
+            free(bodies[i]);
+        return false;
+    }
+    for (size_t i = 0; i < EMISS_NINDICATORS; ++i)
+        server_body_set(i, bodies[i], len[i]);
+    return true;
+}
+
+/*  Remove the files of a directory and the directory. */
+static void
+dir_remove(const char *dir)
+{
+    char path[0x400];
+    DIR *dp = opendir(dir);
+    struct dirent *ent;
+    while (dp && (ent = readdir(dp)))
+        if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..")
+            && cache_path(path, sizeof(path), dir, ent->d_name, ""))
+            remove(path);
+    if (dp)
+        closedir(dp);
+    rmdir(dir);
+}
+
+/*
+**  TESTS
+*/
+
+static char cache_dir[0x400];
+static emiss_source_validator_st validators[EMISS_NINDICATORS];
+
+/*  Whether the datasets of the slots given, and only those, were parsed in that order, each as in
+    its file or, if sha256 is given, as hashed there. */
+static bool
+parsed_check(struct fake_update *fake, const size_t *slots, size_t nslots, const char *sha256)
+{
+    if (fake->norder != nslots || fake->current != -1)
+        return false;
+    for (size_t i = 0; i < nslots; ++i)
+        if (fake->order[i] != slots[i] || strcmp(fake->sha256[slots[i]],
+                sha256 && slots[i] == 3 ? sha256 : data_sha256[slots[i]]))
+            return false;
+    return true;
+}
+
+/*  Whether each source was asked for once, answered as not_modified and on the conditions given
+    by the ETag ('E') and Last-Modified ('L') stored. */
+static bool
+requests_check(unsigned not_modified, const char *conditions)
+{
+    for (size_t i = 0; i < EMISS_NINDICATORS; ++i) {
+        struct resource *rsrc = &server.resources[i];
+        bool etag          = strchr(conditions, 'E'),
+             last_modified = strchr(conditions, 'L');
+        if (rsrc->requests != 1 || rsrc->not_modified != not_modified
+            || strcmp(rsrc->if_none_match, etag ? validators[i].etag : "")
+            || strcmp(rsrc->if_modified_since, last_modified ? validators[i].last_modified : "")
+            || (etag && !*rsrc->if_none_match)
+            || (last_modified && !*rsrc->if_modified_since))
+            return false;
+    }
+    return true;
+}
+
+char *
+test_setup()
+{
+    const char *paths[] = {
+        TEST_DATA_DIR "/" DATASET_0_NAME ".csv", TEST_DATA_DIR "/" DATASET_1_NAME ".csv",
+        TEST_DATA_DIR "/" DATASET_META_NAME ".csv", TEST_DATA_DIR "/" DATASET_2_NAME ".csv"
+    };
+    for (size_t i = 0; i <= EMISS_NINDICATORS; ++i)
+        mu_assert(file_sha256(paths[i], data_sha256[i]), "reading the data files");
+    char root[] = "/tmp/emiss_retrieve_test.XXXXXX";
+    mu_assert(mkdtemp(root), "creating a resource root");
+    mu_assert(!setenv(EMISS_RESOURCE_ROOT_ENV, root, 1)
+        && emiss_resource_path(cache_dir, sizeof(cache_dir), EMISS_CACHE_ROOT)
+        && !strncmp(cache_dir, root, strlen(root)), "resolving the cache in the resource root");
+    /*  Proxies set in the environment are not to be used for the loopback interface. */
+    mu_assert(!setenv("no_proxy", "127.0.0.1", 1) && !setenv("NO_PROXY", "127.0.0.1", 1),
+        "bypassing proxies");
+    unsetenv(EMISS_OFFLINE_ENV);
+    mu_assert(server_bodies_set(NULL), "building the archives");
+    mu_assert(server_start(), "starting the server");
+    return NULL;
+}
+
+/*  Without validators, every source is fetched in full and its datasets parsed in order, from
+    the archives deflated or not, and stored in the cache under their hash. */
+char *
+test_fetch_full()
+{
+    const size_t all[] = {0, 1, 2, 3};
+    struct fake_update fake;
+    struct cache cache;
+    server_validators_set("v1", "Wed, 03 Apr 2019 10:00:00 GMT");
+    mu_assert(emiss_retrieve_data(fake_reset(&fake), validators) == 1, "fetching");
+    mu_assert(parsed_check(&fake, all, 4, NULL), "parsing the datasets in order");
+    mu_assert(requests_check(0, ""), "requesting unconditionally");
+    for (size_t i = 0; i < EMISS_NINDICATORS; ++i)
+        mu_assert(!strcmp(validators[i].etag, server.resources[i].etag)
+            && !strcmp(validators[i].last_modified, server.resources[i].last_modified)
+            && !strcmp(validators[i].sha256, server.resources[i].sha256),
+            "storing the validators of the sources");
+    mu_assert(cache_load(&cache, cache_dir) == 1, "reading the manifest");
+    for (size_t i = 0; i <= EMISS_NINDICATORS; ++i)
+        mu_assert(!strcmp(cache.entries[i].sha256, data_sha256[i])
+            && cache_entry_present(&cache, i), "caching the datasets");
+    mu_assert(!strcmp(cache.entries[2].url, cache.entries[1].url)
+        && !strcmp(cache.entries[2].validator.etag, validators[1].etag),
+        "listing the source of the metadata");
+    return NULL;
+}
+
+/*  A source answering 304 to an ETag or Last-Modified, or in full with the ETag stored, is not
+    parsed. */
+char *
+test_fetch_not_modified()
+{
+    struct fake_update fake;
+    server_validators_set("v1", "Wed, 03 Apr 2019 10:00:00 GMT");
+    mu_assert(emiss_retrieve_data(fake_reset(&fake), validators) == 1, "fetching on an ETag");
+    mu_assert(parsed_check(&fake, NULL, 0, NULL), "parsing nothing on 304");
+    mu_assert(requests_check(1, "EL"), "requesting on the ETag");
+
+    server.honor_conditions = false;
+    server_validators_set("v1", NULL);
+    mu_assert(emiss_retrieve_data(fake_reset(&fake), validators) == 1,
+        "fetching from a server ignoring conditions");
+    server.honor_conditions = true;
+    mu_assert(parsed_check(&fake, NULL, 0, NULL), "parsing nothing with the ETag unchanged");
+    mu_assert(requests_check(0, "EL"), "discarding the bodies of matching ETags");
+
+    server_validators_set(NULL, "Wed, 03 Apr 2019 10:00:00 GMT");
+    for (size_t i = 0; i < EMISS_NINDICATORS; ++i) {
+        memset(validators[i].etag, 0, sizeof(validators[i].etag));
+        snprintf(validators[i].last_modified, sizeof(validators[i].last_modified), "%s",
+            server.resources[i].last_modified);
+    }
+    mu_assert(emiss_retrieve_data(fake_reset(&fake), validators) == 1,
+        "fetching on Last-Modified");
+    mu_assert(parsed_check(&fake, NULL, 0, NULL), "parsing nothing on 304");
+    mu_assert(requests_check(1, "L"), "requesting on Last-Modified");
+    return NULL;
+}
+
+/*  A source without validators is compared by the SHA-256 of its content: one unchanged is not
+    parsed and one changed is, along with the country codes, fetched again in full for it. */
+char *
+test_fetch_hash()
+{
+    struct fake_update fake;
+    struct cache cache;
+    char old_sha256[65], sha256[65];
+    server_validators_set(NULL, NULL);
+    mu_assert(emiss_retrieve_data(fake_reset(&fake), validators) == 1, "fetching");
+    mu_assert(parsed_check(&fake, NULL, 0, NULL), "parsing nothing with the hashes unchanged");
+    mu_assert(requests_check(0, "L"), "requesting in full");
+
+    const char *append = "\"Nowhere\",\"NWH\",\"Population, total\",\"SP.POP.TOTL\",\"1\",\n";
+    char *data = NULL;
+    size_t len;
+    util_sha256_st hash;
+    mu_assert((data = file_read(TEST_DATA_DIR "/" DATASET_2_NAME ".csv", &len)),
+        "reading the data file");
+    util_sha256_init(&hash);
+    util_sha256_update(&hash, data, len);
+    util_sha256_update(&hash, append, strlen(append));
+    util_sha256_final_hex(&hash, sha256);
+    free(data);
+    mu_assert(server_bodies_set(append), "building the archives");
+    server_validators_set(NULL, NULL);
+    memcpy(old_sha256, validators[2].sha256, sizeof(old_sha256));
+
+    const size_t changed[] = {0, 3};
+    mu_assert(emiss_retrieve_data(fake_reset(&fake), validators) == 1, "fetching a change");
+    mu_assert(parsed_check(&fake, changed, 2, sha256),
+        "parsing the change after the country codes");
+    mu_assert(server.resources[0].requests == 2 && server.resources[1].requests == 1
+        && server.resources[2].requests == 1, "fetching the country codes again");
+    mu_assert(strcmp(validators[2].sha256, old_sha256)
+        && !strcmp(validators[2].sha256, server.resources[2].sha256), "storing the new hash");
+    mu_assert(cache_load(&cache, cache_dir) == 1 && !strcmp(cache.entries[3].sha256, sha256)
+        && cache_entry_present(&cache, 3), "caching the change");
+    char path[0x400];
+    mu_assert(cache_path(path, sizeof(path), cache_dir, data_sha256[3], ".csv")
+        && access(path, F_OK), "removing the file replaced");
+    memcpy(data_sha256[3], sha256, sizeof(sha256));
+    return NULL;
+}
+
+/*  A fresh cache is parsed without asking the sources, a stale one is kept when they cannot be
+    reached, and either one or a directory of plain files is parsed offline. */
+char *
+test_cache_fallback()
+{
+    const size_t all[] = {0, 1, 2, 3};
+    struct fake_update fake;
+    struct cache cache;
+    char path[0x400];
+    server_validators_set(NULL, NULL);
+    test_cache_max_age = 3600;
+    mu_assert(cache_load(&cache, cache_dir) == 1 && cache_fresh(&cache, time(NULL), 3600)
+        && !cache_fresh(&cache, time(NULL) + 3600, 3600), "aging the cache");
+    mu_assert(emiss_retrieve_data(fake_reset(&fake), validators) == 1, "parsing a fresh cache");
+    test_cache_max_age = 0;
+    mu_assert(parsed_check(&fake, all, 4, NULL), "parsing the cached datasets");
+    for (size_t i = 0; i < EMISS_NINDICATORS; ++i)
+        mu_assert(!server.resources[i].requests, "asking the sources");
+
+    server_stop();
+    mu_assert(!emiss_retrieve_data(fake_reset(&fake), validators),
+        "fetching from an unreachable server");
+    mu_assert(emiss_retrieve_from_cache(fake_reset(&fake), cache_dir) == 1
+        && parsed_check(&fake, all, 4, NULL), "parsing the cache after a failed fetch");
+
+    mu_assert(!setenv(EMISS_OFFLINE_ENV, "1", 1), "going offline");
+    mu_assert(emiss_retrieve_data(fake_reset(&fake), validators) == 1
+        && parsed_check(&fake, all, 4, NULL), "parsing the cache offline");
+    mu_assert(!setenv(EMISS_OFFLINE_ENV, TEST_DATA_DIR, 1), "going offline to the data files");
+    mu_assert(file_sha256(TEST_DATA_DIR "/" DATASET_2_NAME ".csv", data_sha256[3]),
+        "reading the data file");
+    mu_assert(emiss_retrieve_data(fake_reset(&fake), validators) == 1
+        && parsed_check(&fake, all, 4, NULL), "parsing the data files offline");
+    unsetenv(EMISS_OFFLINE_ENV);
+
+    /*  A cached file that no longer matches its hash is not parsed. */
+    FILE *fp = NULL;
+    mu_assert(cache_load(&cache, cache_dir) == 1
+        && cache_path(path, sizeof(path), cache_dir, cache.entries[1].sha256, ".csv")
+        && (fp = fopen(path, "ab")) && fputs("\n", fp) >= 0 && !fclose(fp),
+        "altering a cached file");
+    mu_assert(!emiss_retrieve_from_cache(fake_reset(&fake), cache_dir),
+        "parsing an altered cache");
+    return NULL;
+}
+
+char *
+test_teardown()
+{
+    char root[0x400];
+    snprintf(root, sizeof(root), "%s", getenv(EMISS_RESOURCE_ROOT_ENV));
+    dir_remove(cache_dir);
+    dir_remove(root);
+    for (size_t i = 0; i < EMISS_NINDICATORS; ++i)
+        free(server.resources[i].body);
+    return NULL;
+}
+
+char *
+all_tests()
+{
+    mu_suite_start();
+    mu_run_test(test_setup);
+    mu_run_test(test_fetch_full);
+    mu_run_test(test_fetch_not_modified);
+    mu_run_test(test_fetch_hash);
+    mu_run_test(test_cache_fallback);
+    mu_run_test(test_teardown);
+    return NULL;
+}
+
+RUN_TESTS(all_tests)
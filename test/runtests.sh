@@ -0,0 +1,20 @@
+#!/bin/sh
+# Run each unit test binary test/*_test built by make tests, stopping at the first that fails.
+# Their output goes to test/tests.log; set VALGRIND to run them under it, e.g. VALGRIND=valgrind.
+
+LOG=test/tests.log
+: > "$LOG"
+echo "Running unit tests:"
+for i in test/*_test; do
+    if test -f "$i" && test -x "$i"; then
+        if $VALGRIND "./$i" >> "$LOG" 2>&1; then
+            echo "$i PASS"
+        else
+            echo "ERROR in test $i: here's $LOG"
+            echo "------"
+            tail "$LOG"
+            exit 1
+        fi
+    fi
+done
+echo ""
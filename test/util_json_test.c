@@ -0,0 +1,160 @@
+#include "minunit.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include "util_json.h"
+
+/*  Append the string escaped as given to a fresh builder and compare the result. */
+static bool
+escape_check(util_json_escape_et escape, const char *src, const char *expected)
+{
+    util_json_buf_st json;
+    if (!util_json_init(&json, NULL, 4, escape))
+        return false;
+    util_json_str(&json, src);
+    bool ok = !json.failed && json.len == strlen(json.data) && !strcmp(json.data, expected);
+    if (!ok)
+        log_err("[mu]: escaping \"%s\": expected %s, got %s", src, expected, json.data);
+    free(json.data);
+    return ok;
+}
+
+/*  Each mode on quotes, backslashes, control characters and bytes other than ASCII. */
+char *
+test_escape()
+{
+    const char *src = "a\"b\\c'd\n\t\x01\x1f\xc3\xa9</e>";
+    mu_assert(escape_check(UTIL_JSON_ESC_JSON, src,
+        "\"a\\\"b\\\\c'd\\n\\t\\u0001\\u001f\xc3\xa9</e>\""), "escaping as JSON");
+    mu_assert(escape_check(UTIL_JSON_ESC_JS_QUOTED, src,
+        "\"a\\\\\"b\\\\\\\\c\\'d\\\\n\\\\t\\\\u0001\\\\u001f\xc3\xa9</e>\""),
+        "escaping as JSON in a JavaScript literal");
+    mu_assert(escape_check(UTIL_JSON_ESC_JS, src,
+        "\"a\"b\\\\c\\'d\\n\\t\\u0001\\u001f\xc3\xa9</e>\""), "escaping as a JavaScript literal");
+    mu_assert(escape_check(UTIL_JSON_ESC_JSON, "", "\"\"")
+        && escape_check(UTIL_JSON_ESC_JS_QUOTED, "plain", "\"plain\""), "passing runs through");
+    return NULL;
+}
+
+/*  A fixed buffer fails on the append that does not fit and ignores the rest, and an allocated
+    one grows. Both stay NUL-terminated. */
+char *
+test_buffers()
+{
+    char buf[8];
+    util_json_buf_st json;
+    mu_assert(util_json_init(&json, buf, sizeof(buf), UTIL_JSON_ESC_JSON), "initializing");
+    UTIL_JSON_LITERAL(&json, "[1,2");
+    mu_assert(!json.failed && !strcmp(buf, "[1,2"), "appending within the buffer");
+    UTIL_JSON_LITERAL(&json, ",3,4");
+    mu_assert(json.failed && json.len == 4 && !strcmp(buf, "[1,2"), "appending past its end");
+    util_json_char(&json, ']');
+    mu_assert(json.len == 4 && !strcmp(buf, "[1,2"), "appending after a failure");
+
+    mu_assert(util_json_init(&json, NULL, 0, UTIL_JSON_ESC_JSON) && json.data, "allocating");
+    for (unsigned i = 0; i < 1000; ++i) {
+        util_json_char(&json, i ? ',' : '[');
+        util_json_uint(&json, i);
+    }
+    util_json_char(&json, ']');
+    mu_assert(!json.failed && json.len == strlen(json.data) && json.len < json.size
+        && !strncmp(json.data, "[0,1,2,", 7) && !strcmp(&json.data[json.len - 5], ",999]"),
+        "growing the allocation");
+    free(json.data);
+    return NULL;
+}
+
+char *
+test_integers()
+{
+    char buf[0x100];
+    util_json_buf_st json;
+    util_json_init(&json, buf, sizeof(buf), UTIL_JSON_ESC_JSON);
+    util_json_int(&json, 0);
+    util_json_char(&json, ' ');
+    util_json_int(&json, -1);
+    util_json_char(&json, ' ');
+    util_json_int(&json, INTMAX_MAX);
+    util_json_char(&json, ' ');
+    util_json_int(&json, INTMAX_MIN);
+    util_json_char(&json, ' ');
+    util_json_uint(&json, UINTMAX_MAX);
+    char expected[0x100];
+    snprintf(expected, sizeof(expected), "0 -1 %jd %jd %ju", INTMAX_MAX, INTMAX_MIN, UINTMAX_MAX);
+    mu_assert(!json.failed && !strcmp(buf, expected), "formatting integers");
+    return NULL;
+}
+
+/*  Format a double into buf, returning whether it reads back as the same value. */
+static bool
+double_format(double value, char *buf, size_t size)
+{
+    util_json_buf_st json;
+    util_json_init(&json, buf, size, UTIL_JSON_ESC_JSON);
+    util_json_double(&json, value);
+    char *end;
+    return !json.failed && strtod(buf, &end) == value && !*end;
+}
+
+/*  Values with up to 6 decimals in their fewest digits, the rest in as many as needed to read
+    back the same, and no numbers that are not finite. */
+char *
+test_doubles()
+{
+    const struct {
+        double      value;
+        const char *text;
+    } exact[] = {
+        {0, "0"}, {-0.0, "0"}, {100, "100"}, {12.5, "12.5"}, {-3.25, "-3.25"}, {0.1, "0.1"},
+        {0.05, "0.05"}, {0.000001, "0.000001"}, {123456.789, "123456.789"},
+        {1234567.125, "1234567.125"}, {1e14, "100000000000000"},
+        {1.0 / 3, "0.3333333333333333"}, {0.1 + 0.2, "0.30000000000000004"}, {1e15, "1e+15"},
+        {1e-7, "1e-07"}, {5e-324, "4.94065645841247e-324"}
+    };
+    char buf[0x40];
+    for (size_t i = 0; i < sizeof(exact) / sizeof(exact[0]); ++i) {
+        bool read_back = double_format(exact[i].value, buf, sizeof(buf));
+        if (strcmp(buf, exact[i].text)) {
+            log_err("[mu]: expected %s, got %s", exact[i].text, buf);
+            mu_assert(false, "formatting a double");
+        }
+        mu_assert(read_back, "reading a double back");
+    }
+    const double not_finite[] = {NAN, INFINITY, -INFINITY};
+    for (size_t i = 0; i < 3; ++i) {
+        double_format(not_finite[i], buf, sizeof(buf));
+        mu_assert(!strcmp(buf, "null"), "formatting a number not finite");
+    }
+    /*  Values of every magnitude and bit pattern, and decimals near the fast path's limits. */
+    uint64_t state = 0x9E3779B97F4A7C15;
+    for (unsigned i = 0; i < 100000; ++i) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        double value;
+        if (i & 1) {
+            memcpy(&value, &state, sizeof(value));
+            if (!isfinite(value))
+                continue;
+        } else
+            value = (double) (int64_t) (state >> (state & 0x3F ? state & 0x3F : 1))
+                    / (double[]){1, 10, 100, 1e3, 1e4, 1e5, 1e6, 1e7}[state >> 61];
+        if (!double_format(value, buf, sizeof(buf))) {
+            log_err("[mu]: %.17g formatted as %s", value, buf);
+            mu_assert(false, "reading a double back");
+        }
+    }
+    return NULL;
+}
+
+char *
+all_tests()
+{
+    mu_suite_start();
+    mu_run_test(test_escape);
+    mu_run_test(test_buffers);
+    mu_run_test(test_integers);
+    mu_run_test(test_doubles);
+    return NULL;
+}
+
+RUN_TESTS(all_tests)
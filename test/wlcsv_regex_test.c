@@ -0,0 +1,130 @@
+#include "minunit.h"
+#include "../src/wlcsv.c"
+#include "emiss.h"
+
+/*  Fields of the Worldbank files and others around the prefilter's edges: numbers, which the
+    prefilter rejects, non-numbers that look like them, empty fields and fields too long to be
+    memoized. */
+static const char *fields[] = {
+    "1960", "2014", "12.5", "-3e5", "+1E-7", "0.", ".5", "1.2.3", "1..2", "12a", "e", "-", "",
+    "Country Name", "Country Code", "Indicator Name", "Indicator Code", "EN.ATM.CO2E.KT",
+    "SP.POP.TOTL", "CO2 emissions (kt)", "Population, total", "Region", "IncomeGroup",
+    "SpecialNotes", "INX", "Not classified", "Aruba", "ABW", "Sub-Saharan Africa",
+    "World", "Country", "Name", "Code Name",
+    "A field of more than IGNORE_MEMO_LEN characters, a.b.c, never memoized",
+    "1234567890123456789012345678901234567890123456789012345678901234567890"
+};
+
+#define NFIELDS (sizeof(fields) / sizeof(fields[0]))
+
+/*  Whether the regex matches the field, by PCRE alone: no study, prefilter or memo. */
+static bool
+reference_match(pcre *code, const char *str, size_t len)
+{
+    return pcre_exec(code, NULL, str, (int) len, 0, 0, NULL, 0) >= 0;
+}
+
+char *
+test_prefilter_applies()
+{
+    mu_assert(regex_excludes_numeric(EMISS_IGNORE_REGEX),
+        "EMISS_IGNORE_REGEX is not found to exclude numbers");
+    mu_assert(!regex_excludes_numeric("\\d+"), "a regex of digits found to exclude numbers");
+    mu_assert(!regex_excludes_numeric("(a|1)"), "an alternative of a digit excludes numbers");
+    mu_assert(!regex_excludes_numeric("Name|[A-Z]{3}"), "a class, as of \"EEE\", excludes numbers");
+    mu_assert(regex_excludes_numeric("Name|N[A-Z]{3}"), "a regex of letters includes numbers");
+    mu_assert(regex_excludes_numeric("\\w+\\.\\w+\\.\\w+"), "two dots found to fit a number");
+    return NULL;
+}
+
+/*  The prefilter and memo of ignore_regex_match() decide as PCRE does on every field, whether in
+    a column of its own, repeated down a column or alternating with others in it. */
+char *
+test_ignore_regex_identical()
+{
+    const char *error_msg;
+    int error_offset;
+    pcre *code = pcre_compile(EMISS_IGNORE_REGEX, 0, &error_msg, &error_offset, 0);
+    mu_assert(code, "compiling the reference regex");
+    wlcsv_ctx_st *ctx = wlcsv_init(EMISS_IGNORE_REGEX, 0, 0, 0, 0, 0, 0, 0, 0);
+    mu_assert(ctx, "initializing");
+    mu_assert(ctx->ignore_regex.numeric_excluded, "the ignore regex is not prefiltered");
+
+    for (unsigned pass = 0; pass < 3; ++pass)
+        for (size_t i = 0; i < NFIELDS; ++i) {
+            /*  A column per field, all fields in a single column, and the columns shifted. */
+            ctx->state.col = pass == 0 ? (unsigned) i : pass == 1 ? 0 : (unsigned) (i * 7 % 5);
+            for (unsigned repeat = 0; repeat < 2; ++repeat) {
+                size_t len = strlen(fields[i]);
+                bool expected = reference_match(code, fields[i], len);
+                if (ignore_regex_match(ctx, fields[i], len) != expected) {
+                    log_err("[mu]: %s ignored by PCRE: %d", fields[i], expected);
+                    mu_assert(false, "the prefiltered and memoized match differs from PCRE");
+                }
+            }
+        }
+    /*  A memo of a field is not taken for a longer field with the same start. */
+    ctx->state.col = 1;
+    mu_assert(!ignore_regex_match(ctx, "EN.ATM", 6) && ignore_regex_match(ctx, "EN.ATM.CO2E", 11)
+        && !ignore_regex_match(ctx, "EN.ATM", 6), "memoizing by length");
+    wlcsv_free(ctx);
+    pcre_free(code);
+    return NULL;
+}
+
+/*  The same fields as pushed through the parser, empty ones included, with the ignore regex set
+    and not: the fields not ignored are exactly those PCRE does not match. */
+static void
+count_field(void *field, size_t len, void *data)
+{
+    (void) field;
+    (void) len;
+    ++*(size_t *)data;
+}
+
+static bool
+push_string(wlcsv_ctx_st *ctx, const char *csv)
+{
+    return wlcsv_push_begin(ctx) == 1 && wlcsv_push(ctx, csv, strlen(csv)) == 1
+        && wlcsv_push_end(ctx) != -1;
+}
+
+char *
+test_ignore_regex_parse()
+{
+    const char *error_msg;
+    int error_offset;
+    pcre *code = pcre_compile(EMISS_IGNORE_REGEX, 0, &error_msg, &error_offset, 0);
+    mu_assert(code, "compiling the reference regex");
+    size_t expected = 0, nfields = 0;
+    char csv[0x800] = {0};
+    for (size_t i = 0; i < NFIELDS; ++i) {
+        expected += !*fields[i] || !reference_match(code, fields[i], strlen(fields[i]));
+        strcat(csv, "\"");
+        strcat(csv, fields[i]);
+        strcat(csv, i % 4 == 3 || i == NFIELDS - 1 ? "\"\n" : "\",");
+    }
+    pcre_free(code);
+    wlcsv_ctx_st *ctx = wlcsv_init(EMISS_IGNORE_REGEX, count_field, &nfields, 0, 0, 0, 0, 0, 0);
+    mu_assert(ctx, "initializing");
+    for (unsigned i = 0; i < 2; ++i) {
+        /*  Twice, the second time from the memo. */
+        nfields = 0;
+        mu_assert(push_string(ctx, csv), "parsing");
+        mu_assert(nfields == expected, "counting the fields not ignored");
+    }
+    wlcsv_free(ctx);
+    return NULL;
+}
+
+char *
+all_tests()
+{
+    mu_suite_start();
+    mu_run_test(test_prefilter_applies);
+    mu_run_test(test_ignore_regex_identical);
+    mu_run_test(test_ignore_regex_parse);
+    return NULL;
+}
+
+RUN_TESTS(all_tests)
@@ -0,0 +1,459 @@
+#include "minunit.h"
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include "wlcsv.h"
+
+#define RECORD_MAX_FIELDS 0x40
+#define RECORD_FIELD_SIZE 0x20
+
+/*  The fields seen by the default callback of a parse and where they were seen. */
+struct record {
+    wlcsv_state_st             *stt;
+    size_t                      nfields;
+    unsigned                    neors;
+    char                        text[RECORD_MAX_FIELDS][RECORD_FIELD_SIZE];
+    unsigned                    col[RECORD_MAX_FIELDS];
+    unsigned                    row[RECORD_MAX_FIELDS];
+};
+
+static void
+record_field(void *field, size_t len, void *data)
+{
+    struct record *rec = (struct record *)data;
+    if (rec->nfields == RECORD_MAX_FIELDS)
+        return;
+    snprintf(rec->text[rec->nfields], RECORD_FIELD_SIZE, "%.*s", (int) len,
+        field ? (char *)field : "");
+    rec->col[rec->nfields] = WLCSV_STATE_MEMB_GET(rec->stt, col);
+    rec->row[rec->nfields] = WLCSV_STATE_MEMB_GET(rec->stt, row);
+    rec->nfields++;
+}
+
+static void
+record_eor(void *data)
+{
+    ((struct record *)data)->neors++;
+}
+
+/*  Push csv to ctx in chunks of at most chunk bytes, as one stream. */
+static bool
+push_string(wlcsv_ctx_st *ctx, const char *csv, size_t chunk)
+{
+    size_t len = strlen(csv);
+    bool ok = wlcsv_push_begin(ctx) == 1;
+    for (size_t i = 0; ok && i < len; i += chunk)
+        ok = wlcsv_push(ctx, &csv[i], len - i < chunk ? len - i : chunk) == 1;
+    return wlcsv_push_end(ctx) != -1 && ok;
+}
+
+/*  Parse csv with the push API in chunks of at most chunk bytes, recording it in rec. */
+static bool
+record_parse(const char *csv, size_t chunk, unsigned options, struct record *rec)
+{
+    memset(rec, 0, sizeof(struct record));
+    wlcsv_ctx_st *ctx = wlcsv_init(0, record_field, rec, 0, 0, 0, 0, 0, options);
+    if (!ctx)
+        return false;
+    rec->stt = wlcsv_state_get(ctx);
+    wlcsv_callbacks_eor_set(ctx, record_eor);
+    bool ok = push_string(ctx, csv, chunk);
+    wlcsv_free(ctx);
+    return ok;
+}
+
+static bool
+record_equal(const struct record *a, const struct record *b)
+{
+    if (a->nfields != b->nfields || a->neors != b->neors)
+        return false;
+    for (size_t i = 0; i < a->nfields; ++i)
+        if (strcmp(a->text[i], b->text[i]) || a->col[i] != b->col[i] || a->row[i] != b->row[i])
+            return false;
+    return true;
+}
+
+/*  A log of which callback was called on which field, as "K:key D:x |" for a keyword callback
+    and the default callback on a row of two fields. */
+struct dispatch {
+    char                        log[0x200];
+};
+
+static void
+dispatch_log(void *data, char tag, void *field, size_t len)
+{
+    struct dispatch *dsp = (struct dispatch *)data;
+    size_t used = strlen(dsp->log);
+    snprintf(&dsp->log[used], sizeof(dsp->log) - used, "%c:%.*s ", tag, (int) len,
+        field ? (char *)field : "");
+}
+
+#define DISPATCH_CALLBACK(name, tag)\
+    static void name(void *field, size_t len, void *data) { dispatch_log(data, tag, field, len); }
+
+DISPATCH_CALLBACK(dispatch_default, 'D')
+DISPATCH_CALLBACK(dispatch_keyword, 'K')
+DISPATCH_CALLBACK(dispatch_regex, 'X')
+DISPATCH_CALLBACK(dispatch_row, 'R')
+DISPATCH_CALLBACK(dispatch_column, 'C')
+DISPATCH_CALLBACK(dispatch_column_last, 'c')
+
+static void
+dispatch_eor(void *data)
+{
+    struct dispatch *dsp = (struct dispatch *)data;
+    size_t used = strlen(dsp->log);
+    snprintf(&dsp->log[used], sizeof(dsp->log) - used, "| ");
+}
+
+/*  Parse csv into a fresh log and compare it to the expected one. */
+static bool
+dispatch_check(wlcsv_ctx_st *ctx, struct dispatch *dsp, const char *csv, const char *expected)
+{
+    memset(dsp->log, 0, sizeof(dsp->log));
+    if (!push_string(ctx, csv, 5))
+        return false;
+    if (strcmp(dsp->log, expected)) {
+        log_err("[mu]: expected \"%s\", got \"%s\"", expected, dsp->log);
+        return false;
+    }
+    return true;
+}
+
+/*  Parse csv with both engines, in chunks of several sizes, and compare the records. */
+static char *
+check_engines_agree(const char *csv)
+{
+    const size_t chunks[] = {1, 3, 7, 64, 0x1000};
+    struct record expected, actual;
+    mu_assert(record_parse(csv, 0x1000, 0, &expected), "parsing with libcsv");
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+        mu_assert(record_parse(csv, chunks[i], WLCSV_TOKENIZER_SIMD, &actual),
+            "parsing with the SIMD tokenizer");
+        mu_assert(record_equal(&expected, &actual), "the SIMD tokenizer differs from libcsv");
+    }
+    return NULL;
+}
+
+/*  An irregular quoted field, one libcsv parses on behalf of the SIMD tokenizer, after regular
+    fields of the same row: the fields after it keep their column indices. */
+char *
+test_simd_fallback_mid_row()
+{
+    const char *csv = "a,b,\"x\"y\",d\n1,2,3,4\n";
+    struct record rec;
+    mu_assert(record_parse(csv, 0x1000, WLCSV_TOKENIZER_SIMD, &rec), "parsing");
+    mu_assert(rec.nfields == 8 && rec.neors == 2, "counting fields and rows");
+    for (unsigned i = 0; i < 8; ++i)
+        mu_assert(rec.col[i] == i % 4 && rec.row[i] == i / 4, "column and row indices");
+    mu_assert(!strcmp(rec.text[2], "x\"y") && !strcmp(rec.text[3], "d")
+        && !strcmp(rec.text[7], "4"), "field text");
+    char *msg = check_engines_agree(csv);
+    if (msg)
+        return msg;
+    /*  A quote within an unquoted field. */
+    return check_engines_agree("a,b,x\"y,d\n1,2,3,4\n");
+}
+
+char *
+test_simd_fallback_later_block()
+{
+    /*  The irregular field in the second block of 64 bytes, after a row split across blocks. */
+    char *msg = check_engines_agree(
+        "\"Country Name\",\"Country Code\",\"Indicator Name\",\"1960\",\"1961\"\n"
+        "Aruba,ABW,\"CO2 \"\"kt\"\"\",  12.5 ,13\n"
+        "Angola,AGO, \"x\" y\" ,7,8\r\n");
+    if (msg)
+        return msg;
+    return check_engines_agree("a,b,c\n  1, \"unterminated");
+}
+
+char *
+test_simd_regular()
+{
+    char *msg = check_engines_agree("a,\"b,c\",\"d\"\"e\"\r\n\r\n  f ,,g\n\n");
+    if (msg)
+        return msg;
+    msg = check_engines_agree("   \n1,2\n \t \n3,4");
+    if (msg)
+        return msg;
+    return check_engines_agree("\"multi\nline\",x\n\"\",\" \"\n");
+}
+
+/*  Keyword before regex before row before column before the default callback. */
+char *
+test_callbacks_precedence()
+{
+    struct dispatch dsp;
+    wlcsv_ctx_st *ctx = wlcsv_init(0, dispatch_default, &dsp, 2, 1, 1, 4, 0,
+                            WLCSV_TOKENIZER_SIMD);
+    mu_assert(ctx, "initializing");
+    wlcsv_callbacks_eor_set(ctx, dispatch_eor);
+    mu_assert(wlcsv_callbacks_set(ctx, KEYWORD, WLCSV_MATCH_STR("key"), dispatch_keyword, 0, 0)
+        != UINT8_MAX, "setting a keyword callback");
+    mu_assert(wlcsv_callbacks_set(ctx, KEYWORD, WLCSV_MATCH_STR("rgx1"), dispatch_keyword, 0, 0)
+        != UINT8_MAX, "setting a keyword callback");
+    mu_assert(wlcsv_callbacks_set(ctx, REGEX, WLCSV_MATCH_STR("^rgx[0-9]$"), dispatch_regex,
+        0, 0) != UINT8_MAX, "setting a regex callback");
+    mu_assert(wlcsv_callbacks_set(ctx, ROW, WLCSV_MATCH_NUM(1U), dispatch_row, 0, 0)
+        != UINT8_MAX, "setting a row callback");
+    mu_assert(wlcsv_callbacks_set(ctx, COLUMN, WLCSV_MATCH_NUM(4U), dispatch_column, 0, 0)
+        != UINT8_MAX, "setting a column callback");
+    mu_assert(dispatch_check(ctx, &dsp, "key,rgx9,rgx1,x,y\np,key,r,s,t\nu,v,w,x,y\n",
+        "K:key X:rgx9 K:rgx1 D:x C:y | R:p K:key R:r R:s R:t | D:u D:v D:w D:x C:y | "),
+        "dispatching by precedence");
+    wlcsv_free(ctx);
+    return NULL;
+}
+
+/*  Of callbacks on the same column, the one set last; toggling and clearing recompile the
+    lookup, and a callback set once is disabled after its first call. */
+char *
+test_callbacks_recompile()
+{
+    struct dispatch dsp;
+    wlcsv_ctx_st *ctx = wlcsv_init(0, dispatch_default, &dsp, 0, 0, 0, 2, 0, 0);
+    mu_assert(ctx, "initializing");
+    wlcsv_callbacks_eor_set(ctx, dispatch_eor);
+    uint8_t first = wlcsv_callbacks_set(ctx, COLUMN, WLCSV_MATCH_NUM(1U), dispatch_column, 0, 0),
+            last  = wlcsv_callbacks_set(ctx, COLUMN, WLCSV_MATCH_NUM(1U), dispatch_column_last,
+                        0, 0);
+    mu_assert(first != UINT8_MAX && last != UINT8_MAX, "setting column callbacks");
+    mu_assert(dispatch_check(ctx, &dsp, "a,b\n", "D:a c:b | "), "selecting the last set");
+    mu_assert(wlcsv_callbacks_toggle(ctx, last) == 1 && wlcsv_callbacks_active(ctx, last) == 0,
+        "toggling");
+    mu_assert(dispatch_check(ctx, &dsp, "a,b\n", "D:a C:b | "), "dispatching after a toggle");
+    mu_assert(wlcsv_callbacks_clear(ctx, first) == 1, "clearing");
+    mu_assert(dispatch_check(ctx, &dsp, "a,b\n", "D:a D:b | "), "dispatching after a clear");
+    mu_assert(wlcsv_callbacks_set(ctx, COLUMN, WLCSV_MATCH_NUM(0U), dispatch_column, 0, 1)
+        != UINT8_MAX, "setting a callback once");
+    mu_assert(dispatch_check(ctx, &dsp, "a,b\nc,d\n", "C:a D:b | D:c D:d | "),
+        "calling a callback set once");
+    wlcsv_free(ctx);
+    return NULL;
+}
+
+/*  A ROW callback is disabled by the end of its row and a callback set once after its call, for
+    the rest of the context's life, unless reset; a toggled one is reset too. */
+char *
+test_callbacks_reset()
+{
+    struct dispatch dsp;
+    wlcsv_ctx_st *ctx = wlcsv_init(0, dispatch_default, &dsp, 0, 0, 1, 2, 0, 0);
+    mu_assert(ctx, "initializing");
+    wlcsv_callbacks_eor_set(ctx, dispatch_eor);
+    uint8_t column = wlcsv_callbacks_set(ctx, COLUMN, WLCSV_MATCH_NUM(1U), dispatch_column, 0, 1);
+    mu_assert(wlcsv_callbacks_set(ctx, ROW, WLCSV_MATCH_NUM(0U), dispatch_row, 0, 0) != UINT8_MAX
+        && column != UINT8_MAX, "setting callbacks");
+    mu_assert(dispatch_check(ctx, &dsp, "a,b\nc,d\n", "R:a R:b | D:c C:d | "), "parsing");
+    mu_assert(dispatch_check(ctx, &dsp, "a,b\nc,d\n", "D:a D:b | D:c D:d | "),
+        "parsing again without a reset");
+    wlcsv_reset_callbacks(ctx);
+    mu_assert(dispatch_check(ctx, &dsp, "a,b\nc,d\n", "R:a R:b | D:c C:d | "),
+        "parsing again after a reset");
+    wlcsv_reset_callbacks(ctx);
+    mu_assert(wlcsv_callbacks_toggle(ctx, column) == 1 && !wlcsv_callbacks_active(ctx, column),
+        "toggling");
+    wlcsv_reset_callbacks(ctx);
+    mu_assert(wlcsv_callbacks_active(ctx, column) == 1, "resetting a toggled callback");
+    wlcsv_free(ctx);
+    return NULL;
+}
+
+/*  The values passed to a typed callback, in order. */
+struct typed {
+    size_t                      nvalues;
+    wlcsv_value_st              values[RECORD_MAX_FIELDS];
+};
+
+static void
+typed_record(const wlcsv_value_st *value, void *data)
+{
+    struct typed *tpd = (struct typed *)data;
+    if (tpd->nvalues < RECORD_MAX_FIELDS)
+        tpd->values[tpd->nvalues++] = *value;
+}
+
+/*  Parse the fields, one per row and quoted, with a typed callback on the column, by both
+    engines and both with and without empty fields ignored. */
+static bool
+typed_parse(const char **fields, size_t nfields, wlcsv_value_type_et type, unsigned options,
+    struct typed *tpd)
+{
+    char csv[0x800] = {0};
+    for (size_t i = 0; i < nfields; ++i) {
+        size_t used = strlen(csv);
+        snprintf(&csv[used], sizeof(csv) - used, "\"%s\"\n", fields[i]);
+    }
+    memset(tpd, 0, sizeof(struct typed));
+    wlcsv_ctx_st *ctx = wlcsv_init(0, 0, 0, 0, 0, 0, 1, 0, options);
+    if (!ctx)
+        return false;
+    bool ok = wlcsv_callbacks_typed_set(ctx, COLUMN, WLCSV_MATCH_NUM(0U), type, typed_record, tpd,
+                0) != UINT8_MAX && push_string(ctx, csv, 3);
+    wlcsv_free(ctx);
+    return ok;
+}
+
+char *
+test_typed_int64()
+{
+    const char *fields[] = {
+        "0", "-0", "+12", "007", "9223372036854775807", "-9223372036854775808",
+        "9223372036854775808", "-9223372036854775809", "99999999999999999999", "",
+        " 1", "1 ", "1.0", "1e3", "0x10", "+", "-", "12a", "--1"
+    };
+    const int64_t values[] = {0, 0, 12, 7, INT64_MAX, INT64_MIN};
+    const size_t nfields = sizeof(fields) / sizeof(fields[0]), nok = 6, empty = 9;
+    const unsigned options[] = {0, WLCSV_TOKENIZER_SIMD};
+    struct typed tpd;
+    for (unsigned o = 0; o < 2; ++o) {
+        mu_assert(typed_parse(fields, nfields, WLCSV_INT64, options[o], &tpd), "parsing");
+        mu_assert(tpd.nvalues == nfields, "counting the values");
+        for (size_t i = 0; i < nfields; ++i) {
+            wlcsv_value_status_et status = i < nok ? WLCSV_VALUE_OK
+                                        : i == empty ? WLCSV_VALUE_EMPTY
+                                        : WLCSV_VALUE_MALFORMED;
+            if (tpd.values[i].type != WLCSV_INT64 || tpd.values[i].status != status
+                || tpd.values[i].i64 != (i < nok ? values[i] : 0)) {
+                log_err("[mu]: \"%s\" as %" PRId64 ", status %d", fields[i], tpd.values[i].i64,
+                    tpd.values[i].status);
+                mu_assert(false, "parsing an int64");
+            }
+        }
+    }
+    mu_assert(typed_parse(fields, nfields, WLCSV_INT64, WLCSV_IGNORE_EMPTY_FIELDS, &tpd)
+        && tpd.nvalues == nfields - 1, "skipping the empty field");
+    return NULL;
+}
+
+/*  Each double as parsed by strtod() in the "C" locale: those by the fast path, those handed to
+    strtod() for more than 19 significant digits, a mantissa over 2^53 or a power of ten out of
+    range, and those strtod() would take but the callback is not to. */
+char *
+test_typed_double()
+{
+    const char *fields[] = {
+        "0", "-0", "0.0", "+12", "12.5", "-3e5", "+1E-7", "0.1", ".5", "5.", "1e22", "1e-22",
+        "9007199254740992", "123456.789e-3", "00000000000000000000001.5",
+        "1e23", "1e-23", "9007199254740993", "12345678901234567890123", "0.1234567890123456789012",
+        "4.9406564584124654e-324", "1.7976931348623157e308", "1e400", "-1e-400", "0e99999",
+        "", " 1", "1 ", ".", "-", "e5", "1e", "1e+", "1.2.3", "0x10", "inf", "nan", "1,5"
+    };
+    const size_t nfields = sizeof(fields) / sizeof(fields[0]), nok = 25, empty = 25;
+    const unsigned options[] = {0, WLCSV_TOKENIZER_SIMD};
+    struct typed tpd;
+    for (unsigned o = 0; o < 2; ++o) {
+        mu_assert(typed_parse(fields, nfields, WLCSV_DOUBLE, options[o], &tpd), "parsing");
+        mu_assert(tpd.nvalues == nfields, "counting the values");
+        for (size_t i = 0; i < nfields; ++i) {
+            const wlcsv_value_st *value = &tpd.values[i];
+            bool ok;
+            if (i < nok) {
+                double expected = strtod(fields[i], NULL);
+                ok = value->status == WLCSV_VALUE_OK && value->f64 == expected
+                    && signbit(value->f64) == signbit(expected);
+            } else
+                ok = value->status == (i == empty ? WLCSV_VALUE_EMPTY : WLCSV_VALUE_MALFORMED)
+                    && isnan(value->f64);
+            if (value->type != WLCSV_DOUBLE || !ok) {
+                log_err("[mu]: \"%s\" as %.17g, status %d", fields[i], value->f64, value->status);
+                mu_assert(false, "parsing a double");
+            }
+        }
+    }
+    return NULL;
+}
+
+/*  Push csv in two chunks split at split, returning the result of wlcsv_push_end(). */
+static int
+push_split(wlcsv_ctx_st *ctx, const char *csv, size_t split)
+{
+    size_t len = strlen(csv);
+    if (wlcsv_push_begin(ctx) != 1 || wlcsv_push(ctx, csv, split) != 1
+        || wlcsv_push(ctx, &csv[split], len - split) != 1) {
+        wlcsv_push_end(ctx);
+        return -1;
+    }
+    return wlcsv_push_end(ctx);
+}
+
+/*  A stream split at every byte, within quotes, escaped quotes, CRLF and the skipped lines, parses
+    as it does whole; wlcsv_push_end() counts the bytes after the skipped lines. */
+char *
+test_push_split()
+{
+    const char *csv = "skipped,\"\r\n\"\r\nA,\"B\r\nC\",\"\"\"D\"\"\"\r\n1,,2\r\n\"x\",y\n";
+    const size_t skipped = strlen("skipped,\"\r\n\"\r\n");
+    const unsigned options[] = {0, WLCSV_TOKENIZER_SIMD};
+    for (unsigned o = 0; o < 2; ++o) {
+        struct record whole, split;
+        memset(&whole, 0, sizeof(struct record));
+        wlcsv_ctx_st *ctx = wlcsv_init(0, record_field, &whole, 0, 0, 0, 0, 2, options[o]);
+        mu_assert(ctx, "initializing");
+        whole.stt = wlcsv_state_get(ctx);
+        wlcsv_callbacks_eor_set(ctx, record_eor);
+        mu_assert(push_split(ctx, csv, 0) == (int) (strlen(csv) - skipped), "parsing whole");
+        mu_assert(whole.nfields == 8 && whole.neors == 3 && !strcmp(whole.text[1], "B\r\nC")
+            && !strcmp(whole.text[2], "\"D\"") && !strcmp(whole.text[4], "")
+            && whole.row[7] == 2 && whole.col[7] == 1, "the fields after the skipped lines");
+        wlcsv_callbacks_default_set(ctx, record_field, &split);
+        for (size_t i = 1; i <= strlen(csv); ++i) {
+            memset(&split, 0, sizeof(struct record));
+            split.stt = whole.stt;
+            mu_assert(push_split(ctx, csv, i) == (int) (strlen(csv) - skipped), "parsing split");
+            if (!record_equal(&whole, &split)) {
+                log_err("[mu]: split at %zu", i);
+                mu_assert(false, "a split stream differs from the whole");
+            }
+        }
+        wlcsv_free(ctx);
+    }
+    return NULL;
+}
+
+/*  Streams begun twice, pushed or ended without a beginning, or ended within the skipped lines
+    fail, leaving the context ready for the next stream. */
+char *
+test_push_misuse()
+{
+    struct record rec;
+    memset(&rec, 0, sizeof(struct record));
+    wlcsv_ctx_st *ctx = wlcsv_init(0, record_field, &rec, 0, 0, 0, 0, 1, 0);
+    mu_assert(ctx, "initializing");
+    rec.stt = wlcsv_state_get(ctx);
+    mu_assert(wlcsv_push(ctx, "a\n", 2) == -1, "pushing before a beginning");
+    mu_assert(wlcsv_push_end(ctx) == -1, "ending before a beginning");
+    mu_assert(wlcsv_push_begin(ctx) == 1 && wlcsv_push_begin(ctx) == -1, "beginning twice");
+    mu_assert(wlcsv_push(ctx, "header", 6) == 1 && wlcsv_push_end(ctx) == -1,
+        "ending within the skipped lines");
+    mu_assert(wlcsv_push_end(ctx) == -1, "ending twice");
+    mu_assert(rec.nfields == 0, "fields within the skipped lines");
+    mu_assert(push_split(ctx, "header\na,b\n", 9) == 4 && rec.nfields == 2 && rec.row[1] == 0
+        && rec.col[1] == 1, "parsing the next stream");
+    mu_assert(push_split(ctx, "header\nc\n", 3) == 2 && rec.nfields == 3 && rec.row[2] == 0,
+        "resetting the row count");
+    mu_assert(!wlcsv_push_begin(NULL) && !wlcsv_push(NULL, "", 0) && !wlcsv_push_end(NULL),
+        "a NULL context");
+    wlcsv_free(ctx);
+    return NULL;
+}
+
+char *
+all_tests()
+{
+    mu_suite_start();
+    mu_run_test(test_simd_fallback_mid_row);
+    mu_run_test(test_simd_fallback_later_block);
+    mu_run_test(test_simd_regular);
+    mu_run_test(test_callbacks_precedence);
+    mu_run_test(test_callbacks_recompile);
+    mu_run_test(test_callbacks_reset);
+    mu_run_test(test_typed_int64);
+    mu_run_test(test_typed_double);
+    mu_run_test(test_push_split);
+    mu_run_test(test_push_misuse);
+    return NULL;
+}
+
+RUN_TESTS(all_tests)